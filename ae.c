@@ -103,6 +103,8 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->maxfd = -1;
     // 设置事件处理前的sleep方法
     eventLoop->beforesleep = NULL;
+    // 设置多路复用返回后执行的方法
+    eventLoop->aftersleep = NULL;
 
     // 创建事件API
     if (aeApiCreate(eventLoop) == -1) goto err;
@@ -630,6 +632,7 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
  * if flags has AE_TIME_EVENTS set, time events are processed.
  * if flags has AE_DONT_WAIT set the function returns ASAP until all
  * the events that's possible to process without to wait are processed.
+ * if flags has AE_CALL_AFTER_SLEEP set, the aftersleep callback is called.
  *
  * The function returns the number of events processed. */
 
@@ -643,6 +646,7 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
  *       AE_FILE_EVENTS 处理文件事件
  *       AE_TIME_EVENTS 处理时间事件
  *       AE_DONT_WAIT 处理完所有不许阻塞的事件之后立即返回
+ *       AE_CALL_AFTER_SLEEP 多路复用返回后调用aftersleep方法
  *
  */
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
@@ -724,6 +728,11 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 
         // 获取已就绪事件数量
         numevents = aeApiPoll(eventLoop, tvp);
+
+        /* After sleep callback. */
+        // 多路复用返回后执行aftersleep方法
+        if (eventLoop->aftersleep != NULL && flags & AE_CALL_AFTER_SLEEP)
+            eventLoop->aftersleep(eventLoop);
         
         // 遍历事件
         for (j = 0; j < numevents; j++) {
@@ -825,7 +834,7 @@ void aeMain(aeEventLoop *eventLoop) {
             eventLoop->beforesleep(eventLoop);
         
         // 调用对应复用库中的aeProcessEvents方法
-        aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS|AE_CALL_AFTER_SLEEP);
     }
 }
 
@@ -849,3 +858,15 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
     // 设置处理事件前需要被执行的sleep函数
     eventLoop->beforesleep = beforesleep;
 }
+
+/*
+ * 设置多路复用返回后需要被执行的函数
+ *
+ * eventLoop 事件处理器指针
+ * aftersleep 函数指针
+ *
+ */
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeAfterSleepProc *aftersleep) {
+    // 设置多路复用返回后需要被执行的函数
+    eventLoop->aftersleep = aftersleep;
+}
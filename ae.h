@@ -50,6 +50,7 @@
 #define AE_TIME_EVENTS 2
 #define AE_ALL_EVENTS (AE_FILE_EVENTS|AE_TIME_EVENTS)
 #define AE_DONT_WAIT 4
+#define AE_CALL_AFTER_SLEEP 8
 
 // 事件是否持续执行
 #define AE_NOMORE -1
@@ -72,6 +73,8 @@ typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *client
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 // 事件处理前的sleep方法
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+// 多路复用返回后（处理就绪事件前）执行的方法
+typedef void aeAfterSleepProc(struct aeEventLoop *eventLoop);
 
 /* File event structure */
 // 文件事件结构体
@@ -137,6 +140,8 @@ typedef struct aeEventLoop {
     void *apidata; /* This is used for polling API specific data */
     // 事件处理前的sleep方法
     aeBeforeSleepProc *beforesleep;
+    // 多路复用返回后执行的方法
+    aeAfterSleepProc *aftersleep;
 } aeEventLoop;
 
 /* Prototypes */
@@ -169,6 +174,8 @@ void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
 // 设置处理事件前需要被执行的sleep函数
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+// 设置多路复用返回后需要被执行的函数
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeAfterSleepProc *aftersleep);
 // 返回事件处理器已追踪的最大文件描述符
 int aeGetSetSize(aeEventLoop *eventLoop);
 // 重置事件处理器已追踪的最大文件描述符
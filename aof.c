@@ -38,9 +38,11 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 
 void aofUpdateCurrentSize(void);
 void aofClosePipes(void);
+static int loadAppendOnlyFilePart(char *filename, int last);
 
 /* ----------------------------------------------------------------------------
  * AOF rewrite buffer implementation.
@@ -63,6 +65,12 @@ typedef struct aofrwblock {
     char buf[AOF_RW_BUF_BLOCK_SIZE];
 } aofrwblock;
 
+/* Free method of the AOF rewrite buffer blocks list. */
+void aofRewriteBufferFreeBlock(void *block) {
+    zmalloc_category_sub(ZMALLOC_CAT_AOF,sizeof(aofrwblock));
+    zfree(block);
+}
+
 /* This function free the old AOF rewrite buffer if needed, and initialize
  * a fresh new one. It tests for server.aof_rewrite_buf_blocks equal to NULL
  * so can be used for the first initialization as well. */
@@ -71,7 +79,7 @@ void aofRewriteBufferReset(void) {
         listRelease(server.aof_rewrite_buf_blocks);
 
     server.aof_rewrite_buf_blocks = listCreate();
-    listSetFreeMethod(server.aof_rewrite_buf_blocks,zfree);
+    listSetFreeMethod(server.aof_rewrite_buf_blocks,aofRewriteBufferFreeBlock);
 }
 
 /* Return the current size of the AOF rewrite buffer. */
@@ -142,6 +150,7 @@ void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
             int numblocks;
 
             block = zmalloc(sizeof(*block));
+            zmalloc_category_add(ZMALLOC_CAT_AOF,sizeof(*block));
             block->free = AOF_RW_BUF_BLOCK_SIZE;
             block->used = 0;
             listAddNodeTail(server.aof_rewrite_buf_blocks,block);
@@ -195,6 +204,414 @@ ssize_t aofRewriteBufferWrite(int fd) {
  * AOF file implementation
  * ------------------------------------------------------------------------- */
 
+/* ----------------------------------------------------------------------------
+ * Multi part AOF
+ *
+ * When aof-multi-part is enabled the AOF is split into a base file, written
+ * by the rewrite child, followed by a sequence of incremental files that
+ * receive the writes. The files are listed, in loading order, in a manifest:
+ *
+ *   <appendfilename>.manifest
+ *   <appendfilename>.<seq>.base.aof
+ *   <appendfilename>.<seq>.incr.aof
+ *
+ * A rewrite starts switching the writes to a new incremental file, so that
+ * the snapshot taken by the child, plus the new file and the ones created
+ * after it, contain the whole dataset. When the child is done its output
+ * becomes the new base, replacing in the manifest the old base and all the
+ * incremental files that the snapshot covers. So the parent doesn't need to
+ * accumulate the writes in the rewrite buffer and to send them to the child.
+ *
+ * The manifest on disk is always replaced atomically, and only ever lists
+ * a set of files that rebuilds the dataset: while waiting for the first
+ * rewrite after the AOF is switched on, the new files are only tracked in
+ * memory.
+ * ------------------------------------------------------------------------- */
+
+typedef struct aofManifest {
+    sds base;           /* Base file name, NULL if there is none yet. */
+    list *incr;         /* Incremental file names (sds), oldest first. */
+    long long seq;      /* Last sequence number used for a file name. */
+} aofManifest;
+
+static void aofManifestFreeName(void *name) {
+    sdsfree(name);
+}
+
+static aofManifest *aofManifestCreate(void) {
+    aofManifest *am = zmalloc(sizeof(*am));
+
+    am->base = NULL;
+    am->incr = listCreate();
+    listSetFreeMethod(am->incr,aofManifestFreeName);
+    am->seq = 0;
+    return am;
+}
+
+static void aofManifestRelease(aofManifest *am) {
+    sdsfree(am->base);
+    listRelease(am->incr);
+    zfree(am);
+}
+
+static sds aofManifestFileName(void) {
+    return sdscatprintf(sdsempty(),"%s.manifest",server.aof_filename);
+}
+
+/* Load the manifest from disk. NULL is returned if there is no manifest.
+ * Errors are fatal since the AOF can't be loaded without it. */
+static aofManifest *aofManifestLoad(void) {
+    sds filename = aofManifestFileName();
+    FILE *fp = fopen(filename,"r");
+    aofManifest *am;
+    char buf[1024];
+    int linenum = 0;
+
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            redisLog(REDIS_WARNING,"Can't open the AOF manifest %s: %s",
+                filename, strerror(errno));
+            exit(1);
+        }
+        sdsfree(filename);
+        return NULL;
+    }
+
+    am = aofManifestCreate();
+    while(fgets(buf,sizeof(buf),fp) != NULL) {
+        sds *argv;
+        int argc, valid = 0;
+
+        linenum++;
+        if ((argv = sdssplitargs(buf,&argc)) == NULL) goto fmterr;
+        if (argc == 0) {
+            valid = 1;
+        } else if (argc == 2 && !strcasecmp(argv[0],"seq")) {
+            am->seq = strtoll(argv[1],NULL,10);
+            valid = 1;
+        } else if (argc == 2 && !strcasecmp(argv[0],"base") &&
+                   am->base == NULL) {
+            am->base = sdsdup(argv[1]);
+            valid = 1;
+        } else if (argc == 2 && !strcasecmp(argv[0],"incr")) {
+            listAddNodeTail(am->incr,sdsdup(argv[1]));
+            valid = 1;
+        }
+        sdsfreesplitres(argv,argc);
+        if (!valid) goto fmterr;
+    }
+    fclose(fp);
+    sdsfree(filename);
+    return am;
+
+fmterr:
+    redisLog(REDIS_WARNING,"Bad AOF manifest %s at line %d",
+        filename, linenum);
+    exit(1);
+    return NULL; /* Just to avoid warning */
+}
+
+/* Atomically replace the manifest on disk with the content of 'am'. */
+static int aofManifestPersist(aofManifest *am) {
+    sds filename = aofManifestFileName();
+    sds tmpfile = sdscatprintf(sdsempty(),"%s.tmp",filename);
+    sds content = sdscatprintf(sdsempty(),"seq %lld\n",am->seq);
+    listIter li;
+    listNode *ln;
+    int fd, retval = REDIS_ERR;
+
+    if (am->base) {
+        content = sdscat(content,"base ");
+        content = sdscatrepr(content,am->base,sdslen(am->base));
+        content = sdscat(content,"\n");
+    }
+    listRewind(am->incr,&li);
+    while((ln = listNext(&li)) != NULL) {
+        sds name = listNodeValue(ln);
+
+        content = sdscat(content,"incr ");
+        content = sdscatrepr(content,name,sdslen(name));
+        content = sdscat(content,"\n");
+    }
+
+    if ((fd = open(tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644)) == -1 ||
+        write(fd,content,sdslen(content)) != (ssize_t)sdslen(content) ||
+        aof_fsync(fd) == -1)
+    {
+        redisLog(REDIS_WARNING,"Error writing the AOF manifest: %s",
+            strerror(errno));
+        if (fd != -1) close(fd);
+        unlink(tmpfile);
+        goto cleanup;
+    }
+    close(fd);
+    if (rename(tmpfile,filename) == -1) {
+        redisLog(REDIS_WARNING,"Error renaming the AOF manifest: %s",
+            strerror(errno));
+        unlink(tmpfile);
+        goto cleanup;
+    }
+    retval = REDIS_OK;
+
+cleanup:
+    sdsfree(content);
+    sdsfree(tmpfile);
+    sdsfree(filename);
+    return retval;
+}
+
+/* Return the name of a new file of the given type ("base" or "incr"). */
+static sds aofManifestNewFileName(aofManifest *am, char *type) {
+    return sdscatprintf(sdsempty(),"%s.%lld.%s.aof",
+        server.aof_filename, ++am->seq, type);
+}
+
+/* Make sure server.aof_manifest is populated, loading it from disk. */
+static void aofManifestInit(void) {
+    if (server.aof_manifest) return;
+    server.aof_manifest = aofManifestLoad();
+    if (server.aof_manifest == NULL) {
+        struct redis_stat sb;
+
+        server.aof_manifest = aofManifestCreate();
+        /* Upgrade from a single file AOF: use it as the base. */
+        if (redis_stat(server.aof_filename,&sb) == 0)
+            server.aof_manifest->base = sdsnew(server.aof_filename);
+    }
+}
+
+/* Return the size of the base file, used as base for the auto rewrite. */
+static off_t aofManifestBaseSize(aofManifest *am) {
+    struct redis_stat sb;
+
+    if (am->base == NULL || redis_stat(am->base,&sb) == -1) return 0;
+    return sb.st_size;
+}
+
+/* Return the sum of the sizes of all the files listed in the manifest. */
+static off_t aofManifestTotalSize(aofManifest *am) {
+    struct redis_stat sb;
+    listIter li;
+    listNode *ln;
+    off_t total = aofManifestBaseSize(am);
+
+    listRewind(am->incr,&li);
+    while((ln = listNext(&li)) != NULL) {
+        if (redis_stat(listNodeValue(ln),&sb) != -1) total += sb.st_size;
+    }
+    return total;
+}
+
+/* Unlink a file without blocking the server: the file is opened before
+ * the unlink so that the blocking part happens when a background thread
+ * closes it. */
+static void aofUnlinkInBackground(char *filename) {
+    int fd = open(filename,O_RDONLY|O_NONBLOCK);
+
+    if (unlink(filename) == -1 && errno != ENOENT) {
+        redisLog(REDIS_WARNING,"Can't remove the old AOF file %s: %s",
+            filename, strerror(errno));
+    }
+    if (fd != -1)
+        bioCreateBackgroundJob(REDIS_BIO_CLOSE_FILE,(void*)(long)fd,NULL,NULL);
+}
+
+/* Create a new incremental file and make it the target of the AOF writes.
+ * Pending writes are flushed to the current file, that is then synced and
+ * closed in background. The new manifest is persisted only if 'persist'
+ * is true. */
+static int aofOpenNewIncrFile(int persist) {
+    aofManifest *am = server.aof_manifest;
+    sds name;
+    int fd;
+
+    if (server.aof_fd != -1) {
+        flushAppendOnlyFile(1);
+        if (sdslen(server.aof_buf)) {
+            redisLog(REDIS_WARNING,"Can't switch to a new AOF file: the pending writes can't be flushed to the current one.");
+            return REDIS_ERR;
+        }
+    }
+
+    name = aofManifestNewFileName(am,"incr");
+    if ((fd = open(name,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644)) == -1) {
+        redisLog(REDIS_WARNING,"Can't open the AOF file %s: %s",
+            name, strerror(errno));
+        sdsfree(name);
+        return REDIS_ERR;
+    }
+    listAddNodeTail(am->incr,name);
+    if (persist && aofManifestPersist(am) == REDIS_ERR) {
+        close(fd);
+        unlink(name);
+        listDelNode(am->incr,listLast(am->incr));
+        return REDIS_ERR;
+    }
+
+    if (server.aof_fd != -1) {
+        bioCreateBackgroundJob(REDIS_BIO_AOF_FSYNC,(void*)(long)server.aof_fd,
+                               (void*)1,NULL);
+    }
+    server.aof_fd = fd;
+    server.aof_incr_size = 0;
+    server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+    return REDIS_OK;
+}
+
+/* Called before forking the rewrite child. When the AOF is enabled the
+ * writes are switched to a new incremental file, and we remember how many
+ * files before it the snapshot is going to replace. */
+static int aofMultiPartPrepareRewrite(void) {
+    aofManifestInit();
+    if (server.aof_state != REDIS_AOF_OFF &&
+        aofOpenNewIncrFile(server.aof_state == REDIS_AOF_ON) == REDIS_ERR)
+        return REDIS_ERR;
+    server.aof_rewrite_incr_count = listLength(server.aof_manifest->incr) -
+                                    (server.aof_state != REDIS_AOF_OFF);
+    return REDIS_OK;
+}
+
+/* Called when the rewrite child terminated with success: the rewritten AOF
+ * becomes the new base, replacing the old one and the incremental files
+ * it covers. The old files are removed only once the new manifest is on
+ * disk. */
+static int aofMultiPartInstallRewrite(char *tmpfile) {
+    aofManifest *am = server.aof_manifest, *newam;
+    sds newbase = aofManifestNewFileName(am,"base");
+    unsigned long j = 0;
+    listIter li;
+    listNode *ln;
+
+    if (rename(tmpfile,newbase) == -1) {
+        redisLog(REDIS_WARNING,
+            "Error trying to rename the temporary AOF file: %s",
+            strerror(errno));
+        sdsfree(newbase);
+        return REDIS_ERR;
+    }
+
+    newam = aofManifestCreate();
+    newam->base = newbase;
+    newam->seq = am->seq;
+    listRewind(am->incr,&li);
+    while((ln = listNext(&li)) != NULL) {
+        if (j++ < server.aof_rewrite_incr_count) continue;
+        listAddNodeTail(newam->incr,sdsdup(listNodeValue(ln)));
+    }
+    if (aofManifestPersist(newam) == REDIS_ERR) {
+        unlink(newbase);
+        aofManifestRelease(newam);
+        return REDIS_ERR;
+    }
+
+    /* The new manifest is in place: remove the files it no longer lists. */
+    if (am->base) aofUnlinkInBackground(am->base);
+    j = 0;
+    listRewind(am->incr,&li);
+    while((ln = listNext(&li)) != NULL &&
+          j++ < server.aof_rewrite_incr_count)
+        aofUnlinkInBackground(listNodeValue(ln));
+    aofManifestRelease(am);
+    server.aof_manifest = newam;
+
+    server.aof_current_size = aofManifestTotalSize(newam);
+    server.aof_rewrite_base_size = aofManifestBaseSize(newam);
+    return REDIS_OK;
+}
+
+/* Called at startup when the AOF is enabled: load the manifest (creating
+ * it if the AOF was written without aof-multi-part) and open the last
+ * incremental file for writing. */
+int aofMultiPartOpen(void) {
+    aofManifest *am;
+    struct redis_stat sb;
+    char *last;
+
+    aofManifestInit();
+    am = server.aof_manifest;
+    if (listLength(am->incr) == 0) return aofOpenNewIncrFile(1);
+
+    last = listNodeValue(listLast(am->incr));
+    server.aof_fd = open(last,O_WRONLY|O_APPEND|O_CREAT,0644);
+    if (server.aof_fd == -1) {
+        redisLog(REDIS_WARNING,"Can't open the append-only file %s: %s",
+            last, strerror(errno));
+        return REDIS_ERR;
+    }
+    if (redis_fstat(server.aof_fd,&sb) == -1) {
+        redisLog(REDIS_WARNING,"Unable to stat the append-only file %s: %s",
+            last, strerror(errno));
+        close(server.aof_fd);
+        server.aof_fd = -1;
+        return REDIS_ERR;
+    }
+    server.aof_incr_size = sb.st_size;
+    return REDIS_OK;
+}
+
+/* Load every file listed in the manifest, in order. When aof-multi-part
+ * is not enabled, or there is no manifest yet, this is just like loading
+ * the single file AOF.
+ *
+ * A manifest found while aof-multi-part is not enabled means that the
+ * single file AOF only holds the writes received before the option was
+ * turned on, if any: loading it would silently lose data, so we refuse
+ * to start instead. */
+int loadAppendOnlyFiles(void) {
+    aofManifest *am;
+    listIter li;
+    listNode *ln;
+    char *last = NULL;
+    int loaded = 0;
+
+    if (!server.aof_multi_part) {
+        sds manifest = aofManifestFileName();
+        struct redis_stat sb;
+
+        if (redis_stat(manifest,&sb) == 0) {
+            redisLog(REDIS_WARNING,
+                "Found the AOF manifest %s but aof-multi-part is not "
+                "enabled. Set aof-multi-part yes to load the dataset it "
+                "describes, or remove the manifest if you really want to "
+                "load %s alone. Exiting.", manifest, server.aof_filename);
+            exit(1);
+        }
+        sdsfree(manifest);
+        return loadAppendOnlyFile(server.aof_filename);
+    }
+    aofManifestInit();
+    am = server.aof_manifest;
+    if (am->base == NULL && listLength(am->incr) == 0)
+        return loadAppendOnlyFile(server.aof_filename);
+
+    /* Only the last non empty file, the one that was being written when
+     * the server stopped, may be truncated by aof-load-truncated. */
+    last = am->base;
+    listRewind(am->incr,&li);
+    while((ln = listNext(&li)) != NULL) {
+        struct redis_stat sb;
+
+        if (redis_stat(listNodeValue(ln),&sb) == -1 || sb.st_size != 0)
+            last = listNodeValue(ln);
+    }
+
+    /* loadAppendOnlyFilePart() only returns an error for empty files, that
+     * are expected here (the incr file just created), while real errors
+     * are fatal. */
+    if (am->base &&
+        loadAppendOnlyFilePart(am->base,am->base == last) == REDIS_OK)
+        loaded = 1;
+    listRewind(am->incr,&li);
+    while((ln = listNext(&li)) != NULL) {
+        if (loadAppendOnlyFilePart(listNodeValue(ln),
+                                   listNodeValue(ln) == last) == REDIS_OK)
+            loaded = 1;
+    }
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = aofManifestBaseSize(am);
+    return loaded ? REDIS_OK : REDIS_ERR;
+}
+
 /* Starts a background task that performs fsync() against the specified
  * file descriptor (the one of the AOF file) in another thread. */
 void aof_background_fsync(int fd) {
@@ -226,7 +643,13 @@ void stopAppendOnly(void) {
         server.aof_child_pid = -1;
         server.aof_rewrite_time_start = -1;
         /* close pipes used for IPC between the two processes. */
-        aofClosePipes();
+        if (!server.aof_multi_part) aofClosePipes();
+    }
+    /* Forget the multi part AOF state that was only in memory: it will be
+     * reloaded from the manifest when the AOF is switched on again. */
+    if (server.aof_manifest) {
+        aofManifestRelease(server.aof_manifest);
+        server.aof_manifest = NULL;
     }
 }
 
@@ -234,6 +657,26 @@ void stopAppendOnly(void) {
  * at runtime using the CONFIG command. */
 int startAppendOnly(void) {
     server.aof_last_fsync = server.unixtime;
+    redisAssert(server.aof_state == REDIS_AOF_OFF);
+    if (server.aof_multi_part) {
+        /* The rewrite opens the incremental file that will receive the
+         * writes from now on, and the manifest is only updated when the
+         * new base is ready. */
+        aofManifestInit();
+        server.aof_state = REDIS_AOF_WAIT_REWRITE;
+        if (rewriteAppendOnlyFileBackground() == REDIS_ERR) {
+            server.aof_state = REDIS_AOF_OFF;
+            if (server.aof_fd != -1) {
+                close(server.aof_fd);
+                server.aof_fd = -1;
+            }
+            aofManifestRelease(server.aof_manifest);
+            server.aof_manifest = NULL;
+            redisLog(REDIS_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
+            return REDIS_ERR;
+        }
+        return REDIS_OK;
+    }
     server.aof_fd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     redisAssert(server.aof_state == REDIS_AOF_OFF);
     if (server.aof_fd == -1) {
@@ -251,6 +694,330 @@ int startAppendOnly(void) {
     return REDIS_OK;
 }
 
+/* Update the memory accounted to the AOF buffer after it was modified. */
+static void aofBufferUpdateMemUsage(void) {
+    static size_t accounted = 0;
+    size_t mem = sdsAllocSize(server.aof_buf);
+
+    zmalloc_category_update(ZMALLOC_CAT_AOF,accounted,mem);
+    accounted = mem;
+}
+
+/* ----------------------------------------------------------------------------
+ * AOF writer thread
+ *
+ * When aof-threaded-write is enabled the main thread never calls write(2)
+ * or fsync(2) against the AOF: flushAppendOnlyFile() just hands the AOF
+ * buffer off to a writer thread, swapping it with the (empty) buffer the
+ * writer is done with, so a stalled disk no longer blocks the event loop.
+ *
+ * Every hand off is a batch with an increasing sequence number. With
+ * appendfsync always the replies of the clients that performed writes are
+ * held (REDIS_AOF_WAIT) until the writer reports the batch containing
+ * their writes as synced: all the writes of an event loop iteration share
+ * a single fsync. The writer wakes up the event loop using a pipe.
+ * ------------------------------------------------------------------------- */
+
+static struct aofWriter {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t newdata;     /* Signaled when a batch is handed off. */
+    pthread_cond_t idle;        /* Signaled when there is nothing to write. */
+    sds pending;                /* Data handed off, not yet taken. */
+    int fd;                     /* File descriptor 'pending' goes to. */
+    int busy;                   /* Writer is writing or syncing. */
+    int dirty_fd;               /* Written but not synced fd, or -1. */
+    long long submitted_seq;    /* Last batch handed off (main thread). */
+    long long pending_seq;      /* Last batch appended to 'pending'. */
+    long long synced_seq;       /* Last batch written (and synced). */
+    int write_errno;            /* Last write error, 0 if writes succeed. */
+    int drop;                   /* Give up the batch failing to be written. */
+    int fsync_policy;           /* server.aof_fsync as of the last hand off. */
+    int notify_pipe[2];         /* Writer -> main thread wake up. */
+} aofw;
+
+/* Wake up the main thread. The pipe is non blocking: if it is full the
+ * main thread has a wake up pending anyway. */
+static void aofWriterNotify(void) {
+    if (write(aofw.notify_pipe[1],"x",1) != 1) {
+        /* Nothing to do. */
+    }
+}
+
+static void *aofWriterMain(void *arg) {
+    sds buf = sdsempty();
+    time_t last_fsync = time(NULL);
+    REDIS_NOTUSED(arg);
+
+    pthread_mutex_lock(&aofw.lock);
+    while(1) {
+        long long seq;
+        size_t written = 0;
+        int fd, policy;
+
+        if (sdslen(aofw.pending) == 0) {
+            aofw.busy = 0;
+            pthread_cond_broadcast(&aofw.idle);
+            if (aofw.dirty_fd != -1) {
+                /* Make sure the data is synced within a second even when
+                 * the writes stop. */
+                struct timespec ts;
+
+                ts.tv_sec = time(NULL)+1;
+                ts.tv_nsec = 0;
+                pthread_cond_timedwait(&aofw.newdata,&aofw.lock,&ts);
+            } else {
+                pthread_cond_wait(&aofw.newdata,&aofw.lock);
+            }
+            if (sdslen(aofw.pending) == 0) {
+                if (aofw.dirty_fd != -1 && time(NULL) > last_fsync) {
+                    fd = aofw.dirty_fd;
+                    aofw.dirty_fd = -1;
+                    aofw.busy = 1;
+                    pthread_mutex_unlock(&aofw.lock);
+                    aof_fsync(fd);
+                    last_fsync = time(NULL);
+                    pthread_mutex_lock(&aofw.lock);
+                }
+                continue;
+            }
+        }
+
+        /* Take the pending batch, leaving our empty buffer in its place. */
+        {
+            sds tmp = aofw.pending;
+            aofw.pending = buf;
+            buf = tmp;
+        }
+        seq = aofw.pending_seq;
+        fd = aofw.fd;
+        policy = aofw.fsync_policy;
+        aofw.busy = 1;
+        pthread_mutex_unlock(&aofw.lock);
+
+        /* Retry on errors: like the main thread does, the data is kept
+         * until it is written, and the error is reported so that the server
+         * stops accepting writes meanwhile. The batch is given up only when
+         * the main thread asks for it, see aofWriterFlush(). */
+        while(written < sdslen(buf)) {
+            ssize_t nwritten = write(fd,buf+written,sdslen(buf)-written);
+
+            if (nwritten == -1 && errno == EINTR) continue;
+            if (nwritten <= 0) {
+                struct timespec ts;
+
+                pthread_mutex_lock(&aofw.lock);
+                aofw.write_errno = (nwritten == -1) ? errno : ENOSPC;
+                pthread_cond_broadcast(&aofw.idle);
+                aofWriterNotify();
+                if (!aofw.drop) {
+                    ts.tv_sec = time(NULL)+1;
+                    ts.tv_nsec = 0;
+                    pthread_cond_timedwait(&aofw.newdata,&aofw.lock,&ts);
+                }
+                if (aofw.drop) {
+                    pthread_mutex_unlock(&aofw.lock);
+                    break;
+                }
+                pthread_mutex_unlock(&aofw.lock);
+                continue;
+            }
+            written += nwritten;
+        }
+
+        if (written < sdslen(buf)) {
+            /* Given up: nothing was synced, the error stays reported. */
+            sdsclear(buf);
+            pthread_mutex_lock(&aofw.lock);
+            aofw.dirty_fd = -1;
+            continue;
+        }
+
+        if (policy == AOF_FSYNC_ALWAYS) {
+            aof_fsync(fd);
+            last_fsync = time(NULL);
+        } else if (policy == AOF_FSYNC_EVERYSEC &&
+                   time(NULL) > last_fsync)
+        {
+            aof_fsync(fd);
+            last_fsync = time(NULL);
+            fd = -1;
+        }
+        sdsclear(buf);
+
+        pthread_mutex_lock(&aofw.lock);
+        aofw.dirty_fd = (policy == AOF_FSYNC_EVERYSEC) ? fd : -1;
+        aofw.synced_seq = seq;
+        aofw.write_errno = 0;
+        aofWriterNotify();
+    }
+    return NULL;
+}
+
+/* Release the replies of the clients whose writes are now synced, and
+ * report writer errors. Called by the main thread when woken up. */
+static void aofWriterProcessAcks(void) {
+    long long synced;
+    int write_errno;
+    listIter li;
+    listNode *ln;
+
+    pthread_mutex_lock(&aofw.lock);
+    synced = aofw.synced_seq;
+    write_errno = aofw.write_errno;
+    pthread_mutex_unlock(&aofw.lock);
+
+    if (write_errno) {
+        if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+            redisLog(REDIS_WARNING,"Can't recover from AOF write error when the AOF fsync policy is 'always'. Exiting...");
+            exit(1);
+        }
+        if (server.aof_last_write_status == REDIS_OK) {
+            redisLog(REDIS_WARNING,"Error writing to the AOF file: %s",
+                strerror(write_errno));
+        }
+        server.aof_last_write_status = REDIS_ERR;
+        server.aof_last_write_errno = write_errno;
+    } else if (server.aof_last_write_status == REDIS_ERR) {
+        redisLog(REDIS_WARNING,
+            "AOF write error looks solved, Redis can write again.");
+        server.aof_last_write_status = REDIS_OK;
+    }
+
+    listRewind(server.aof_wait_clients,&li);
+    while((ln = listNext(&li)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        if (c->aof_wait_seq > synced) continue;
+        c->flags &= ~REDIS_AOF_WAIT;
+        listDelNode(server.aof_wait_clients,ln);
+        if ((c->bufpos || listLength(c->reply)) &&
+            aeCreateFileEvent(server.el,c->fd,AE_WRITABLE,
+                              sendReplyToClient,c) == AE_ERR)
+        {
+            freeClientAsync(c);
+        }
+    }
+}
+
+static void aofWriterNotifyHandler(aeEventLoop *el, int fd, void *privdata,
+                                   int mask)
+{
+    char buf[64];
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(privdata);
+    REDIS_NOTUSED(mask);
+
+    while(read(fd,buf,sizeof(buf)) > 0);
+    aofWriterProcessAcks();
+}
+
+/* Start the writer thread. Called at startup when aof-threaded-write is
+ * enabled, even if the AOF is off, since it can be turned on later. */
+void aofWriterInit(void) {
+    aofw.pending = sdsempty();
+    aofw.fd = -1;
+    aofw.busy = 0;
+    aofw.dirty_fd = -1;
+    aofw.submitted_seq = aofw.pending_seq = aofw.synced_seq = 0;
+    aofw.write_errno = 0;
+    aofw.drop = 0;
+    aofw.fsync_policy = server.aof_fsync;
+    pthread_mutex_init(&aofw.lock,NULL);
+    pthread_cond_init(&aofw.newdata,NULL);
+    pthread_cond_init(&aofw.idle,NULL);
+
+    if (pipe(aofw.notify_pipe) == -1 ||
+        anetNonBlock(NULL,aofw.notify_pipe[0]) != ANET_OK ||
+        anetNonBlock(NULL,aofw.notify_pipe[1]) != ANET_OK ||
+        aeCreateFileEvent(server.el,aofw.notify_pipe[0],AE_READABLE,
+                          aofWriterNotifyHandler,NULL) == AE_ERR)
+    {
+        redisLog(REDIS_WARNING,"Can't setup the AOF writer notification pipe: %s", strerror(errno));
+        exit(1);
+    }
+    if (pthread_create(&aofw.thread,NULL,aofWriterMain,NULL) != 0) {
+        redisLog(REDIS_WARNING,"Fatal: Can't initialize the AOF writer thread.");
+        exit(1);
+    }
+}
+
+/* Hold the reply of 'c' until the writes it just performed, that are in
+ * the AOF buffer, are synced on disk. */
+void aofHoldClientReply(redisClient *c) {
+    if (!server.aof_threaded_write || server.aof_fsync != AOF_FSYNC_ALWAYS ||
+        c->fd <= 0 || c->flags & (REDIS_MASTER|REDIS_SLAVE|REDIS_MONITOR))
+        return;
+    c->aof_wait_seq = aofw.submitted_seq+1;
+    if (c->flags & REDIS_AOF_WAIT) return;
+    c->flags |= REDIS_AOF_WAIT;
+    listAddNodeTail(server.aof_wait_clients,c);
+    aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+}
+
+/* flushAppendOnlyFile() implementation for the threaded mode. When 'force'
+ * is true we also wait for the writer to write everything: this is needed
+ * before closing or switching the AOF file descriptor. */
+static void aofWriterFlush(int force) {
+    size_t len = sdslen(server.aof_buf);
+
+    if (len) {
+        pthread_mutex_lock(&aofw.lock);
+        if (sdslen(aofw.pending) == 0) {
+            sds tmp = aofw.pending;
+            aofw.pending = server.aof_buf;
+            server.aof_buf = tmp;
+        } else {
+            aofw.pending = sdscatlen(aofw.pending,server.aof_buf,len);
+            sdsclear(server.aof_buf);
+        }
+        aofw.fd = server.aof_fd;
+        aofw.fsync_policy = server.aof_fsync;
+        aofw.pending_seq = ++aofw.submitted_seq;
+        pthread_cond_signal(&aofw.newdata);
+        pthread_mutex_unlock(&aofw.lock);
+
+        server.aof_current_size += len;
+        server.aof_incr_size += len;
+        aofBufferUpdateMemUsage();
+    }
+
+    if (force) {
+        mstime_t latency;
+
+        latencyStartMonitor(latency);
+        pthread_mutex_lock(&aofw.lock);
+        while(sdslen(aofw.pending) || aofw.busy) {
+            if (aofw.write_errno && !aofw.drop) {
+                /* The writer can't write: waiting for the disk to recover
+                 * would block SHUTDOWN or CONFIG SET appendonly no forever.
+                 * Like the non threaded path, give up the data instead
+                 * (aofWriterProcessAcks() exits under appendfsync always,
+                 * since the written data can't be acknowledged). */
+                pthread_mutex_unlock(&aofw.lock);
+                aofWriterProcessAcks();
+                pthread_mutex_lock(&aofw.lock);
+                redisLog(REDIS_WARNING,
+                    "Giving up %zu bytes of the AOF buffer the writer "
+                    "thread can't write: %s",
+                    sdslen(aofw.pending), strerror(aofw.write_errno));
+                sdsclear(aofw.pending);
+                aofw.drop = 1;
+                pthread_cond_signal(&aofw.newdata);
+                continue;
+            }
+            pthread_cond_wait(&aofw.idle,&aofw.lock);
+        }
+        aofw.drop = 0;
+        /* The caller is going to take care of the file descriptor. */
+        aofw.dirty_fd = -1;
+        pthread_mutex_unlock(&aofw.lock);
+        latencyEndMonitor(latency);
+        latencyAddSampleIfNeeded("aof-writer-drain",latency);
+        aofWriterProcessAcks();
+    }
+}
+
 /* Write the append only file buffer on disk.
  *
  * Since we are required to write the AOF before replying to the client,
@@ -275,6 +1042,10 @@ void flushAppendOnlyFile(int force) {
     int sync_in_progress = 0;
     mstime_t latency;
 
+    if (server.aof_threaded_write) {
+        aofWriterFlush(force);
+        return;
+    }
     if (sdslen(server.aof_buf) == 0) return;
 
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
@@ -353,7 +1124,11 @@ void flushAppendOnlyFile(int force) {
                                        (long long)sdslen(server.aof_buf));
             }
 
-            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+            /* With a multi part AOF the file written is just the last
+             * incremental one. */
+            off_t cursize = server.aof_multi_part ? server.aof_incr_size :
+                                                    server.aof_current_size;
+            if (ftruncate(server.aof_fd, cursize) == -1) {
                 if (can_log) {
                     redisLog(REDIS_WARNING, "Could not remove short write "
                              "from the append-only file.  Redis may refuse "
@@ -386,6 +1161,7 @@ void flushAppendOnlyFile(int force) {
              * was no way to undo it with ftruncate(2). */
             if (nwritten > 0) {
                 server.aof_current_size += nwritten;
+                server.aof_incr_size += nwritten;
                 sdsrange(server.aof_buf,nwritten,-1);
             }
             return; /* We'll try again on the next call... */
@@ -400,6 +1176,7 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+    server.aof_incr_size += nwritten;
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -409,6 +1186,7 @@ void flushAppendOnlyFile(int force) {
         sdsfree(server.aof_buf);
         server.aof_buf = sdsempty();
     }
+    aofBufferUpdateMemUsage();
 
     /* Don't fsync if no-appendfsync-on-rewrite is set to yes and there are
      * children doing I/O in the background. */
@@ -530,15 +1308,29 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
 
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == REDIS_AOF_ON)
+     * positive reply about the operation performed.
+     *
+     * With a multi part AOF the writes performed while waiting for the
+     * first rewrite go to the new incremental file as well: this is what
+     * will follow the base file produced by the child. */
+    if (server.aof_state == REDIS_AOF_ON ||
+        (server.aof_multi_part && server.aof_state == REDIS_AOF_WAIT_REWRITE))
+    {
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
+        aofBufferUpdateMemUsage();
+        /* With the threaded writer the reply can't be sent before the
+         * write is synced, when this is what appendfsync asks for. */
+        if (server.current_client)
+            aofHoldClientReply(server.current_client);
+    }
 
     /* If a background append only file rewriting is in progress we want to
      * accumulate the differences between the child DB and the current one
      * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    if (server.aof_child_pid != -1)
+     * can append the differences to the new append only file. This is not
+     * needed with a multi part AOF, where the differences are already in
+     * the incremental files. */
+    if (server.aof_child_pid != -1 && !server.aof_multi_part)
         aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
 
     sdsfree(buf);
@@ -593,16 +1385,151 @@ void freeFakeClient(struct redisClient *c) {
     zfree(c);
 }
 
+/* Return values of the mapped AOF parser. */
+#define AOF_LOAD_OK 0       /* End of file reached after a full command. */
+#define AOF_LOAD_UXEOF 1    /* The file ends in the middle of a command. */
+#define AOF_LOAD_FMTERR 2   /* Bad file format. */
+
+/* The mapped AOF is executed in batches: clients are served and the loading
+ * progress is updated after every batch of commands or bytes. */
+#define AOF_LOAD_BATCH_CMDS 1000
+#define AOF_LOAD_BATCH_BYTES (1024*1024*4)
+
+/* Parse a "<prefix><number>\r\n" protocol line at *pp, without going past
+ * 'end'. On success *pp is updated to point to the next line. */
+static int aofParseLine(char **pp, char *end, char prefix, long long *val) {
+    char *p = *pp, *nl;
+    size_t len;
+
+    if (p == end) return AOF_LOAD_UXEOF;
+    if (*p != prefix) return AOF_LOAD_FMTERR;
+    if ((nl = memchr(p,'\n',end-p)) == NULL) return AOF_LOAD_UXEOF;
+    len = nl-p-1;
+    if (len && nl[-1] == '\r') len--;
+    if (!string2ll(p+1,len,val)) return AOF_LOAD_FMTERR;
+    *pp = nl+1;
+    return AOF_LOAD_OK;
+}
+
+/* Execute the commands found in the memory mapped AOF 'map' of 'size' bytes,
+ * starting at offset 'start'. The arguments are created straight from the
+ * mapped file, and the argument vector is reused across commands. The
+ * offset after the last command executed is stored in *valid_up_to.
+ *
+ * Commands are executed in batches (see AOF_LOAD_BATCH_*), and since runs
+ * of the same command are common in AOF files, the command table lookup
+ * is skipped when a command has the same name of the previous one. */
+static int loadAppendOnlyFileMapped(struct redisClient *fakeClient,
+                                    char *map, off_t start, off_t size,
+                                    off_t *valid_up_to)
+{
+    char *p = map+start, *end = map+size;
+    char *batch_start = p;
+    robj **argv = NULL;
+    long long argv_size = 0;
+    long batch_cmds = 0;
+    struct redisCommand *cmd = NULL;
+    int retval = AOF_LOAD_OK;
+
+    loadingProgress(p-map);
+    while(p < end) {
+        long long argc, len, j;
+
+        /* Serve the clients at the end of every batch. */
+        if (++batch_cmds == AOF_LOAD_BATCH_CMDS ||
+            p-batch_start >= AOF_LOAD_BATCH_BYTES)
+        {
+            loadingProgress(p-map);
+            processEventsWhileBlocked();
+            batch_cmds = 0;
+            batch_start = p;
+        }
+
+        if ((retval = aofParseLine(&p,end,'*',&argc)) != AOF_LOAD_OK) break;
+        if (argc < 1 || argc > INT_MAX) {
+            retval = AOF_LOAD_FMTERR;
+            break;
+        }
+        /* Every argument takes some bytes: a bigger count can't be
+         * satisfied by the rest of the file. */
+        if (argc > end-p) {
+            retval = AOF_LOAD_UXEOF;
+            break;
+        }
+        if (argc > argv_size) {
+            argv = zrealloc(argv,sizeof(robj*)*argc);
+            argv_size = argc;
+        }
+        for (j = 0; j < argc; j++) {
+            if ((retval = aofParseLine(&p,end,'$',&len)) != AOF_LOAD_OK)
+                break;
+            if (len < 0) {
+                retval = AOF_LOAD_FMTERR;
+                break;
+            }
+            if (end-p < 2 || len > (end-p)-2) {
+                retval = AOF_LOAD_UXEOF;
+                break;
+            }
+            argv[j] = createStringObject(p,len);
+            p += len+2; /* Skip CRLF as well. */
+        }
+        if (retval != AOF_LOAD_OK) {
+            while(j--) decrRefCount(argv[j]);
+            break;
+        }
+        fakeClient->argc = argc;
+        fakeClient->argv = argv;
+
+        /* Command lookup */
+        if (cmd == NULL || strcasecmp(cmd->name,argv[0]->ptr)) {
+            cmd = lookupCommand(argv[0]->ptr);
+            if (!cmd) {
+                redisLog(REDIS_WARNING,"Unknown command '%s' reading the append only file", (char*)argv[0]->ptr);
+                exit(1);
+            }
+        }
+
+        /* Run the command in the context of a fake client */
+        cmd->proc(fakeClient);
+
+        /* The fake client should not have a reply */
+        redisAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
+        /* The fake client should never get blocked */
+        redisAssert((fakeClient->flags & REDIS_BLOCKED) == 0);
+
+        /* Clean up. The command may have rewritten the argument vector,
+         * releasing ours: in that case we reuse the new one. */
+        for (j = 0; j < fakeClient->argc; j++)
+            decrRefCount(fakeClient->argv[j]);
+        if (fakeClient->argv != argv) {
+            argv = fakeClient->argv;
+            argv_size = fakeClient->argc;
+        }
+        fakeClient->argc = 0;
+        fakeClient->argv = NULL;
+        *valid_up_to = p-map;
+    }
+    zfree(argv);
+    return retval;
+}
+
 /* Replay the append log file. On success REDIS_OK is returned. On non fatal
  * error (the append only file is zero-length) REDIS_ERR is returned. On
- * fatal error an error message is logged and the program exists. */
-int loadAppendOnlyFile(char *filename) {
+ * fatal error an error message is logged and the program exists.
+ *
+ * 'last' tells if the file is the last one of the AOF: only then a short
+ * read is fixed by truncating the file when aof-load-truncated is set. */
+static int loadAppendOnlyFilePart(char *filename, int last) {
     struct redisClient *fakeClient;
     FILE *fp = fopen(filename,"r");
     struct redis_stat sb;
     int old_aof_state = server.aof_state;
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of the latest well-formed command loaded. */
+    /* Only the last file may be truncated: the writes of the files that
+     * follow would otherwise be replayed on top of the lost ones. */
+    int truncate_ok = server.aof_load_truncated && last;
 
     if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
         server.aof_current_size = 0;
@@ -622,6 +1549,52 @@ int loadAppendOnlyFile(char *filename) {
     fakeClient = createFakeClient();
     startLoading(fp);
 
+    /* Check if this AOF file has an RDB preamble. In that case we need to
+     * load the RDB file and later continue loading the AOF tail. */
+    char sig[5]; /* "REDIS" */
+    if (fread(sig,1,5,fp) != 5 || memcmp(sig,"REDIS",5) != 0) {
+        /* No RDB preamble, seek back at 0 offset. */
+        if (fseek(fp,0,SEEK_SET) == -1) goto readerr;
+    } else {
+        /* RDB preamble: load it with the RDB functions. */
+        rio rdb;
+
+        redisLog(REDIS_NOTICE,"Reading RDB preamble from AOF file...");
+        if (fseek(fp,0,SEEK_SET) == -1) goto readerr;
+        rioInitWithFile(&rdb,fp);
+        if (rdbLoadRio(&rdb,REDIS_RDB_LOAD_NONE) != REDIS_OK) {
+            redisLog(REDIS_WARNING,"Error reading the RDB preamble of the AOF file, AOF loading aborted");
+            exit(1);
+        }
+        redisLog(REDIS_NOTICE,"Reading the remaining AOF tail...");
+        if (truncate_ok) valid_up_to = ftello(fp);
+    }
+
+    /* Parse the commands straight from a memory mapping of the file when
+     * possible, falling back to stdio otherwise: when the file is too big
+     * for the address space, like on 32 bit systems, or mmap() fails. */
+    if (redis_fstat(fileno(fp),&sb) != -1 &&
+        (uint64_t)sb.st_size <= SIZE_MAX)
+    {
+        off_t start = ftello(fp);
+        char *map;
+        int retval;
+
+        if (start == -1) goto readerr;
+        if (sb.st_size <= start) goto loaded_ok; /* Only the RDB preamble. */
+        map = mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fileno(fp),0);
+        if (map != MAP_FAILED) {
+            madvise(map,sb.st_size,MADV_SEQUENTIAL);
+            retval = loadAppendOnlyFileMapped(fakeClient,map,start,
+                                              sb.st_size,&valid_up_to);
+            munmap(map,sb.st_size);
+            if (retval == AOF_LOAD_FMTERR) goto fmterr;
+            if (retval == AOF_LOAD_UXEOF) goto uxeof;
+            if (fakeClient->flags & REDIS_MULTI) goto uxeof;
+            goto loaded_ok;
+        }
+    }
+
     while(1) {
         int argc, j;
         unsigned long len;
@@ -692,7 +1665,7 @@ int loadAppendOnlyFile(char *filename) {
         /* Clean up. Command code may have changed argv/argc so we use the
          * argv/argc of the client instead of the local variables. */
         freeFakeClientArgv(fakeClient);
-        if (server.aof_load_truncated) valid_up_to = ftello(fp);
+        if (truncate_ok) valid_up_to = ftello(fp);
     }
 
     /* This point can only be reached when EOF is reached without errors.
@@ -715,7 +1688,7 @@ readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     }
 
 uxeof: /* Unexpected AOF end of file. */
-    if (server.aof_load_truncated) {
+    if (truncate_ok) {
         redisLog(REDIS_WARNING,"!!! Warning: short read while loading the AOF file !!!");
         redisLog(REDIS_WARNING,"!!! Truncating the AOF at offset %llu !!!",
             (unsigned long long) valid_up_to);
@@ -739,6 +1712,10 @@ uxeof: /* Unexpected AOF end of file. */
             }
         }
     }
+    if (server.aof_load_truncated && !last) {
+        redisLog(REDIS_WARNING,"Unexpected end of file reading %s, that is not the last file of the AOF manifest: it can't be truncated since the files after it would be replayed over the missing writes. Make a backup of your AOF files, then use ./redis-check-aof --fix <filename>.", filename);
+        exit(1);
+    }
     redisLog(REDIS_WARNING,"Unexpected end of file reading the append only file. You can: 1) Make a backup of your AOF file, then use ./redis-check-aof --fix <filename>. 2) Alternatively you can set the 'aof-load-truncated' configuration option to yes and restart the server.");
     exit(1);
 
@@ -747,6 +1724,13 @@ fmterr: /* Format error. */
     exit(1);
 }
 
+/* Replay the append log file 'filename', that is the last (or only) file
+ * of the AOF, so it can be truncated if aof-load-truncated is enabled. See
+ * loadAppendOnlyFilePart() for the return value. */
+int loadAppendOnlyFile(char *filename) {
+    return loadAppendOnlyFilePart(filename,1);
+}
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite
  * ------------------------------------------------------------------------- */
@@ -1003,6 +1987,7 @@ ssize_t aofReadDiffFromParent(void) {
     char buf[65536]; /* Default pipe buffer size on most Linux systems. */
     ssize_t nread, total = 0;
 
+    if (server.aof_multi_part) return 0; /* No pipes in this mode. */
     while ((nread =
             read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
         server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
@@ -1012,50 +1997,26 @@ ssize_t aofReadDiffFromParent(void) {
 }
 
 /* Write a sequence of commands able to fully rebuild the dataset into
- * "filename". Used both by REWRITEAOF and BGREWRITEAOF.
- *
- * In order to minimize the number of commands needed in the rewritten
- * log Redis uses variadic commands when possible, such as RPUSH, SADD
- * and ZADD. However at max REDIS_AOF_REWRITE_ITEMS_PER_CMD items per time
- * are inserted using a single command. */
-int rewriteAppendOnlyFile(char *filename) {
+ * the rio stream 'aof'. Returns REDIS_ERR on write errors. */
+int rewriteAppendOnlyFileRio(rio *aof) {
     dictIterator *di = NULL;
     dictEntry *de;
-    rio aof;
-    FILE *fp;
-    char tmpfile[256];
     int j;
     long long now = mstime();
-    char byte;
     size_t processed = 0;
+    unsigned long keys = 0;
 
-    /* Note that we have to use a different temp name here compared to the
-     * one used by rewriteAppendOnlyFileBackground() function. */
-    snprintf(tmpfile,256,"temp-rewriteaof-%d.aof", (int) getpid());
-    fp = fopen(tmpfile,"w");
-    if (!fp) {
-        redisLog(REDIS_WARNING, "Opening the temp file for AOF rewrite in rewriteAppendOnlyFile(): %s", strerror(errno));
-        return REDIS_ERR;
-    }
-
-    server.aof_child_diff = sdsempty();
-    rioInitWithFile(&aof,fp);
-    if (server.aof_rewrite_incremental_fsync)
-        rioSetAutoSync(&aof,REDIS_AOF_AUTOSYNC_BYTES);
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
         dict *d = db->dict;
         if (dictSize(d) == 0) continue;
         di = dictGetSafeIterator(d);
-        if (!di) {
-            fclose(fp);
-            return REDIS_ERR;
-        }
+        if (!di) return REDIS_ERR;
 
         /* SELECT the new DB */
-        if (rioWrite(&aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
-        if (rioWriteBulkLongLong(&aof,j) == 0) goto werr;
+        if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
+        if (rioWriteBulkLongLong(aof,j) == 0) goto werr;
 
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
@@ -1064,7 +2025,7 @@ int rewriteAppendOnlyFile(char *filename) {
             long long expiretime;
 
             keystr = dictGetKey(de);
-            o = dictGetVal(de);
+            o = dbGetVal(de);
             initStaticStringObject(key,keystr);
 
             expiretime = getExpire(db,&key);
@@ -1076,41 +2037,53 @@ int rewriteAppendOnlyFile(char *filename) {
             if (o->type == REDIS_STRING) {
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
-                if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
                 /* Key and value */
-                if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
-                if (rioWriteBulkObject(&aof,o) == 0) goto werr;
+                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
+                if (rioWriteBulkObject(aof,o) == 0) goto werr;
             } else if (o->type == REDIS_LIST) {
-                if (rewriteListObject(&aof,&key,o) == 0) goto werr;
+                if (rewriteListObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == REDIS_SET) {
-                if (rewriteSetObject(&aof,&key,o) == 0) goto werr;
+                if (rewriteSetObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == REDIS_ZSET) {
-                if (rewriteSortedSetObject(&aof,&key,o) == 0) goto werr;
+                if (rewriteSortedSetObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == REDIS_HASH) {
-                if (rewriteHashObject(&aof,&key,o) == 0) goto werr;
+                if (rewriteHashObject(aof,&key,o) == 0) goto werr;
             } else {
                 redisPanic("Unknown object type");
             }
             /* Save the expire time */
             if (expiretime != -1) {
                 char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
-                if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
-                if (rioWriteBulkLongLong(&aof,expiretime) == 0) goto werr;
+                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
+                if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
             }
             /* Read some diff from the parent process from time to time. */
-            if (aof.processed_bytes > processed+1024*10) {
-                processed = aof.processed_bytes;
+            if (aof->processed_bytes >
+                processed+REDIS_AOF_READ_DIFF_INTERVAL_BYTES)
+            {
+                processed = aof->processed_bytes;
                 aofReadDiffFromParent();
             }
+            /* Report the copy-on-write of the child to the parent. */
+            if ((++keys & 1023) == 0) sendChildCOWInfo(0,NULL);
         }
         dictReleaseIterator(di);
+        di = NULL;
     }
+    return REDIS_OK;
 
-    /* Do an initial slow fsync here while the parent is still sending
-     * data, in order to make the next final fsync faster. */
-    if (fflush(fp) == EOF) goto werr;
-    if (fsync(fileno(fp)) == -1) goto werr;
+werr:
+    if (di) dictReleaseIterator(di);
+    return REDIS_ERR;
+}
+
+/* Called by the rewrite child once the dataset is written: read the
+ * differences accumulated by the parent meanwhile, ask the parent to stop
+ * sending them, and append them to the rewritten AOF. */
+static int rewriteAppendOnlyFileFetchDiff(rio *aof) {
+    char byte;
 
     /* Read again a few times to get more data from the parent.
      * We can't read forever (the server may receive data from clients
@@ -1132,14 +2105,14 @@ int rewriteAppendOnlyFile(char *filename) {
     }
 
     /* Ask the master to stop sending diffs. */
-    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
+    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) return REDIS_ERR;
     if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
-        goto werr;
+        return REDIS_ERR;
     /* We read the ACK from the server using a 10 seconds timeout. Normally
      * it should reply ASAP, but just in case we lose its reply, we are sure
      * the child will eventually get terminated. */
     if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
-        byte != '!') goto werr;
+        byte != '!') return REDIS_ERR;
     redisLog(REDIS_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
 
     /* Read the final diff if any. */
@@ -1149,8 +2122,62 @@ int rewriteAppendOnlyFile(char *filename) {
     redisLog(REDIS_NOTICE,
         "Concatenating %.2f MB of AOF diff received from parent.",
         (double) sdslen(server.aof_child_diff) / (1024*1024));
-    if (rioWrite(&aof,server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
-        goto werr;
+    if (rioWrite(aof,server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
+        return REDIS_ERR;
+    return REDIS_OK;
+}
+
+/* Write a sequence of commands able to fully rebuild the dataset into
+ * "filename". Used both by REWRITEAOF and BGREWRITEAOF.
+ *
+ * In order to minimize the number of commands needed in the rewritten
+ * log Redis uses variadic commands when possible, such as RPUSH, SADD
+ * and ZADD. However at max REDIS_AOF_REWRITE_ITEMS_PER_CMD items per time
+ * are inserted using a single command.
+ *
+ * When aof-use-rdb-preamble is enabled the dataset is written in RDB
+ * format instead, and the commands received from the parent meanwhile are
+ * appended after it: loadAppendOnlyFile() recognizes the "REDIS" prefix. */
+int rewriteAppendOnlyFile(char *filename) {
+    rio aof;
+    FILE *fp;
+    char tmpfile[256];
+
+    /* Note that we have to use a different temp name here compared to the
+     * one used by rewriteAppendOnlyFileBackground() function. */
+    snprintf(tmpfile,256,"temp-rewriteaof-%d.aof", (int) getpid());
+    fp = fopen(tmpfile,"w");
+    if (!fp) {
+        redisLog(REDIS_WARNING, "Opening the temp file for AOF rewrite in rewriteAppendOnlyFile(): %s", strerror(errno));
+        return REDIS_ERR;
+    }
+
+    server.aof_child_diff = sdsempty();
+    rioInitWithFile(&aof,fp);
+    if (server.aof_rewrite_incremental_fsync)
+        rioSetAutoSync(&aof,REDIS_AOF_AUTOSYNC_BYTES);
+    if (server.aof_use_rdb_preamble) {
+        int error;
+
+        if (rdbSaveRio(&aof,&error,REDIS_RDB_SAVE_AOF_PREAMBLE) == REDIS_ERR) {
+            errno = error;
+            goto werr;
+        }
+        /* The AOF tail is not covered by the RDB checksum. */
+        aof.update_cksum = NULL;
+    } else {
+        if (rewriteAppendOnlyFileRio(&aof) == REDIS_ERR) goto werr;
+    }
+
+    /* Do an initial slow fsync here while the parent is still sending
+     * data, in order to make the next final fsync faster. */
+    if (fflush(fp) == EOF) goto werr;
+    if (fsync(fileno(fp)) == -1) goto werr;
+
+    /* Get the last writes from the parent, not needed with a multi part
+     * AOF since they are already in the incremental files. */
+    if (!server.aof_multi_part && rewriteAppendOnlyFileFetchDiff(&aof) ==
+        REDIS_ERR) goto werr;
 
     /* Make sure data will not remain on the OS's output buffers */
     if (fflush(fp) == EOF) goto werr;
@@ -1168,10 +2195,9 @@ int rewriteAppendOnlyFile(char *filename) {
     return REDIS_OK;
 
 werr:
+    redisLog(REDIS_WARNING,"Write error writing append only file on disk: %s", strerror(errno));
     fclose(fp);
     unlink(tmpfile);
-    redisLog(REDIS_WARNING,"Write error writing append only file on disk: %s", strerror(errno));
-    if (di) dictReleaseIterator(di);
     return REDIS_ERR;
 }
 
@@ -1270,23 +2296,23 @@ int rewriteAppendOnlyFileBackground(void) {
     long long start;
 
     if (server.aof_child_pid != -1) return REDIS_ERR;
-    if (aofCreatePipes() != REDIS_OK) return REDIS_ERR;
+    if (server.aof_multi_part) {
+        if (aofMultiPartPrepareRewrite() != REDIS_OK) return REDIS_ERR;
+    } else {
+        if (aofCreatePipes() != REDIS_OK) return REDIS_ERR;
+    }
+    openChildInfoPipe();
     start = ustime();
     if ((childpid = fork()) == 0) {
         char tmpfile[256];
 
         /* Child */
+        server.in_fork_child = REDIS_CHILD_INFO_TYPE_AOF;
         closeListeningSockets(0);
         redisSetProcTitle("redis-aof-rewrite");
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof", (int) getpid());
         if (rewriteAppendOnlyFile(tmpfile) == REDIS_OK) {
-            size_t private_dirty = zmalloc_get_private_dirty();
-
-            if (private_dirty) {
-                redisLog(REDIS_NOTICE,
-                    "AOF rewrite: %zu MB of memory used by copy-on-write",
-                    private_dirty/(1024*1024));
-            }
+            sendChildCOWInfo(1,"AOF rewrite");
             exitFromChild(0);
         } else {
             exitFromChild(1);
@@ -1300,6 +2326,7 @@ int rewriteAppendOnlyFileBackground(void) {
             redisLog(REDIS_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
+            if (server.rdb_child_pid == -1) closeChildInfoPipe();
             return REDIS_ERR;
         }
         redisLog(REDIS_NOTICE,
@@ -1322,7 +2349,7 @@ int rewriteAppendOnlyFileBackground(void) {
 void bgrewriteaofCommand(redisClient *c) {
     if (server.aof_child_pid != -1) {
         addReplyError(c,"Background append only file rewriting already in progress");
-    } else if (server.rdb_child_pid != -1) {
+    } else if (server.rdb_child_pid != -1 || server.rdb_snapshot) {
         server.aof_rewrite_scheduled = 1;
         addReplyStatus(c,"Background append only file rewriting scheduled");
     } else if (rewriteAppendOnlyFileBackground() == REDIS_OK) {
@@ -1348,7 +2375,13 @@ void aofUpdateCurrentSize(void) {
     mstime_t latency;
 
     latencyStartMonitor(latency);
-    if (redis_fstat(server.aof_fd,&sb) == -1) {
+    if (server.aof_multi_part && server.aof_manifest) {
+        /* The AOF is the sum of all its parts, the one written is the
+         * last incremental file. */
+        server.aof_current_size = aofManifestTotalSize(server.aof_manifest);
+        if (server.aof_fd != -1 && redis_fstat(server.aof_fd,&sb) != -1)
+            server.aof_incr_size = sb.st_size;
+    } else if (redis_fstat(server.aof_fd,&sb) == -1) {
         redisLog(REDIS_WARNING,"Unable to obtain the AOF file length. stat: %s",
             strerror(errno));
     } else {
@@ -1370,11 +2403,21 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         redisLog(REDIS_NOTICE,
             "Background AOF rewrite terminated with success");
 
+        snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
+            (int)server.aof_child_pid);
+
+        /* With a multi part AOF there is no diff to flush nor file
+         * descriptor to switch: just install the new base. */
+        if (server.aof_multi_part) {
+            if (aofMultiPartInstallRewrite(tmpfile) == REDIS_ERR)
+                goto cleanup;
+            oldfd = -1;
+            goto installed;
+        }
+
         /* Flush the differences accumulated by the parent to the
          * rewritten AOF. */
         latencyStartMonitor(latency);
-        snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
-            (int)server.aof_child_pid);
         newfd = open(tmpfile,O_WRONLY|O_APPEND);
         if (newfd == -1) {
             redisLog(REDIS_WARNING,
@@ -1451,7 +2494,9 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
              * to this new file, so we can close it. */
             close(newfd);
         } else {
-            /* AOF enabled, replace the old fd with the new one. */
+            /* AOF enabled, replace the old fd with the new one. The
+             * writer thread must be done with the old one first. */
+            if (server.aof_threaded_write) flushAppendOnlyFile(1);
             oldfd = server.aof_fd;
             server.aof_fd = newfd;
             if (server.aof_fsync == AOF_FSYNC_ALWAYS)
@@ -1466,8 +2511,10 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
              * the new AOF from the background rewrite buffer. */
             sdsfree(server.aof_buf);
             server.aof_buf = sdsempty();
+            aofBufferUpdateMemUsage();
         }
 
+installed:
         server.aof_lastbgrewrite_status = REDIS_OK;
 
         redisLog(REDIS_NOTICE, "Background AOF rewrite finished successfully");
@@ -1493,7 +2540,7 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     }
 
 cleanup:
-    aofClosePipes();
+    if (!server.aof_multi_part) aofClosePipes();
     aofRewriteBufferReset();
     aofRemoveTempFile(server.aof_child_pid);
     server.aof_child_pid = -1;
@@ -176,6 +176,9 @@ void *bioProcessBackgroundJobs(void *arg) {
             close((long)job->arg1);
         } else if (type == REDIS_BIO_AOF_FSYNC) {
             aof_fsync((long)job->arg1);
+            /* A non NULL arg2 asks to close the file once synced: this is
+             * used to retire AOF files that are no longer written. */
+            if (job->arg2) close((long)job->arg1);
         } else {
             redisPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
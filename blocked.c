@@ -132,6 +132,8 @@ void unblockClient(redisClient *c) {
         unblockClientWaitingData(c);
     } else if (c->btype == REDIS_BLOCKED_WAIT) {
         unblockClientWaitingReplicas(c);
+    } else if (c->btype == REDIS_BLOCKED_OFFSET) {
+        unblockClientWaitingOffset(c);
     } else {
         redisPanic("Unknown btype in unblockClient().");
     }
@@ -151,6 +153,8 @@ void replyToBlockedClientTimedOut(redisClient *c) {
         addReply(c,shared.nullmultibulk);
     } else if (c->btype == REDIS_BLOCKED_WAIT) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
+    } else if (c->btype == REDIS_BLOCKED_OFFSET) {
+        addReplyLongLong(c,replicationGetServedOffset());
     } else {
         redisPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
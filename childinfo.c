@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+#include <unistd.h>
+
+/* Child info pipe
+ * ---------------
+ *
+ * The memory a fork()ed child uses is not visible from the parent: every
+ * page the parent modifies while the child is alive is duplicated by the
+ * kernel (copy-on-write), so a BGSAVE or BGREWRITEAOF can use up to twice
+ * the memory of the dataset when the write traffic is high. The children
+ * measure their private dirty memory from time to time and report it to the
+ * parent over this pipe, so that it can be shown in INFO. */
+
+/* Message sent by a child to the parent. */
+typedef struct childInfoData {
+    int process_type;       /* REDIS_CHILD_INFO_TYPE_* of the sender. */
+    size_t cow_size;        /* Private dirty bytes of the child. */
+} childInfoData;
+
+/* Open the child info pipe before fork()ing a child. RDB and AOF children
+ * may run at the same time and share the same pipe, so it is created only
+ * if not already open. Both ends are non blocking: a child never waits for
+ * a busy parent, it just loses a sample, and the parent reads what is
+ * available from serverCron(). */
+void openChildInfoPipe(void) {
+    /* A new fork with no other child alive: start from scratch. */
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+        server.stat_current_cow_bytes = 0;
+        server.stat_peak_cow_bytes = 0;
+    }
+    if (server.child_info_pipe[0] != -1) return;
+
+    if (pipe(server.child_info_pipe) == -1) {
+        /* Not fatal: the child will not be able to report its COW. */
+        redisLog(REDIS_WARNING,"Can't open the child info pipe: %s",
+            strerror(errno));
+        server.child_info_pipe[0] = -1;
+        server.child_info_pipe[1] = -1;
+        return;
+    }
+    if (anetNonBlock(NULL,server.child_info_pipe[0]) == ANET_ERR ||
+        anetNonBlock(NULL,server.child_info_pipe[1]) == ANET_ERR)
+    {
+        closeChildInfoPipe();
+    }
+}
+
+/* Close the child info pipe, once no child is left. */
+void closeChildInfoPipe(void) {
+    if (server.child_info_pipe[0] != -1) {
+        close(server.child_info_pipe[0]);
+        close(server.child_info_pipe[1]);
+        server.child_info_pipe[0] = -1;
+        server.child_info_pipe[1] = -1;
+    }
+}
+
+/* Called by the children from time to time, and once more with 'final'
+ * set when they are done: measure the private dirty memory of the child and
+ * send it to the parent. Reading /proc/self/smaps is not free, so periodic
+ * reports are sent at most once per second. On completion the measure is
+ * also logged, using 'pname' as prefix. Calling it from the parent is a
+ * no-op, so that code shared with synchronous saving can call it freely. */
+void sendChildCOWInfo(int final, char *pname) {
+    static long long last_sent = 0;
+    childInfoData info;
+    long long now;
+
+    if (!server.in_fork_child) return;
+    now = mstime();
+    if (!final && now-last_sent < 1000) return;
+    last_sent = now;
+
+    info.process_type = server.in_fork_child;
+    info.cow_size = zmalloc_get_private_dirty();
+    if (final && info.cow_size) {
+        redisLog(REDIS_NOTICE,
+            "%s: %zu MB of memory used by copy-on-write",
+            pname, info.cow_size/(1024*1024));
+    }
+    /* Messages are smaller than PIPE_BUF, so writes are atomic. A full
+     * pipe only means the parent is late reading, skip this sample. */
+    if (server.child_info_pipe[1] != -1 &&
+        write(server.child_info_pipe[1],&info,sizeof(info)) != sizeof(info))
+    {
+        /* Nothing to do. */
+    }
+}
+
+/* Read the reports sent by the children so far, updating the COW stats.
+ * Called by the parent from serverCron() while children are active, and
+ * just before handling the termination of a child, so that its final
+ * report is accounted. */
+void receiveChildInfo(void) {
+    childInfoData info;
+
+    if (server.child_info_pipe[0] == -1) return;
+    while(read(server.child_info_pipe[0],&info,sizeof(info)) == sizeof(info)) {
+        server.stat_current_cow_bytes = info.cow_size;
+        if (info.cow_size > server.stat_peak_cow_bytes)
+            server.stat_peak_cow_bytes = info.cow_size;
+        if (info.process_type == REDIS_CHILD_INFO_TYPE_RDB)
+            server.stat_rdb_cow_bytes = info.cow_size;
+        else if (info.process_type == REDIS_CHILD_INFO_TYPE_AOF)
+            server.stat_aof_cow_bytes = info.cow_size;
+    }
+}
@@ -548,6 +548,14 @@ void clusterReset(int hard) {
  * CLUSTER communication link
  * -------------------------------------------------------------------------- */
 
+/* Update the memory accounted to the link buffers after they changed. */
+void clusterLinkUpdateMemUsage(clusterLink *link) {
+    size_t mem = sdsAllocSize(link->sndbuf)+sdsAllocSize(link->rcvbuf);
+
+    zmalloc_category_update(ZMALLOC_CAT_CLUSTER,link->mem_usage,mem);
+    link->mem_usage = mem;
+}
+
 clusterLink *createClusterLink(clusterNode *node) {
     clusterLink *link = zmalloc(sizeof(*link));
     link->ctime = mstime();
@@ -555,6 +563,8 @@ clusterLink *createClusterLink(clusterNode *node) {
     link->rcvbuf = sdsempty();
     link->node = node;
     link->fd = -1;
+    link->mem_usage = 0;
+    clusterLinkUpdateMemUsage(link);
     return link;
 }
 
@@ -568,6 +578,7 @@ void freeClusterLink(clusterLink *link) {
     }
     sdsfree(link->sndbuf);
     sdsfree(link->rcvbuf);
+    zmalloc_category_sub(ZMALLOC_CAT_CLUSTER,link->mem_usage);
     if (link->node)
         link->node->link = NULL;
     close(link->fd);
@@ -1960,6 +1971,7 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             link->rcvbuf = sdscatlen(link->rcvbuf,buf,nread);
             hdr = (clusterMsg*) link->rcvbuf;
             rcvbuflen += nread;
+            clusterLinkUpdateMemUsage(link);
         }
 
         /* Total length obtained? Process this packet. */
@@ -1967,6 +1979,7 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             if (clusterProcessPacket(link)) {
                 sdsfree(link->rcvbuf);
                 link->rcvbuf = sdsempty();
+                clusterLinkUpdateMemUsage(link);
             } else {
                 return; /* Link no longer valid. */
             }
@@ -1985,6 +1998,7 @@ void clusterSendMessage(clusterLink *link, unsigned char *msg, size_t msglen) {
                     clusterWriteHandler,link);
 
     link->sndbuf = sdscatlen(link->sndbuf, msg, msglen);
+    clusterLinkUpdateMemUsage(link);
     server.cluster->stats_bus_messages_sent++;
 }
 
@@ -4122,8 +4136,12 @@ void clusterCommand(redisClient *c) {
  * -------------------------------------------------------------------------- */
 
 /* Generates a DUMP-format representation of the object 'o', adding it to the
- * io stream pointed by 'rio'. This function can't fail. */
-void createDumpPayload(rio *payload, robj *o) {
+ * io stream pointed by 'rio'. This function can't fail.
+ *
+ * If 'checksum' is false the CRC64 is not computed and zero is stored
+ * instead, that RESTORE understands as "no checksum", exactly like RDB
+ * files saved with rdbchecksum set to no. */
+void createDumpPayload(rio *payload, robj *o, int checksum) {
     unsigned char buf[2];
     uint64_t crc;
 
@@ -4146,14 +4164,15 @@ void createDumpPayload(rio *payload, robj *o) {
     payload->io.buffer.ptr = sdscatlen(payload->io.buffer.ptr,buf,2);
 
     /* CRC64 */
-    crc = crc64(0,(unsigned char*)payload->io.buffer.ptr,
-                sdslen(payload->io.buffer.ptr));
+    crc = checksum ? crc64(0,(unsigned char*)payload->io.buffer.ptr,
+                           sdslen(payload->io.buffer.ptr)) : 0;
     memrev64ifbe(&crc);
     payload->io.buffer.ptr = sdscatlen(payload->io.buffer.ptr,&crc,8);
 }
 
 /* Verify that the RDB version of the dump payload matches the one of this Redis
- * instance and that the checksum is ok.
+ * instance and that the checksum is ok. A zero checksum means that the
+ * sender did not compute it (MIGRATE ... NOCRC), so it is not checked.
  * If the DUMP payload looks valid REDIS_OK is returned, otherwise REDIS_ERR
  * is returned. */
 int verifyDumpPayload(unsigned char *p, size_t len) {
@@ -4170,6 +4189,8 @@ int verifyDumpPayload(unsigned char *p, size_t len) {
     if (rdbver != REDIS_RDB_VERSION) return REDIS_ERR;
 
     /* Verify CRC64 */
+    memcpy(&crc,footer+2,8);
+    if (crc == 0) return REDIS_OK;
     crc = crc64(0,p,len-8);
     memrev64ifbe(&crc);
     return (memcmp(&crc,footer+2,8) == 0) ? REDIS_OK : REDIS_ERR;
@@ -4189,7 +4210,7 @@ void dumpCommand(redisClient *c) {
     }
 
     /* Create the DUMP encoded representation. */
-    createDumpPayload(&payload,o);
+    createDumpPayload(&payload,o,1);
 
     /* Transfer to the client */
     dumpobj = createObject(REDIS_STRING,payload.io.buffer.ptr);
@@ -4266,6 +4287,7 @@ void restoreCommand(redisClient *c) {
 
 typedef struct migrateCachedSocket {
     int fd;
+    long last_dbid;         /* DB selected on the target, or -1. */
     time_t last_use_time;
 } migrateCachedSocket;
 
@@ -4273,14 +4295,15 @@ typedef struct migrateCachedSocket {
  * a cached one.
  *
  * This function is responsible of sending errors to the client if a
- * connection can't be established. In this case -1 is returned.
- * Otherwise on success the socket is returned, and the caller should not
- * attempt to free it after usage.
+ * connection can't be established. In this case NULL is returned.
+ * Otherwise on success the cached socket is returned, and the caller should
+ * not attempt to free it after usage.
  *
  * If the caller detects an error while using the socket, migrateCloseSocket()
  * should be called so that the connection will be created from scratch
  * the next time. */
-int migrateGetSocket(redisClient *c, robj *host, robj *port, long timeout) {
+migrateCachedSocket *migrateGetSocket(redisClient *c, robj *host, robj *port,
+                                      long timeout) {
     int fd;
     sds name = sdsempty();
     migrateCachedSocket *cs;
@@ -4293,7 +4316,7 @@ int migrateGetSocket(redisClient *c, robj *host, robj *port, long timeout) {
     if (cs) {
         sdsfree(name);
         cs->last_use_time = server.unixtime;
-        return cs->fd;
+        return cs;
     }
 
     /* No cached socket, create one. */
@@ -4313,7 +4336,7 @@ int migrateGetSocket(redisClient *c, robj *host, robj *port, long timeout) {
         sdsfree(name);
         addReplyErrorFormat(c,"Can't connect to target node: %s",
             server.neterr);
-        return -1;
+        return NULL;
     }
     anetEnableTcpNoDelay(server.neterr,fd);
 
@@ -4323,15 +4346,16 @@ int migrateGetSocket(redisClient *c, robj *host, robj *port, long timeout) {
         addReplySds(c,
             sdsnew("-IOERR error or timeout connecting to the client\r\n"));
         close(fd);
-        return -1;
+        return NULL;
     }
 
     /* Add to the cache and return it to the caller. */
     cs = zmalloc(sizeof(*cs));
     cs->fd = fd;
+    cs->last_dbid = -1;
     cs->last_use_time = server.unixtime;
     dictAdd(server.migrate_cached_sockets,name,cs);
-    return fd;
+    return cs;
 }
 
 /* Free a migrate cached connection. */
@@ -4370,13 +4394,96 @@ void migrateCloseTimedoutSockets(void) {
     dictReleaseIterator(di);
 }
 
-/* MIGRATE host port key dbid timeout [COPY | REPLACE] */
+/* Read 'numreplies' single line replies (status or error) from the target
+ * instance of MIGRATE. Unlike syncReadLine(), that reads a byte at a time,
+ * we read as much as the socket has to offer and then parse all the replies
+ * we got, so that the replies of a whole pipeline are read with a few
+ * system calls.
+ *
+ * 'failed[j]' is set to 1 if the j-th reply is an error, and the first
+ * error received is returned in '*err' (that must be initially NULL) as a
+ * new sds string. Returns REDIS_ERR on I/O error or timeout, with errno
+ * set, otherwise REDIS_OK. */
+static int migrateReadReplies(int fd, int numreplies, char *failed, sds *err,
+                              long timeout)
+{
+    sds buf = sdsempty();
+    size_t pos = 0;
+    long long start = mstime();
+    int j = 0;
+
+    while(1) {
+        char *nl;
+        ssize_t nread;
+        long long elapsed;
+
+        /* Consume all the complete replies we have. */
+        while(j < numreplies &&
+              (nl = memchr(buf+pos,'\n',sdslen(buf)-pos)) != NULL)
+        {
+            char *line = buf+pos;
+            size_t linelen = nl-line;
+
+            if (linelen && line[linelen-1] == '\r') linelen--;
+            failed[j] = line[0] == '-';
+            if (failed[j] && *err == NULL) *err = sdsnewlen(line+1,linelen-1);
+            pos = nl-buf+1;
+            j++;
+        }
+        if (j == numreplies) break;
+        sdsrange(buf,pos,-1);
+        pos = 0;
+
+        /* Read more data, waiting for it if the socket is not readable. */
+        buf = sdsMakeRoomFor(buf,REDIS_IOBUF_LEN);
+        nread = read(fd,buf+sdslen(buf),REDIS_IOBUF_LEN);
+        if (nread > 0) {
+            sdsIncrLen(buf,nread);
+            continue;
+        }
+        if (nread == 0) {
+            errno = ECONNRESET;
+            goto ioerr;
+        }
+        if (errno != EAGAIN) goto ioerr;
+        elapsed = mstime() - start;
+        if (elapsed >= timeout) {
+            errno = ETIMEDOUT;
+            goto ioerr;
+        }
+        aeWait(fd,AE_READABLE,timeout-elapsed);
+    }
+    sdsfree(buf);
+    return REDIS_OK;
+
+ioerr:
+    sdsfree(buf);
+    return REDIS_ERR;
+}
+
+/* MIGRATE host port key dbid timeout [COPY | REPLACE | NOCRC]
+ * MIGRATE host port "" dbid timeout [COPY | REPLACE | NOCRC] KEYS key1 ...
+ *
+ * The second form moves all the specified keys at once: the RESTORE
+ * commands are pipelined to the target instance, and the replies are read
+ * in bulk at the end. The keys that can't be restored are left in place,
+ * the error is reported to the client, and the other keys are migrated.
+ *
+ * NOCRC skips the CRC64 of the payloads, that is, the target trusts the
+ * link instead of checking every payload. It is meant for trusted peers,
+ * like the nodes of the same cluster resharding slots. */
 void migrateCommand(redisClient *c) {
-    int fd, copy, replace, j;
+    migrateCachedSocket *cs;
+    int copy, replace, checksum, j;
     long timeout;
     long dbid;
     long long ttl, expireat;
-    robj *o;
+    robj **ov = NULL; /* Objects to migrate. */
+    robj **kv = NULL; /* Key names. */
+    char *failed = NULL; /* failed[j] is true if kv[j] was not restored. */
+    int first_key, num_keys;
+    int select, numreplies, moved;
+    sds err = NULL;
     rio cmd, payload;
     int retry_num = 0;
 
@@ -4384,7 +4491,9 @@ try_again:
     /* Initialization */
     copy = 0;
     replace = 0;
-    ttl = 0;
+    checksum = 1;
+    first_key = 3; /* Argument index of the first key. */
+    num_keys = 1;  /* By default only migrate the 'key' argument. */
 
     /* Parse additional options */
     for (j = 6; j < c->argc; j++) {
@@ -4392,6 +4501,18 @@ try_again:
             copy = 1;
         } else if (!strcasecmp(c->argv[j]->ptr,"replace")) {
             replace = 1;
+        } else if (!strcasecmp(c->argv[j]->ptr,"nocrc")) {
+            checksum = 0;
+        } else if (!strcasecmp(c->argv[j]->ptr,"keys")) {
+            if (sdslen(c->argv[3]->ptr) != 0) {
+                addReplyError(c,
+                    "When using MIGRATE KEYS option, the key argument"
+                    " must be set to the empty string");
+                return;
+            }
+            first_key = j+1;
+            num_keys = c->argc - j - 1;
+            break; /* All the remaining args are keys. */
         } else {
             addReply(c,shared.syntaxerr);
             return;
@@ -4405,51 +4526,76 @@ try_again:
         return;
     if (timeout <= 0) timeout = 1000;
 
-    /* Check if the key is here. If not we reply with success as there is
+    /* Check if the keys are here. If not we reply with success as there is
      * nothing to migrate (for instance the key expired in the meantime), but
      * we include such information in the reply string. */
-    if ((o = lookupKeyRead(c->db,c->argv[3])) == NULL) {
+    ov = zrealloc(ov,sizeof(robj*)*num_keys);
+    kv = zrealloc(kv,sizeof(robj*)*num_keys);
+    failed = zrealloc(failed,num_keys);
+    {
+        int oi = 0;
+
+        for (j = 0; j < num_keys; j++) {
+            if ((ov[oi] = lookupKeyRead(c->db,c->argv[first_key+j])) != NULL)
+            {
+                kv[oi] = c->argv[first_key+j];
+                oi++;
+            }
+        }
+        num_keys = oi;
+    }
+    if (num_keys == 0) {
         addReplySds(c,sdsnew("+NOKEY\r\n"));
-        return;
+        goto cleanup;
     }
 
     /* Connect */
-    fd = migrateGetSocket(c,c->argv[1],c->argv[2],timeout);
-    if (fd == -1) return; /* error sent to the client by migrateGetSocket() */
+    cs = migrateGetSocket(c,c->argv[1],c->argv[2],timeout);
+    if (cs == NULL) goto cleanup; /* error sent by migrateGetSocket() */
 
-    /* Create RESTORE payload and generate the protocol to call the command. */
+    /* Create the RESTORE payloads and generate the protocol to call the
+     * commands. SELECT is only sent if the cached connection is not
+     * already using the target DB. */
     rioInitWithBuffer(&cmd,sdsempty());
-    redisAssertWithInfo(c,NULL,rioWriteBulkCount(&cmd,'*',2));
-    redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"SELECT",6));
-    redisAssertWithInfo(c,NULL,rioWriteBulkLongLong(&cmd,dbid));
-
-    expireat = getExpire(c->db,c->argv[3]);
-    if (expireat != -1) {
-        ttl = expireat-mstime();
-        if (ttl < 1) ttl = 1;
+    select = cs->last_dbid != dbid;
+    if (select) {
+        redisAssertWithInfo(c,NULL,rioWriteBulkCount(&cmd,'*',2));
+        redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"SELECT",6));
+        redisAssertWithInfo(c,NULL,rioWriteBulkLongLong(&cmd,dbid));
     }
-    redisAssertWithInfo(c,NULL,rioWriteBulkCount(&cmd,'*',replace ? 5 : 4));
-    if (server.cluster_enabled)
+
+    for (j = 0; j < num_keys; j++) {
+        ttl = 0;
+        expireat = getExpire(c->db,kv[j]);
+        if (expireat != -1) {
+            ttl = expireat-mstime();
+            if (ttl < 1) ttl = 1;
+        }
         redisAssertWithInfo(c,NULL,
-            rioWriteBulkString(&cmd,"RESTORE-ASKING",14));
-    else
-        redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"RESTORE",7));
-    redisAssertWithInfo(c,NULL,sdsEncodedObject(c->argv[3]));
-    redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,c->argv[3]->ptr,
-            sdslen(c->argv[3]->ptr)));
-    redisAssertWithInfo(c,NULL,rioWriteBulkLongLong(&cmd,ttl));
-
-    /* Emit the payload argument, that is the serialized object using
-     * the DUMP format. */
-    createDumpPayload(&payload,o);
-    redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,payload.io.buffer.ptr,
-                                sdslen(payload.io.buffer.ptr)));
-    sdsfree(payload.io.buffer.ptr);
-
-    /* Add the REPLACE option to the RESTORE command if it was specified
-     * as a MIGRATE option. */
-    if (replace)
-        redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"REPLACE",7));
+            rioWriteBulkCount(&cmd,'*',replace ? 5 : 4));
+        if (server.cluster_enabled)
+            redisAssertWithInfo(c,NULL,
+                rioWriteBulkString(&cmd,"RESTORE-ASKING",14));
+        else
+            redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"RESTORE",7));
+        redisAssertWithInfo(c,NULL,sdsEncodedObject(kv[j]));
+        redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,kv[j]->ptr,
+                sdslen(kv[j]->ptr)));
+        redisAssertWithInfo(c,NULL,rioWriteBulkLongLong(&cmd,ttl));
+
+        /* Emit the payload argument, that is the serialized object using
+         * the DUMP format. */
+        createDumpPayload(&payload,ov[j],checksum);
+        redisAssertWithInfo(c,NULL,
+            rioWriteBulkString(&cmd,payload.io.buffer.ptr,
+                               sdslen(payload.io.buffer.ptr)));
+        sdsfree(payload.io.buffer.ptr);
+
+        /* Add the REPLACE option to the RESTORE command if it was specified
+         * as a MIGRATE option. */
+        if (replace)
+            redisAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"REPLACE",7));
+    }
 
     /* Transfer the query to the other node in 64K chunks. */
     errno = 0;
@@ -4460,61 +4606,82 @@ try_again:
 
         while ((towrite = sdslen(buf)-pos) > 0) {
             towrite = (towrite > (64*1024) ? (64*1024) : towrite);
-            nwritten = syncWrite(fd,buf+pos,towrite,timeout);
-            if (nwritten != (signed)towrite) goto socket_wr_err;
+            nwritten = syncWrite(cs->fd,buf+pos,towrite,timeout);
+            if (nwritten != (signed)towrite) goto socket_err;
             pos += nwritten;
         }
     }
 
-    /* Read back the reply. */
-    {
-        char buf1[1024];
-        char buf2[1024];
-
-        /* Read the two replies */
-        if (syncReadLine(fd, buf1, sizeof(buf1), timeout) <= 0)
-            goto socket_rd_err;
-        if (syncReadLine(fd, buf2, sizeof(buf2), timeout) <= 0)
-            goto socket_rd_err;
-        if (buf1[0] == '-' || buf2[0] == '-') {
+    /* Read back all the replies: the SELECT one, if any, is the first. */
+    numreplies = num_keys + select;
+    failed = zrealloc(failed,numreplies);
+    if (migrateReadReplies(cs->fd,numreplies,failed,&err,timeout) ==
+        REDIS_ERR) goto socket_err;
+    if (select) {
+        if (failed[0]) {
+            /* The RESTOREs were executed in whatever DB the connection was
+             * using: like a failed single key MIGRATE, we report the error
+             * and leave the local keys in place. */
+            cs->last_dbid = -1;
             addReplyErrorFormat(c,"Target instance replied with error: %s",
-                (buf1[0] == '-') ? buf1+1 : buf2+1);
-        } else {
-            robj *aux;
+                err);
+            goto cleanup_cmd;
+        }
+        cs->last_dbid = dbid;
+        memmove(failed,failed+1,num_keys);
+    }
 
-            if (!copy) {
-                /* No COPY option: remove the local key, signal the change. */
-                dbDelete(c->db,c->argv[3]);
-                signalModifiedKey(c->db,c->argv[3]);
-            }
-            addReply(c,shared.ok);
+    /* Remove the keys the target restored, unless COPY was given, and
+     * translate MIGRATE as DEL of the removed keys for replication/AOF. */
+    moved = 0;
+    if (!copy) {
+        robj **newargv = zmalloc(sizeof(robj*)*(num_keys+1));
+
+        newargv[0] = createStringObject("DEL",3);
+        for (j = 0; j < num_keys; j++) {
+            if (failed[j]) continue;
+            dbDelete(c->db,kv[j]);
+            signalModifiedKey(c->db,kv[j]);
+            incrRefCount(kv[j]);
+            newargv[++moved] = kv[j];
+        }
+        if (moved) {
             server.dirty++;
-
-            /* Translate MIGRATE as DEL for replication/AOF. */
-            aux = createStringObject("DEL",3);
-            rewriteClientCommandVector(c,2,aux,c->argv[3]);
-            decrRefCount(aux);
+            replaceClientCommandVector(c,moved+1,newargv);
+        } else {
+            decrRefCount(newargv[0]);
+            zfree(newargv);
         }
     }
+    if (err) {
+        addReplyErrorFormat(c,"Target instance replied with error: %s",err);
+    } else {
+        addReply(c,shared.ok);
+    }
 
+cleanup_cmd:
     sdsfree(cmd.io.buffer.ptr);
+cleanup:
+    if (err) sdsfree(err);
+    zfree(ov);
+    zfree(kv);
+    zfree(failed);
     return;
 
-socket_wr_err:
-    sdsfree(cmd.io.buffer.ptr);
-    migrateCloseSocket(c->argv[1],c->argv[2]);
-    if (errno != ETIMEDOUT && retry_num++ == 0) goto try_again;
-    addReplySds(c,
-        sdsnew("-IOERR error or timeout writing to target instance\r\n"));
-    return;
-
-socket_rd_err:
+socket_err:
+    /* On errors the connection is dropped, and we try again once with a new
+     * one unless the error was a timeout: cached connections may have been
+     * closed by the target in the meantime. */
     sdsfree(cmd.io.buffer.ptr);
+    if (err) sdsfree(err);
+    err = NULL;
     migrateCloseSocket(c->argv[1],c->argv[2]);
     if (errno != ETIMEDOUT && retry_num++ == 0) goto try_again;
     addReplySds(c,
-        sdsnew("-IOERR error or timeout reading from target node\r\n"));
-    return;
+        sdsnew("-IOERR error or timeout talking with the target instance\r\n"));
+    zfree(ov);
+    zfree(kv);
+    zfree(failed);
 }
 
 /* -----------------------------------------------------------------------------
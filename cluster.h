@@ -40,6 +40,7 @@ typedef struct clusterLink {
     sds sndbuf;                 /* Packet send buffer */
     sds rcvbuf;                 /* Packet reception buffer */
     struct clusterNode *node;   /* Node related to this link if any, or NULL */
+    size_t mem_usage;           /* Memory accounted to the link buffers. */
 } clusterLink;
 
 /* Cluster node flags and macros. */
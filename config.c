@@ -66,6 +66,28 @@ int yesnotoi(char *s) {
     else return -1;
 }
 
+/* Map an rdb-compression-algo name to REDIS_RDB_COMPRESS_*. Returns -1 if
+ * the name is unknown or the algorithm was not compiled in. */
+static int rdbCompressionAlgoByName(char *s) {
+    if (!strcasecmp(s,"lzf")) return REDIS_RDB_COMPRESS_LZF;
+#ifdef USE_LZ4
+    if (!strcasecmp(s,"lz4")) return REDIS_RDB_COMPRESS_LZ4;
+#endif
+#ifdef USE_ZSTD
+    if (!strcasecmp(s,"zstd")) return REDIS_RDB_COMPRESS_ZSTD;
+#endif
+    return -1;
+}
+
+static char *rdbCompressionAlgoName(int algo) {
+    switch(algo) {
+    case REDIS_RDB_COMPRESS_LZF: return "lzf";
+    case REDIS_RDB_COMPRESS_LZ4: return "lz4";
+    case REDIS_RDB_COMPRESS_ZSTD: return "zstd";
+    default: return "unknown";
+    }
+}
+
 void appendServerSaveParams(time_t seconds, int changes) {
     server.saveparams = zrealloc(server.saveparams,sizeof(struct saveparam)*(server.saveparamslen+1));
     server.saveparams[server.saveparamslen].seconds = seconds;
@@ -83,6 +105,7 @@ void loadServerConfigFromString(char *config) {
     char *err = NULL;
     int linenum = 0, totlines, i;
     int slaveof_linenum = 0;
+    int defrag_threshold_linenum = 0;
     sds *lines;
 
     lines = sdssplitlen(config,strlen(config),"\n",1,&totlines);
@@ -274,6 +297,25 @@ void loadServerConfigFromString(char *config) {
             if ((server.repl_diskless_sync = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"repl-diskless-load") && argc==2) {
+            if (!strcasecmp(argv[1],"disabled")) {
+                server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_DISABLED;
+            } else if (!strcasecmp(argv[1],"flush")) {
+                server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_FLUSH;
+            } else if (!strcasecmp(argv[1],"swapdb")) {
+                server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_SWAPDB;
+            } else {
+                err = "argument must be 'disabled', 'flush' or 'swapdb'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-compression") && argc==2) {
+            if ((server.repl_compression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-async-load") && argc==2) {
+            if ((server.repl_async_load = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-diskless-sync-delay") && argc==2) {
             server.repl_diskless_sync_delay = atoi(argv[1]);
             if (server.repl_diskless_sync_delay < 0) {
@@ -287,6 +329,13 @@ void loadServerConfigFromString(char *config) {
                 goto loaderr;
             }
             resizeReplicationBacklog(size);
+        } else if (!strcasecmp(argv[0],"repl-backlog-disk-size") && argc == 2) {
+            long long size = memtoll(argv[1],NULL);
+            if (size < 0) {
+                err = "repl-backlog-disk-size can't be negative";
+                goto loaderr;
+            }
+            resizeReplicationBacklogSpill(size);
         } else if (!strcasecmp(argv[0],"repl-backlog-ttl") && argc == 2) {
             server.repl_backlog_time_limit = atoi(argv[1]);
             if (server.repl_backlog_time_limit < 0) {
@@ -307,6 +356,39 @@ void loadServerConfigFromString(char *config) {
             if ((server.rdb_compression = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdb-compression-algo") && argc == 2) {
+            if ((server.rdb_compression_algo =
+                 rdbCompressionAlgoByName(argv[1])) == -1)
+            {
+                err = "argument must be 'lzf', 'lz4' or 'zstd', and the "
+                      "algorithm must be supported by this build";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-zstd-level") && argc == 2) {
+            server.rdb_zstd_level = atoi(argv[1]);
+            if (server.rdb_zstd_level < 1 || server.rdb_zstd_level > 22) {
+                err = "rdb-zstd-level must be between 1 and 22";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-zstd-dictionary") && argc == 2) {
+            zfree(server.rdb_zstd_dict_file);
+            server.rdb_zstd_dict_file = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"rdb-save-threads") && argc == 2) {
+            server.rdb_save_threads = atoi(argv[1]);
+            if (server.rdb_save_threads < 1 ||
+                server.rdb_save_threads > REDIS_RDB_SAVE_MAX_THREADS)
+            {
+                err = "rdb-save-threads must be between 1 and 64";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-threaded-load") && argc == 2) {
+            if ((server.rdb_threaded_load = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-threaded-snapshot") && argc == 2) {
+            if ((server.rdb_threaded_snapshot = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"rdbchecksum") && argc == 2) {
             if ((server.rdb_checksum = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -323,6 +405,83 @@ void loadServerConfigFromString(char *config) {
             server.hz = atoi(argv[1]);
             if (server.hz < REDIS_MIN_HZ) server.hz = REDIS_MIN_HZ;
             if (server.hz > REDIS_MAX_HZ) server.hz = REDIS_MAX_HZ;
+        } else if (!strcasecmp(argv[0],"active-expire-max-cpu") && argc == 2) {
+            server.active_expire_max_cpu = atoi(argv[1]);
+            if (server.active_expire_max_cpu < 1 ||
+                server.active_expire_max_cpu > 100)
+            {
+                err = "active-expire-max-cpu must be between 1 and 100";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-expire-latency-target") &&
+                   argc == 2)
+        {
+            server.active_expire_latency_target = strtoll(argv[1],NULL,10);
+            if (server.active_expire_latency_target < 0) {
+                err = "active-expire-latency-target can't be negative";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"activedefrag") && argc == 2) {
+            if ((server.active_defrag_enabled = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+#ifndef HAVE_DEFRAG
+            if (server.active_defrag_enabled) {
+                err = "active defrag can't be enabled if jemalloc doesn't "
+                      "support it";
+                goto loaderr;
+            }
+#endif
+        } else if (!strcasecmp(argv[0],"active-defrag-ignore-bytes") &&
+                   argc == 2)
+        {
+            server.active_defrag_ignore_bytes = memtoll(argv[1],NULL);
+            if (server.active_defrag_ignore_bytes <= 0) {
+                err = "active-defrag-ignore-bytes must above 0";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-defrag-threshold-lower") &&
+                   argc == 2)
+        {
+            server.active_defrag_threshold_lower = atoi(argv[1]);
+            if (server.active_defrag_threshold_lower < 0 ||
+                server.active_defrag_threshold_lower > 1000)
+            {
+                err = "active-defrag-threshold-lower must be between 0 and 1000";
+                goto loaderr;
+            }
+            defrag_threshold_linenum = linenum;
+        } else if (!strcasecmp(argv[0],"active-defrag-threshold-upper") &&
+                   argc == 2)
+        {
+            server.active_defrag_threshold_upper = atoi(argv[1]);
+            if (server.active_defrag_threshold_upper < 0 ||
+                server.active_defrag_threshold_upper > 1000)
+            {
+                err = "active-defrag-threshold-upper must be between 0 and 1000";
+                goto loaderr;
+            }
+            defrag_threshold_linenum = linenum;
+        } else if (!strcasecmp(argv[0],"active-defrag-cycle-min") &&
+                   argc == 2)
+        {
+            server.active_defrag_cycle_min = atoi(argv[1]);
+            if (server.active_defrag_cycle_min < 1 ||
+                server.active_defrag_cycle_min > 99)
+            {
+                err = "active-defrag-cycle-min must be between 1 and 99";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-defrag-cycle-max") &&
+                   argc == 2)
+        {
+            server.active_defrag_cycle_max = atoi(argv[1]);
+            if (server.active_defrag_cycle_max < 1 ||
+                server.active_defrag_cycle_max > 99)
+            {
+                err = "active-defrag-cycle-max must be between 1 and 99";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"appendonly") && argc == 2) {
             int yes;
 
@@ -376,6 +535,18 @@ void loadServerConfigFromString(char *config) {
             if ((server.aof_load_truncated = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"aof-use-rdb-preamble") && argc == 2) {
+            if ((server.aof_use_rdb_preamble = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"aof-multi-part") && argc == 2) {
+            if ((server.aof_multi_part = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"aof-threaded-write") && argc == 2) {
+            if ((server.aof_threaded_write = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"requirepass") && argc == 2) {
             if (strlen(argv[1]) > REDIS_AUTHPASS_MAX_LEN) {
                 err = "Password is longer than REDIS_AUTHPASS_MAX_LEN";
@@ -553,6 +724,16 @@ void loadServerConfigFromString(char *config) {
         err = "slaveof directive not allowed in cluster mode";
         goto loaderr;
     }
+    /* The defrag effort is interpolated between the two thresholds. */
+    if (server.active_defrag_threshold_lower >=
+        server.active_defrag_threshold_upper)
+    {
+        linenum = defrag_threshold_linenum;
+        i = linenum-1;
+        err = "active-defrag-threshold-lower must be less than "
+              "active-defrag-threshold-upper";
+        goto loaderr;
+    }
 
     sdsfreesplitres(lines,totlines);
     return;
@@ -668,6 +849,47 @@ void configSetCommand(redisClient *c) {
         server.hz = ll;
         if (server.hz < REDIS_MIN_HZ) server.hz = REDIS_MIN_HZ;
         if (server.hz > REDIS_MAX_HZ) server.hz = REDIS_MAX_HZ;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-expire-max-cpu")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 1 || ll > 100) goto badfmt;
+        server.active_expire_max_cpu = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-expire-latency-target")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
+        server.active_expire_latency_target = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"activedefrag")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+#ifndef HAVE_DEFRAG
+        if (yn) {
+            addReplyError(c,
+                "Active defragmentation cannot be enabled: it requires a "
+                "Redis server compiled with a modified Jemalloc.");
+            return;
+        }
+#endif
+        server.active_defrag_enabled = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-defrag-ignore-bytes")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll <= 0) goto badfmt;
+        server.active_defrag_ignore_bytes = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-defrag-threshold-lower")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0 || ll > 1000 ||
+            ll >= server.active_defrag_threshold_upper) goto badfmt;
+        server.active_defrag_threshold_lower = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-defrag-threshold-upper")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0 || ll > 1000 ||
+            ll <= server.active_defrag_threshold_lower) goto badfmt;
+        server.active_defrag_threshold_upper = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-defrag-cycle-min")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 1 || ll > 99) goto badfmt;
+        server.active_defrag_cycle_min = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-defrag-cycle-max")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 1 || ll > 99) goto badfmt;
+        server.active_defrag_cycle_max = ll;
     } else if (!strcasecmp(c->argv[2]->ptr,"maxmemory-policy")) {
         if (!strcasecmp(o->ptr,"volatile-lru")) {
             server.maxmemory_policy = REDIS_MAXMEMORY_VOLATILE_LRU;
@@ -740,6 +962,11 @@ void configSetCommand(redisClient *c) {
 
         if (yn == -1) goto badfmt;
         server.aof_load_truncated = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"aof-use-rdb-preamble")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.aof_use_rdb_preamble = yn;
     } else if (!strcasecmp(c->argv[2]->ptr,"save")) {
         int vlen, j;
         sds *v = sdssplitlen(o->ptr,sdslen(o->ptr)," ",1,&vlen);
@@ -897,6 +1124,9 @@ void configSetCommand(redisClient *c) {
     } else if (!strcasecmp(c->argv[2]->ptr,"repl-backlog-size")) {
         if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll <= 0) goto badfmt;
         resizeReplicationBacklog(ll);
+    } else if (!strcasecmp(c->argv[2]->ptr,"repl-backlog-disk-size")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
+        resizeReplicationBacklogSpill(ll);
     } else if (!strcasecmp(c->argv[2]->ptr,"repl-backlog-ttl")) {
         if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
         server.repl_backlog_time_limit = ll;
@@ -911,6 +1141,29 @@ void configSetCommand(redisClient *c) {
 
         if (yn == -1) goto badfmt;
         server.rdb_compression = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"rdb-compression-algo")) {
+        int algo = rdbCompressionAlgoByName(o->ptr);
+
+        if (algo == -1) goto badfmt;
+        server.rdb_compression_algo = algo;
+    } else if (!strcasecmp(c->argv[2]->ptr,"rdb-zstd-level")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 1 || ll > 22) goto badfmt;
+        server.rdb_zstd_level = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"rdb-save-threads")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 1 || ll > REDIS_RDB_SAVE_MAX_THREADS) goto badfmt;
+        server.rdb_save_threads = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"rdb-threaded-load")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.rdb_threaded_load = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"rdb-threaded-snapshot")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.rdb_threaded_snapshot = yn;
     } else if (!strcasecmp(c->argv[2]->ptr,"notify-keyspace-events")) {
         int flags = keyspaceEventsStringToFlags(o->ptr);
 
@@ -926,6 +1179,26 @@ void configSetCommand(redisClient *c) {
 
         if (yn == -1) goto badfmt;
         server.repl_diskless_sync = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"repl-diskless-load")) {
+        if (!strcasecmp(o->ptr,"disabled")) {
+            server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_DISABLED;
+        } else if (!strcasecmp(o->ptr,"flush")) {
+            server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_FLUSH;
+        } else if (!strcasecmp(o->ptr,"swapdb")) {
+            server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_SWAPDB;
+        } else {
+            goto badfmt;
+        }
+    } else if (!strcasecmp(c->argv[2]->ptr,"repl-compression")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.repl_compression = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"repl-async-load")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.repl_async_load = yn;
     } else if (!strcasecmp(c->argv[2]->ptr,"repl-diskless-sync-delay")) {
         if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
             ll < 0) goto badfmt;
@@ -1014,6 +1287,7 @@ void configGetCommand(redisClient *c) {
 
     /* String values */
     config_get_string_field("dbfilename",server.rdb_filename);
+    config_get_string_field("rdb-zstd-dictionary",server.rdb_zstd_dict_file);
     config_get_string_field("requirepass",server.requirepass);
     config_get_string_field("masterauth",server.masterauth);
     config_get_string_field("unixsocket",server.unixsocket);
@@ -1058,6 +1332,7 @@ void configGetCommand(redisClient *c) {
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-timeout",server.repl_timeout);
     config_get_numerical_field("repl-backlog-size",server.repl_backlog_size);
+    config_get_numerical_field("repl-backlog-disk-size",server.repl_backlog_disk_size);
     config_get_numerical_field("repl-backlog-ttl",server.repl_backlog_time_limit);
     config_get_numerical_field("maxclients",server.maxclients);
     config_get_numerical_field("watchdog-period",server.watchdog_period);
@@ -1065,6 +1340,22 @@ void configGetCommand(redisClient *c) {
     config_get_numerical_field("min-slaves-to-write",server.repl_min_slaves_to_write);
     config_get_numerical_field("min-slaves-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("hz",server.hz);
+    config_get_numerical_field("rdb-zstd-level",server.rdb_zstd_level);
+    config_get_numerical_field("rdb-save-threads",server.rdb_save_threads);
+    config_get_numerical_field("active-expire-max-cpu",
+            server.active_expire_max_cpu);
+    config_get_numerical_field("active-expire-latency-target",
+            server.active_expire_latency_target);
+    config_get_numerical_field("active-defrag-ignore-bytes",
+            server.active_defrag_ignore_bytes);
+    config_get_numerical_field("active-defrag-threshold-lower",
+            server.active_defrag_threshold_lower);
+    config_get_numerical_field("active-defrag-threshold-upper",
+            server.active_defrag_threshold_upper);
+    config_get_numerical_field("active-defrag-cycle-min",
+            server.active_defrag_cycle_min);
+    config_get_numerical_field("active-defrag-cycle-max",
+            server.active_defrag_cycle_max);
     config_get_numerical_field("cluster-node-timeout",server.cluster_node_timeout);
     config_get_numerical_field("cluster-migration-barrier",server.cluster_migration_barrier);
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
@@ -1083,16 +1374,28 @@ void configGetCommand(redisClient *c) {
             server.stop_writes_on_bgsave_err);
     config_get_bool_field("daemonize", server.daemonize);
     config_get_bool_field("rdbcompression", server.rdb_compression);
+    config_get_bool_field("rdb-threaded-load", server.rdb_threaded_load);
+    config_get_bool_field("rdb-threaded-snapshot",
+            server.rdb_threaded_snapshot);
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
     config_get_bool_field("activerehashing", server.activerehashing);
+    config_get_bool_field("activedefrag", server.active_defrag_enabled);
     config_get_bool_field("repl-disable-tcp-nodelay",
             server.repl_disable_tcp_nodelay);
     config_get_bool_field("repl-diskless-sync",
             server.repl_diskless_sync);
+    config_get_bool_field("repl-compression",
+            server.repl_compression);
+    config_get_bool_field("repl-async-load",
+            server.repl_async_load);
     config_get_bool_field("aof-rewrite-incremental-fsync",
             server.aof_rewrite_incremental_fsync);
     config_get_bool_field("aof-load-truncated",
             server.aof_load_truncated);
+    config_get_bool_field("aof-use-rdb-preamble",
+            server.aof_use_rdb_preamble);
+    config_get_bool_field("aof-multi-part",server.aof_multi_part);
+    config_get_bool_field("aof-threaded-write",server.aof_threaded_write);
 
     /* Everything we can't handle with macros follows. */
 
@@ -1127,6 +1430,25 @@ void configGetCommand(redisClient *c) {
         addReplyBulkCString(c,s);
         matches++;
     }
+    if (stringmatch(pattern,"rdb-compression-algo",0)) {
+        addReplyBulkCString(c,"rdb-compression-algo");
+        addReplyBulkCString(c,
+            rdbCompressionAlgoName(server.rdb_compression_algo));
+        matches++;
+    }
+    if (stringmatch(pattern,"repl-diskless-load",0)) {
+        char *mode;
+
+        switch(server.repl_diskless_load) {
+        case REDIS_REPL_DISKLESS_LOAD_DISABLED: mode = "disabled"; break;
+        case REDIS_REPL_DISKLESS_LOAD_FLUSH: mode = "flush"; break;
+        case REDIS_REPL_DISKLESS_LOAD_SWAPDB: mode = "swapdb"; break;
+        default: mode = "unknown"; break;
+        }
+        addReplyBulkCString(c,"repl-diskless-load");
+        addReplyBulkCString(c,mode);
+        matches++;
+    }
     if (stringmatch(pattern,"appendfsync",0)) {
         char *policy;
 
@@ -1802,6 +2124,16 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"databases",server.dbnum,REDIS_DEFAULT_DBNUM);
     rewriteConfigYesNoOption(state,"stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err,REDIS_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR);
     rewriteConfigYesNoOption(state,"rdbcompression",server.rdb_compression,REDIS_DEFAULT_RDB_COMPRESSION);
+    rewriteConfigEnumOption(state,"rdb-compression-algo",server.rdb_compression_algo,
+        "lzf", REDIS_RDB_COMPRESS_LZF,
+        "lz4", REDIS_RDB_COMPRESS_LZ4,
+        "zstd", REDIS_RDB_COMPRESS_ZSTD,
+        NULL, REDIS_DEFAULT_RDB_COMPRESSION_ALGO);
+    rewriteConfigNumericalOption(state,"rdb-zstd-level",server.rdb_zstd_level,REDIS_DEFAULT_RDB_ZSTD_LEVEL);
+    rewriteConfigStringOption(state,"rdb-zstd-dictionary",server.rdb_zstd_dict_file,NULL);
+    rewriteConfigNumericalOption(state,"rdb-save-threads",server.rdb_save_threads,REDIS_DEFAULT_RDB_SAVE_THREADS);
+    rewriteConfigYesNoOption(state,"rdb-threaded-load",server.rdb_threaded_load,REDIS_DEFAULT_RDB_THREADED_LOAD);
+    rewriteConfigYesNoOption(state,"rdb-threaded-snapshot",server.rdb_threaded_snapshot,REDIS_DEFAULT_RDB_THREADED_SNAPSHOT);
     rewriteConfigYesNoOption(state,"rdbchecksum",server.rdb_checksum,REDIS_DEFAULT_RDB_CHECKSUM);
     rewriteConfigStringOption(state,"dbfilename",server.rdb_filename,REDIS_DEFAULT_RDB_FILENAME);
     rewriteConfigDirOption(state);
@@ -1812,10 +2144,18 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"repl-ping-slave-period",server.repl_ping_slave_period,REDIS_REPL_PING_SLAVE_PERIOD);
     rewriteConfigNumericalOption(state,"repl-timeout",server.repl_timeout,REDIS_REPL_TIMEOUT);
     rewriteConfigBytesOption(state,"repl-backlog-size",server.repl_backlog_size,REDIS_DEFAULT_REPL_BACKLOG_SIZE);
+    rewriteConfigBytesOption(state,"repl-backlog-disk-size",server.repl_backlog_disk_size,REDIS_DEFAULT_REPL_BACKLOG_DISK_SIZE);
     rewriteConfigBytesOption(state,"repl-backlog-ttl",server.repl_backlog_time_limit,REDIS_DEFAULT_REPL_BACKLOG_TIME_LIMIT);
     rewriteConfigYesNoOption(state,"repl-disable-tcp-nodelay",server.repl_disable_tcp_nodelay,REDIS_DEFAULT_REPL_DISABLE_TCP_NODELAY);
     rewriteConfigYesNoOption(state,"repl-diskless-sync",server.repl_diskless_sync,REDIS_DEFAULT_REPL_DISKLESS_SYNC);
     rewriteConfigNumericalOption(state,"repl-diskless-sync-delay",server.repl_diskless_sync_delay,REDIS_DEFAULT_REPL_DISKLESS_SYNC_DELAY);
+    rewriteConfigYesNoOption(state,"repl-compression",server.repl_compression,REDIS_DEFAULT_REPL_COMPRESSION);
+    rewriteConfigYesNoOption(state,"repl-async-load",server.repl_async_load,REDIS_DEFAULT_REPL_ASYNC_LOAD);
+    rewriteConfigEnumOption(state,"repl-diskless-load",server.repl_diskless_load,
+        "disabled", REDIS_REPL_DISKLESS_LOAD_DISABLED,
+        "flush", REDIS_REPL_DISKLESS_LOAD_FLUSH,
+        "swapdb", REDIS_REPL_DISKLESS_LOAD_SWAPDB,
+        NULL, REDIS_DEFAULT_REPL_DISKLESS_LOAD);
     rewriteConfigNumericalOption(state,"slave-priority",server.slave_priority,REDIS_DEFAULT_SLAVE_PRIORITY);
     rewriteConfigNumericalOption(state,"min-slaves-to-write",server.repl_min_slaves_to_write,REDIS_DEFAULT_MIN_SLAVES_TO_WRITE);
     rewriteConfigNumericalOption(state,"min-slaves-max-lag",server.repl_min_slaves_max_lag,REDIS_DEFAULT_MIN_SLAVES_MAX_LAG);
@@ -1863,8 +2203,19 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,REDIS_DEFAULT_ACTIVE_REHASHING);
     rewriteConfigClientoutputbufferlimitOption(state);
     rewriteConfigNumericalOption(state,"hz",server.hz,REDIS_DEFAULT_HZ);
+    rewriteConfigNumericalOption(state,"active-expire-max-cpu",server.active_expire_max_cpu,REDIS_DEFAULT_ACTIVE_EXPIRE_MAX_CPU);
+    rewriteConfigNumericalOption(state,"active-expire-latency-target",server.active_expire_latency_target,REDIS_DEFAULT_ACTIVE_EXPIRE_LATENCY_TARGET);
+    rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,REDIS_DEFAULT_ACTIVE_DEFRAG);
+    rewriteConfigBytesOption(state,"active-defrag-ignore-bytes",server.active_defrag_ignore_bytes,REDIS_DEFAULT_ACTIVE_DEFRAG_IGNORE_BYTES);
+    rewriteConfigNumericalOption(state,"active-defrag-threshold-lower",server.active_defrag_threshold_lower,REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD_LOWER);
+    rewriteConfigNumericalOption(state,"active-defrag-threshold-upper",server.active_defrag_threshold_upper,REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD_UPPER);
+    rewriteConfigNumericalOption(state,"active-defrag-cycle-min",server.active_defrag_cycle_min,REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE_MIN);
+    rewriteConfigNumericalOption(state,"active-defrag-cycle-max",server.active_defrag_cycle_max,REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE_MAX);
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,REDIS_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
     rewriteConfigYesNoOption(state,"aof-load-truncated",server.aof_load_truncated,REDIS_DEFAULT_AOF_LOAD_TRUNCATED);
+    rewriteConfigYesNoOption(state,"aof-use-rdb-preamble",server.aof_use_rdb_preamble,REDIS_DEFAULT_AOF_USE_RDB_PREAMBLE);
+    rewriteConfigYesNoOption(state,"aof-multi-part",server.aof_multi_part,REDIS_DEFAULT_AOF_MULTI_PART);
+    rewriteConfigYesNoOption(state,"aof-threaded-write",server.aof_threaded_write,REDIS_DEFAULT_AOF_THREADED_WRITE);
     if (server.sentinel_mode) rewriteConfigSentinelOption(state);
 
     /* Step 3: remove all the orphaned lines in the old file, that is, lines
@@ -170,7 +170,15 @@ static const uint64_t crc64_tab[256] = {
     UINT64_C(0x536fa08fdfd90e51), UINT64_C(0x29b7d047efec8728),
 };
 
-uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+/* Tables for the slicing-by-8 implementation: crc64_slice_tab[k][n] is the
+ * CRC of the byte 'n' followed by 'k' zero bytes, so that eight bytes can be
+ * processed at once with eight independent lookups. Filled by crc64_init(). */
+static uint64_t crc64_slice_tab[8][256];
+static int crc64_initialized = 0;
+
+/* Process one byte at a time. Used for the unaligned head and the tail of
+ * the buffer, and before crc64_init() is called. */
+static uint64_t crc64_bytewise(uint64_t crc, const unsigned char *s, uint64_t l) {
     uint64_t j;
 
     for (j = 0; j < l; j++) {
@@ -180,12 +188,204 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
     return crc;
 }
 
+static uint64_t crc64_slice8(uint64_t crc, const unsigned char *s, uint64_t l) {
+    uint64_t (*t)[256] = crc64_slice_tab;
+
+    while (l >= 8) {
+        /* The CRC is reflected, so the word is loaded as little endian
+         * regardless of the host byte order. */
+        crc ^= (uint64_t)s[0] | (uint64_t)s[1] << 8 |
+               (uint64_t)s[2] << 16 | (uint64_t)s[3] << 24 |
+               (uint64_t)s[4] << 32 | (uint64_t)s[5] << 40 |
+               (uint64_t)s[6] << 48 | (uint64_t)s[7] << 56;
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+              t[5][(crc >> 16) & 0xff] ^ t[4][(crc >> 24) & 0xff] ^
+              t[3][(crc >> 32) & 0xff] ^ t[2][(crc >> 40) & 0xff] ^
+              t[1][(crc >> 48) & 0xff] ^ t[0][crc >> 56];
+        s += 8;
+        l -= 8;
+    }
+    return crc64_bytewise(crc,s,l);
+}
+
+/* Carry-less multiplication path for x86, selected at runtime.
+ *
+ * Since there is no initial or final XOR, crc64(0,M) is M(x)*x^64 mod P(x),
+ * so the buffer can be folded 16 bytes at a time into a 128 bit remainder
+ * that is congruent to it, multiplying the folded value by x^n mod P(x) with
+ * PCLMULQDQ. The CRC of the final remainder is then computed with the
+ * tables. Four independent remainders are kept to hide the latency of the
+ * multiplication. */
+#if defined(__x86_64__) && \
+    ((defined(__GNUC__) && (__GNUC__ > 4 || \
+      (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || defined(__clang__))
+#define HAVE_CRC64_CLMUL 1
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+#define CRC64_CLMUL_MIN_LEN 256  /* Use the tables for smaller buffers. */
+
+static int crc64_use_clmul = 0;
+/* Folding constants: x^(n-1) mod P(x), bit reflected, see crc64_init().
+ * The "-1" compensates for the product of two reflected 64 bit values
+ * being one bit short of the 128 bit reflected frame. */
+static uint64_t crc64_k128[2];  /* n = 192, 128: fold by 16 bytes. */
+static uint64_t crc64_k512[2];  /* n = 576, 512: fold by 64 bytes. */
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i crc64_fold(__m128i v, __m128i k) {
+    return _mm_xor_si128(_mm_clmulepi64_si128(v,k,0x00),
+                         _mm_clmulepi64_si128(v,k,0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint64_t crc64_clmul(uint64_t crc, const unsigned char *s, uint64_t l) {
+    __m128i k128 = _mm_set_epi64x(crc64_k128[1],crc64_k128[0]);
+    __m128i k512 = _mm_set_epi64x(crc64_k512[1],crc64_k512[0]);
+    __m128i v0, v1, v2, v3;
+    unsigned char buf[16];
+
+    /* The CRC register is just XORed with the first 8 bytes. */
+    v0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)s),
+                       _mm_set_epi64x(0,crc));
+    v1 = _mm_loadu_si128((const __m128i*)(s+16));
+    v2 = _mm_loadu_si128((const __m128i*)(s+32));
+    v3 = _mm_loadu_si128((const __m128i*)(s+48));
+    s += 64;
+    l -= 64;
+    while (l >= 64) {
+        v0 = _mm_xor_si128(crc64_fold(v0,k512),
+                           _mm_loadu_si128((const __m128i*)s));
+        v1 = _mm_xor_si128(crc64_fold(v1,k512),
+                           _mm_loadu_si128((const __m128i*)(s+16)));
+        v2 = _mm_xor_si128(crc64_fold(v2,k512),
+                           _mm_loadu_si128((const __m128i*)(s+32)));
+        v3 = _mm_xor_si128(crc64_fold(v3,k512),
+                           _mm_loadu_si128((const __m128i*)(s+48)));
+        s += 64;
+        l -= 64;
+    }
+    /* Merge the four remainders, then fold the remaining whole blocks. */
+    v1 = _mm_xor_si128(v1,crc64_fold(v0,k128));
+    v2 = _mm_xor_si128(v2,crc64_fold(v1,k128));
+    v0 = _mm_xor_si128(v3,crc64_fold(v2,k128));
+    while (l >= 16) {
+        v0 = _mm_xor_si128(crc64_fold(v0,k128),
+                           _mm_loadu_si128((const __m128i*)s));
+        s += 16;
+        l -= 16;
+    }
+    _mm_storeu_si128((__m128i*)buf,v0);
+    crc = crc64_slice8(0,buf,16);
+    return crc64_slice8(crc,s,l);
+}
+#endif
+
+/* Return x^n mod P(x), bit reflected like the CRC itself. */
+static uint64_t crc64_xpow_mod(int n) {
+    const uint64_t poly = UINT64_C(0xad93d23594c935a9);
+    uint64_t r = 1, reflected = 0;
+    int j;
+
+    while (n--) r = (r & (UINT64_C(1) << 63)) ? (r << 1) ^ poly : r << 1;
+    for (j = 0; j < 64; j++)
+        if (r & (UINT64_C(1) << j)) reflected |= UINT64_C(1) << (63-j);
+    return reflected;
+}
+
+/* Initialize the tables and select the fastest implementation for this CPU.
+ * Must be called before any thread computes CRCs. Calling crc64() earlier
+ * is still valid, but slower. */
+void crc64_init(void) {
+    int j, k;
+
+    for (j = 0; j < 256; j++) {
+        crc64_slice_tab[0][j] = crc64_tab[j];
+        for (k = 1; k < 8; k++) {
+            uint64_t prev = crc64_slice_tab[k-1][j];
+            crc64_slice_tab[k][j] = crc64_tab[prev & 0xff] ^ (prev >> 8);
+        }
+    }
+#ifdef HAVE_CRC64_CLMUL
+    crc64_k128[0] = crc64_xpow_mod(191);
+    crc64_k128[1] = crc64_xpow_mod(127);
+    crc64_k512[0] = crc64_xpow_mod(575);
+    crc64_k512[1] = crc64_xpow_mod(511);
+    __builtin_cpu_init();
+    crc64_use_clmul = __builtin_cpu_supports("pclmul") &&
+                      __builtin_cpu_supports("sse2");
+#endif
+    crc64_initialized = 1;
+}
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+    if (!crc64_initialized) return crc64_bytewise(crc,s,l);
+#ifdef HAVE_CRC64_CLMUL
+    if (crc64_use_clmul && l >= CRC64_CLMUL_MIN_LEN)
+        return crc64_clmul(crc,s,l);
+#endif
+    return crc64_slice8(crc,s,l);
+}
+
 /* Test main */
 #ifdef TEST_MAIN
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static long long crc64_test_ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+static void crc64_benchmark(const char *name,
+    uint64_t (*fn)(uint64_t, const unsigned char *, uint64_t),
+    const unsigned char *buf, uint64_t len, int iterations)
+{
+    long long start = crc64_test_ustime(), elapsed;
+    uint64_t crc = 0;
+    int j;
+
+    for (j = 0; j < iterations; j++) crc = fn(crc,buf,len);
+    elapsed = crc64_test_ustime()-start;
+    if (elapsed == 0) elapsed = 1;
+    printf("%-10s %8.1f MB/s (crc %016llx)\n", name,
+        ((double)len*iterations/(1024*1024))/((double)elapsed/1000000),
+        (unsigned long long) crc);
+}
+
 int main(void) {
+    uint64_t len = 1024*1024*16, l;
+    unsigned char *buf = malloc(len+64);
+    int errors = 0, j;
+
+    crc64_init();
     printf("e9c6d914c4b8d9ca == %016llx\n",
         (unsigned long long) crc64(0,(unsigned char*)"123456789",9));
-    return 0;
+
+    /* All the implementations must return the same CRC, for any length,
+     * alignment and initial value. */
+    srand(1234);
+    for (j = 0; j < (int)len+64; j++) buf[j] = rand();
+    for (l = 0; l < 2048; l++) {
+        const unsigned char *p = buf+(l % 16);
+        uint64_t init = l * UINT64_C(0x9e3779b97f4a7c15);
+        uint64_t expected = crc64_bytewise(init,p,l);
+
+        if (crc64_slice8(init,p,l) != expected) errors++;
+        if (crc64(init,p,l) != expected) errors++;
+    }
+    printf("%d mismatches between implementations\n", errors);
+
+    crc64_benchmark("bytewise",crc64_bytewise,buf,len,4);
+    crc64_benchmark("slice8",crc64_slice8,buf,len,16);
+#ifdef HAVE_CRC64_CLMUL
+    if (crc64_use_clmul)
+        crc64_benchmark("clmul",crc64_clmul,buf,len,64);
+#endif
+    free(buf);
+    return errors != 0;
 }
 #endif
@@ -41,16 +41,63 @@ void slotToKeyFlush(void);
  * C-level DB API
  *----------------------------------------------------------------------------*/
 
+/* Return the value stored at the db->dict entry 'de'. Inline integers are
+ * returned as the corresponding shared integer object, so callers can't
+ * modify it in place (its refcount is always greater than one while the
+ * key exists, since the inline value holds a reference). */
+robj *dbGetVal(dictEntry *de) {
+    void *v = dictGetVal(de);
+
+    if (dbValIsInline(v)) return shared.integers[dbValInlineInt(v)];
+    return v;
+}
+
+/* Return the LRU clock of the value stored at the db->dict entry 'de'. */
+unsigned int dbGetValLRU(dictEntry *de) {
+    void *v = dictGetVal(de);
+
+    if (dbValIsInline(v)) return dbValInlineLRU(v);
+    return ((robj*)v)->lru;
+}
+
+/* Update the LRU clock of the value stored at the db->dict entry 'de'. */
+void dbSetValLRU(dictEntry *de, unsigned int lru) {
+    void *v = dictGetVal(de);
+
+    if (dbValIsInline(v))
+        de->v.val = dbValMakeInline(dbValInlineInt(v),lru);
+    else
+        ((robj*)v)->lru = lru;
+}
+
+/* Return what should be stored in the db->dict value slot for 'val'.
+ * Shared integers are stored inline with a private LRU field, taking
+ * ownership of the reference of the caller as a normal value does. */
+void *dbEncodeVal(robj *val) {
+    long n;
+
+    if (val->type != REDIS_STRING || val->encoding != REDIS_ENCODING_INT)
+        return val;
+    n = (long)val->ptr;
+    if (n < 0 || n >= REDIS_SHARED_INTEGERS ||
+        (unsigned long)n >= REDIS_DBVAL_INLINE_MAX ||
+        shared.integers[n] != val) return val;
+    return dbValMakeInline(n,LRU_CLOCK());
+}
+
 robj *lookupKey(redisDb *db, robj *key) {
     dictEntry *de = dictFind(db->dict,key->ptr);
     if (de) {
-        robj *val = dictGetVal(de);
+        robj *val = dbGetVal(de);
 
         /* Update the access time for the ageing algorithm.
          * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
-            val->lru = LRU_CLOCK();
+         * a copy on write madness, nor during a fork-free BGSAVE, since
+         * 'lru' shares its word with the type and encoding fields the
+         * snapshot thread is reading. */
+        if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+            server.rdb_snapshot == NULL)
+            dbSetValLRU(de,LRU_CLOCK());
         return val;
     } else {
         return NULL;
@@ -70,6 +117,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
 }
 
 robj *lookupKeyWrite(redisDb *db, robj *key) {
+    if (server.rdb_snapshot) rdbSnapshotTouchKey(db,key->ptr);
     expireIfNeeded(db,key);
     return lookupKey(db,key);
 }
@@ -91,8 +139,12 @@ robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    sds copy;
+    int retval;
+
+    if (server.rdb_snapshot) rdbSnapshotTouchKey(db,key->ptr);
+    copy = sdsdup(key->ptr);
+    retval = dictAdd(db->dict, copy, dbEncodeVal(val));
 
     redisAssertWithInfo(NULL,key,retval == REDIS_OK);
     if (val->type == REDIS_LIST) signalListAsReady(db, key);
@@ -105,10 +157,13 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dictEntry *de;
+
+    if (server.rdb_snapshot) rdbSnapshotTouchKey(db,key->ptr);
+    de = dictFind(db->dict,key->ptr);
 
     redisAssertWithInfo(NULL,key,de != NULL);
-    dictReplace(db->dict, key->ptr, val);
+    dictReplace(db->dict, key->ptr, dbEncodeVal(val));
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -160,6 +215,7 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbDelete(redisDb *db, robj *key) {
+    if (server.rdb_snapshot) rdbSnapshotTouchKey(db,key->ptr);
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
@@ -200,6 +256,7 @@ int dbDelete(redisDb *db, robj *key) {
  */
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     redisAssert(o->type == REDIS_STRING);
+    if (server.rdb_snapshot) rdbSnapshotTouchKey(db,key->ptr);
     if (o->refcount != 1 || o->encoding != REDIS_ENCODING_RAW) {
         robj *decoded = getDecodedObject(o);
         o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
@@ -213,6 +270,8 @@ long long emptyDb(void(callback)(void*)) {
     int j;
     long long removed = 0;
 
+    /* The keys not yet saved by a fork-free BGSAVE would be lost. */
+    if (server.rdb_snapshot) rdbSnapshotFinish();
     for (j = 0; j < server.dbnum; j++) {
         removed += dictSize(server.db[j].dict);
         dictEmpty(server.db[j].dict,callback);
@@ -222,6 +281,72 @@ long long emptyDb(void(callback)(void*)) {
     return removed;
 }
 
+/* Queue a dictionary nobody references anymore, like the old keyspace of
+ * a slave after a full resynchronization, so that lazyfreeCron() releases it
+ * a few buckets at a time instead of blocking the server until millions of
+ * objects are freed. */
+void freeDictLazily(dict *d) {
+    server.lazyfree_pending_objects += dictSize(d);
+    listAddNodeTail(server.lazyfree_dicts,d);
+}
+
+/* Release every entry of the bucket 'idx' of the table 'ht' of 'd'.
+ * Returns the number of entries released. */
+static unsigned long lazyfreeBucket(dict *d, dictht *ht, unsigned long idx) {
+    dictEntry *de = ht->table[idx], *next;
+    unsigned long freed = 0;
+
+    while(de) {
+        next = de->next;
+        dictFreeKey(d,de);
+        dictFreeVal(d,de);
+        zfree(de);
+        freed++;
+        de = next;
+    }
+    ht->table[idx] = NULL;
+    ht->used -= freed;
+    return freed;
+}
+
+/* Called by databasesCron() while dictionaries are queued: the buckets of
+ * the first one are emptied in order, both tables if it was rehashing, then
+ * the empty dictionary is released and the next one is processed. Like
+ * activeExpireCycle() we use at most LAZYFREE_CYCLE_TIME_PERC percent of the
+ * CPU time. */
+void lazyfreeCron(void) {
+    static unsigned long cursor = 0; /* Next bucket of the first dict. */
+    long long start = ustime(), timelimit;
+    unsigned long iteration = 0;
+
+    timelimit = 1000000LL*LAZYFREE_CYCLE_TIME_PERC/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+
+    while(listLength(server.lazyfree_dicts)) {
+        listNode *ln = listFirst(server.lazyfree_dicts);
+        dict *d = listNodeValue(ln);
+        dictht *ht = &d->ht[0];
+        unsigned long idx = cursor;
+
+        if (idx >= ht->size) {
+            idx -= ht->size;
+            ht = &d->ht[1];
+        }
+        if (idx >= ht->size) {
+            /* Every bucket was visited: only the tables are left. */
+            dictRelease(d);
+            listDelNode(server.lazyfree_dicts,ln);
+            cursor = 0;
+            continue;
+        }
+        server.lazyfree_pending_objects -= lazyfreeBucket(d,ht,idx);
+        cursor++;
+
+        /* Checking the time is not free: do it every 1024 buckets. */
+        if ((++iteration & 1023) == 0 && ustime()-start > timelimit) break;
+    }
+}
+
 int selectDb(redisClient *c, int id) {
     if (id < 0 || id >= server.dbnum)
         return REDIS_ERR;
@@ -251,6 +376,7 @@ void signalFlushedDb(int dbid) {
  *----------------------------------------------------------------------------*/
 
 void flushdbCommand(redisClient *c) {
+    if (server.rdb_snapshot) rdbSnapshotFinish();
     server.dirty += dictSize(c->db->dict);
     signalFlushedDb(c->db->id);
     dictEmpty(c->db->dict,NULL);
@@ -260,6 +386,8 @@ void flushdbCommand(redisClient *c) {
 }
 
 void flushallCommand(redisClient *c) {
+    /* Like the saving child below, a fork-free BGSAVE is stopped. */
+    if (server.rdb_snapshot) rdbSnapshotAbort();
     signalFlushedDb(-1);
     server.dirty += emptyDb(NULL);
     addReply(c,shared.ok);
@@ -767,12 +895,14 @@ int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     redisAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
+    if (server.rdb_snapshot) rdbSnapshotTouchKey(db,key->ptr);
     return dictDelete(db->expires,key->ptr) == DICT_OK;
 }
 
 void setExpire(redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
 
+    if (server.rdb_snapshot) rdbSnapshotTouchKey(db,key->ptr);
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     redisAssertWithInfo(NULL,key,kde != NULL);
@@ -1125,6 +1255,24 @@ int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys)
     return keys;
 }
 
+/* Helper function to extract keys from the MEMORY command. Only the USAGE
+ * subcommand takes a key:
+ *
+ * MEMORY USAGE <key> [SAMPLES <count>] */
+int *memoryGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys) {
+    int *keys;
+    REDIS_NOTUSED(cmd);
+
+    if (argc >= 3 && !strcasecmp(argv[1]->ptr,"usage")) {
+        keys = zmalloc(sizeof(int));
+        keys[0] = 2;
+        *numkeys = 1;
+        return keys;
+    }
+    *numkeys = 0;
+    return NULL;
+}
+
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
  * while rehashing the cluster. */
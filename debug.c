@@ -143,7 +143,7 @@ void computeDatasetDigest(unsigned char *final) {
 
             mixDigest(digest,key,sdslen(key));
 
-            o = dictGetVal(de);
+            o = dbGetVal(de);
 
             aux = htonl(o->type);
             mixDigest(digest,&aux,sizeof(aux));
@@ -263,6 +263,8 @@ void debugCommand(redisClient *c) {
         if (c->argc >= 3) c->argv[2] = tryObjectEncoding(c->argv[2]);
         redisAssertWithInfo(c,c->argv[0],1 == 2);
     } else if (!strcasecmp(c->argv[1]->ptr,"reload")) {
+        /* The snapshot would later replace the file we are saving. */
+        if (server.rdb_snapshot) rdbSnapshotFinish();
         if (rdbSave(server.rdb_filename) != REDIS_OK) {
             addReply(c,shared.err);
             return;
@@ -276,7 +278,7 @@ void debugCommand(redisClient *c) {
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"loadaof")) {
         emptyDb(NULL);
-        if (loadAppendOnlyFile(server.aof_filename) != REDIS_OK) {
+        if (loadAppendOnlyFiles() != REDIS_OK) {
             addReply(c,shared.err);
             return;
         }
@@ -292,7 +294,7 @@ void debugCommand(redisClient *c) {
             addReply(c,shared.nokeyerr);
             return;
         }
-        val = dictGetVal(de);
+        val = dbGetVal(de);
         strenc = strEncoding(val->encoding);
 
         addReplyStatusFormat(c,
@@ -301,7 +303,7 @@ void debugCommand(redisClient *c) {
             "lru:%d lru_seconds_idle:%llu",
             (void*)val, val->refcount,
             strenc, (long long) rdbSavedObjectLen(val),
-            val->lru, estimateObjectIdleTime(val));
+            dbGetValLRU(de), estimateIdleTimeFromLRU(dbGetValLRU(de)));
     } else if (!strcasecmp(c->argv[1]->ptr,"sdslen") && c->argc == 3) {
         dictEntry *de;
         robj *val;
@@ -311,7 +313,7 @@ void debugCommand(redisClient *c) {
             addReply(c,shared.nokeyerr);
             return;
         }
-        val = dictGetVal(de);
+        val = dbGetVal(de);
         key = dictGetKey(de);
 
         if (val->type != REDIS_STRING || !sdsEncodedObject(val)) {
@@ -711,7 +713,7 @@ void logCurrentClient(void) {
         key = getDecodedObject(cc->argv[1]);
         de = dictFind(cc->db->dict, key->ptr);
         if (de) {
-            val = dictGetVal(de);
+            val = dbGetVal(de);
             redisLog(REDIS_WARNING,"key '%s' found in DB containing the following object:", (char*)key->ptr);
             redisLogObjectDebugInfo(val);
         }
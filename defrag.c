@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+#include <stddef.h>
+
+/* Active memory defragmentation: try to find key / value allocations that
+ * need to be re-allocated in order to reduce external fragmentation. We do
+ * that by scanning the keyspace and, for each pointer we have, asking the
+ * allocator if moving it to a new address will help reduce fragmentation. */
+
+/* Return the allocator external fragmentation as a percentage of the
+ * allocated bytes, and the number of fragmented bytes in 'out_frag_bytes'
+ * if not NULL. When the allocator does not provide this information
+ * zero is returned. */
+float getAllocatorFragmentation(size_t *out_frag_bytes) {
+    size_t allocated, active;
+    float frag_pct = 0;
+    size_t frag_bytes = 0;
+
+    if (zmalloc_get_allocator_info(&allocated,&active) && allocated) {
+        frag_pct = ((float)active/allocated)*100-100;
+        frag_bytes = active-allocated;
+    }
+    if (out_frag_bytes) *out_frag_bytes = frag_bytes;
+    return frag_pct;
+}
+
+#ifdef HAVE_DEFRAG
+
+/* this method was added to jemalloc in order to help us understand which
+ * pointers are worthwhile moving and which aren't */
+int je_get_defrag_hint(void* ptr, int *bin_util, int *run_util);
+
+/* Defrag helper for generic allocations.
+ *
+ * returns NULL in case the allocatoin wasn't moved.
+ * when it returns a non-null value, the old pointer was already released
+ * and should NOT be accessed. */
+void* activeDefragAlloc(void *ptr) {
+    int bin_util, run_util;
+    size_t size;
+    void *newptr;
+
+    if (!je_get_defrag_hint(ptr, &bin_util, &run_util)) {
+        server.stat_active_defrag_misses++;
+        return NULL;
+    }
+    /* if this run is more utilized than the average utilization in this bin
+     * (or it is full), skip it. This will eventually move all the allocations
+     * from relatively empty runs into relatively full runs. */
+    if (run_util > bin_util || run_util == 1<<16) {
+        server.stat_active_defrag_misses++;
+        return NULL;
+    }
+    /* move this allocation to a new allocation.
+     * make sure not to use the thread cache. so that we don't get back the same
+     * pointers we try to free */
+    size = zmalloc_size(ptr);
+    newptr = zmalloc_no_tcache(size);
+    memcpy(newptr, ptr, size);
+    zfree_no_tcache(ptr);
+    server.stat_active_defrag_hits++;
+    return newptr;
+}
+
+/* Defrag helper for sds strings
+ *
+ * returns NULL in case the allocatoin wasn't moved.
+ * when it returns a non-null value, the old pointer was already released
+ * and should NOT be accessed. */
+sds activeDefragSds(sds sdsptr) {
+    void *ptr = sdsptr-sizeof(struct sdshdr);
+    void *newptr = activeDefragAlloc(ptr);
+
+    if (newptr) return (char*)newptr+sizeof(struct sdshdr);
+    return NULL;
+}
+
+/* Defrag helper for string objects. The object is moved only if 'refcount'
+ * references to it exist, that is, all of them are known by the caller and
+ * will be updated.
+ *
+ * returns NULL in case the allocatoin wasn't moved.
+ * when it returns a non-null value, the old pointer was already released
+ * and should NOT be accessed. */
+robj *activeDefragStringOb(robj *ob, int refcount, int *defragged) {
+    robj *ret = NULL;
+
+    if (ob->refcount != refcount) return NULL;
+
+    /* try to defrag robj (only if not an EMBSTR type (handled below). */
+    if (ob->type != REDIS_STRING || ob->encoding != REDIS_ENCODING_EMBSTR) {
+        if ((ret = activeDefragAlloc(ob))) {
+            ob = ret;
+            (*defragged)++;
+        }
+    }
+
+    /* try to defrag string object */
+    if (ob->type == REDIS_STRING) {
+        if (ob->encoding == REDIS_ENCODING_RAW) {
+            sds newsds = activeDefragSds((sds)ob->ptr);
+            if (newsds) {
+                ob->ptr = newsds;
+                (*defragged)++;
+            }
+        } else if (ob->encoding == REDIS_ENCODING_EMBSTR) {
+            /* The sds is embedded in the object allocation, calculate the
+             * offset and update the pointer in the new allocation. */
+            long ofs = (intptr_t)ob->ptr - (intptr_t)ob;
+            if ((ret = activeDefragAlloc(ob))) {
+                ret->ptr = (void*)((intptr_t)ret + ofs);
+                (*defragged)++;
+            }
+        } else if (ob->encoding != REDIS_ENCODING_INT) {
+            redisPanic("Unknown string encoding");
+        }
+    }
+    return ret;
+}
+
+/* Defrag the elements and the nodes of a linked list encoded list. */
+void activeDefragList(list *l, int *defragged) {
+    listNode *ln, *newln;
+    robj *newele;
+
+    for (ln = l->head; ln; ln = ln->next) {
+        if ((newele = activeDefragStringOb(ln->value,1,defragged)))
+            ln->value = newele;
+        if ((newln = activeDefragAlloc(ln))) {
+            if (newln->prev) newln->prev->next = newln;
+            else l->head = newln;
+            if (newln->next) newln->next->prev = newln;
+            else l->tail = newln;
+            ln = newln;
+            (*defragged)++;
+        }
+    }
+}
+
+/* Defrag the keys (and the values if 'defragvals' is true) of a dictionary
+ * having string objects as keys, as used by sets and hashes. */
+void activeDefragObjectDict(dict *d, int defragvals, int *defragged) {
+    dictIterator *di = dictGetIterator(d);
+    dictEntry *de;
+
+    while((de = dictNext(di)) != NULL) {
+        robj *newob;
+
+        if ((newob = activeDefragStringOb(dictGetKey(de),1,defragged)))
+            de->key = newob;
+        if (defragvals &&
+            (newob = activeDefragStringOb(dictGetVal(de),1,defragged)))
+            de->v.val = newob;
+    }
+    dictReleaseIterator(di);
+}
+
+/* Update the pointers to 'oldnode' after it was moved to 'newnode'. The
+ * 'update' array contains, for every level, the last node before 'oldnode'
+ * as found by activeDefragZsetEntry(). */
+void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode,
+                   zskiplistNode *newnode, zskiplistNode **update)
+{
+    int i;
+
+    for (i = 0; i < zsl->level; i++) {
+        if (update[i]->level[i].forward == oldnode)
+            update[i]->level[i].forward = newnode;
+    }
+    if (newnode->level[0].forward) {
+        newnode->level[0].forward->backward = newnode;
+    } else {
+        zsl->tail = newnode;
+    }
+}
+
+/* Defrag a single skiplist encoded sorted set element. The element object
+ * is referenced both by the dictionary and by the skiplist node, while the
+ * dictionary value points to the score stored inside the node, so all the
+ * three pointers need to be updated. */
+void activeDefragZsetEntry(zset *zs, dictEntry *de, int *defragged) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
+    zskiplist *zsl = zs->zsl;
+    robj *ele = dictGetKey(de), *newele;
+    double *scoreptr = dictGetVal(de);
+    int i;
+
+    /* The score is embedded in the skiplist node. */
+    x = (zskiplistNode*)((char*)scoreptr-offsetof(zskiplistNode,score));
+    if ((newele = activeDefragStringOb(ele,2,defragged))) {
+        x->obj = newele;
+        de->key = newele;
+        ele = newele;
+    }
+
+    /* Find the nodes pointing to 'x' at every level, so that the node
+     * itself can be moved. */
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+               x->level[i].forward->obj != ele &&
+               (x->level[i].forward->score < *scoreptr ||
+                (x->level[i].forward->score == *scoreptr &&
+                 compareStringObjects(x->level[i].forward->obj,ele) < 0)))
+            x = x->level[i].forward;
+        update[i] = x;
+    }
+    x = x->level[0].forward;
+    redisAssert(x && x->obj == ele);
+    if ((newx = activeDefragAlloc(x))) {
+        zslUpdateNode(zsl,x,newx,update);
+        de->v.val = &newx->score;
+        (*defragged)++;
+    }
+}
+
+/* Defrag the internal representation of a value. Objects with multiple
+ * allocations are walked and every allocation is considered. */
+void activeDefragValue(robj *ob, int *defragged) {
+    void *newptr;
+
+    switch(ob->type) {
+    case REDIS_STRING:
+        /* Already handled by activeDefragStringOb(). */
+        break;
+    case REDIS_LIST:
+        if (ob->encoding == REDIS_ENCODING_ZIPLIST) {
+            if ((newptr = activeDefragAlloc(ob->ptr))) {
+                ob->ptr = newptr;
+                (*defragged)++;
+            }
+        } else if (ob->encoding == REDIS_ENCODING_LINKEDLIST) {
+            activeDefragList(ob->ptr,defragged);
+        } else {
+            redisPanic("Unknown list encoding");
+        }
+        break;
+    case REDIS_SET:
+        if (ob->encoding == REDIS_ENCODING_INTSET) {
+            if ((newptr = activeDefragAlloc(ob->ptr))) {
+                ob->ptr = newptr;
+                (*defragged)++;
+            }
+        } else if (ob->encoding == REDIS_ENCODING_HT) {
+            activeDefragObjectDict(ob->ptr,0,defragged);
+        } else {
+            redisPanic("Unknown set encoding");
+        }
+        break;
+    case REDIS_ZSET:
+        if (ob->encoding == REDIS_ENCODING_ZIPLIST) {
+            if ((newptr = activeDefragAlloc(ob->ptr))) {
+                ob->ptr = newptr;
+                (*defragged)++;
+            }
+        } else if (ob->encoding == REDIS_ENCODING_SKIPLIST) {
+            zset *zs = ob->ptr;
+            dictIterator *di = dictGetIterator(zs->dict);
+            dictEntry *de;
+
+            while((de = dictNext(di)) != NULL)
+                activeDefragZsetEntry(zs,de,defragged);
+            dictReleaseIterator(di);
+        } else {
+            redisPanic("Unknown sorted set encoding");
+        }
+        break;
+    case REDIS_HASH:
+        if (ob->encoding == REDIS_ENCODING_ZIPLIST) {
+            if ((newptr = activeDefragAlloc(ob->ptr))) {
+                ob->ptr = newptr;
+                (*defragged)++;
+            }
+        } else if (ob->encoding == REDIS_ENCODING_HT) {
+            activeDefragObjectDict(ob->ptr,1,defragged);
+        } else {
+            redisPanic("Unknown hash encoding");
+        }
+        break;
+    default:
+        redisPanic("Unknown object type");
+    }
+}
+
+/* Callback invoked by dictScan() for every key of the database being
+ * defragmented. The key sds is shared by the main dictionary and the
+ * expires dictionary, so both entries are updated. */
+void defragScanCallback(void *privdata, const dictEntry *const_de) {
+    dictEntry *de = (dictEntry*)const_de;
+    redisDb *db = privdata;
+    dictEntry *exde = NULL;
+    sds keysds = dictGetKey(de), newsds;
+    robj *ob, *newob;
+    int defragged = 0;
+
+    /* Look up the expires entry before the key is moved, using the pointer
+     * since the dictScan() callback can't trigger a rehashing step. */
+    if (dictSize(db->expires)) {
+        unsigned int hash = dictGetHash(db->dict,keysds);
+        exde = dictFindEntryByPtrAndHash(db->expires,keysds,hash);
+    }
+    if ((newsds = activeDefragSds(keysds))) {
+        de->key = newsds;
+        if (exde) exde->key = newsds;
+        defragged++;
+    }
+
+    /* Inline integers have no allocation to move. */
+    ob = dictGetVal(de);
+    if (!dbValIsInline(ob)) {
+        if ((newob = activeDefragStringOb(ob,1,&defragged))) {
+            de->v.val = newob;
+            ob = newob;
+        }
+        activeDefragValue(ob,&defragged);
+    }
+
+    if (defragged)
+        server.stat_active_defrag_key_hits++;
+    else
+        server.stat_active_defrag_key_misses++;
+}
+
+/* Utility macros to compute the CPU effort of the defrag cycle. */
+#define INTERPOLATE(x, x1, x2, y1, y2) ( (y1) + ((x)-(x1)) * ((y2)-(y1)) / ((x2)-(x1)) )
+#define LIMIT(y, min, max) ((y)<(min)? min: ((y)>(max)? max: (y)))
+
+/* Perform incremental defragmentation work from the serverCron.
+ * This works in a similar way to activeExpireCycle, in the sense that
+ * we do incremental work across calls. */
+void activeDefragCycle(void) {
+    static int current_db = -1;
+    static unsigned long cursor = 0;
+    static redisDb *db = NULL;
+    static long long start_scan, start_stat;
+    unsigned int iterations = 0;
+    unsigned long long defragged = server.stat_active_defrag_hits;
+    long long start, timelimit;
+
+    /* Defragging memory while there's a fork will just do damage, since
+     * every moved allocation would also be copied on write. The snapshot
+     * thread of a fork-free BGSAVE may be reading the values as well. */
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1 ||
+        server.rdb_snapshot) return;
+
+    /* Once a second, check if the fragmentation justifies starting a scan
+     * or making it more aggressive. */
+    run_with_period(1000) {
+        size_t frag_bytes;
+        float frag_pct = getAllocatorFragmentation(&frag_bytes);
+        int cpu_pct;
+
+        /* If we're not already running, and below the threshold, exit. */
+        if (!server.active_defrag_running) {
+            if (frag_pct < server.active_defrag_threshold_lower ||
+                frag_bytes < (size_t)server.active_defrag_ignore_bytes)
+                return;
+        }
+
+        /* Calculate the adaptive aggressiveness of the defrag. */
+        cpu_pct = INTERPOLATE(frag_pct,
+                server.active_defrag_threshold_lower,
+                server.active_defrag_threshold_upper,
+                server.active_defrag_cycle_min,
+                server.active_defrag_cycle_max);
+        cpu_pct = LIMIT(cpu_pct,
+                server.active_defrag_cycle_min,
+                server.active_defrag_cycle_max);
+        /* We allow increasing the aggressiveness during a scan, but don't
+         * reduce it. */
+        if (!server.active_defrag_running ||
+            cpu_pct > server.active_defrag_running)
+        {
+            server.active_defrag_running = cpu_pct;
+            redisLog(REDIS_VERBOSE,
+                "Starting active defrag, frag=%.0f%%, frag_bytes=%zu, cpu=%d%%",
+                frag_pct, frag_bytes, cpu_pct);
+        }
+    }
+    if (!server.active_defrag_running) return;
+
+    /* See activeExpireCycle for how timelimit is handled. */
+    start = ustime();
+    timelimit = 1000000LL*server.active_defrag_running/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+
+    do {
+        if (!cursor) {
+            /* Move on to next database, and stop if we reached the last one. */
+            if (++current_db >= server.dbnum) {
+                long long now = ustime();
+                size_t frag_bytes;
+                float frag_pct = getAllocatorFragmentation(&frag_bytes);
+
+                redisLog(REDIS_VERBOSE,
+                    "Active defrag done in %dms, reallocated=%d, frag=%.0f%%, frag_bytes=%zu",
+                    (int)((now - start_scan)/1000),
+                    (int)(server.stat_active_defrag_hits - start_stat),
+                    frag_pct, frag_bytes);
+
+                start_scan = now;
+                current_db = -1;
+                cursor = 0;
+                db = NULL;
+                server.active_defrag_running = 0;
+                return;
+            } else if (current_db == 0) {
+                /* Start a scan from the first database. */
+                start_scan = ustime();
+                start_stat = server.stat_active_defrag_hits;
+            }
+            db = &server.db[current_db];
+            cursor = 0;
+        }
+
+        do {
+            cursor = dictScan(db->dict, cursor, defragScanCallback, db);
+            /* Once in 16 scan iterations, or 1000 pointer reallocations
+             * (if we have a lot of pointers in one hash bucket), check if we
+             * reached the time limit. */
+            if (cursor && (++iterations > 16 ||
+                server.stat_active_defrag_hits - defragged > 1000))
+            {
+                if ((ustime() - start) > timelimit) {
+                    latencyAddSampleIfNeeded("active-defrag-cycle",
+                        (ustime() - start)/1000);
+                    return;
+                }
+                iterations = 0;
+                defragged = server.stat_active_defrag_hits;
+            }
+        } while(cursor);
+    } while(1);
+}
+
+#else /* HAVE_DEFRAG */
+
+/* Never called: without an allocator able to report fragmentation the
+ * configuration refuses "activedefrag yes", both in the config file and
+ * with CONFIG SET. */
+void activeDefragCycle(void) {
+}
+
+#endif
@@ -868,6 +868,51 @@ void *dictFetchValue(dict *d, const void *key) {
     return he ? dictGetVal(he) : NULL;
 }
 
+/* Return the hash value of 'key' using the hash function of the dictionary. */
+
+/*
+ * 返回键在字典中使用的哈希值
+ *
+ * d 字典节点
+ * key 键
+ *
+ */
+unsigned int dictGetHash(dict *d, const void *key) {
+    return dictHashKey(d, key);
+}
+
+/* Finds the dictEntry whose key is exactly the pointer 'oldptr' (no key
+ * comparison is performed), using the precomputed 'hash' of the key.
+ * Unlike dictFind() no rehashing step is performed, so it is safe to call
+ * this function from a dictScan() callback, and the old pointer may be
+ * already freed as it is never dereferenced. Returns NULL if not found. */
+
+/*
+ * 根据键的指针地址与哈希值查找节点
+ * 不比较键的内容，也不执行rehash，因此可以在dictScan回调中使用
+ *
+ * d 字典节点
+ * oldptr 键的指针地址
+ * hash 键的哈希值
+ *
+ */
+dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, unsigned int hash) {
+    dictEntry *he;
+    unsigned int idx, table;
+
+    if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
+    for (table = 0; table <= 1; table++) {
+        idx = hash & d->ht[table].sizemask;
+        he = d->ht[table].table[idx];
+        while(he) {
+            if (oldptr == he->key) return he;
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) return NULL;
+    }
+    return NULL;
+}
+
 /* A fingerprint is a 64 bit number that represents the state of the dictionary
  * at a given time, it's just a few dict properties xored together.
  * When an unsafe iterator is initialized, we get the dict fingerprint, and check
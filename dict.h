@@ -230,6 +230,10 @@ void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
 // 在字典中查找键对应的值
 void *dictFetchValue(dict *d, const void *key);
+// 返回键在字典中使用的哈希值
+unsigned int dictGetHash(dict *d, const void *key);
+// 根据键的指针地址与哈希值查找节点
+dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, unsigned int hash);
 // 调整字典大小，让已有节点数与Bucket比率尽量接近小于等于1
 int dictResize(dict *d);
 // 给指定字典创建一个不安全迭代器
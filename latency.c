@@ -230,6 +230,7 @@ sds createLatencyReport(void) {
     int advise_large_objects = 0;   /* Deletion of large objects. */
     int advise_relax_fsync_policy = 0; /* appendfsync always is slow. */
     int advise_disable_thp = 0;     /* AnonHugePages detected. */
+    int advise_expire_effort = 0;   /* Active expire cycle is using more CPU. */
     int advices = 0;
 
     /* Return ASAP if the latency engine is disabled and it looks like it
@@ -361,6 +362,10 @@ sds createLatencyReport(void) {
             advise_hz = 1;
             advise_large_objects = 1;
             advices += 2;
+            if (server.active_expire_effort > ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC) {
+                advise_expire_effort = 1;
+                advices++;
+            }
         }
 
         /* Eviction cycle. */
@@ -448,6 +453,13 @@ sds createLatencyReport(void) {
             report = sdscat(report,"- In order to make the Redis keys expiring process more incremental, try to set the 'hz' configuration parameter to 100 using 'CONFIG SET hz 100'.\n");
         }
 
+        if (advise_expire_effort) {
+            double stale_perc;
+            long long stale_keys = activeExpireEstimateStaleKeys(&stale_perc);
+
+            report = sdscatprintf(report,"- The active expire cycle is currently allowed to use %d%% of the CPU time (up to 'active-expire-max-cpu' %d%%), since an estimated %lld keys (%.2f%% of the keys with an expire) are already expired but still use memory. If the resulting latency is not acceptable try to lower 'active-expire-max-cpu', or set 'active-expire-latency-target' to the max event loop latency in milliseconds you want the expire cycle to back off at.\n", server.active_expire_effort, server.active_expire_max_cpu, stale_keys, stale_perc);
+        }
+
         if (advise_large_objects) {
             report = sdscat(report,"- Deleting, expiring or evicting (because of maxmemory policy) large objects is a blocking operation. If you have very large objects that are often deleted, expired, or evicted, try to fragment those objects into multiple smaller objects.\n");
         }
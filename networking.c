@@ -101,12 +101,22 @@ redisClient *createClient(int fd) {
     c->authenticated = 0;
     c->replstate = REDIS_REPL_NONE;
     c->repl_put_online_on_ack = 0;
+    c->read_reploff = 0;
     c->reploff = 0;
+    c->pending_querybuf = sdsempty();
     c->repl_ack_off = 0;
     c->repl_ack_time = 0;
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
+    c->repl_spill_off = -1;
+    c->repl_lzf_buf = NULL;
     c->slave_listening_port = 0;
+    c->slave_capa = REDIS_SLAVE_CAPA_NONE;
+    memset(c->replid,0,sizeof(c->replid));
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->mem_usage = 0;
+    c->mem_cat = ZMALLOC_CAT_CLIENTS;
     c->obuf_soft_limit_reached_time = 0;
     listSetFreeMethod(c->reply,decrRefCountVoid);
     listSetDupMethod(c->reply,dupClientReplyValue);
@@ -117,6 +127,7 @@ redisClient *createClient(int fd) {
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
     c->woff = 0;
+    c->aof_wait_seq = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&setDictType,NULL);
     c->pubsub_patterns = listCreate();
@@ -147,9 +158,10 @@ int prepareClientToWrite(redisClient *c) {
     if ((c->flags & REDIS_MASTER) &&
         !(c->flags & REDIS_MASTER_FORCE_REPLY)) return REDIS_ERR;
     if (c->fd <= 0) return REDIS_ERR; /* Fake client */
-    if (c->bufpos == 0 && listLength(c->reply) == 0 &&
+    if (!clientHasPendingReplies(c) &&
         (c->replstate == REDIS_REPL_NONE ||
          c->replstate == REDIS_REPL_ONLINE) &&
+        !(c->flags & REDIS_AOF_WAIT) &&
         aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
         sendReplyToClient, c) == AE_ERR) return REDIS_ERR;
     return REDIS_OK;
@@ -545,13 +557,39 @@ void addReplyBulkLongLong(redisClient *c, long long ll) {
 
 /* Copy 'src' client output buffers into 'dst' client output buffers.
  * The function takes care of freeing the old output buffers of the
- * destination client. */
+ * destination client. For slaves the cursor in the shared replication
+ * buffer is copied as well, so 'dst' will receive the same stream. */
 void copyClientOutputBuffer(redisClient *dst, redisClient *src) {
     listRelease(dst->reply);
     dst->reply = listDup(src->reply);
     memcpy(dst->buf,src->buf,src->bufpos);
     dst->bufpos = src->bufpos;
     dst->reply_bytes = src->reply_bytes;
+    replicationReleaseSlaveCursor(dst);
+    if (src->ref_repl_buf_node) {
+        replBufBlock *b = listNodeValue(src->ref_repl_buf_node);
+
+        b->refcount++;
+        dst->ref_repl_buf_node = src->ref_repl_buf_node;
+        dst->ref_block_pos = src->ref_block_pos;
+    }
+    dst->repl_spill_off = src->repl_spill_off;
+}
+
+/* Return true if the client has output not yet transferred: the static
+ * buffer, the reply list, and for slaves the part of the shared replication
+ * buffer after the slave cursor, or the backlog spill files. */
+int clientHasPendingReplies(redisClient *c) {
+    if (c->bufpos || listLength(c->reply)) return 1;
+    if (c->repl_lzf_buf && sdslen(c->repl_lzf_buf)) return 1;
+    if (c->repl_spill_off != -1) return 1;
+    if (c->ref_repl_buf_node) {
+        replBufBlock *b = listNodeValue(c->ref_repl_buf_node);
+
+        if (c->ref_block_pos < b->used ||
+            listNextNode(c->ref_repl_buf_node) != NULL) return 1;
+    }
+    return 0;
 }
 
 #define MAX_ACCEPTS_PER_CALL 1000
@@ -646,12 +684,10 @@ void replicationHandleMasterDisconnection(void) {
     server.master = NULL;
     server.repl_state = REDIS_REPL_CONNECT;
     server.repl_down_since = server.unixtime;
-    /* We lost connection with our master, force our slaves to resync
-     * with us as well to load the new data set.
-     *
-     * If server.masterhost is NULL the user called SLAVEOF NO ONE so
-     * slave resync is not needed. */
-    if (server.masterhost != NULL) disconnectSlaves();
+    /* We lost the connection with our master, but we don't disconnect our
+     * slaves: we may be able to partially resync with our master later,
+     * and continue to proxy its stream to them. They are disconnected only
+     * if a full resync with our master is needed, see syncWithMaster(). */
 }
 
 void freeClient(redisClient *c) {
@@ -685,8 +721,13 @@ void freeClient(redisClient *c) {
 
     /* Free the query buffer */
     sdsfree(c->querybuf);
+    sdsfree(c->pending_querybuf);
     c->querybuf = NULL;
 
+    /* The buffers are going away: remove them from the memory accounting. */
+    zmalloc_category_sub(c->mem_cat,c->mem_usage);
+    c->mem_usage = 0;
+
     /* Deallocate structures used to block on blocking ops. */
     if (c->flags & REDIS_BLOCKED) unblockClient(c);
     dictRelease(c->bpop.keys);
@@ -726,6 +767,13 @@ void freeClient(redisClient *c) {
         listDelNode(server.unblocked_clients,ln);
     }
 
+    /* Remove from the list of clients waiting for the AOF writer. */
+    if (c->flags & REDIS_AOF_WAIT) {
+        ln = listSearchKey(server.aof_wait_clients,c);
+        redisAssert(ln != NULL);
+        listDelNode(server.aof_wait_clients,ln);
+    }
+
     /* Master/slave cleanup Case 1:
      * we lost the connection with a slave. */
     if (c->flags & REDIS_SLAVE) {
@@ -733,6 +781,8 @@ void freeClient(redisClient *c) {
             if (c->repldbfd != -1) close(c->repldbfd);
             if (c->replpreamble) sdsfree(c->replpreamble);
         }
+        if (c->repl_lzf_buf) sdsfree(c->repl_lzf_buf);
+        replicationReleaseSlaveCursor(c);
         list *l = (c->flags & REDIS_MONITOR) ? server.monitors : server.slaves;
         ln = listSearchKey(l,c);
         redisAssert(ln != NULL);
@@ -795,7 +845,14 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     REDIS_NOTUSED(el);
     REDIS_NOTUSED(mask);
 
-    while(c->bufpos > 0 || listLength(c->reply)) {
+    /* The reply is held until the AOF writer syncs the client writes: the
+     * handler is installed again by the writer acknowledge. */
+    if (c->flags & REDIS_AOF_WAIT) {
+        aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+        return;
+    }
+
+    while(clientHasPendingReplies(c)) {
         if (c->bufpos > 0) {
             nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
             if (nwritten <= 0) break;
@@ -808,7 +865,7 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
                 c->bufpos = 0;
                 c->sentlen = 0;
             }
-        } else {
+        } else if (listLength(c->reply)) {
             o = listNodeValue(listFirst(c->reply));
             objlen = sdslen(o->ptr);
             objmem = getStringObjectSdsUsedMemory(o);
@@ -830,6 +887,12 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
                 c->sentlen = 0;
                 c->reply_bytes -= objmem;
             }
+        } else {
+            /* Slaves: the replication stream is written directly from the
+             * buffer shared with the backlog and the other slaves. */
+            nwritten = writeReplicationBufferToSlave(c);
+            if (nwritten <= 0) break;
+            totwritten += nwritten;
         }
         /* Note that we avoid to send more than REDIS_MAX_WRITE_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
@@ -853,6 +916,7 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
             return;
         }
     }
+    updateClientMemUsage(c);
     if (totwritten > 0) {
         /* For clients representing masters we don't count sending data
          * as an interaction, since we always send REPLCONF ACK commands
@@ -860,7 +924,7 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
          * We just rely on data / pings received for timeout detection. */
         if (!(c->flags & REDIS_MASTER)) c->lastinteraction = server.unixtime;
     }
-    if (c->bufpos == 0 && listLength(c->reply) == 0) {
+    if (!clientHasPendingReplies(c)) {
         c->sentlen = 0;
         aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
 
@@ -1093,6 +1157,78 @@ int processMultibulkBuffer(redisClient *c) {
     return REDIS_ERR;
 }
 
+/* Return the length of the multi bulk command starting at 'p', if it is
+ * entirely contained in the 'len' bytes at 'p' and can be handled by
+ * processMasterBatch(), otherwise zero is returned. The number of
+ * arguments is stored in '*argc'. */
+static size_t masterBatchCommandLen(char *p, size_t len, int *argc) {
+    char *end = p+len, *start = p, *newline;
+    long long ll, count;
+
+    if (len == 0 || *p != '*') return 0;
+    newline = memchr(p,'\r',len);
+    if (newline == NULL || newline+1 >= end) return 0;
+    if (!string2ll(p+1,newline-(p+1),&count) ||
+        count <= 0 || count > 1024*1024) return 0;
+    p = newline+2;
+    *argc = count;
+    while(count--) {
+        if (p >= end || *p != '$') return 0;
+        newline = memchr(p,'\r',end-p);
+        if (newline == NULL || newline+1 >= end) return 0;
+        /* Big arguments are better handled by processMultibulkBuffer(),
+         * that avoids copying them. */
+        if (!string2ll(p+1,newline-(p+1),&ll) ||
+            ll < 0 || ll >= REDIS_MBULK_BIG_ARG) return 0;
+        p = newline+2;
+        if (end-p < ll+2) return 0;
+        p += ll+2;
+    }
+    return p-start;
+}
+
+/* Fast path of processInputBuffer() for the replication stream received
+ * from our master, that is trusted and usually made of many small commands:
+ * the commands entirely contained in the query buffer are parsed in place
+ * one after the other, and the buffer is trimmed only once at the end of the
+ * batch, instead of after every command. The commands are executed with
+ * processMasterCommand().
+ *
+ * The function stops at the first command it can't handle (not complete,
+ * inline, or with big arguments), that is processed by the usual code. */
+static void processMasterBatch(redisClient *c) {
+    size_t pos = 0, qblen = sdslen(c->querybuf), cmdlen;
+    int argc, j;
+
+    while(!(c->flags & (REDIS_BLOCKED|REDIS_CLOSE_AFTER_REPLY)) &&
+          (cmdlen = masterBatchCommandLen(c->querybuf+pos,qblen-pos,&argc)))
+    {
+        char *p = (char*)memchr(c->querybuf+pos,'\n',cmdlen)+1;
+
+        /* The command is valid, so we can skip the checks while creating
+         * the arguments. */
+        if (c->argv) zfree(c->argv);
+        c->argv = zmalloc(sizeof(robj*)*argc);
+        for (j = 0; j < argc; j++) {
+            char *newline = strchr(p,'\r');
+            long long ll;
+
+            string2ll(p+1,newline-(p+1),&ll);
+            p = newline+2;
+            c->argv[j] = createStringObject(p,ll);
+            p += ll+2;
+        }
+        c->argc = argc;
+        pos += cmdlen;
+
+        if (processMasterCommand(c) != REDIS_OK) break;
+        if (!(c->flags & REDIS_MULTI))
+            c->reploff = c->read_reploff - (qblen - pos);
+        resetClient(c);
+    }
+    if (pos) sdsrange(c->querybuf,pos,-1);
+}
+
 void processInputBuffer(redisClient *c) {
     /* Keep processing while there is something in the input buffer */
     while(sdslen(c->querybuf)) {
@@ -1107,6 +1243,14 @@ void processInputBuffer(redisClient *c) {
          * this flag has been set (i.e. don't process more commands). */
         if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
 
+        /* Commands from our master take the fast path when we are not in
+         * the middle of parsing a command. */
+        if (c->flags & REDIS_MASTER && !c->reqtype) {
+            processMasterBatch(c);
+            if (sdslen(c->querybuf) == 0 ||
+                c->flags & (REDIS_BLOCKED|REDIS_CLOSE_AFTER_REPLY)) return;
+        }
+
         /* Determine request type when unknown. */
         if (!c->reqtype) {
             if (c->querybuf[0] == '*') {
@@ -1129,8 +1273,16 @@ void processInputBuffer(redisClient *c) {
             resetClient(c);
         } else {
             /* Only reset the client when the command was executed. */
-            if (processCommand(c) == REDIS_OK)
+            if ((c->flags & REDIS_MASTER ? processMasterCommand(c) :
+                                           processCommand(c)) == REDIS_OK)
+            {
+                /* Update the applied replication offset of our master:
+                 * the commands inside a transaction are applied only on
+                 * EXEC, so the offset is updated only outside of it. */
+                if (c->flags & REDIS_MASTER && !(c->flags & REDIS_MULTI))
+                    c->reploff = c->read_reploff - sdslen(c->querybuf);
                 resetClient(c);
+            }
         }
     }
 }
@@ -1160,8 +1312,15 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
-    c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
-    nread = read(fd, c->querybuf+qblen, readlen);
+    if (c->flags & REDIS_REPL_LZF) {
+        /* Our master sends LZF frames: append to the query buffer the
+         * content of every frame received so far. */
+        nread = replicationReadFrames(fd,&c->querybuf);
+    } else {
+        c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
+        nread = read(fd, c->querybuf+qblen, readlen);
+        if (nread > 0) sdsIncrLen(c->querybuf,nread);
+    }
     if (nread == -1) {
         if (errno == EAGAIN) {
             nread = 0;
@@ -1176,9 +1335,12 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         return;
     }
     if (nread) {
-        sdsIncrLen(c->querybuf,nread);
         c->lastinteraction = server.unixtime;
-        if (c->flags & REDIS_MASTER) c->reploff += nread;
+        if (c->flags & REDIS_MASTER) {
+            c->read_reploff += nread;
+            c->pending_querybuf = sdscatlen(c->pending_querybuf,
+                                            c->querybuf+qblen,nread);
+        }
     } else {
         server.current_client = NULL;
         return;
@@ -1193,10 +1355,32 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         freeClient(c);
         return;
     }
-    processInputBuffer(c);
+    updateClientMemUsage(c);
+    processInputBufferAndReplicate(c);
     server.current_client = NULL;
 }
 
+/* Like processInputBuffer(), but when 'c' is our master the stream is also
+ * proxied verbatim to our slaves and to the backlog, so that they share our
+ * master replication ID and offsets. Only the part that was actually
+ * applied is proxied. */
+void processInputBufferAndReplicate(redisClient *c) {
+    if (c->flags & REDIS_MASTER) {
+        long long prev_offset = c->reploff;
+        size_t applied;
+
+        processInputBuffer(c);
+        applied = c->reploff - prev_offset;
+        if (applied) {
+            replicationFeedSlavesFromMasterStream(server.slaves,
+                    c->pending_querybuf, applied);
+            sdsrange(c->pending_querybuf,applied,-1);
+        }
+    } else {
+        processInputBuffer(c);
+    }
+}
+
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer) {
     redisClient *c;
@@ -1497,6 +1681,16 @@ void rewriteClientCommandVector(redisClient *c, int argc, ...) {
         argv[j] = a;
         incrRefCount(a);
     }
+    replaceClientCommandVector(c,argc,argv);
+    va_end(ap);
+}
+
+/* Like rewriteClientCommandVector() but takes an already built vector: the
+ * client takes ownership of 'argv' and of the references of the objects it
+ * contains. */
+void replaceClientCommandVector(redisClient *c, int argc, robj **argv) {
+    int j;
+
     /* We free the objects in the original vector at the end, so we are
      * sure that if the same objects are reused in the new vector the
      * refcount gets incremented before it gets decremented. */
@@ -1507,7 +1701,6 @@ void rewriteClientCommandVector(redisClient *c, int argc, ...) {
     c->argc = argc;
     c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
     redisAssertWithInfo(c,NULL,c->cmd != NULL);
-    va_end(ap);
 }
 
 /* Rewrite a single item in the command vector.
@@ -1538,10 +1731,22 @@ void rewriteClientCommandArgument(redisClient *c, int i, robj *newval) {
  * list node. The static reply buffer is not taken into account since it
  * is allocated anyway.
  *
+ * For slaves the part of the shared replication buffer the slave still
+ * has to receive is added as well: it is not memory owned by the slave,
+ * but it is memory that can't be released because of the slave, which is
+ * what the output buffer limits are about.
+ *
  * Note: this function is very fast so can be called as many time as
  * the caller wishes. The main usage of this function currently is
  * enforcing the client output length limits. */
 unsigned long getClientOutputBufferMemoryUsage(redisClient *c) {
+    return getClientReplyListMemoryUsage(c) +
+           (unsigned long) replicationSlavePendingBytes(c);
+}
+
+/* Like getClientOutputBufferMemoryUsage() but only accounts the memory
+ * owned by the client reply list, without the shared replication buffer. */
+unsigned long getClientReplyListMemoryUsage(redisClient *c) {
     unsigned long list_item_size = sizeof(listNode)+sizeof(robj);
 
     return c->reply_bytes + (list_item_size*listLength(c->reply));
@@ -1619,6 +1824,28 @@ int checkClientOutputBufferLimits(redisClient *c) {
     return soft || hard;
 }
 
+/* Update the memory accounted to the client buffers, that is the query
+ * buffer and the output buffers, applying the delta from the last update
+ * to the client memory category. Slaves are accounted as replication
+ * memory, all the other clients as client memory. The function is O(1) and
+ * is called every time the output buffer grows, and after reads and
+ * writes. */
+void updateClientMemUsage(redisClient *c) {
+    int cat = ((c->flags & REDIS_SLAVE) && !(c->flags & REDIS_MONITOR)) ?
+              ZMALLOC_CAT_REPLICATION : ZMALLOC_CAT_CLIENTS;
+    size_t mem = getClientReplyListMemoryUsage(c);
+
+    if (c->querybuf) mem += sdsAllocSize(c->querybuf);
+    if (cat != c->mem_cat) {
+        /* The client became a slave: move it to the new category. */
+        zmalloc_category_sub(c->mem_cat,c->mem_usage);
+        c->mem_usage = 0;
+        c->mem_cat = cat;
+    }
+    zmalloc_category_update(cat,c->mem_usage,mem);
+    c->mem_usage = mem;
+}
+
 /* Asynchronously close a client if soft or hard limit is reached on the
  * output buffer size. The caller can check if the client will be closed
  * checking if the client REDIS_CLOSE_ASAP flag is set.
@@ -1628,7 +1855,9 @@ int checkClientOutputBufferLimits(redisClient *c) {
  * lower level functions pushing data inside the client output buffers. */
 void asyncCloseClientOnOutputBufferLimitReached(redisClient *c) {
     redisAssert(c->reply_bytes < ULONG_MAX-(1024*64));
-    if (c->reply_bytes == 0 || c->flags & REDIS_CLOSE_ASAP) return;
+    updateClientMemUsage(c);
+    if ((c->reply_bytes == 0 && c->ref_repl_buf_node == NULL) ||
+        c->flags & REDIS_CLOSE_ASAP) return;
     if (checkClientOutputBufferLimits(c)) {
         sds client = catClientInfoString(sdsempty(),c);
 
@@ -1652,7 +1881,7 @@ void flushSlavesOutputBuffers(void) {
         events = aeGetFileEvents(server.el,slave->fd);
         if (events & AE_WRITABLE &&
             slave->replstate == REDIS_REPL_ONLINE &&
-            listLength(slave->reply))
+            clientHasPendingReplies(slave))
         {
             sendReplyToClient(server.el,slave->fd,slave,0);
         }
@@ -280,7 +280,7 @@ void freeHashObject(robj *o) {
 }
 
 void incrRefCount(robj *o) {
-    o->refcount++;
+    if (o->refcount != REDIS_SHARED_REFCOUNT) o->refcount++;
 }
 
 void decrRefCount(robj *o) {
@@ -296,7 +296,7 @@ void decrRefCount(robj *o) {
         }
         zfree(o);
     } else {
-        o->refcount--;
+        if (o->refcount != REDIS_SHARED_REFCOUNT) o->refcount--;
     }
 }
 
@@ -324,6 +324,15 @@ robj *resetRefCount(robj *obj) {
     return obj;
 }
 
+/* Turn 'o' into an object that is never freed and whose refcount is never
+ * modified, see REDIS_SHARED_REFCOUNT. The object is returned for
+ * convenience. */
+robj *makeObjectShared(robj *o) {
+    redisAssert(o->refcount == 1);
+    o->refcount = REDIS_SHARED_REFCOUNT;
+    return o;
+}
+
 int checkType(redisClient *c, robj *o, int type) {
     if (o->type != type) {
         addReply(c,shared.wrongtypeerr);
@@ -370,12 +379,15 @@ robj *tryObjectEncoding(robj *o) {
     len = sdslen(s);
     if (len <= 21 && string2l(s,len,&value)) {
         /* This object is encodable as a long. Try to use a shared object.
-         * Note that we avoid using shared integers when maxmemory is used
-         * because every object needs to have a private LRU field for the LRU
-         * algorithm to work well. */
+         * Note that every key needs a private LRU field for the LRU
+         * algorithm to work well: this is still possible with shared
+         * integers when they can be stored inline in the keyspace (see
+         * dbEncodeVal()), otherwise we avoid sharing when maxmemory is
+         * used with an LRU policy. */
         if ((server.maxmemory == 0 ||
              (server.maxmemory_policy != REDIS_MAXMEMORY_VOLATILE_LRU &&
-              server.maxmemory_policy != REDIS_MAXMEMORY_ALLKEYS_LRU)) &&
+              server.maxmemory_policy != REDIS_MAXMEMORY_ALLKEYS_LRU) ||
+             (unsigned long)value < REDIS_DBVAL_INLINE_MAX) &&
             value >= 0 &&
             value < REDIS_SHARED_INTEGERS)
         {
@@ -672,11 +684,17 @@ char *strEncoding(int encoding) {
 /* Given an object returns the min number of milliseconds the object was never
  * requested, using an approximated LRU algorithm. */
 unsigned long long estimateObjectIdleTime(robj *o) {
+    return estimateIdleTimeFromLRU(o->lru);
+}
+
+/* Like estimateObjectIdleTime() but using the given LRU clock value, as
+ * stored for inline values of the keyspace. */
+unsigned long long estimateIdleTimeFromLRU(unsigned int lru) {
     unsigned long long lruclock = LRU_CLOCK();
-    if (lruclock >= o->lru) {
-        return (lruclock - o->lru) * REDIS_LRU_CLOCK_RESOLUTION;
+    if (lruclock >= lru) {
+        return (lruclock - lru) * REDIS_LRU_CLOCK_RESOLUTION;
     } else {
-        return (lruclock + (REDIS_LRU_CLOCK_MAX - o->lru)) *
+        return (lruclock + (REDIS_LRU_CLOCK_MAX - lru)) *
                     REDIS_LRU_CLOCK_RESOLUTION;
     }
 }
@@ -687,7 +705,7 @@ robj *objectCommandLookup(redisClient *c, robj *key) {
     dictEntry *de;
 
     if ((de = dictFind(c->db->dict,key->ptr)) == NULL) return NULL;
-    return (robj*) dictGetVal(de);
+    return dbGetVal(de);
 }
 
 robj *objectCommandLookupOrReply(redisClient *c, robj *key, robj *reply) {
@@ -711,11 +729,357 @@ void objectCommand(redisClient *c) {
                 == NULL) return;
         addReplyBulkCString(c,strEncoding(o->encoding));
     } else if (!strcasecmp(c->argv[1]->ptr,"idletime") && c->argc == 3) {
-        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
-                == NULL) return;
-        addReplyLongLong(c,estimateObjectIdleTime(o)/1000);
+        dictEntry *de = dictFind(c->db->dict,c->argv[2]->ptr);
+
+        if (de == NULL) {
+            addReply(c,shared.nullbulk);
+            return;
+        }
+        addReplyLongLong(c,estimateIdleTimeFromLRU(dbGetValLRU(de))/1000);
     } else {
         addReplyError(c,"Syntax error. Try OBJECT (refcount|encoding|idletime)");
     }
 }
 
+
+/* ======================= The MEMORY command =============================== */
+
+/* Default number of elements sampled by MEMORY USAGE for aggregate types. */
+#define REDIS_MEMORY_USAGE_DEF_SAMPLES 5
+
+/* Return the number of bytes allocated for the string object 'o', including
+ * the object structure itself. */
+static size_t stringObjectAllocSize(robj *o) {
+    if (o->encoding == REDIS_ENCODING_RAW)
+        return zmalloc_size(o)+zmalloc_size((char*)o->ptr-sizeof(struct sdshdr));
+    /* INT and EMBSTR encoded strings are a single allocation. */
+    return zmalloc_size(o);
+}
+
+/* Return the bytes used by the hash table structure of 'd', without
+ * accounting for the keys and values referenced by the entries. */
+static size_t dictOverheadSize(dict *d) {
+    return zmalloc_size(d)+
+           sizeof(dictEntry*)*dictSlots(d)+
+           sizeof(dictEntry)*dictSize(d);
+}
+
+/* Return an estimate of the memory used by the value 'o', including the
+ * object structure. Aggregate types are estimated sampling up to
+ * 'sample_size' elements and extrapolating the average element size to
+ * the whole collection. A 'sample_size' of zero means to visit every
+ * element, with a cost proportional to the number of elements. */
+size_t objectComputeSize(robj *o, size_t sample_size) {
+    size_t asize = 0, elesize = 0, samples = 0;
+    dictIterator *di;
+    dictEntry *de;
+
+    if (o->type == REDIS_STRING) {
+        asize = stringObjectAllocSize(o);
+    } else if (o->type == REDIS_LIST) {
+        asize = zmalloc_size(o);
+        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            asize += zmalloc_size(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+            list *l = o->ptr;
+            listNode *ln = listFirst(l);
+
+            asize += zmalloc_size(l);
+            while (ln && (!sample_size || samples < sample_size)) {
+                elesize += zmalloc_size(ln)+stringObjectAllocSize(ln->value);
+                samples++;
+                ln = listNextNode(ln);
+            }
+            if (samples) asize += (double)elesize/samples*listLength(l);
+        } else {
+            redisPanic("Unknown list encoding");
+        }
+    } else if (o->type == REDIS_SET) {
+        asize = zmalloc_size(o);
+        if (o->encoding == REDIS_ENCODING_INTSET) {
+            asize += zmalloc_size(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_HT) {
+            dict *d = o->ptr;
+
+            asize += dictOverheadSize(d);
+            di = dictGetIterator(d);
+            while ((de = dictNext(di)) != NULL &&
+                   (!sample_size || samples < sample_size))
+            {
+                elesize += stringObjectAllocSize(dictGetKey(de));
+                samples++;
+            }
+            dictReleaseIterator(di);
+            if (samples) asize += (double)elesize/samples*dictSize(d);
+        } else {
+            redisPanic("Unknown set encoding");
+        }
+    } else if (o->type == REDIS_ZSET) {
+        asize = zmalloc_size(o);
+        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            asize += zmalloc_size(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_SKIPLIST) {
+            zset *zs = o->ptr;
+            zskiplist *zsl = zs->zsl;
+            zskiplistNode *zn = zsl->header->level[0].forward;
+
+            /* Elements are shared by the dict and the skiplist, so they
+             * are accounted only once while walking the skiplist. */
+            asize += zmalloc_size(zs)+dictOverheadSize(zs->dict)+
+                     zmalloc_size(zsl)+zmalloc_size(zsl->header);
+            while (zn && (!sample_size || samples < sample_size)) {
+                elesize += zmalloc_size(zn)+stringObjectAllocSize(zn->obj);
+                samples++;
+                zn = zn->level[0].forward;
+            }
+            if (samples) asize += (double)elesize/samples*zsl->length;
+        } else {
+            redisPanic("Unknown sorted set encoding");
+        }
+    } else if (o->type == REDIS_HASH) {
+        asize = zmalloc_size(o);
+        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            asize += zmalloc_size(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_HT) {
+            dict *d = o->ptr;
+
+            asize += dictOverheadSize(d);
+            di = dictGetIterator(d);
+            while ((de = dictNext(di)) != NULL &&
+                   (!sample_size || samples < sample_size))
+            {
+                elesize += stringObjectAllocSize(dictGetKey(de))+
+                           stringObjectAllocSize(dictGetVal(de));
+                samples++;
+            }
+            dictReleaseIterator(di);
+            if (samples) asize += (double)elesize/samples*dictSize(d);
+        } else {
+            redisPanic("Unknown hash encoding");
+        }
+    } else {
+        redisPanic("Unknown object type");
+    }
+    return asize;
+}
+
+/* Return the memory used by the clients in 'l', that is the query buffer,
+ * the output buffers and the client structure. When 'slaves' is true only
+ * slaves are considered, otherwise only the other clients. */
+static size_t clientsMemoryUsage(list *l, int slaves) {
+    listIter li;
+    listNode *ln;
+    size_t mem = 0;
+
+    listRewind(l,&li);
+    while((ln = listNext(&li))) {
+        redisClient *c = listNodeValue(ln);
+        int is_slave = (c->flags & REDIS_SLAVE) && !(c->flags & REDIS_MONITOR);
+
+        if (is_slave != slaves) continue;
+        mem += getClientReplyListMemoryUsage(c);
+        mem += sdsAllocSize(c->querybuf);
+        mem += sizeof(redisClient);
+    }
+    return mem;
+}
+
+/* Return a structure describing where the memory not used by the dataset
+ * is going. The computation is proportional to the number of clients and
+ * databases, not to the number of keys, so it is cheap enough to be called
+ * on a production instance. The returned structure must be released with
+ * freeMemoryOverheadData(). */
+struct redisMemOverhead *getMemoryOverheadData(void) {
+    int j;
+    size_t mem_total = 0;
+    size_t mem = 0;
+    size_t zmalloc_used = zmalloc_used_memory();
+    struct redisMemOverhead *mh = zcalloc(sizeof(*mh));
+
+    mh->total_allocated = zmalloc_used;
+    mh->startup_allocated = server.initial_memory_usage;
+    mh->peak_allocated = server.stat_peak_memory;
+    mh->fragmentation =
+        zmalloc_get_fragmentation_ratio(server.resident_set_size);
+    mem_total += server.initial_memory_usage;
+
+    /* The replication buffer is shared by the backlog and the slaves, so
+     * it is accounted only once here, and not in the slaves output
+     * buffers. */
+    mem = server.repl_buffer_mem;
+    mh->repl_backlog = mem;
+    mem_total += mem;
+
+    mh->clients_slaves = clientsMemoryUsage(server.slaves,1);
+    mem_total += mh->clients_slaves;
+
+    mh->clients_normal = clientsMemoryUsage(server.clients,0);
+    mem_total += mh->clients_normal;
+
+    mem = 0;
+    if (server.aof_state != REDIS_AOF_OFF)
+        mem += sdsAllocSize(server.aof_buf);
+    mem += aofRewriteBufferSize();
+    mh->aof_buffer = mem;
+    mem_total += mem;
+
+    mem = dictOverheadSize(server.lua_scripts);
+    mh->lua_caches = mem;
+    mem_total += mem;
+
+    /* The Lua interpreter doesn't allocate using zmalloc, so its memory is
+     * reported but not accounted in the overhead. */
+    mh->lua_vm = ((size_t)lua_gc(server.lua,LUA_GCCOUNT,0))*1024;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        long long keyscount = dictSize(db->dict);
+
+        if (keyscount == 0) continue;
+
+        mh->total_keys += keyscount;
+        mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
+        mh->db[mh->num_dbs].dbid = j;
+
+        mem = dictSize(db->dict) * sizeof(dictEntry) +
+              dictSlots(db->dict) * sizeof(dictEntry*) +
+              dictSize(db->dict) * sizeof(robj);
+        mh->db[mh->num_dbs].overhead_ht_main = mem;
+        mem_total += mem;
+
+        mem = dictSize(db->expires) * sizeof(dictEntry) +
+              dictSlots(db->expires) * sizeof(dictEntry*);
+        mh->db[mh->num_dbs].overhead_ht_expires = mem;
+        mem_total += mem;
+
+        mh->num_dbs++;
+    }
+
+    mh->overhead_total = mem_total;
+    mh->dataset = zmalloc_used > mem_total ? zmalloc_used - mem_total : 0;
+    if (mh->peak_allocated)
+        mh->peak_perc = (float)zmalloc_used*100/mh->peak_allocated;
+
+    /* Metrics computed after subtracting the startup memory from
+     * the total memory. */
+    if (zmalloc_used > mh->startup_allocated) {
+        size_t net_usage = zmalloc_used - mh->startup_allocated;
+
+        mh->dataset_perc = (float)mh->dataset*100/net_usage;
+        if (mh->total_keys) mh->bytes_per_key = net_usage / mh->total_keys;
+    }
+    return mh;
+}
+
+void freeMemoryOverheadData(struct redisMemOverhead *mh) {
+    zfree(mh->db);
+    zfree(mh);
+}
+
+/* The memory command allows to inspect the memory used by single keys
+ * and where the memory not used by the dataset is going.
+ * Usage: MEMORY USAGE <key> [SAMPLES <count>]
+ *        MEMORY STATS */
+void memoryCommand(redisClient *c) {
+    if (!strcasecmp(c->argv[1]->ptr,"usage") && c->argc >= 3) {
+        long long samples = REDIS_MEMORY_USAGE_DEF_SAMPLES;
+        dictEntry *de;
+        size_t usage;
+        int j;
+
+        for (j = 3; j < c->argc; j++) {
+            if (!strcasecmp(c->argv[j]->ptr,"samples") && j+1 < c->argc) {
+                if (getLongLongFromObjectOrReply(c,c->argv[j+1],&samples,NULL)
+                    == REDIS_ERR) return;
+                if (samples < 0) {
+                    addReply(c,shared.syntaxerr);
+                    return;
+                }
+                j++;
+            } else {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+            addReply(c,shared.nullbulk);
+            return;
+        }
+        /* Inline integers don't use any memory beyond the dict entry. */
+        usage = dbValIsInline(dictGetVal(de)) ? 0 :
+                objectComputeSize(dictGetVal(de),samples);
+        usage += sdsAllocSize(dictGetKey(de));
+        usage += sizeof(dictEntry);
+        addReplyLongLong(c,usage);
+    } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
+        struct redisMemOverhead *mh = getMemoryOverheadData();
+        size_t j;
+
+        addReplyMultiBulkLen(c,(16+mh->num_dbs)*2);
+
+        addReplyBulkCString(c,"peak.allocated");
+        addReplyLongLong(c,mh->peak_allocated);
+
+        addReplyBulkCString(c,"total.allocated");
+        addReplyLongLong(c,mh->total_allocated);
+
+        addReplyBulkCString(c,"startup.allocated");
+        addReplyLongLong(c,mh->startup_allocated);
+
+        addReplyBulkCString(c,"replication.backlog");
+        addReplyLongLong(c,mh->repl_backlog);
+
+        addReplyBulkCString(c,"clients.slaves");
+        addReplyLongLong(c,mh->clients_slaves);
+
+        addReplyBulkCString(c,"clients.normal");
+        addReplyLongLong(c,mh->clients_normal);
+
+        addReplyBulkCString(c,"aof.buffer");
+        addReplyLongLong(c,mh->aof_buffer);
+
+        addReplyBulkCString(c,"lua.caches");
+        addReplyLongLong(c,mh->lua_caches);
+
+        addReplyBulkCString(c,"lua.vm");
+        addReplyLongLong(c,mh->lua_vm);
+
+        for (j = 0; j < mh->num_dbs; j++) {
+            char dbname[32];
+            snprintf(dbname,sizeof(dbname),"db.%zu",mh->db[j].dbid);
+            addReplyBulkCString(c,dbname);
+            addReplyMultiBulkLen(c,4);
+
+            addReplyBulkCString(c,"overhead.hashtable.main");
+            addReplyLongLong(c,mh->db[j].overhead_ht_main);
+
+            addReplyBulkCString(c,"overhead.hashtable.expires");
+            addReplyLongLong(c,mh->db[j].overhead_ht_expires);
+        }
+
+        addReplyBulkCString(c,"overhead.total");
+        addReplyLongLong(c,mh->overhead_total);
+
+        addReplyBulkCString(c,"keys.count");
+        addReplyLongLong(c,mh->total_keys);
+
+        addReplyBulkCString(c,"keys.bytes-per-key");
+        addReplyLongLong(c,mh->bytes_per_key);
+
+        addReplyBulkCString(c,"dataset.bytes");
+        addReplyLongLong(c,mh->dataset);
+
+        addReplyBulkCString(c,"dataset.percentage");
+        addReplyDouble(c,mh->dataset_perc);
+
+        addReplyBulkCString(c,"peak.percentage");
+        addReplyDouble(c,mh->peak_perc);
+
+        addReplyBulkCString(c,"fragmentation");
+        addReplyDouble(c,mh->fragmentation);
+
+        freeMemoryOverheadData(mh);
+    } else {
+        addReplyError(c,"Syntax error. Try MEMORY (usage <key> [samples <count>]|stats)");
+    }
+}
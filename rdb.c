@@ -31,6 +31,12 @@
 #include "lzf.h"    /* LZF compression library */
 #include "zipmap.h"
 #include "endianconv.h"
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
 #include <math.h>
 #include <sys/types.h>
@@ -181,8 +187,10 @@ robj *rdbLoadIntegerObject(rio *rdb, int enctype, int encode) {
         v = enc[0]|(enc[1]<<8)|(enc[2]<<16)|(enc[3]<<24);
         val = (int32_t)v;
     } else {
-        val = 0; /* anti-warning */
-        redisPanic("Unknown RDB integer encoding type");
+        /* Corrupted payload: let the caller handle it as a load error,
+         * so that REDIS_RDB_LOAD_NOFATAL loaders can survive it. */
+        redisLog(REDIS_WARNING,"Unknown RDB integer encoding type %d",enctype);
+        return NULL;
     }
     if (encode)
         return createStringObjectFromLongLong(val);
@@ -209,10 +217,31 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-int rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
-    size_t comprlen, outlen;
+/* Write a compressed string as [enctype][compressed len][len][data]. */
+static int rdbSaveCompressedString(rio *rdb, int enctype, void *out,
+                                   size_t comprlen, size_t len)
+{
     unsigned char byte;
     int n, nwritten = 0;
+
+    byte = (REDIS_RDB_ENCVAL<<6)|enctype;
+    if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) return -1;
+    nwritten += n;
+
+    if ((n = rdbSaveLen(rdb,comprlen)) == -1) return -1;
+    nwritten += n;
+
+    if ((n = rdbSaveLen(rdb,len)) == -1) return -1;
+    nwritten += n;
+
+    if ((n = rdbWriteRaw(rdb,out,comprlen)) == -1) return -1;
+    nwritten += n;
+    return nwritten;
+}
+
+int rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+    size_t comprlen, outlen;
+    int n;
     void *out;
 
     /* We require at least four bytes compression for this to be worth it */
@@ -225,28 +254,147 @@ int rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
         return 0;
     }
     /* Data compressed! Let's save it on disk */
-    byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_LZF;
-    if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
-    nwritten += n;
+    n = rdbSaveCompressedString(rdb,REDIS_RDB_ENC_LZF,out,comprlen,len);
+    zfree(out);
+    return n;
+}
 
-    if ((n = rdbSaveLen(rdb,comprlen)) == -1) goto writeerr;
-    nwritten += n;
+#ifdef USE_LZ4
+int rdbSaveLz4StringObject(rio *rdb, unsigned char *s, size_t len) {
+    int comprlen, outlen, n;
+    void *out;
 
-    if ((n = rdbSaveLen(rdb,len)) == -1) goto writeerr;
-    nwritten += n;
+    if (len <= 4 || len > LZ4_MAX_INPUT_SIZE) return 0;
+    outlen = LZ4_compressBound(len);
+    out = zmalloc(outlen);
+    comprlen = LZ4_compress_default((char*)s,out,len,outlen);
+    /* Like for LZF, require at least four bytes compression. */
+    if (comprlen <= 0 || (size_t)comprlen >= len-4) {
+        zfree(out);
+        return 0;
+    }
+    n = rdbSaveCompressedString(rdb,REDIS_RDB_ENC_LZ4,out,comprlen,len);
+    zfree(out);
+    return n;
+}
+#endif
 
-    if ((n = rdbWriteRaw(rdb,out,comprlen)) == -1) goto writeerr;
-    nwritten += n;
+#ifdef USE_ZSTD
+/* Content of rdb-zstd-dictionary, if any, and the same dictionary digested
+ * for decompression. Both are read only once created, so they are shared by
+ * all the threads (de)compressing. */
+static sds rdb_zstd_dict = NULL;
+static ZSTD_DDict *rdb_zstd_ddict = NULL;
+
+/* Every thread (de)compressing strings (the main thread, the RDB save
+ * workers, the loading thread, ...) keeps its own zstd contexts instead of
+ * creating them again for every string. The compression context also holds
+ * the dictionary digested for the level in use: it is loaded again when
+ * rdb-zstd-level is changed with CONFIG SET. */
+typedef struct rdbZstdThreadCtx {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    int level;          /* Level 'cctx' is configured for, 0 if none yet. */
+} rdbZstdThreadCtx;
+
+static pthread_key_t rdb_zstd_key;
+static pthread_once_t rdb_zstd_key_once = PTHREAD_ONCE_INIT;
+
+/* Called by the thread library when a thread owning contexts exits. */
+static void rdbZstdFreeThreadCtx(void *ptr) {
+    rdbZstdThreadCtx *tc = ptr;
+
+    ZSTD_freeCCtx(tc->cctx);
+    ZSTD_freeDCtx(tc->dctx);
+    zfree(tc);
+}
 
-    zfree(out);
-    return nwritten;
+static void rdbZstdCreateKey(void) {
+    pthread_key_create(&rdb_zstd_key,rdbZstdFreeThreadCtx);
+}
+
+static rdbZstdThreadCtx *rdbZstdGetThreadCtx(void) {
+    rdbZstdThreadCtx *tc;
 
-writeerr:
+    pthread_once(&rdb_zstd_key_once,rdbZstdCreateKey);
+    if ((tc = pthread_getspecific(rdb_zstd_key)) == NULL) {
+        tc = zmalloc(sizeof(*tc));
+        tc->cctx = ZSTD_createCCtx();
+        tc->dctx = ZSTD_createDCtx();
+        tc->level = 0;
+        pthread_setspecific(rdb_zstd_key,tc);
+    }
+    return tc;
+}
+
+int rdbSaveZstdStringObject(rio *rdb, unsigned char *s, size_t len) {
+    rdbZstdThreadCtx *tc = rdbZstdGetThreadCtx();
+    int level = server.rdb_zstd_level;
+    size_t comprlen, outlen;
+    int n;
+    void *out;
+
+    if (len <= 4) return 0;
+    if (tc->level != level) {
+        /* Resetting the parameters also drops the dictionary digested for
+         * the old level: zstd digests it again on the next compression. */
+        ZSTD_CCtx_reset(tc->cctx,ZSTD_reset_parameters);
+        ZSTD_CCtx_setParameter(tc->cctx,ZSTD_c_compressionLevel,level);
+        if (rdb_zstd_dict)
+            ZSTD_CCtx_loadDictionary(tc->cctx,rdb_zstd_dict,
+                                     sdslen(rdb_zstd_dict));
+        tc->level = level;
+    }
+    outlen = ZSTD_compressBound(len);
+    out = zmalloc(outlen);
+    comprlen = ZSTD_compress2(tc->cctx,out,outlen,s,len);
+    /* Like for LZF, require at least four bytes compression. */
+    if (ZSTD_isError(comprlen) || comprlen >= len-4) {
+        zfree(out);
+        return 0;
+    }
+    n = rdbSaveCompressedString(rdb,REDIS_RDB_ENC_ZSTD,out,comprlen,len);
     zfree(out);
-    return -1;
+    return n;
+}
+#endif
+
+/* Load the dictionary configured with rdb-zstd-dictionary, if any. Called
+ * at startup. Returns REDIS_ERR if the file can't be used. */
+int rdbInitCompression(void) {
+#ifdef USE_ZSTD
+    FILE *fp;
+    sds buf;
+    size_t nread;
+    char chunk[4096];
+
+    if (server.rdb_zstd_dict_file == NULL) return REDIS_OK;
+    if ((fp = fopen(server.rdb_zstd_dict_file,"r")) == NULL) {
+        redisLog(REDIS_WARNING,"Can't open the zstd dictionary %s: %s",
+            server.rdb_zstd_dict_file, strerror(errno));
+        return REDIS_ERR;
+    }
+    buf = sdsempty();
+    while((nread = fread(chunk,1,sizeof(chunk),fp)) > 0)
+        buf = sdscatlen(buf,chunk,nread);
+    fclose(fp);
+    rdb_zstd_dict = buf;
+    rdb_zstd_ddict = ZSTD_createDDict(buf,sdslen(buf));
+    if (!rdb_zstd_ddict) {
+        redisLog(REDIS_WARNING,"Invalid zstd dictionary %s",
+            server.rdb_zstd_dict_file);
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE,"Using zstd dictionary %s (id %u)",
+        server.rdb_zstd_dict_file, ZSTD_getDictID_fromDDict(rdb_zstd_ddict));
+#endif
+    return REDIS_OK;
 }
 
-robj *rdbLoadLzfStringObject(rio *rdb) {
+/* Load a string compressed with the algorithm 'enctype'. NULL is returned
+ * on read errors, corrupted data, or if the algorithm is not supported by
+ * this build, so that RESTORE can fail without crashing the server. */
+robj *rdbLoadCompressedStringObject(rio *rdb, int enctype) {
     unsigned int len, clen;
     unsigned char *c = NULL;
     sds val = NULL;
@@ -256,7 +404,38 @@ robj *rdbLoadLzfStringObject(rio *rdb) {
     if ((c = zmalloc(clen)) == NULL) goto err;
     if ((val = sdsnewlen(NULL,len)) == NULL) goto err;
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) goto err;
+    switch(enctype) {
+    case REDIS_RDB_ENC_LZF:
+        if (lzf_decompress(c,clen,val,len) == 0) goto err;
+        break;
+#ifdef USE_LZ4
+    case REDIS_RDB_ENC_LZ4:
+        if (LZ4_decompress_safe((char*)c,val,clen,len) != (int)len)
+            goto err;
+        break;
+#endif
+#ifdef USE_ZSTD
+    case REDIS_RDB_ENC_ZSTD:
+    {
+        rdbZstdThreadCtx *tc = rdbZstdGetThreadCtx();
+        size_t retval;
+
+        if (rdb_zstd_ddict) {
+            retval = ZSTD_decompress_usingDDict(tc->dctx,val,len,c,clen,
+                                                rdb_zstd_ddict);
+        } else {
+            retval = ZSTD_decompressDCtx(tc->dctx,val,len,c,clen);
+        }
+        if (ZSTD_isError(retval) || retval != len) goto err;
+        break;
+    }
+#endif
+    default:
+        redisLog(REDIS_WARNING,
+            "RDB string compressed with an algorithm not supported by this "
+            "build (encoding %d)", enctype);
+        goto err;
+    }
     zfree(c);
     return createObject(REDIS_STRING,val);
 err:
@@ -280,10 +459,24 @@ int rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
+    /* Try compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
     if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+        switch(server.rdb_compression_algo) {
+#ifdef USE_LZ4
+        case REDIS_RDB_COMPRESS_LZ4:
+            n = rdbSaveLz4StringObject(rdb,s,len);
+            break;
+#endif
+#ifdef USE_ZSTD
+        case REDIS_RDB_COMPRESS_ZSTD:
+            n = rdbSaveZstdStringObject(rdb,s,len);
+            break;
+#endif
+        default:
+            n = rdbSaveLzfStringObject(rdb,s,len);
+            break;
+        }
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -343,9 +536,12 @@ robj *rdbGenericLoadStringObject(rio *rdb, int encode) {
         case REDIS_RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,encode);
         case REDIS_RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb);
+        case REDIS_RDB_ENC_LZ4:
+        case REDIS_RDB_ENC_ZSTD:
+            return rdbLoadCompressedStringObject(rdb,len);
         default:
-            redisPanic("Unknown RDB encoding type");
+            redisLog(REDIS_WARNING,"Unknown RDB encoding type %u",len);
+            return NULL;
         }
     }
 
@@ -627,6 +823,328 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val,
     return 1;
 }
 
+/* -----------------------------------------------------------------------------
+ * Parallel serialization of the dataset
+ *
+ * When rdb-save-threads is greater than one, rdbSaveRio() groups consecutive
+ * key-value pairs into batches that are serialized (and LZF compressed) by a
+ * pool of worker threads into memory buffers. The buffers are written to the
+ * target rio in the same order the batches were created, so the output is
+ * exactly the one produced by a single thread, checksum included.
+ *
+ * This is safe since serializing an object never modifies it: the workers
+ * only read the dataset, while the dictionaries (where a lookup may perform
+ * a rehashing step) are only accessed by the thread calling rdbSaveRio().
+ * -------------------------------------------------------------------------- */
+
+#define RDB_SAVE_BATCH_BYTES (1024*256) /* Estimated bytes per batch. */
+#define RDB_SAVE_BATCH_KEYS 1024        /* Max key-value pairs per batch. */
+#define RDB_SAVE_JOBS_PER_THREAD 4      /* Batches in flight per worker. */
+
+typedef struct rdbSaveJob {
+    int numkeys;
+    sds keys[RDB_SAVE_BATCH_KEYS];
+    robj *vals[RDB_SAVE_BATCH_KEYS];
+    long long expires[RDB_SAVE_BATCH_KEYS];
+    size_t size;        /* Estimated serialized size of the batch. */
+    sds buf;            /* Serialized batch, filled by the worker. */
+    int done;           /* True when 'buf' is ready to be written. */
+} rdbSaveJob;
+
+typedef struct rdbSavePool {
+    pthread_t *threads;
+    int numthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t newjob;      /* Signaled when a batch is submitted. */
+    pthread_cond_t jobdone;     /* Signaled when a batch is serialized. */
+    rdbSaveJob *jobs;           /* Ring buffer of batches. */
+    int numjobs;
+    unsigned long submitted;    /* Batches handed to the workers. */
+    unsigned long picked;       /* Batches taken by a worker. */
+    unsigned long written;      /* Batches written to the target rio. */
+    long long now;              /* Keys expired before 'now' are skipped. */
+    int shutdown;               /* Tell the workers to exit. */
+} rdbSavePool;
+
+/* Return a rough estimate of the serialized size of 'o', used to size
+ * the batches. It must be cheap, so aggregate values encoded with a hash
+ * table, skiplist or linked list are estimated by their cardinality. */
+static size_t rdbEstimateObjectSize(robj *o) {
+    switch(o->encoding) {
+    case REDIS_ENCODING_RAW:
+    case REDIS_ENCODING_EMBSTR:
+        return sdslen(o->ptr);
+    case REDIS_ENCODING_INT:
+        return 8;
+    case REDIS_ENCODING_ZIPLIST:
+        return ziplistBlobLen(o->ptr);
+    case REDIS_ENCODING_INTSET:
+        return intsetBlobLen(o->ptr);
+    case REDIS_ENCODING_LINKEDLIST:
+        return listLength((list*)o->ptr)*16;
+    case REDIS_ENCODING_HT:
+        return dictSize((dict*)o->ptr)*(o->type == REDIS_HASH ? 32 : 16);
+    case REDIS_ENCODING_SKIPLIST:
+        return dictSize(((zset*)o->ptr)->dict)*24;
+    default:
+        return 16;
+    }
+}
+
+static void *rdbSaveWorkerMain(void *arg) {
+    rdbSavePool *pool = arg;
+
+    while(1) {
+        rdbSaveJob *job;
+        rio r;
+        int j;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->picked == pool->submitted && !pool->shutdown)
+            pthread_cond_wait(&pool->newjob,&pool->lock);
+        if (pool->picked == pool->submitted) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        job = pool->jobs+(pool->picked++ % pool->numjobs);
+        pthread_mutex_unlock(&pool->lock);
+
+        /* Writing to a memory buffer can't fail. */
+        rioInitWithBuffer(&r,job->buf);
+        for (j = 0; j < job->numkeys; j++) {
+            robj key;
+
+            initStaticStringObject(key,job->keys[j]);
+            if (rdbSaveKeyValuePair(&r,&key,job->vals[j],job->expires[j],
+                                    pool->now) == -1)
+                redisPanic("Error serializing a key in an RDB save worker");
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->buf = r.io.buffer.ptr;
+        job->done = 1;
+        pthread_cond_signal(&pool->jobdone);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Stop the workers of 'pool' and release it. Batches not yet written are
+ * discarded, so this should be called after rdbSavePoolFlush() unless
+ * the save is being aborted. */
+static void rdbSavePoolRelease(rdbSavePool *pool) {
+    int j;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->newjob);
+    pthread_mutex_unlock(&pool->lock);
+    for (j = 0; j < pool->numthreads; j++)
+        pthread_join(pool->threads[j],NULL);
+    for (j = 0; j < pool->numjobs; j++)
+        sdsfree(pool->jobs[j].buf);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->newjob);
+    pthread_cond_destroy(&pool->jobdone);
+    zfree(pool->jobs);
+    zfree(pool->threads);
+    zfree(pool);
+}
+
+/* Create a pool of 'numthreads' workers. NULL is returned if the threads
+ * can't be created, in which case the caller should save serially. */
+static rdbSavePool *rdbSavePoolCreate(int numthreads, long long now) {
+    rdbSavePool *pool = zcalloc(sizeof(*pool));
+    int j;
+
+    pool->numjobs = numthreads*RDB_SAVE_JOBS_PER_THREAD;
+    pool->jobs = zcalloc(sizeof(rdbSaveJob)*pool->numjobs);
+    for (j = 0; j < pool->numjobs; j++)
+        pool->jobs[j].buf = sdsempty();
+    pool->threads = zmalloc(sizeof(pthread_t)*numthreads);
+    pool->now = now;
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->newjob,NULL);
+    pthread_cond_init(&pool->jobdone,NULL);
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&pool->threads[j],NULL,rdbSaveWorkerMain,pool)
+            != 0) {
+            redisLog(REDIS_WARNING,
+                "Can't create RDB save worker threads: %s", strerror(errno));
+            rdbSavePoolRelease(pool);
+            return NULL;
+        }
+        pool->numthreads++;
+    }
+    return pool;
+}
+
+/* Wait for the oldest batch to be serialized and write it to 'rdb'.
+ * Returns -1 on write error. */
+static int rdbSavePoolWriteNext(rdbSavePool *pool, rio *rdb) {
+    rdbSaveJob *job = pool->jobs+(pool->written % pool->numjobs);
+    int retval = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done) pthread_cond_wait(&pool->jobdone,&pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (sdslen(job->buf) && rioWrite(rdb,job->buf,sdslen(job->buf)) == 0)
+        retval = -1;
+    /* Reuse the buffer unless it grew too much. */
+    if (sdsAllocSize(job->buf) > RDB_SAVE_BATCH_BYTES*4) {
+        sdsfree(job->buf);
+        job->buf = sdsempty();
+    } else {
+        sdsclear(job->buf);
+    }
+    job->numkeys = 0;
+    job->size = 0;
+    job->done = 0;
+    pool->written++;
+    return retval;
+}
+
+/* Hand the batch being filled to the workers, and write the batches that
+ * are already serialized. If all the batches are in flight wait for the
+ * oldest one, so that the next batch to fill is always free. */
+static int rdbSavePoolSubmit(rdbSavePool *pool, rio *rdb) {
+    int done;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->submitted++;
+    pthread_cond_signal(&pool->newjob);
+    pthread_mutex_unlock(&pool->lock);
+
+    while (pool->written < pool->submitted) {
+        pthread_mutex_lock(&pool->lock);
+        done = pool->jobs[pool->written % pool->numjobs].done;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!done && pool->submitted - pool->written < (unsigned)pool->numjobs)
+            break;
+        if (rdbSavePoolWriteNext(pool,rdb) == -1) return -1;
+    }
+    return 0;
+}
+
+/* Add a key-value pair to the batch being filled. Returns -1 on error. */
+static int rdbSavePoolAddKey(rdbSavePool *pool, rio *rdb, sds key, robj *val,
+                             long long expire)
+{
+    rdbSaveJob *job = pool->jobs+(pool->submitted % pool->numjobs);
+
+    job->keys[job->numkeys] = key;
+    job->vals[job->numkeys] = val;
+    job->expires[job->numkeys] = expire;
+    job->numkeys++;
+    job->size += sdslen(key)+rdbEstimateObjectSize(val);
+    if (job->numkeys == RDB_SAVE_BATCH_KEYS ||
+        job->size >= RDB_SAVE_BATCH_BYTES)
+        return rdbSavePoolSubmit(pool,rdb);
+    return 0;
+}
+
+/* Submit the batch being filled, if any, and write all the pending
+ * batches to 'rdb'. Returns -1 on error. */
+static int rdbSavePoolFlush(rdbSavePool *pool, rio *rdb) {
+    rdbSaveJob *job = pool->jobs+(pool->submitted % pool->numjobs);
+
+    if (job->numkeys && rdbSavePoolSubmit(pool,rdb) == -1) return -1;
+    while (pool->written < pool->submitted)
+        if (rdbSavePoolWriteNext(pool,rdb) == -1) return -1;
+    return 0;
+}
+
+/* Save an auxiliary field, a key/value pair of strings describing the
+ * RDB file itself. Loaders skip the fields they don't know about. */
+static int rdbSaveAuxField(rio *rdb, char *key, char *val, size_t vallen) {
+    if (rdbSaveType(rdb,REDIS_RDB_OPCODE_AUX) == -1) return -1;
+    if (rdbSaveRawString(rdb,(unsigned char*)key,strlen(key)) == -1)
+        return -1;
+    if (rdbSaveRawString(rdb,(unsigned char*)val,vallen) == -1) return -1;
+    return 1;
+}
+
+static int rdbSaveAuxFieldStrInt(rio *rdb, char *key, long long val) {
+    char buf[REDIS_LONGSTR_SIZE];
+    int len = ll2string(buf,sizeof(buf),val);
+
+    return rdbSaveAuxField(rdb,key,buf,len);
+}
+
+/* Save the auxiliary fields. If the instance takes part in replication we
+ * also save the replication ID and offset the dataset corresponds to, and
+ * the DB selected by the replication stream at that offset, so that a
+ * slave restarted from this file can partially resynchronize with its
+ * master. The scripts cache is saved as well in this case, since the
+ * master may send EVALSHA for scripts the slave already received.
+ *
+ * The RDB is saved by a child process, or by the snapshot thread that
+ * saves the dataset as it was when it started, so all this state is
+ * consistent with the dataset saved. Returns -1 on error. */
+static int rdbSaveInfoAuxFields(rio *rdb) {
+    dictIterator *di;
+    dictEntry *de;
+    int stream_db;
+
+    if (rdbSaveAuxField(rdb,"redis-ver",REDIS_VERSION,
+                        strlen(REDIS_VERSION)) == -1) return -1;
+    if (rdbSaveAuxFieldStrInt(rdb,"ctime",time(NULL)) == -1) return -1;
+
+    if (server.masterhost == NULL) {
+        /* Without a backlog the offset is not updated by writes. */
+        if (server.repl_backlog == NULL) return 1;
+        stream_db = (server.slaveseldb == -1) ? 0 : server.slaveseldb;
+    } else if (server.master) {
+        stream_db = server.master->db->id;
+    } else if (server.cached_master) {
+        stream_db = server.cached_master->db->id;
+    } else {
+        return 1;
+    }
+    if (rdbSaveAuxField(rdb,"repl-id",server.replid,
+                        REDIS_RUN_ID_SIZE) == -1) return -1;
+    if (rdbSaveAuxFieldStrInt(rdb,"repl-offset",
+                              server.master_repl_offset) == -1) return -1;
+    if (rdbSaveAuxFieldStrInt(rdb,"repl-stream-db",stream_db) == -1)
+        return -1;
+
+    di = dictGetIterator(server.lua_scripts);
+    while((de = dictNext(di)) != NULL) {
+        robj *body = dictGetVal(de);
+
+        if (rdbSaveAuxField(rdb,"lua",body->ptr,sdslen(body->ptr)) == -1) {
+            dictReleaseIterator(di);
+            return -1;
+        }
+    }
+    dictReleaseIterator(di);
+    return 1;
+}
+
+/* Write the magic string and the version of the format, followed by the
+ * auxiliary fields. Returns -1 on error. */
+int rdbSaveHeader(rio *rdb) {
+    char magic[10];
+
+    snprintf(magic,sizeof(magic),"REDIS%04d",REDIS_RDB_VERSION);
+    if (rdbWriteRaw(rdb,magic,9) == -1) return -1;
+    return rdbSaveInfoAuxFields(rdb);
+}
+
+/* Write the EOF opcode, followed by the CRC64 checksum of what was written
+ * to 'rdb' so far. It will be zero if checksum computation is disabled, the
+ * loading code skips the check in this case. Returns -1 on error. */
+int rdbSaveFooter(rio *rdb) {
+    uint64_t cksum;
+
+    if (rdbSaveType(rdb,REDIS_RDB_OPCODE_EOF) == -1) return -1;
+    cksum = rdb->cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(rdb,&cksum,8) == 0) return -1;
+    return 1;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success REDIS_OK is returned, otherwise REDIS_ERR
  * is returned and part of the output, or all the output, can be
@@ -634,19 +1152,26 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val,
  *
  * When the function returns REDIS_ERR and if 'error' is not NULL, the
  * integer pointed by 'error' is set to the value of errno just after the I/O
- * error. */
-int rdbSaveRio(rio *rdb, int *error) {
+ * error.
+ *
+ * With the REDIS_RDB_SAVE_AOF_PREAMBLE flag the RDB is the first part of an
+ * AOF being rewritten, so the diffs accumulated by the parent are read from
+ * time to time like rewriteAppendOnlyFile() does. */
+int rdbSaveRio(rio *rdb, int *error, int flags) {
     dictIterator *di = NULL;
     dictEntry *de;
-    char magic[10];
     int j;
     long long now = mstime();
-    uint64_t cksum;
+    size_t processed = 0;
+    unsigned long keys = 0;
+    rdbSavePool *pool = NULL;
 
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
-    snprintf(magic,sizeof(magic),"REDIS%04d",REDIS_RDB_VERSION);
-    if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
+    if (rdbSaveHeader(rdb) == -1) goto werr;
+
+    if (server.rdb_save_threads > 1)
+        pool = rdbSavePoolCreate(server.rdb_save_threads,now);
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
@@ -659,32 +1184,54 @@ int rdbSaveRio(rio *rdb, int *error) {
         if (rdbSaveType(rdb,REDIS_RDB_OPCODE_SELECTDB) == -1) goto werr;
         if (rdbSaveLen(rdb,j) == -1) goto werr;
 
+        /* Write the RESIZE DB opcode, so that the loader can create the
+         * hash tables of the DB with the right size upfront, instead of
+         * growing them through many rehashing steps. */
+        if (rdbSaveType(rdb,REDIS_RDB_OPCODE_RESIZEDB) == -1) goto werr;
+        if (rdbSaveLen(rdb,dictSize(db->dict)) == -1) goto werr;
+        if (rdbSaveLen(rdb,dictSize(db->expires)) == -1) goto werr;
+
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
             sds keystr = dictGetKey(de);
-            robj key, *o = dictGetVal(de);
+            robj key, *o = dbGetVal(de);
             long long expire;
 
             initStaticStringObject(key,keystr);
             expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(rdb,&key,o,expire,now) == -1) goto werr;
+            if (pool) {
+                if (rdbSavePoolAddKey(pool,rdb,keystr,o,expire) == -1)
+                    goto werr;
+            } else {
+                if (rdbSaveKeyValuePair(rdb,&key,o,expire,now) == -1)
+                    goto werr;
+            }
+            if (flags & REDIS_RDB_SAVE_AOF_PREAMBLE &&
+                rdb->processed_bytes >
+                processed+REDIS_AOF_READ_DIFF_INTERVAL_BYTES)
+            {
+                processed = rdb->processed_bytes;
+                aofReadDiffFromParent();
+            }
+            /* Report the copy-on-write of the child to the parent. */
+            if ((++keys & 1023) == 0) sendChildCOWInfo(0,NULL);
         }
+        /* Write the pending batches before the next SELECT DB opcode. */
+        if (pool && rdbSavePoolFlush(pool,rdb) == -1) goto werr;
         dictReleaseIterator(di);
     }
     di = NULL; /* So that we don't release it again on error. */
+    if (pool) {
+        rdbSavePoolRelease(pool);
+        pool = NULL;
+    }
 
-    /* EOF opcode */
-    if (rdbSaveType(rdb,REDIS_RDB_OPCODE_EOF) == -1) goto werr;
-
-    /* CRC64 checksum. It will be zero if checksum computation is disabled, the
-     * loading code skips the check in this case. */
-    cksum = rdb->cksum;
-    memrev64ifbe(&cksum);
-    if (rioWrite(rdb,&cksum,8) == 0) goto werr;
+    if (rdbSaveFooter(rdb) == -1) goto werr;
     return REDIS_OK;
 
 werr:
     if (error) *error = errno;
+    if (pool) rdbSavePoolRelease(pool);
     if (di) dictReleaseIterator(di);
     return REDIS_ERR;
 }
@@ -696,8 +1243,11 @@ werr:
  *
  * While the suffix is the 40 bytes hex string we announced in the prefix.
  * This way processes receiving the payload can understand when it ends
- * without doing any processing of the content. */
-int rdbSaveRioWithEOFMark(rio *rdb, int *error) {
+ * without doing any processing of the content.
+ *
+ * If 'lzf' is not NULL, the rio is a file descriptors set target, and the
+ * payload is sent as LZF frames to the file descriptors flagged there. */
+int rdbSaveRioWithEOFMark(rio *rdb, int *error, int *lzf) {
     char eofmark[REDIS_EOF_MARK_SIZE];
 
     getRandomHexChars(eofmark,REDIS_EOF_MARK_SIZE);
@@ -705,7 +1255,10 @@ int rdbSaveRioWithEOFMark(rio *rdb, int *error) {
     if (rioWrite(rdb,"$EOF:",5) == 0) goto werr;
     if (rioWrite(rdb,eofmark,REDIS_EOF_MARK_SIZE) == 0) goto werr;
     if (rioWrite(rdb,"\r\n",2) == 0) goto werr;
-    if (rdbSaveRio(rdb,error) == REDIS_ERR) goto werr;
+    /* Slaves with a LZF link read the preamble in clear, and the frames
+     * start with the payload. */
+    if (lzf && rioFdsetSetLzf(rdb,lzf) == 0) goto werr;
+    if (rdbSaveRio(rdb,error,REDIS_RDB_SAVE_NONE) == REDIS_ERR) goto werr;
     if (rioWrite(rdb,eofmark,REDIS_EOF_MARK_SIZE) == 0) goto werr;
     return REDIS_OK;
 
@@ -731,7 +1284,7 @@ int rdbSave(char *filename) {
     }
 
     rioInitWithFile(&rdb,fp);
-    if (rdbSaveRio(&rdb,&error) == REDIS_ERR) {
+    if (rdbSaveRio(&rdb,&error,REDIS_RDB_SAVE_NONE) == REDIS_ERR) {
         errno = error;
         goto werr;
     }
@@ -765,28 +1318,22 @@ int rdbSaveBackground(char *filename) {
     pid_t childpid;
     long long start;
 
-    if (server.rdb_child_pid != -1) return REDIS_ERR;
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) return REDIS_ERR;
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
 
+    openChildInfoPipe();
     start = ustime();
     if ((childpid = fork()) == 0) {
         int retval;
 
         /* Child */
+        server.in_fork_child = REDIS_CHILD_INFO_TYPE_RDB;
         closeListeningSockets(0);
         redisSetProcTitle("redis-rdb-bgsave");
         retval = rdbSave(filename);
-        if (retval == REDIS_OK) {
-            size_t private_dirty = zmalloc_get_private_dirty();
-
-            if (private_dirty) {
-                redisLog(REDIS_NOTICE,
-                    "RDB: %zu MB of memory used by copy-on-write",
-                    private_dirty/(1024*1024));
-            }
-        }
+        if (retval == REDIS_OK) sendChildCOWInfo(1,"RDB");
         exitFromChild((retval == REDIS_OK) ? 0 : 1);
     } else {
         /* Parent */
@@ -797,6 +1344,7 @@ int rdbSaveBackground(char *filename) {
             server.lastbgsave_status = REDIS_ERR;
             redisLog(REDIS_WARNING,"Can't save in background: fork: %s",
                 strerror(errno));
+            if (server.aof_child_pid == -1) closeChildInfoPipe();
             return REDIS_ERR;
         }
         redisLog(REDIS_NOTICE,"Background saving started by pid %d",childpid);
@@ -987,9 +1535,16 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             field = tryObjectEncoding(field);
             value = tryObjectEncoding(value);
 
-            /* Add pair to hash table */
+            /* Add pair to hash table. A duplicated field can only come
+             * from a corrupted payload. */
             ret = dictAdd((dict*)o->ptr, field, value);
-            redisAssert(ret == DICT_OK);
+            if (ret != DICT_OK) {
+                redisLog(REDIS_WARNING,"Duplicated hash field loading DB");
+                decrRefCount(field);
+                decrRefCount(value);
+                decrRefCount(o);
+                return NULL;
+            }
         }
 
         /* All pairs should be read by now */
@@ -1070,11 +1625,15 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                     hashTypeConvert(o, REDIS_ENCODING_HT);
                 break;
             default:
-                redisPanic("Unknown encoding");
-                break;
+                redisLog(REDIS_WARNING,"Unknown RDB encoding type %d",rdbtype);
+                decrRefCount(o);
+                return NULL;
         }
     } else {
-        redisPanic("Unknown object type");
+        /* Unknown types are reported as load errors instead of panicking,
+         * see rdbLoadIntegerObject(). */
+        redisLog(REDIS_WARNING,"Unknown RDB object type %d",rdbtype);
+        return NULL;
     }
     return o;
 }
@@ -1085,15 +1644,22 @@ void startLoading(FILE *fp) {
     struct stat sb;
 
     /* Load the DB */
-    server.loading = 1;
-    server.loading_start_time = time(NULL);
     if (fstat(fileno(fp), &sb) == -1) {
-        server.loading_total_bytes = 1; /* just to avoid division by zero */
+        startLoadingSize(0);
     } else {
-        server.loading_total_bytes = sb.st_size;
+        startLoadingSize(sb.st_size);
     }
 }
 
+/* Like startLoading() for streams that are not files: 'size' is the
+ * number of bytes to load, or 0 if unknown. */
+void startLoadingSize(off_t size) {
+    server.loading = 1;
+    server.loading_start_time = time(NULL);
+    /* Avoid divisions by zero if the size is unknown. */
+    server.loading_total_bytes = size ? size : 1;
+}
+
 /* Refresh the loading progress info */
 void loadingProgress(off_t pos) {
     server.loading_loaded_bytes = pos;
@@ -1106,6 +1672,20 @@ void stopLoading(void) {
     server.loading = 0;
 }
 
+/* Called from time to time while loading, in the main thread, in order to
+ * serve clients and refresh the loading stats. 'pos' is the number of bytes
+ * of the RDB file processed so far. */
+static void rdbLoadProcessEvents(off_t pos) {
+    /* The DB can take some non trivial amount of time to load. Update
+     * our cached time since it is used to create and update the last
+     * interaction time with clients and for other important things. */
+    updateCachedTime();
+    if (server.masterhost && server.repl_state == REDIS_REPL_TRANSFER)
+        replicationSendNewlineToMaster();
+    loadingProgress(pos);
+    processEventsWhileBlocked();
+}
+
 /* Track loading progress in order to serve client's from time to time
    and if needed calculate rdb checksum  */
 void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
@@ -1114,129 +1694,412 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     if (server.loading_process_events_interval_bytes &&
         (r->processed_bytes + len)/server.loading_process_events_interval_bytes > r->processed_bytes/server.loading_process_events_interval_bytes)
     {
-        /* The DB can take some non trivial amount of time to load. Update
-         * our cached time since it is used to create and update the last
-         * interaction time with clients and for other important things. */
-        updateCachedTime();
-        if (server.masterhost && server.repl_state == REDIS_REPL_TRANSFER)
-            replicationSendNewlineToMaster();
-        loadingProgress(r->processed_bytes);
-        processEventsWhileBlocked();
+        rdbLoadProcessEvents(r->processed_bytes);
     }
 }
 
-int rdbLoad(char *filename) {
-    uint32_t dbid;
-    int type, rdbver;
-    redisDb *db = server.db+0;
-    char buf[1024];
-    long long expiretime, now = mstime();
-    FILE *fp;
-    rio rdb;
-
-    if ((fp = fopen(filename,"r")) == NULL) return REDIS_ERR;
+/* Checksum only variant of rdbLoadProgressCallback(), used when the file is
+ * parsed by the loader thread: serving clients is up to the main thread. */
+static void rdbLoadChecksumCallback(rio *r, const void *buf, size_t len) {
+    if (server.rdb_checksum)
+        rioGenericUpdateChecksum(r, buf, len);
+}
 
-    rioInitWithFile(&rdb,fp);
-    rdb.update_cksum = rdbLoadProgressCallback;
-    rdb.max_processing_chunk = server.loading_process_events_interval_bytes;
-    if (rioRead(&rdb,buf,9) == 0) goto eoferr;
-    buf[9] = '\0';
-    if (memcmp(buf,"REDIS",5) != 0) {
-        fclose(fp);
-        redisLog(REDIS_WARNING,"Wrong signature trying to load DB from file");
-        errno = EINVAL;
-        return REDIS_ERR;
-    }
-    rdbver = atoi(buf+5);
-    if (rdbver < 1 || rdbver > REDIS_RDB_VERSION) {
-        fclose(fp);
-        redisLog(REDIS_WARNING,"Can't handle RDB format version %d",rdbver);
-        errno = EINVAL;
-        return REDIS_ERR;
-    }
+/* Records returned by rdbLoadNextRecord(). */
+#define RDB_LOAD_KEY 0          /* Key-value pair, with optional expire. */
+#define RDB_LOAD_SELECTDB 1     /* SELECT DB opcode. */
+#define RDB_LOAD_RESIZEDB 2     /* RESIZE DB opcode. */
+#define RDB_LOAD_EOF 3          /* End of file, checksum verified. */
+#define RDB_LOAD_BADCKSUM 4     /* End of file, checksum mismatch. */
+#define RDB_LOAD_ERR 5          /* Short read, OOM or corrupted file. */
+#define RDB_LOAD_AUX 6          /* Auxiliary field. */
 
-    startLoading(fp);
-    while(1) {
-        robj *key, *val;
-        expiretime = -1;
-
-        /* Read type. */
-        if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
-        if (type == REDIS_RDB_OPCODE_EXPIRETIME) {
-            if ((expiretime = rdbLoadTime(&rdb)) == -1) goto eoferr;
-            /* We read the time so we need to read the object type again. */
-            if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
-            /* the EXPIRETIME opcode specifies time in seconds, so convert
-             * into milliseconds. */
-            expiretime *= 1000;
-        } else if (type == REDIS_RDB_OPCODE_EXPIRETIME_MS) {
-            /* Milliseconds precision expire times introduced with RDB
-             * version 3. */
-            if ((expiretime = rdbLoadMillisecondTime(&rdb)) == -1) goto eoferr;
-            /* We read the time so we need to read the object type again. */
-            if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
-        }
+typedef struct rdbLoadRecord {
+    int type;
+    uint32_t dbid;          /* RDB_LOAD_SELECTDB only. */
+    uint32_t db_size;       /* RDB_LOAD_RESIZEDB only. */
+    uint32_t expires_size;  /* RDB_LOAD_RESIZEDB only. */
+    robj *key, *val;        /* RDB_LOAD_KEY and RDB_LOAD_AUX only. */
+    long long expiretime;   /* RDB_LOAD_KEY only, -1 if none. */
+    int nocksum;            /* RDB_LOAD_EOF: file saved without checksum. */
+    off_t pos;              /* Bytes of the file processed so far. */
+} rdbLoadRecord;
+
+/* Parse the next record of 'rdb' into 'rec'. Only the file and the new
+ * objects are accessed, so this is safe to call from the loader thread. */
+static void rdbLoadNextRecord(rio *rdb, int rdbver, rdbLoadRecord *rec) {
+    int type;
 
-        if (type == REDIS_RDB_OPCODE_EOF)
-            break;
+    rec->type = RDB_LOAD_ERR;
+    rec->key = rec->val = NULL;
+    rec->expiretime = -1;
+    rec->nocksum = 0;
+
+    /* Read type. */
+    if ((type = rdbLoadType(rdb)) == -1) goto end;
+    if (type == REDIS_RDB_OPCODE_EXPIRETIME) {
+        if ((rec->expiretime = rdbLoadTime(rdb)) == -1) goto end;
+        /* We read the time so we need to read the object type again. */
+        if ((type = rdbLoadType(rdb)) == -1) goto end;
+        /* the EXPIRETIME opcode specifies time in seconds, so convert
+         * into milliseconds. */
+        rec->expiretime *= 1000;
+    } else if (type == REDIS_RDB_OPCODE_EXPIRETIME_MS) {
+        /* Milliseconds precision expire times introduced with RDB
+         * version 3. */
+        if ((rec->expiretime = rdbLoadMillisecondTime(rdb)) == -1) goto end;
+        /* We read the time so we need to read the object type again. */
+        if ((type = rdbLoadType(rdb)) == -1) goto end;
+    }
 
-        /* Handle SELECT DB opcode as a special case */
-        if (type == REDIS_RDB_OPCODE_SELECTDB) {
-            if ((dbid = rdbLoadLen(&rdb,NULL)) == REDIS_RDB_LENERR)
-                goto eoferr;
-            if (dbid >= (unsigned)server.dbnum) {
-                redisLog(REDIS_WARNING,"FATAL: Data file was created with a Redis server configured to handle more than %d databases. Exiting\n", server.dbnum);
-                exit(1);
+    if (type == REDIS_RDB_OPCODE_EOF) {
+        /* Verify the checksum if RDB version is >= 5 */
+        if (rdbver >= 5 && server.rdb_checksum) {
+            uint64_t cksum, expected = rdb->cksum;
+
+            if (rioRead(rdb,&cksum,8) == 0) goto end;
+            memrev64ifbe(&cksum);
+            if (cksum == 0) {
+                rec->nocksum = 1;
+            } else if (cksum != expected) {
+                rec->type = RDB_LOAD_BADCKSUM;
+                goto end;
             }
-            db = server.db+dbid;
-            continue;
         }
+        rec->type = RDB_LOAD_EOF;
+    } else if (type == REDIS_RDB_OPCODE_SELECTDB) {
+        if ((rec->dbid = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR)
+            goto end;
+        rec->type = RDB_LOAD_SELECTDB;
+    } else if (type == REDIS_RDB_OPCODE_RESIZEDB) {
+        if ((rec->db_size = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR)
+            goto end;
+        if ((rec->expires_size = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR)
+            goto end;
+        rec->type = RDB_LOAD_RESIZEDB;
+    } else if (type == REDIS_RDB_OPCODE_AUX) {
+        if ((rec->key = rdbLoadStringObject(rdb)) == NULL) goto end;
+        if ((rec->val = rdbLoadStringObject(rdb)) == NULL) goto end;
+        rec->type = RDB_LOAD_AUX;
+    } else {
         /* Read key */
-        if ((key = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
+        if ((rec->key = rdbLoadStringObject(rdb)) == NULL) goto end;
         /* Read value */
-        if ((val = rdbLoadObject(type,&rdb)) == NULL) goto eoferr;
-        /* Check if the key already expired. This function is used when loading
-         * an RDB file from disk, either at startup, or when an RDB was
-         * received from the master. In the latter case, the master is
+        if ((rec->val = rdbLoadObject(type,rdb)) == NULL) goto end;
+        rec->type = RDB_LOAD_KEY;
+    }
+
+end:
+    rec->pos = rdb->processed_bytes;
+}
+
+/* Handle an auxiliary field. Unknown fields are ignored, so that new
+ * fields can be added without breaking older loaders. */
+static void rdbLoadAuxField(robj *auxkey, robj *auxval) {
+    rdbReplInfo *ri = &server.rdb_repl_info;
+    char *key = auxkey->ptr, *val = auxval->ptr;
+
+    if (!strcasecmp(key,"repl-id")) {
+        if (sdslen(val) == REDIS_RUN_ID_SIZE) {
+            memcpy(ri->repl_id,val,REDIS_RUN_ID_SIZE+1);
+            ri->repl_id_is_set = 1;
+        }
+    } else if (!strcasecmp(key,"repl-offset")) {
+        ri->repl_offset = strtoll(val,NULL,10);
+    } else if (!strcasecmp(key,"repl-stream-db")) {
+        ri->repl_stream_db = atoi(val);
+    } else if (!strcasecmp(key,"lua")) {
+        if (luaLoadScriptFromRdb(auxval) == REDIS_ERR)
+            redisLog(REDIS_WARNING,"Can't load Lua script from RDB file! BODY: %s", val);
+    } else if (!strcasecmp(key,"redis-ver")) {
+        redisLog(REDIS_NOTICE,"Loading RDB produced by version %s", val);
+    } else {
+        redisLog(REDIS_DEBUG,"Unrecognized RDB AUX field: '%s'", key);
+    }
+}
+
+/* Apply a record returned by rdbLoadNextRecord() to the dataset. This must
+ * be called by the main thread, in the same order the records were read.
+ * Returns 1 when the end of the file is reached, 0 otherwise, and -1 after
+ * logging the cause if the file can't be loaded. */
+static int rdbLoadApplyRecord(rdbLoadRecord *rec, redisDb **db, long long now) {
+    switch(rec->type) {
+    case RDB_LOAD_SELECTDB:
+        if (rec->dbid >= (unsigned)server.dbnum) {
+            redisLog(REDIS_WARNING,"Data file was created with a Redis server configured to handle more than %d databases.", server.dbnum);
+            return -1;
+        }
+        *db = server.loading_db+rec->dbid;
+        return 0;
+    case RDB_LOAD_AUX:
+        rdbLoadAuxField(rec->key,rec->val);
+        decrRefCount(rec->key);
+        decrRefCount(rec->val);
+        return 0;
+    case RDB_LOAD_RESIZEDB:
+        /* Files saved by older versions lack this opcode, in which case
+         * the hash tables just grow while keys are added. */
+        dictExpand((*db)->dict,rec->db_size);
+        dictExpand((*db)->expires,rec->expires_size);
+        return 0;
+    case RDB_LOAD_KEY:
+        /* Check if the key already expired. This function is used when
+         * loading an RDB file from disk, either at startup, or when an RDB
+         * was received from the master. In the latter case, the master is
          * responsible for key expiry. If we would expire keys here, the
          * snapshot taken by the master may not be reflected on the slave. */
-        if (server.masterhost == NULL && expiretime != -1 && expiretime < now) {
-            decrRefCount(key);
-            decrRefCount(val);
-            continue;
+        if (server.masterhost == NULL && rec->expiretime != -1 &&
+            rec->expiretime < now)
+        {
+            decrRefCount(rec->key);
+            decrRefCount(rec->val);
+            return 0;
         }
         /* Add the new object in the hash table */
-        dbAdd(db,key,val);
+        dbAdd(*db,rec->key,rec->val);
 
         /* Set the expire time if needed */
-        if (expiretime != -1) setExpire(db,key,expiretime);
+        if (rec->expiretime != -1) setExpire(*db,rec->key,rec->expiretime);
 
-        decrRefCount(key);
+        decrRefCount(rec->key);
+        return 0;
+    case RDB_LOAD_EOF:
+        if (rec->nocksum)
+            redisLog(REDIS_WARNING,"RDB file was saved with checksum disabled: no check performed.");
+        return 1;
+    case RDB_LOAD_BADCKSUM:
+        redisLog(REDIS_WARNING,"Wrong RDB checksum.");
+        return -1;
+    default:
+        redisLog(REDIS_WARNING,"Short read or OOM loading DB.");
+        return -1;
     }
-    /* Verify the checksum if RDB version is >= 5 */
-    if (rdbver >= 5 && server.rdb_checksum) {
-        uint64_t cksum, expected = rdb.cksum;
+}
 
-        if (rioRead(&rdb,&cksum,8) == 0) goto eoferr;
-        memrev64ifbe(&cksum);
-        if (cksum == 0) {
-            redisLog(REDIS_WARNING,"RDB file was saved with checksum disabled: no check performed.");
-        } else if (cksum != expected) {
-            redisLog(REDIS_WARNING,"Wrong RDB checksum. Aborting now.");
-            exit(1);
+/* Release a record that is not going to be applied because of a previous
+ * error. Returns 1 if this is the last record of the file. */
+static int rdbLoadDiscardRecord(rdbLoadRecord *rec) {
+    /* Failed records may hold the key, if the value could not be read. */
+    if (rec->key) decrRefCount(rec->key);
+    if (rec->val) decrRefCount(rec->val);
+    return rec->type != RDB_LOAD_KEY && rec->type != RDB_LOAD_SELECTDB &&
+           rec->type != RDB_LOAD_RESIZEDB && rec->type != RDB_LOAD_AUX;
+}
+
+/* -----------------------------------------------------------------------------
+ * Pipelined loading
+ *
+ * When rdb-threaded-load is enabled, a loader thread reads the file and
+ * performs all the expensive work: LZF decompression, checksum, creation
+ * and encoding of the objects. Parsed records are passed to the main thread
+ * using a bounded queue, and the main thread just adds them to the keyspace
+ * in the same order, serving clients every loading_process_events_interval_bytes
+ * bytes of the file as the serial loader does.
+ *
+ * The file format can't be split without parsing it, so there is a single
+ * loader thread. Objects it creates are owned by the main thread once
+ * queued, and the only preexisting objects it references, the shared
+ * integers, have a refcount that is never modified.
+ * -------------------------------------------------------------------------- */
+
+#define RDB_LOAD_QUEUE_LEN 4096     /* Parsed records waiting insertion. */
+#define RDB_LOAD_WAIT_MS 100        /* Serve clients if the queue is empty
+                                       for this long. */
+
+typedef struct rdbLoadPipeline {
+    rio *rdb;
+    int rdbver;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;    /* Signaled when a record is queued. */
+    pthread_cond_t notfull;     /* Signaled when records are consumed. */
+    unsigned long produced;     /* Records queued by the loader thread. */
+    unsigned long consumed;     /* Records applied by the main thread. */
+    rdbLoadRecord queue[RDB_LOAD_QUEUE_LEN];
+} rdbLoadPipeline;
+
+static void *rdbLoadThreadMain(void *arg) {
+    rdbLoadPipeline *p = arg;
+    rdbLoadRecord rec;
+
+    do {
+        rdbLoadNextRecord(p->rdb,p->rdbver,&rec);
+        pthread_mutex_lock(&p->lock);
+        while (p->produced - p->consumed == RDB_LOAD_QUEUE_LEN)
+            pthread_cond_wait(&p->notfull,&p->lock);
+        p->queue[p->produced++ % RDB_LOAD_QUEUE_LEN] = rec;
+        pthread_cond_signal(&p->notempty);
+        pthread_mutex_unlock(&p->lock);
+    } while (rec.type == RDB_LOAD_KEY || rec.type == RDB_LOAD_SELECTDB ||
+             rec.type == RDB_LOAD_RESIZEDB || rec.type == RDB_LOAD_AUX);
+    return NULL;
+}
+
+/* Load the records of 'rdb' using the loader thread. Returns REDIS_ERR
+ * without consuming any input if the thread can't be created, so that the
+ * caller can fall back to the serial loader. Otherwise *error is set to 1
+ * if the file could not be loaded, 0 on success. */
+static int rdbLoadPipelined(rio *rdb, int rdbver, long long now, int *error) {
+    rdbLoadPipeline *p = zmalloc(sizeof(*p));
+    size_t interval = server.loading_process_events_interval_bytes;
+    redisDb *db = server.loading_db+0;
+    off_t lastpos = rdb->processed_bytes;
+    int done = 0;
+
+    *error = 0;
+
+    p->rdb = rdb;
+    p->rdbver = rdbver;
+    p->produced = p->consumed = 0;
+    pthread_mutex_init(&p->lock,NULL);
+    pthread_cond_init(&p->notempty,NULL);
+    pthread_cond_init(&p->notfull,NULL);
+    rdb->update_cksum = rdbLoadChecksumCallback;
+    if (pthread_create(&p->thread,NULL,rdbLoadThreadMain,p) != 0) {
+        redisLog(REDIS_WARNING,
+            "Can't create the RDB loader thread: %s", strerror(errno));
+        rdb->update_cksum = rdbLoadProgressCallback;
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->notempty);
+        pthread_cond_destroy(&p->notfull);
+        zfree(p);
+        return REDIS_ERR;
+    }
+
+    while(!done) {
+        unsigned long j, last;
+
+        pthread_mutex_lock(&p->lock);
+        while (p->consumed == p->produced) {
+            struct timespec ts;
+            long long when = ustime()+RDB_LOAD_WAIT_MS*1000;
+
+            ts.tv_sec = when/1000000;
+            ts.tv_nsec = (when%1000000)*1000;
+            if (pthread_cond_timedwait(&p->notempty,&p->lock,&ts) ==
+                ETIMEDOUT && interval)
+            {
+                /* The loader thread is busy with a big value or waiting
+                 * for the disk: don't stop serving clients meanwhile. */
+                pthread_mutex_unlock(&p->lock);
+                rdbLoadProcessEvents(lastpos);
+                pthread_mutex_lock(&p->lock);
+            }
         }
+        last = p->produced;
+        pthread_mutex_unlock(&p->lock);
+
+        /* Queued records can't be overwritten before 'consumed' is
+         * updated, so they are applied without holding the lock. */
+        for (j = p->consumed; j != last && !done; j++) {
+            rdbLoadRecord *rec = p->queue+(j % RDB_LOAD_QUEUE_LEN);
+
+            /* After an error we still need to consume what the loader
+             * thread produces, until it reaches the end of the file. */
+            if (*error) {
+                done = rdbLoadDiscardRecord(rec);
+                continue;
+            }
+            done = rdbLoadApplyRecord(rec,&db,now);
+            if (done == -1) {
+                *error = 1;
+                done = rdbLoadDiscardRecord(rec);
+                continue;
+            }
+            if (interval && rec->pos/interval > lastpos/interval)
+                rdbLoadProcessEvents(rec->pos);
+            lastpos = rec->pos;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->consumed = last;
+        pthread_cond_signal(&p->notfull);
+        pthread_mutex_unlock(&p->lock);
     }
 
-    fclose(fp);
-    stopLoading();
+    pthread_join(p->thread,NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->notempty);
+    pthread_cond_destroy(&p->notfull);
+    zfree(p);
     return REDIS_OK;
+}
+
+/* Load an RDB file from the rio stream 'rdb', that must be positioned at
+ * the start of the RDB header. On success REDIS_OK is returned and the
+ * stream is positioned just after the RDB checksum, so that the caller can
+ * continue reading (this is used for the RDB preamble of AOF files).
+ * Loading stats must be initialized by the caller with startLoading().
+ *
+ * Short reads and corrupted data are fatal, since the dataset would be
+ * incomplete, unless REDIS_RDB_LOAD_NOFATAL is given: the caller is then
+ * responsible for the partially loaded data. */
+int rdbLoadRio(rio *rdb, int flags) {
+    int rdbver, error = 0;
+    redisDb *db = server.loading_db+0;
+    char buf[1024];
+    long long now = mstime();
 
-eoferr: /* unexpected end of file is handled here with a fatal exit */
-    redisLog(REDIS_WARNING,"Short read or OOM loading DB. Unrecoverable error, aborting now.");
+    server.rdb_repl_info.repl_id_is_set = 0;
+    server.rdb_repl_info.repl_offset = -1;
+    server.rdb_repl_info.repl_stream_db = -1;
+
+    rdb->update_cksum = rdbLoadProgressCallback;
+    rdb->max_processing_chunk = server.loading_process_events_interval_bytes;
+    if (rioRead(rdb,buf,9) == 0) goto eoferr;
+    buf[9] = '\0';
+    if (memcmp(buf,"REDIS",5) != 0) {
+        redisLog(REDIS_WARNING,"Wrong signature trying to load DB from file");
+        errno = EINVAL;
+        return REDIS_ERR;
+    }
+    rdbver = atoi(buf+5);
+    if (rdbver < 1 || rdbver > REDIS_RDB_VERSION) {
+        redisLog(REDIS_WARNING,"Can't handle RDB format version %d",rdbver);
+        errno = EINVAL;
+        return REDIS_ERR;
+    }
+
+    if (!server.rdb_threaded_load ||
+        rdbLoadPipelined(rdb,rdbver,now,&error) == REDIS_ERR)
+    {
+        rdbLoadRecord rec;
+        int retval;
+
+        do {
+            rdbLoadNextRecord(rdb,rdbver,&rec);
+        } while((retval = rdbLoadApplyRecord(&rec,&db,now)) == 0);
+        if (retval == -1) {
+            rdbLoadDiscardRecord(&rec);
+            error = 1;
+        }
+    }
+    if (!error) return REDIS_OK;
+    goto loaderr;
+
+eoferr:
+    redisLog(REDIS_WARNING,"Short read or OOM loading DB.");
+loaderr: /* unless asked otherwise, errors are handled with a fatal exit */
+    if (flags & REDIS_RDB_LOAD_NOFATAL) return REDIS_ERR;
+    redisLog(REDIS_WARNING,"Unrecoverable error loading the DB, aborting now.");
     exit(1);
     return REDIS_ERR; /* Just to avoid warning */
 }
 
+int rdbLoad(char *filename) {
+    FILE *fp;
+    rio rdb;
+    int retval;
+
+    if ((fp = fopen(filename,"r")) == NULL) return REDIS_ERR;
+    startLoading(fp);
+    rioInitWithFile(&rdb,fp);
+    retval = rdbLoadRio(&rdb,REDIS_RDB_LOAD_NONE);
+    fclose(fp);
+    stopLoading();
+    return retval;
+}
+
 /* A background saving child (BGSAVE) terminated its work. Handle this.
  * This function covers the case of actual BGSAVEs. */
 void backgroundSaveDoneHandlerDisk(int exitcode, int bysignal) {
@@ -1385,16 +2248,16 @@ void backgroundSaveDoneHandler(int exitcode, int bysignal) {
 /* Spawn an RDB child that writes the RDB to the sockets of the slaves
  * that are currently in REDIS_REPL_WAIT_BGSAVE_START state. */
 int rdbSaveToSlavesSockets(void) {
-    int *fds;
+    int *fds, *lzf;
     uint64_t *clientids;
-    int numfds;
+    int numfds, numlzf = 0;
     listNode *ln;
     listIter li;
     pid_t childpid;
     long long start;
     int pipefds[2];
 
-    if (server.rdb_child_pid != -1) return REDIS_ERR;
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) return REDIS_ERR;
 
     /* Before to fork, create a pipe that will be used in order to
      * send back to the parent the IDs of the slaves that successfully
@@ -1410,6 +2273,8 @@ int rdbSaveToSlavesSockets(void) {
      * be useful for the child process in order to build the report
      * (sent via unix pipe) that will be sent to the parent. */
     clientids = zmalloc(sizeof(uint64_t)*listLength(server.slaves));
+    /* Slaves with a LZF link are flagged as well. */
+    lzf = zmalloc(sizeof(int)*listLength(server.slaves));
     numfds = 0;
 
     listRewind(server.slaves,&li);
@@ -1418,6 +2283,8 @@ int rdbSaveToSlavesSockets(void) {
 
         if (slave->replstate == REDIS_REPL_WAIT_BGSAVE_START) {
             clientids[numfds] = slave->id;
+            lzf[numfds] = (slave->flags & REDIS_REPL_LZF) != 0;
+            numlzf += lzf[numfds];
             fds[numfds++] = slave->fd;
             slave->replstate = REDIS_REPL_WAIT_BGSAVE_END;
             /* Put the socket in non-blocking mode to simplify RDB transfer.
@@ -1429,6 +2296,7 @@ int rdbSaveToSlavesSockets(void) {
     }
 
     /* Create the child process. */
+    openChildInfoPipe();
     start = ustime();
     if ((childpid = fork()) == 0) {
         /* Child */
@@ -1438,21 +2306,17 @@ int rdbSaveToSlavesSockets(void) {
         rioInitWithFdset(&slave_sockets,fds,numfds);
         zfree(fds);
 
+        server.in_fork_child = REDIS_CHILD_INFO_TYPE_RDB;
         closeListeningSockets(0);
         redisSetProcTitle("redis-rdb-to-slaves");
 
-        retval = rdbSaveRioWithEOFMark(&slave_sockets,NULL);
+        retval = rdbSaveRioWithEOFMark(&slave_sockets,NULL,
+                                       numlzf ? lzf : NULL);
         if (retval == REDIS_OK && rioFlush(&slave_sockets) == 0)
             retval = REDIS_ERR;
 
         if (retval == REDIS_OK) {
-            size_t private_dirty = zmalloc_get_private_dirty();
-
-            if (private_dirty) {
-                redisLog(REDIS_NOTICE,
-                    "RDB: %zu MB of memory used by copy-on-write",
-                    private_dirty/(1024*1024));
-            }
+            sendChildCOWInfo(1,"RDB");
 
             /* If we are returning OK, at least one slave was served
              * with the RDB file as expected, so we need to send a report
@@ -1496,6 +2360,7 @@ int rdbSaveToSlavesSockets(void) {
     } else {
         /* Parent */
         zfree(clientids); /* Not used by parent. Free ASAP. */
+        zfree(lzf);
         server.stat_fork_time = ustime()-start;
         server.stat_fork_rate = (double) zmalloc_used_memory() * 1000000 / server.stat_fork_time / (1024*1024*1024); /* GB per second. */
         latencyAddSampleIfNeeded("fork",server.stat_fork_time/1000);
@@ -1505,6 +2370,7 @@ int rdbSaveToSlavesSockets(void) {
             zfree(fds);
             close(pipefds[0]);
             close(pipefds[1]);
+            if (server.aof_child_pid == -1) closeChildInfoPipe();
             return REDIS_ERR;
         }
         redisLog(REDIS_NOTICE,"Background RDB transfer started by pid %d",childpid);
@@ -1519,7 +2385,7 @@ int rdbSaveToSlavesSockets(void) {
 }
 
 void saveCommand(redisClient *c) {
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -1531,11 +2397,20 @@ void saveCommand(redisClient *c) {
 }
 
 void bgsaveCommand(redisClient *c) {
-    if (server.rdb_child_pid != -1) {
+    int retval;
+
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) {
         addReplyError(c,"Background save already in progress");
+        return;
     } else if (server.aof_child_pid != -1) {
         addReplyError(c,"Can't BGSAVE while AOF log rewriting is in progress");
-    } else if (rdbSaveBackground(server.rdb_filename) == REDIS_OK) {
+        return;
+    }
+    if (server.rdb_threaded_snapshot)
+        retval = rdbSnapshotStart(server.rdb_filename);
+    else
+        retval = rdbSaveBackground(server.rdb_filename);
+    if (retval == REDIS_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
         addReply(c,shared.err);
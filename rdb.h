@@ -38,7 +38,7 @@
 
 /* The current RDB version. When the format changes in a way that is no longer
  * backward compatible this number gets incremented. */
-#define REDIS_RDB_VERSION 6
+#define REDIS_RDB_VERSION 7
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -66,6 +66,8 @@
 #define REDIS_RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define REDIS_RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define REDIS_RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define REDIS_RDB_ENC_LZ4 4         /* string compressed with LZ4 */
+#define REDIS_RDB_ENC_ZSTD 5        /* string compressed with Zstandard */
 
 /* Dup object types to RDB object types. Only reason is readability (are we
  * dealing with RDB types or with in-memory object types?). */
@@ -86,6 +88,8 @@
 #define rdbIsObjectType(t) ((t >= 0 && t <= 4) || (t >= 9 && t <= 13))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
+#define REDIS_RDB_OPCODE_AUX        250
+#define REDIS_RDB_OPCODE_RESIZEDB   251
 #define REDIS_RDB_OPCODE_EXPIRETIME_MS 252
 #define REDIS_RDB_OPCODE_EXPIRETIME 253
 #define REDIS_RDB_OPCODE_SELECTDB   254
@@ -99,7 +103,19 @@ int rdbSaveLen(rio *rdb, uint32_t len);
 uint32_t rdbLoadLen(rio *rdb, int *isencoded);
 int rdbSaveObjectType(rio *rdb, robj *o);
 int rdbLoadObjectType(rio *rdb);
+/* Flags for rdbSaveRio(). */
+#define REDIS_RDB_SAVE_NONE 0
+#define REDIS_RDB_SAVE_AOF_PREAMBLE (1<<0)  /* Read AOF diffs while saving. */
+
+/* rdbLoadRio() flags. */
+#define REDIS_RDB_LOAD_NONE 0
+#define REDIS_RDB_LOAD_NOFATAL (1<<0)   /* Return errors instead of exiting. */
+
 int rdbLoad(char *filename);
+int rdbLoadRio(rio *rdb, int flags);
+int rdbSaveRio(rio *rdb, int *error, int flags);
+int rdbSaveHeader(rio *rdb);
+int rdbSaveFooter(rio *rdb);
 int rdbSaveBackground(char *filename);
 int rdbSaveToSlavesSockets(void);
 void rdbRemoveTempFile(pid_t childpid);
@@ -111,5 +127,6 @@ robj *rdbLoadObject(int type, rio *rdb);
 void backgroundSaveDoneHandler(int exitcode, int bysignal);
 int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime, long long now);
 robj *rdbLoadStringObject(rio *rdb);
+int rdbInitCompression(void);
 
 #endif
@@ -185,6 +185,20 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    /* AOF files rewritten with aof-use-rdb-preamble start with an RDB
+     * file, that this tool can't parse: refuse to check them instead of
+     * truncating the whole file. */
+    char sig[5];
+    if (fread(sig,1,5,fp) == 5 && memcmp(sig,"REDIS",5) == 0) {
+        printf("The AOF starts with an RDB preamble, that can't be checked "
+               "by this tool: not processing it.\n");
+        exit(1);
+    }
+    if (fseek(fp,0,SEEK_SET) == -1) {
+        printf("Cannot seek file: %s\n", filename);
+        exit(1);
+    }
+
     off_t pos = process(fp);
     off_t diff = size-pos;
     printf("AOF analyzed: size=%lld, ok_up_to=%lld, diff=%lld\n",
@@ -40,6 +40,12 @@
 #include <stdint.h>
 #include <limits.h>
 #include "lzf.h"
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 #include "crc64.h"
 
 /* Object types */
@@ -63,6 +69,8 @@
 #define REDIS_ENCODING_HT 3     /* Encoded as a hash table */
 
 /* Object types only used for dumping to disk */
+#define REDIS_AUX 250
+#define REDIS_RESIZEDB 251
 #define REDIS_EXPIRETIME_MS 252
 #define REDIS_EXPIRETIME 253
 #define REDIS_SELECTDB 254
@@ -94,6 +102,8 @@
 #define REDIS_RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define REDIS_RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define REDIS_RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define REDIS_RDB_ENC_LZ4 4         /* string compressed with LZ4 */
+#define REDIS_RDB_ENC_ZSTD 5        /* string compressed with Zstandard */
 
 #define ERROR(...) { \
     printf(__VA_ARGS__); \
@@ -150,7 +160,7 @@ int checkType(unsigned char t) {
     return
         (t >= REDIS_HASH_ZIPMAP && t <= REDIS_HASH_ZIPLIST) ||
         t <= REDIS_HASH ||
-        t >= REDIS_EXPIRETIME_MS;
+        t >= REDIS_AUX;
 }
 
 /* when number of bytes to read is negative, do a peek */
@@ -182,7 +192,7 @@ int processHeader(void) {
     }
 
     dump_version = (int)strtol(buf + 5, NULL, 10);
-    if (dump_version < 1 || dump_version > 6) {
+    if (dump_version < 1 || dump_version > 7) {
         ERROR("Unknown RDB format version: %d\n", dump_version);
     }
     return dump_version;
@@ -289,9 +299,10 @@ char *loadIntegerObject(int enctype) {
     return buf;
 }
 
-char* loadLzfStringObject() {
+char* loadCompressedStringObject(int enctype) {
     unsigned int slen, clen;
     char *c, *s;
+    int ok = 0;
 
     if ((clen = loadLength(NULL)) == REDIS_RDB_LENERR) return NULL;
     if ((slen = loadLength(NULL)) == REDIS_RDB_LENERR) return NULL;
@@ -303,7 +314,23 @@ char* loadLzfStringObject() {
     }
 
     s = malloc(slen+1);
-    if (lzf_decompress(c,clen,s,slen) == 0) {
+    switch(enctype) {
+    case REDIS_RDB_ENC_LZF:
+        ok = lzf_decompress(c,clen,s,slen) != 0;
+        break;
+#ifdef USE_LZ4
+    case REDIS_RDB_ENC_LZ4:
+        ok = LZ4_decompress_safe(c,s,clen,slen) == (int)slen;
+        break;
+#endif
+#ifdef USE_ZSTD
+    case REDIS_RDB_ENC_ZSTD:
+        /* Strings compressed using a dictionary can't be checked. */
+        ok = ZSTD_decompress(s,slen,c,clen) == slen;
+        break;
+#endif
+    }
+    if (!ok) {
         free(c); free(s);
         return NULL;
     }
@@ -326,7 +353,13 @@ char* loadStringObject() {
         case REDIS_RDB_ENC_INT32:
             return loadIntegerObject(len);
         case REDIS_RDB_ENC_LZF:
-            return loadLzfStringObject();
+#ifdef USE_LZ4
+        case REDIS_RDB_ENC_LZ4:
+#endif
+#ifdef USE_ZSTD
+        case REDIS_RDB_ENC_ZSTD:
+#endif
+            return loadCompressedStringObject(len);
         default:
             /* unknown encoding */
             SHIFT_ERROR(offset, "Unknown string encoding (0x%02x)", len);
@@ -508,6 +541,26 @@ entry loadEntry() {
             SHIFT_ERROR(offset[1], "Database number out of range (%d)", length);
             return e;
         }
+    } else if (e.type == REDIS_RESIZEDB) {
+        if ((length = loadLength(NULL)) == REDIS_RDB_LENERR) {
+            SHIFT_ERROR(offset[1], "Error reading database size");
+            return e;
+        }
+        offset[1] = CURR_OFFSET;
+        if ((length = loadLength(NULL)) == REDIS_RDB_LENERR) {
+            SHIFT_ERROR(offset[1], "Error reading expires size");
+            return e;
+        }
+    } else if (e.type == REDIS_AUX) {
+        if (!processStringObject(NULL)) {
+            SHIFT_ERROR(offset[1], "Error reading auxiliary field name");
+            return e;
+        }
+        offset[1] = CURR_OFFSET;
+        if (!processStringObject(NULL)) {
+            SHIFT_ERROR(offset[1], "Error reading auxiliary field value");
+            return e;
+        }
     } else if (e.type == REDIS_EOF) {
         if (positions[level].offset < positions[level].size) {
             SHIFT_ERROR(offset[0], "Unexpected EOF");
@@ -714,6 +767,7 @@ int main(int argc, char **argv) {
         printf("Usage: %s <dump.rdb>\n", argv[0]);
         exit(0);
     }
+    crc64_init();
 
     int fd;
     off_t size;
@@ -754,6 +808,8 @@ int main(int argc, char **argv) {
 
     /* Object types only used for dumping to disk */
     sprintf(types[REDIS_EXPIRETIME], "EXPIRETIME");
+    sprintf(types[REDIS_AUX], "AUX");
+    sprintf(types[REDIS_RESIZEDB], "RESIZEDB");
     sprintf(types[REDIS_SELECTDB], "SELECTDB");
     sprintf(types[REDIS_EOF], "EOF");
 
@@ -119,6 +119,9 @@ struct redisServer server; /* server global state */
  *    its execution as long as the kernel scheduler is giving us time.
  *    Note that commands that may trigger a DEL as a side effect (like SET)
  *    are not fast commands.
+ * L: Deny the command while a slave loads the master dataset in the
+ *    background (repl-async-load), even if it does not write the key space.
+ *    For commands acting on the replication link or on the loading itself.
  */
 struct redisCommand redisCommandTable[] = {
     {"get",getCommand,2,"rF",0,NULL,1,1,1,0,0},
@@ -233,10 +236,10 @@ struct redisCommand redisCommandTable[] = {
     {"lastsave",lastsaveCommand,1,"rRF",0,NULL,0,0,0,0,0},
     {"type",typeCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"multi",multiCommand,1,"rsF",0,NULL,0,0,0,0,0},
-    {"exec",execCommand,1,"sM",0,NULL,0,0,0,0,0},
+    {"exec",execCommand,1,"sML",0,NULL,0,0,0,0,0},
     {"discard",discardCommand,1,"rsF",0,NULL,0,0,0,0,0},
-    {"sync",syncCommand,1,"ars",0,NULL,0,0,0,0,0},
-    {"psync",syncCommand,3,"ars",0,NULL,0,0,0,0,0},
+    {"sync",syncCommand,1,"arsL",0,NULL,0,0,0,0,0},
+    {"psync",syncCommand,3,"arsL",0,NULL,0,0,0,0,0},
     {"replconf",replconfCommand,-1,"arslt",0,NULL,0,0,0,0,0},
     {"flushdb",flushdbCommand,1,"w",0,NULL,0,0,0,0,0},
     {"flushall",flushallCommand,1,"w",0,NULL,0,0,0,0,0},
@@ -246,9 +249,9 @@ struct redisCommand redisCommandTable[] = {
     {"ttl",ttlCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"pttl",pttlCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"persist",persistCommand,2,"wF",0,NULL,1,1,1,0,0},
-    {"slaveof",slaveofCommand,3,"ast",0,NULL,0,0,0,0,0},
+    {"slaveof",slaveofCommand,3,"astL",0,NULL,0,0,0,0,0},
     {"role",roleCommand,1,"last",0,NULL,0,0,0,0,0},
-    {"debug",debugCommand,-2,"as",0,NULL,0,0,0,0,0},
+    {"debug",debugCommand,-2,"asL",0,NULL,0,0,0,0,0},
     {"config",configCommand,-2,"art",0,NULL,0,0,0,0,0},
     {"subscribe",subscribeCommand,-2,"rpslt",0,NULL,0,0,0,0,0},
     {"unsubscribe",unsubscribeCommand,-1,"rpslt",0,NULL,0,0,0,0,0},
@@ -277,13 +280,15 @@ struct redisCommand redisCommandTable[] = {
     {"bitcount",bitcountCommand,-2,"r",0,NULL,1,1,1,0,0},
     {"bitpos",bitposCommand,-3,"r",0,NULL,1,1,1,0,0},
     {"wait",waitCommand,3,"rs",0,NULL,0,0,0,0,0},
+    {"waitoffset",waitoffsetCommand,3,"rs",0,NULL,0,0,0,0,0},
     {"command",commandCommand,0,"rlt",0,NULL,0,0,0,0,0},
     {"pfselftest",pfselftestCommand,1,"r",0,NULL,0,0,0,0,0},
     {"pfadd",pfaddCommand,-2,"wmF",0,NULL,1,1,1,0,0},
     {"pfcount",pfcountCommand,-2,"w",0,NULL,1,1,1,0,0},
     {"pfmerge",pfmergeCommand,-2,"wm",0,NULL,1,-1,1,0,0},
     {"pfdebug",pfdebugCommand,-3,"w",0,NULL,0,0,0,0,0},
-    {"latency",latencyCommand,-2,"arslt",0,NULL,0,0,0,0,0}
+    {"latency",latencyCommand,-2,"arslt",0,NULL,0,0,0,0,0},
+    {"memory",memoryCommand,-2,"r",0,memoryGetKeys,0,0,0,0,0}
 };
 
 struct evictionPoolEntry *evictionPoolAlloc(void);
@@ -453,6 +458,18 @@ void dictRedisObjectDestructor(void *privdata, void *val)
     decrRefCount(val);
 }
 
+/* Destructor of the db->dict values, that may be inline integers holding
+ * a reference to the shared integer object. */
+void dictDbValDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    if (dbValIsInline(val))
+        decrRefCount(shared.integers[dbValInlineInt(val)]);
+    else
+        decrRefCount(val);
+}
+
 void dictSdsDestructor(void *privdata, void *val)
 {
     DICT_NOTUSED(privdata);
@@ -548,7 +565,7 @@ dictType dbDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictRedisObjectDestructor   /* val destructor */
+    dictDbValDestructor         /* val destructor */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -694,7 +711,8 @@ int incrementallyRehash(int dbid) {
  * for dict.c to resize the hash tables accordingly to the fact we have o not
  * running childs. */
 void updateDictResizePolicy(void) {
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        server.rdb_snapshot == NULL)
         dictEnableResize();
     else
         dictDisableResize();
@@ -731,6 +749,74 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     }
 }
 
+/* Return the estimated number of keys that are already logically expired
+ * but still use memory, summing the per-DB estimates obtained sampling the
+ * expires dictionaries in activeExpireCycle(). If 'perc' is not NULL it is
+ * set to the percentage of such keys among all the keys with an expire. */
+long long activeExpireEstimateStaleKeys(double *perc) {
+    double stale = 0;
+    long long volatile_keys = 0;
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        long long size = dictSize(db->expires);
+
+        if (size == 0) continue;
+        stale += db->expired_stale_perc*size/100;
+        volatile_keys += size;
+    }
+    if (perc) *perc = volatile_keys ? (stale*100/volatile_keys) : 0;
+    return (long long) stale;
+}
+
+/* Feedback controller for the amount of CPU the active expire cycle is
+ * allowed to use, called once per slow cycle.
+ *
+ * The target effort is ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC as long as the
+ * estimated stale keys are no more than ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE
+ * percent of the volatile keys, and grows linearly up to the configured
+ * 'active-expire-max-cpu' as the backlog approaches
+ * ACTIVE_EXPIRE_CYCLE_HIGH_STALE percent.
+ *
+ * The effort moves towards the target in steps of
+ * ACTIVE_EXPIRE_CYCLE_EFFORT_STEP, but is halved (down to
+ * ACTIVE_EXPIRE_CYCLE_MIN_TIME_PERC) every time an event loop iteration
+ * since the previous call took longer than 'active-expire-latency-target'
+ * milliseconds, since that is the latency clients are experiencing. */
+void activeExpireUpdateEffort(void) {
+    int effort = server.active_expire_effort;
+    int target = ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC;
+    double stale_perc;
+
+    activeExpireEstimateStaleKeys(&stale_perc);
+    if (server.active_expire_max_cpu < target) {
+        target = server.active_expire_max_cpu;
+    } else if (stale_perc > ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE) {
+        double scale = (stale_perc-ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE) /
+            (ACTIVE_EXPIRE_CYCLE_HIGH_STALE-ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE);
+
+        if (scale > 1) scale = 1;
+        target += (server.active_expire_max_cpu-target)*scale;
+    }
+
+    if (server.active_expire_latency_target &&
+        server.el_busy_peak > server.active_expire_latency_target*1000)
+    {
+        effort /= 2;
+        if (effort < ACTIVE_EXPIRE_CYCLE_MIN_TIME_PERC)
+            effort = ACTIVE_EXPIRE_CYCLE_MIN_TIME_PERC;
+        if (effort > target) effort = target;
+    } else if (effort < target) {
+        effort += ACTIVE_EXPIRE_CYCLE_EFFORT_STEP;
+        if (effort > target) effort = target;
+    } else {
+        effort = target;
+    }
+    server.active_expire_effort = effort;
+    server.el_busy_peak = 0;
+}
+
 /* Try to expire a few timed out keys. The algorithm used is adaptive and
  * will use few CPU cycles if there are few expiring keys, otherwise
  * it will get more aggressive to avoid that too much memory is used by
@@ -747,11 +833,12 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
  *
  * If type is ACTIVE_EXPIRE_CYCLE_FAST the function will try to run a
  * "fast" expire cycle that takes no longer than EXPIRE_FAST_CYCLE_DURATION
- * microseconds, and is not repeated again before the same amount of time.
+ * microseconds (scaled by the current effort), and is not repeated again
+ * before the same amount of time.
  *
  * If type is ACTIVE_EXPIRE_CYCLE_SLOW, that normal expire cycle is
  * executed, where the time limit is a percentage of the REDIS_HZ period
- * as specified by the REDIS_EXPIRELOOKUPS_TIME_PERC define. */
+ * as computed by activeExpireUpdateEffort(). */
 
 void activeExpireCycle(int type) {
     /* This function has some global state in order to continue the work
@@ -762,15 +849,22 @@ void activeExpireCycle(int type) {
 
     int j, iteration = 0;
     int dbs_per_call = REDIS_DBCRON_DBS_PER_CALL;
-    long long start = ustime(), timelimit;
+    long long start = ustime(), timelimit, fast_duration, elapsed;
+
+    fast_duration = (long long)ACTIVE_EXPIRE_CYCLE_FAST_DURATION*
+                    server.active_expire_effort/
+                    ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC;
+    if (fast_duration <= 0) fast_duration = 1;
 
     if (type == ACTIVE_EXPIRE_CYCLE_FAST) {
         /* Don't start a fast cycle if the previous cycle did not exited
          * for time limt. Also don't repeat a fast cycle for the same period
          * as the fast cycle total duration itself. */
         if (!timelimit_exit) return;
-        if (start < last_fast_cycle + ACTIVE_EXPIRE_CYCLE_FAST_DURATION*2) return;
+        if (start < last_fast_cycle + fast_duration*2) return;
         last_fast_cycle = start;
+    } else {
+        activeExpireUpdateEffort();
     }
 
     /* We usually should test REDIS_DBCRON_DBS_PER_CALL per iteration, with
@@ -783,18 +877,18 @@ void activeExpireCycle(int type) {
     if (dbs_per_call > server.dbnum || timelimit_exit)
         dbs_per_call = server.dbnum;
 
-    /* We can use at max ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC percentage of CPU time
+    /* We can use at max server.active_expire_effort percentage of CPU time
      * per iteration. Since this function gets called with a frequency of
      * server.hz times per second, the following is the max amount of
      * microseconds we can spend in this function. */
-    timelimit = 1000000*ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC/server.hz/100;
+    timelimit = 1000000LL*server.active_expire_effort/server.hz/100;
     timelimit_exit = 0;
     if (timelimit <= 0) timelimit = 1;
 
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
-        timelimit = ACTIVE_EXPIRE_CYCLE_FAST_DURATION; /* in microseconds. */
+        timelimit = fast_duration; /* in microseconds. */
 
-    for (j = 0; j < dbs_per_call; j++) {
+    for (j = 0; j < dbs_per_call && timelimit_exit == 0; j++) {
         int expired;
         redisDb *db = server.db+(current_db % server.dbnum);
 
@@ -813,6 +907,7 @@ void activeExpireCycle(int type) {
             /* If there is nothing to expire try next DB ASAP. */
             if ((num = dictSize(db->expires)) == 0) {
                 db->avg_ttl = 0;
+                db->expired_stale_perc = 0;
                 break;
             }
             slots = dictSlots(db->expires);
@@ -848,10 +943,16 @@ void activeExpireCycle(int type) {
             /* Update the average TTL stats for this database. */
             if (ttl_samples) {
                 long long avg_ttl = ttl_sum/ttl_samples;
+                double current_perc = (double)expired*100/ttl_samples;
 
                 if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
                 /* Smooth the value averaging with the previous one. */
                 db->avg_ttl = (db->avg_ttl+avg_ttl)/2;
+
+                /* The stale keys estimate changes slowly, so we use a
+                 * moving average giving a small weight to every sample. */
+                db->expired_stale_perc = (current_perc*0.05)+
+                                         (db->expired_stale_perc*0.95);
             }
 
             /* We can't block forever here even if there are many keys to
@@ -859,16 +960,17 @@ void activeExpireCycle(int type) {
              * caller waiting for the other active expire cycle. */
             iteration++;
             if ((iteration & 0xf) == 0) { /* check once every 16 iterations. */
-                long long elapsed = ustime()-start;
-
-                latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
-                if (elapsed > timelimit) timelimit_exit = 1;
+                if (ustime()-start > timelimit) timelimit_exit = 1;
             }
-            if (timelimit_exit) return;
             /* We don't repeat the cycle if there are less than 25% of keys
              * found expired in the current DB. */
-        } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP/4);
+        } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP/4 &&
+                 !timelimit_exit);
     }
+
+    elapsed = ustime()-start;
+    server.stat_expire_cycle_time_used += elapsed;
+    latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
 }
 
 unsigned int getLRUClock(void) {
@@ -945,6 +1047,7 @@ int clientsCronResizeQueryBuffer(redisClient *c) {
         /* Only resize the query buffer if it is actually wasting space. */
         if (sdsavail(c->querybuf) > 1024) {
             c->querybuf = sdsRemoveFreeSpace(c->querybuf);
+            updateClientMemUsage(c);
         }
     }
     /* Reset the peak again to capture the peak memory usage in the next
@@ -991,10 +1094,20 @@ void databasesCron(void) {
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
 
+    /* Defrag keys gradually. */
+    if (server.active_defrag_enabled)
+        activeDefragCycle();
+
+    /* Release the keyspaces queued by freeDictLazily(). */
+    if (listLength(server.lazyfree_dicts)) lazyfreeCron();
+
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
-     * as will cause a lot of copy-on-write of memory pages. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+     * as will cause a lot of copy-on-write of memory pages. A fork-free
+     * BGSAVE needs the layout of the DB dictionaries to stay the same. */
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        server.rdb_snapshot == NULL)
+    {
         /* We use global counters so if we stop the computation at a given
          * DB we'll be able to start from the successive in the next
          * cron loop iteration. */
@@ -1133,7 +1246,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
-        server.aof_rewrite_scheduled)
+        server.rdb_snapshot == NULL && server.aof_rewrite_scheduled)
     {
         rewriteAppendOnlyFileBackground();
     }
@@ -1143,11 +1256,20 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         int statloc;
         pid_t pid;
 
+        receiveChildInfo();
         if ((pid = wait3(&statloc,WNOHANG,NULL)) != 0) {
             int exitcode = WEXITSTATUS(statloc);
             int bysignal = 0;
 
             if (WIFSIGNALED(statloc)) bysignal = WTERMSIG(statloc);
+            /* Account the final report of the child, sent just before
+             * exiting. */
+            receiveChildInfo();
+            if (server.stat_peak_cow_bytes) {
+                redisLog(REDIS_NOTICE,
+                    "Child %ld copy-on-write peak: %zu MB",
+                    (long)pid, server.stat_peak_cow_bytes/(1024*1024));
+            }
 
             if (pid == server.rdb_child_pid) {
                 backgroundSaveDoneHandler(exitcode,bysignal);
@@ -1159,6 +1281,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                     (long)pid);
             }
             updateDictResizePolicy();
+            if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+                server.stat_current_cow_bytes = 0;
+                closeChildInfoPipe();
+            }
         }
     } else {
         /* If there is not a background saving/rewrite in progress check if
@@ -1170,7 +1296,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
              * the given amount of seconds, and if the latest bgsave was
              * successful or if, in case of an error, at least
              * REDIS_BGSAVE_RETRY_DELAY seconds already elapsed. */
-            if (server.dirty >= sp->changes &&
+            if (server.rdb_snapshot == NULL &&
+                server.dirty >= sp->changes &&
                 server.unixtime-server.lastsave > sp->seconds &&
                 (server.unixtime-server.lastbgsave_try >
                  REDIS_BGSAVE_RETRY_DELAY ||
@@ -1178,7 +1305,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             {
                 redisLog(REDIS_NOTICE,"%d changes in %d seconds. Saving...",
                     sp->changes, (int)sp->seconds);
-                rdbSaveBackground(server.rdb_filename);
+                if (server.rdb_threaded_snapshot)
+                    rdbSnapshotStart(server.rdb_filename);
+                else
+                    rdbSaveBackground(server.rdb_filename);
                 break;
             }
          }
@@ -1186,6 +1316,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
          /* Trigger an AOF rewrite if needed */
          if (server.rdb_child_pid == -1 &&
              server.aof_child_pid == -1 &&
+             server.rdb_snapshot == NULL &&
              server.aof_rewrite_perc &&
              server.aof_current_size > server.aof_rewrite_min_size)
          {
@@ -1248,6 +1379,14 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 void beforeSleep(struct aeEventLoop *eventLoop) {
     REDIS_NOTUSED(eventLoop);
 
+    /* Track the slowest event loop iteration, that is, the worst delay a
+     * client had to wait before its ready file event was served. This is
+     * the feedback signal used to throttle the active expire cycle. */
+    if (server.el_iteration_start) {
+        long long busy = ustime()-server.el_iteration_start;
+        if (busy > server.el_busy_peak) server.el_busy_peak = busy;
+    }
+
     /* Run a fast expire cycle (the called function will return
      * ASAP if a fast cycle is not needed). */
     if (server.active_expire_enabled && server.masterhost == NULL)
@@ -1273,6 +1412,11 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (listLength(server.clients_waiting_acks))
         processClientsWaitingReplicas();
 
+    /* Unblock the clients blocked in WAITOFFSET whose offset was reached
+     * by the master stream processed in this iteration. */
+    if (listLength(server.clients_waiting_offset))
+        processClientsWaitingOffset();
+
     /* Try to process pending commands for clients that were just unblocked. */
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
@@ -1280,10 +1424,21 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
+    /* Advance the fork-free BGSAVE in progress. */
+    if (server.rdb_snapshot) rdbSnapshotCron();
+
     /* Call the Redis Cluster before sleep function. */
     if (server.cluster_enabled) clusterBeforeSleep();
 }
 
+/* This function is called immadiately after the event loop multiplexing
+ * API returned, and the control is going to soon return to Redis by invoking
+ * the different events callbacks. */
+void afterSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+    server.el_iteration_start = ustime();
+}
+
 /* =========================== Server initialization ======================== */
 
 void createSharedObjects(void) {
@@ -1359,7 +1514,8 @@ void createSharedObjects(void) {
     shared.lpop = createStringObject("LPOP",4);
     shared.lpush = createStringObject("LPUSH",5);
     for (j = 0; j < REDIS_SHARED_INTEGERS; j++) {
-        shared.integers[j] = createObject(REDIS_STRING,(void*)(long)j);
+        shared.integers[j] =
+            makeObjectShared(createObject(REDIS_STRING,(void*)(long)j));
         shared.integers[j]->encoding = REDIS_ENCODING_INT;
     }
     for (j = 0; j < REDIS_SHARED_BULKHDR_LEN; j++) {
@@ -1396,9 +1552,20 @@ void initServerConfig(void) {
     server.maxidletime = REDIS_MAXIDLETIME;
     server.tcpkeepalive = REDIS_DEFAULT_TCP_KEEPALIVE;
     server.active_expire_enabled = 1;
+    server.active_expire_max_cpu = REDIS_DEFAULT_ACTIVE_EXPIRE_MAX_CPU;
+    server.active_expire_latency_target = REDIS_DEFAULT_ACTIVE_EXPIRE_LATENCY_TARGET;
+    server.active_expire_effort = ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC;
+    server.active_defrag_enabled = REDIS_DEFAULT_ACTIVE_DEFRAG;
+    server.active_defrag_ignore_bytes = REDIS_DEFAULT_ACTIVE_DEFRAG_IGNORE_BYTES;
+    server.active_defrag_threshold_lower = REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD_LOWER;
+    server.active_defrag_threshold_upper = REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD_UPPER;
+    server.active_defrag_cycle_min = REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE_MIN;
+    server.active_defrag_cycle_max = REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE_MAX;
+    server.active_defrag_running = 0;
     server.client_max_querybuf_len = REDIS_MAX_QUERYBUF_LEN;
     server.saveparams = NULL;
     server.loading = 0;
+    server.async_loading = 0;
     server.logfile = zstrdup(REDIS_DEFAULT_LOGFILE);
     server.syslog_enabled = REDIS_DEFAULT_SYSLOG_ENABLED;
     server.syslog_ident = zstrdup(REDIS_DEFAULT_SYSLOG_IDENT);
@@ -1421,11 +1588,23 @@ void initServerConfig(void) {
     server.aof_flush_postponed_start = 0;
     server.aof_rewrite_incremental_fsync = REDIS_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC;
     server.aof_load_truncated = REDIS_DEFAULT_AOF_LOAD_TRUNCATED;
+    server.aof_use_rdb_preamble = REDIS_DEFAULT_AOF_USE_RDB_PREAMBLE;
+    server.aof_multi_part = REDIS_DEFAULT_AOF_MULTI_PART;
+    server.aof_manifest = NULL;
+    server.aof_incr_size = 0;
+    server.aof_rewrite_incr_count = 0;
+    server.aof_threaded_write = REDIS_DEFAULT_AOF_THREADED_WRITE;
     server.pidfile = zstrdup(REDIS_DEFAULT_PID_FILE);
     server.rdb_filename = zstrdup(REDIS_DEFAULT_RDB_FILENAME);
     server.aof_filename = zstrdup(REDIS_DEFAULT_AOF_FILENAME);
     server.requirepass = NULL;
     server.rdb_compression = REDIS_DEFAULT_RDB_COMPRESSION;
+    server.rdb_compression_algo = REDIS_DEFAULT_RDB_COMPRESSION_ALGO;
+    server.rdb_zstd_level = REDIS_DEFAULT_RDB_ZSTD_LEVEL;
+    server.rdb_zstd_dict_file = NULL;
+    server.rdb_save_threads = REDIS_DEFAULT_RDB_SAVE_THREADS;
+    server.rdb_threaded_load = REDIS_DEFAULT_RDB_THREADED_LOAD;
+    server.rdb_threaded_snapshot = REDIS_DEFAULT_RDB_THREADED_SNAPSHOT;
     server.rdb_checksum = REDIS_DEFAULT_RDB_CHECKSUM;
     server.stop_writes_on_bgsave_err = REDIS_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
     server.activerehashing = REDIS_DEFAULT_ACTIVE_REHASHING;
@@ -1483,15 +1662,25 @@ void initServerConfig(void) {
     server.repl_disable_tcp_nodelay = REDIS_DEFAULT_REPL_DISABLE_TCP_NODELAY;
     server.repl_diskless_sync = REDIS_DEFAULT_REPL_DISKLESS_SYNC;
     server.repl_diskless_sync_delay = REDIS_DEFAULT_REPL_DISKLESS_SYNC_DELAY;
+    server.repl_diskless_load = REDIS_DEFAULT_REPL_DISKLESS_LOAD;
+    server.repl_compression = REDIS_DEFAULT_REPL_COMPRESSION;
+    server.repl_async_load = REDIS_DEFAULT_REPL_ASYNC_LOAD;
+    server.repl_link_lzf = 0;
+    server.repl_frame_buf = sdsempty();
+    server.repl_transfer_decoded = sdsempty();
     server.slave_priority = REDIS_DEFAULT_SLAVE_PRIORITY;
     server.master_repl_offset = 0;
+    changeReplicationId();
+    clearReplicationId2();
 
     /* Replication partial resync backlog */
     server.repl_backlog = NULL;
     server.repl_backlog_size = REDIS_DEFAULT_REPL_BACKLOG_SIZE;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
     server.repl_backlog_off = 0;
+    server.repl_buffer_mem = 0;
+    server.repl_backlog_disk_size = REDIS_DEFAULT_REPL_BACKLOG_DISK_SIZE;
+    server.repl_spill_histlen = 0;
     server.repl_backlog_time_limit = REDIS_DEFAULT_REPL_BACKLOG_TIME_LIMIT;
     server.repl_no_slaves_since = time(NULL);
 
@@ -1690,10 +1879,21 @@ void resetServerStats(void) {
     server.stat_keyspace_hits = 0;
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
+    server.stat_current_cow_bytes = 0;
+    server.stat_peak_cow_bytes = 0;
+    server.stat_rdb_cow_bytes = 0;
+    server.stat_aof_cow_bytes = 0;
     server.stat_rejected_conn = 0;
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
     server.stat_sync_partial_err = 0;
+    server.stat_repl_lzf_raw = 0;
+    server.stat_repl_lzf_sent = 0;
+    server.stat_expire_cycle_time_used = 0;
+    server.stat_active_defrag_hits = 0;
+    server.stat_active_defrag_misses = 0;
+    server.stat_active_defrag_key_hits = 0;
+    server.stat_active_defrag_key_misses = 0;
     memset(server.ops_sec_samples,0,sizeof(server.ops_sec_samples));
     server.ops_sec_idx = 0;
     server.ops_sec_last_sample_time = mstime();
@@ -1717,11 +1917,15 @@ void initServer(void) {
     server.clients = listCreate();
     server.clients_to_close = listCreate();
     server.slaves = listCreate();
+    server.repl_buffer_blocks = listCreate();
+    server.repl_spill_segments = listCreate();
     server.monitors = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
+    server.clients_waiting_offset = listCreate();
+    server.aof_wait_clients = listCreate();
     server.get_ack_from_slaves = 0;
     server.clients_paused = 0;
 
@@ -1763,7 +1967,15 @@ void initServer(void) {
         server.db[j].eviction_pool = evictionPoolAlloc();
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
-    }
+        server.db[j].expired_stale_perc = 0;
+    }
+    server.loading_db = server.db;
+    server.rdb_snapshot = NULL;
+    server.child_info_pipe[0] = -1;
+    server.child_info_pipe[1] = -1;
+    server.in_fork_child = 0;
+    server.lazyfree_dicts = listCreate();
+    server.lazyfree_pending_objects = 0;
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
@@ -1788,6 +2000,8 @@ void initServer(void) {
     server.aof_last_write_status = REDIS_OK;
     server.aof_last_write_errno = 0;
     server.repl_good_slaves_count = 0;
+    server.el_iteration_start = 0;
+    server.el_busy_peak = 0;
     updateCachedTime();
 
     /* Create the serverCron() time event, that's our main way to process
@@ -1811,7 +2025,9 @@ void initServer(void) {
         acceptUnixHandler,NULL) == AE_ERR) redisPanic("Unrecoverable error creating server.sofd file event.");
 
     /* Open the AOF file if needed. */
-    if (server.aof_state == REDIS_AOF_ON) {
+    if (server.aof_state == REDIS_AOF_ON && server.aof_multi_part) {
+        if (aofMultiPartOpen() == REDIS_ERR) exit(1);
+    } else if (server.aof_state == REDIS_AOF_ON) {
         server.aof_fd = open(server.aof_filename,
                                O_WRONLY|O_APPEND|O_CREAT,0644);
         if (server.aof_fd == -1) {
@@ -1820,6 +2036,7 @@ void initServer(void) {
             exit(1);
         }
     }
+    if (server.aof_threaded_write) aofWriterInit();
 
     /* 32 bit instances are limited to 4GB of address space, so if there is
      * no explicit limit in the user provided configuration we set a limit
@@ -1837,6 +2054,8 @@ void initServer(void) {
     slowlogInit();
     latencyMonitorInit();
     bioInit();
+    if (rdbInitCompression() == REDIS_ERR) exit(1);
+    server.initial_memory_usage = zmalloc_used_memory();
 }
 
 /* Populates the Redis Command Table starting from the hard coded list
@@ -1865,6 +2084,7 @@ void populateCommandTable(void) {
             case 'M': c->flags |= REDIS_CMD_SKIP_MONITOR; break;
             case 'k': c->flags |= REDIS_CMD_ASKING; break;
             case 'F': c->flags |= REDIS_CMD_FAST; break;
+            case 'L': c->flags |= REDIS_CMD_NO_ASYNC_LOADING; break;
             default: redisPanic("Unsupported command flag"); break;
             }
             f++;
@@ -1997,7 +2217,7 @@ void call(redisClient *c, int flags) {
     /* Sent the command to clients in MONITOR mode, only if the commands are
      * not generated from reading an AOF. */
     if (listLength(server.monitors) &&
-        !server.loading &&
+        (!server.loading || server.async_loading) &&
         !(c->cmd->flags & REDIS_CMD_SKIP_MONITOR))
     {
         replicationFeedMonitors(c,server.monitors,c->db->id,c->argv,c->argc);
@@ -2073,6 +2293,18 @@ void call(redisClient *c, int flags) {
     server.stat_numcommands++;
 }
 
+/* Return true if 'cmd' can't be executed because we are loading the
+ * dataset. When a slave loads the new dataset of its master in the
+ * background, the old one is still served to readers, but writes would be
+ * lost with the swap, so they are refused, together with the commands that
+ * would interfere with the load in progress, like SLAVEOF or DEBUG RELOAD,
+ * or that could execute writes, like EXEC. */
+int commandDeniedWhileLoading(struct redisCommand *cmd) {
+    if (!server.loading || cmd->flags & REDIS_CMD_LOADING) return 0;
+    if (!server.async_loading) return 1;
+    return (cmd->flags & (REDIS_CMD_WRITE|REDIS_CMD_NO_ASYNC_LOADING)) != 0;
+}
+
 /* If this function gets called we already read a whole
  * command, arguments are in the client argv/argc fields.
  * processCommand() execute the command or prepare the
@@ -2239,7 +2471,7 @@ int processCommand(redisClient *c) {
 
     /* Loading DB? Return an error if the command has not the
      * REDIS_CMD_LOADING flag. */
-    if (server.loading && !(c->cmd->flags & REDIS_CMD_LOADING)) {
+    if (commandDeniedWhileLoading(c->cmd)) {
         addReply(c, shared.loadingerr);
         return REDIS_OK;
     }
@@ -2276,6 +2508,34 @@ int processCommand(redisClient *c) {
     return REDIS_OK;
 }
 
+/* Lightweight version of processCommand() for the commands received from
+ * our master. None of the checks performed by processCommand() can fail for
+ * the master client when not in a transaction, not loading, without a
+ * maxmemory limit and without a timed out script, so in this case the
+ * command is just looked up and executed. The command is only propagated
+ * to the AOF (our slaves receive the master stream as it is), and it is
+ * neither logged in the slow log nor accounted in the commands stats.
+ *
+ * Anything else is handled by processCommand(). */
+int processMasterCommand(redisClient *c) {
+    struct redisCommand *cmd;
+
+    if (c->flags & REDIS_MULTI || server.maxmemory || server.loading ||
+        server.lua_timedout) return processCommand(c);
+
+    cmd = lookupCommand(c->argv[0]->ptr);
+    if (cmd == NULL ||
+        (cmd->arity > 0 && cmd->arity != c->argc) ||
+        (c->argc < -cmd->arity)) return processCommand(c);
+
+    c->cmd = c->lastcmd = cmd;
+    call(c,REDIS_CALL_PROPAGATE);
+    c->woff = server.master_repl_offset;
+    if (listLength(server.ready_keys))
+        handleClientsBlockedOnLists();
+    return REDIS_OK;
+}
+
 /*================================== Shutdown =============================== */
 
 /* Close listening sockets. Also unlink the unix domain socket if
@@ -2306,6 +2566,7 @@ int prepareForShutdown(int flags) {
         kill(server.rdb_child_pid,SIGUSR1);
         rdbRemoveTempFile(server.rdb_child_pid);
     }
+    if (server.rdb_snapshot) rdbSnapshotAbort();
     if (server.aof_state != REDIS_AOF_OFF) {
         /* Kill the AOF saving child as the AOF we already have may be longer
          * but contains the full dataset anyway. */
@@ -2322,6 +2583,7 @@ int prepareForShutdown(int flags) {
         }
         /* Append only file: fsync() the AOF and exit */
         redisLog(REDIS_NOTICE,"Calling fsync() on the AOF file.");
+        flushAppendOnlyFile(1);
         aof_fsync(server.aof_fd);
     }
     if ((server.saveparamslen > 0 && !nosave) || save) {
@@ -2664,6 +2926,20 @@ sds genRedisInfoString(char *section) {
         char hmem[64];
         char peak_hmem[64];
         size_t zmalloc_used = zmalloc_used_memory();
+        size_t allocator_frag_bytes;
+        float allocator_frag_pct =
+            getAllocatorFragmentation(&allocator_frag_bytes);
+        size_t mem_clients = zmalloc_category_used(ZMALLOC_CAT_CLIENTS);
+        size_t mem_repl = zmalloc_category_used(ZMALLOC_CAT_REPLICATION);
+        size_t mem_aof = zmalloc_category_used(ZMALLOC_CAT_AOF);
+        size_t mem_scripting = zmalloc_category_used(ZMALLOC_CAT_SCRIPTING);
+        size_t mem_cluster = zmalloc_category_used(ZMALLOC_CAT_CLUSTER);
+        size_t mem_keyspace = server.initial_memory_usage+mem_clients+
+                              mem_repl+mem_aof+mem_scripting+mem_cluster;
+
+        /* The keyspace is what is not accounted to the other categories. */
+        mem_keyspace = (zmalloc_used > mem_keyspace) ?
+                       zmalloc_used-mem_keyspace : 0;
 
         /* Peak memory is updated from time to time by serverCron() so it
          * may happen that the instantaneous value is slightly bigger than
@@ -2684,6 +2960,17 @@ sds genRedisInfoString(char *section) {
             "used_memory_peak_human:%s\r\n"
             "used_memory_lua:%lld\r\n"
             "mem_fragmentation_ratio:%.2f\r\n"
+            "allocator_frag_pct:%.2f\r\n"
+            "allocator_frag_bytes:%zu\r\n"
+            "used_memory_startup:%zu\r\n"
+            "used_memory_keyspace:%zu\r\n"
+            "used_memory_clients:%zu\r\n"
+            "used_memory_replication:%zu\r\n"
+            "used_memory_aof:%zu\r\n"
+            "used_memory_scripting:%zu\r\n"
+            "used_memory_cluster:%zu\r\n"
+            "used_memory_not_counted:%zu\r\n"
+            "lazyfree_pending_objects:%llu\r\n"
             "mem_allocator:%s\r\n",
             zmalloc_used,
             hmem,
@@ -2692,6 +2979,17 @@ sds genRedisInfoString(char *section) {
             peak_hmem,
             ((long long)lua_gc(server.lua,LUA_GCCOUNT,0))*1024LL,
             zmalloc_get_fragmentation_ratio(server.resident_set_size),
+            allocator_frag_pct,
+            allocator_frag_bytes,
+            server.initial_memory_usage,
+            mem_keyspace,
+            mem_clients,
+            mem_repl,
+            mem_aof,
+            mem_scripting,
+            mem_cluster,
+            freeMemoryGetNotCountedMemory(),
+            server.lazyfree_pending_objects,
             ZMALLOC_LIB
             );
     }
@@ -2702,6 +3000,7 @@ sds genRedisInfoString(char *section) {
         info = sdscatprintf(info,
             "# Persistence\r\n"
             "loading:%d\r\n"
+            "async_loading:%d\r\n"
             "rdb_changes_since_last_save:%lld\r\n"
             "rdb_bgsave_in_progress:%d\r\n"
             "rdb_last_save_time:%jd\r\n"
@@ -2714,14 +3013,20 @@ sds genRedisInfoString(char *section) {
             "aof_last_rewrite_time_sec:%jd\r\n"
             "aof_current_rewrite_time_sec:%jd\r\n"
             "aof_last_bgrewrite_status:%s\r\n"
-            "aof_last_write_status:%s\r\n",
-            server.loading,
+            "aof_last_write_status:%s\r\n"
+            "current_cow_size:%zu\r\n"
+            "current_cow_peak:%zu\r\n"
+            "rdb_last_cow_size:%zu\r\n"
+            "aof_last_cow_size:%zu\r\n",
+            server.loading && !server.async_loading,
+            server.async_loading,
             server.dirty,
-            server.rdb_child_pid != -1,
+            server.rdb_child_pid != -1 || server.rdb_snapshot != NULL,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == REDIS_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.rdb_child_pid == -1) ?
+            (intmax_t)((server.rdb_child_pid == -1 &&
+                        server.rdb_snapshot == NULL) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.aof_state != REDIS_AOF_OFF,
             server.aof_child_pid != -1,
@@ -2730,7 +3035,11 @@ sds genRedisInfoString(char *section) {
             (intmax_t)((server.aof_child_pid == -1) ?
                 -1 : time(NULL)-server.aof_rewrite_time_start),
             (server.aof_lastbgrewrite_status == REDIS_OK) ? "ok" : "err",
-            (server.aof_last_write_status == REDIS_OK) ? "ok" : "err");
+            (server.aof_last_write_status == REDIS_OK) ? "ok" : "err",
+            server.stat_current_cow_bytes,
+            server.stat_peak_cow_bytes,
+            server.stat_rdb_cow_bytes,
+            server.stat_aof_cow_bytes);
 
         if (server.aof_state != REDIS_AOF_OFF) {
             info = sdscatprintf(info,
@@ -2784,6 +3093,9 @@ sds genRedisInfoString(char *section) {
 
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
+        double stale_perc;
+        long long stale_keys = activeExpireEstimateStaleKeys(&stale_perc);
+
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -2795,13 +3107,22 @@ sds genRedisInfoString(char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_stale_perc:%.2f\r\n"
+            "expired_stale_keys_estimate:%lld\r\n"
+            "expire_cycle_cpu_perc:%d\r\n"
+            "expire_cycle_cpu_milliseconds:%lld\r\n"
             "evicted_keys:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
             "latest_fork_usec:%lld\r\n"
-            "migrate_cached_sockets:%ld\r\n",
+            "migrate_cached_sockets:%ld\r\n"
+            "active_defrag_running:%d\r\n"
+            "active_defrag_hits:%lld\r\n"
+            "active_defrag_misses:%lld\r\n"
+            "active_defrag_key_hits:%lld\r\n"
+            "active_defrag_key_misses:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getOperationsPerSecond(),
@@ -2810,13 +3131,22 @@ sds genRedisInfoString(char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            stale_perc,
+            stale_keys,
+            server.active_expire_effort,
+            server.stat_expire_cycle_time_used/1000,
             server.stat_evictedkeys,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
             listLength(server.pubsub_patterns),
             server.stat_fork_time,
-            dictSize(server.migrate_cached_sockets));
+            dictSize(server.migrate_cached_sockets),
+            server.active_defrag_running,
+            server.stat_active_defrag_hits,
+            server.stat_active_defrag_misses,
+            server.stat_active_defrag_key_hits,
+            server.stat_active_defrag_key_misses);
     }
 
     /* Replication */
@@ -2840,6 +3170,7 @@ sds genRedisInfoString(char *section) {
                 "master_link_status:%s\r\n"
                 "master_last_io_seconds_ago:%d\r\n"
                 "master_sync_in_progress:%d\r\n"
+                "master_link_compression:%s\r\n"
                 "slave_repl_offset:%lld\r\n"
                 ,server.masterhost,
                 server.masterport,
@@ -2848,6 +3179,7 @@ sds genRedisInfoString(char *section) {
                 server.master ?
                 ((int)(server.unixtime-server.master->lastinteraction)) : -1,
                 server.repl_state == REDIS_REPL_TRANSFER,
+                server.repl_link_lzf ? "lzf" : "none",
                 slave_repl_offset
             );
 
@@ -2918,23 +3250,42 @@ sds genRedisInfoString(char *section) {
 
                 info = sdscatprintf(info,
                     "slave%d:ip=%s,port=%d,state=%s,"
-                    "offset=%lld,lag=%ld\r\n",
+                    "offset=%lld,lag=%ld,lzf=%d\r\n",
                     slaveid,ip,slave->slave_listening_port,state,
-                    slave->repl_ack_off, lag);
+                    slave->repl_ack_off, lag,
+                    (slave->flags & REDIS_REPL_LZF) != 0);
                 slaveid++;
             }
         }
         info = sdscatprintf(info,
+            "master_replid:%s\r\n"
+            "master_replid2:%s\r\n"
             "master_repl_offset:%lld\r\n"
+            "second_repl_offset:%lld\r\n"
             "repl_backlog_active:%d\r\n"
             "repl_backlog_size:%lld\r\n"
             "repl_backlog_first_byte_offset:%lld\r\n"
-            "repl_backlog_histlen:%lld\r\n",
+            "repl_backlog_histlen:%lld\r\n"
+            "repl_backlog_disk_size:%lld\r\n"
+            "repl_backlog_disk_first_byte_offset:%lld\r\n"
+            "repl_backlog_disk_histlen:%lld\r\n"
+            "repl_lzf_raw_bytes:%lld\r\n"
+            "repl_lzf_sent_bytes:%lld\r\n",
+            server.replid,
+            server.replid2,
             server.master_repl_offset,
+            server.second_replid_offset,
             server.repl_backlog != NULL,
             server.repl_backlog_size,
             server.repl_backlog_off,
-            server.repl_backlog_histlen);
+            server.repl_backlog_histlen,
+            server.repl_backlog_disk_size,
+            listLength(server.repl_spill_segments) ? ((replSpillSegment*)
+                listNodeValue(listFirst(server.repl_spill_segments)))->
+                repl_offset : 0,
+            server.repl_spill_histlen,
+            server.stat_repl_lzf_raw,
+            server.stat_repl_lzf_sent);
     }
 
     /* CPU */
@@ -3105,7 +3456,6 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEn
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
-        robj *o;
         dictEntry *de;
 
         de = samples[j];
@@ -3114,8 +3464,7 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEn
          * dictionary (but the expires one) we need to lookup the key
          * again in the key dictionary to obtain the value object. */
         if (sampledict != keydict) de = dictFind(keydict, key);
-        o = dictGetVal(de);
-        idle = estimateObjectIdleTime(o);
+        idle = estimateIdleTimeFromLRU(dbGetValLRU(de));
 
         /* Insert the element inside the pool.
          * First, find the first empty bucket or the first populated
@@ -3153,32 +3502,27 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEn
     if (samples != _samples) zfree(samples);
 }
 
+/* Return the amount of memory that freeMemoryIfNeeded() should not count
+ * against the maxmemory limit, as tracked by the zmalloc categories. */
+size_t freeMemoryGetNotCountedMemory(void) {
+    return zmalloc_category_used(ZMALLOC_CAT_REPLICATION)+
+           zmalloc_category_used(ZMALLOC_CAT_AOF);
+}
+
 int freeMemoryIfNeeded(void) {
-    size_t mem_used, mem_tofree, mem_freed;
+    size_t mem_used, mem_tofree, mem_freed, mem_not_counted;
     int slaves = listLength(server.slaves);
     mstime_t latency;
 
-    /* Remove the size of slaves output buffers and AOF buffer from the
-     * count of used memory. */
+    /* Remove the size of slaves output buffers, the replication backlog
+     * and the AOF buffers from the count of used memory: evicting keys
+     * is not going to make them smaller. */
     mem_used = zmalloc_used_memory();
-    if (slaves) {
-        listIter li;
-        listNode *ln;
-
-        listRewind(server.slaves,&li);
-        while((ln = listNext(&li))) {
-            redisClient *slave = listNodeValue(ln);
-            unsigned long obuf_bytes = getClientOutputBufferMemoryUsage(slave);
-            if (obuf_bytes > mem_used)
-                mem_used = 0;
-            else
-                mem_used -= obuf_bytes;
-        }
-    }
-    if (server.aof_state != REDIS_AOF_OFF) {
-        mem_used -= sdslen(server.aof_buf);
-        mem_used -= aofRewriteBufferSize();
-    }
+    mem_not_counted = freeMemoryGetNotCountedMemory();
+    if (mem_not_counted > mem_used)
+        mem_used = 0;
+    else
+        mem_used -= mem_not_counted;
 
     /* Check if we are over the memory limit. */
     if (mem_used <= server.maxmemory) return REDIS_OK;
@@ -3486,12 +3830,29 @@ int checkForSentinelMode(int argc, char **argv) {
 void loadDataFromDisk(void) {
     long long start = ustime();
     if (server.aof_state == REDIS_AOF_ON) {
-        if (loadAppendOnlyFile(server.aof_filename) == REDIS_OK)
+        if (loadAppendOnlyFiles() == REDIS_OK)
             redisLog(REDIS_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
     } else {
         if (rdbLoad(server.rdb_filename) == REDIS_OK) {
+            rdbReplInfo *ri = &server.rdb_repl_info;
+
             redisLog(REDIS_NOTICE,"DB loaded from disk: %.3f seconds",
                 (float)(ustime()-start)/1000000);
+
+            /* If we are a slave, restore the replication ID and offset of
+             * the dataset, so that we can try a partial resynchronization
+             * with our master instead of transferring the whole dataset. */
+            if ((server.masterhost ||
+                 (server.cluster_enabled &&
+                  nodeIsSlave(server.cluster->myself))) &&
+                ri->repl_id_is_set && ri->repl_offset != -1 &&
+                ri->repl_stream_db != -1)
+            {
+                memcpy(server.replid,ri->repl_id,sizeof(server.replid));
+                server.master_repl_offset = ri->repl_offset;
+                replicationCacheMasterUsingMyself();
+                selectDb(server.cached_master,ri->repl_stream_db);
+            }
         } else if (errno != ENOENT) {
             redisLog(REDIS_WARNING,"Fatal error loading the DB: %s. Exiting.",strerror(errno));
             exit(1);
@@ -3521,6 +3882,52 @@ void redisSetProcTitle(char *title) {
 #endif
 }
 
+#ifdef REDIS_TEST
+#include "testhelp.h"
+
+/* Check which commands are accepted by processCommand() while a slave
+ * loads the dataset of its master, in the foreground and in the
+ * background. Build with make REDIS_CFLAGS=-DREDIS_TEST, and run with:
+ * redis-server test async-loading */
+static int asyncLoadingTest(void) {
+    char *denied_async[] = {"set","del","flushall","exec","slaveof","debug",
+                            "sync","psync",NULL};
+    char *allowed_async[] = {"get","hgetall","multi","discard","ping","info",
+                             "waitoffset",NULL};
+    char **p;
+    char descr[128];
+
+    server.loading = 1;
+    server.async_loading = 0;
+    for (p = allowed_async; *p; p++) {
+        struct redisCommand *cmd = lookupCommandByCString(*p);
+
+        snprintf(descr,sizeof(descr),"%s only allowed by 'l' while loading",*p);
+        test_cond(descr, cmd->flags & REDIS_CMD_LOADING ||
+                         commandDeniedWhileLoading(cmd));
+    }
+
+    server.async_loading = 1;
+    for (p = denied_async; *p; p++) {
+        snprintf(descr,sizeof(descr),"%s denied while async loading",*p);
+        test_cond(descr,commandDeniedWhileLoading(lookupCommandByCString(*p)));
+    }
+    for (p = allowed_async; *p; p++) {
+        snprintf(descr,sizeof(descr),"%s allowed while async loading",*p);
+        test_cond(descr,!commandDeniedWhileLoading(lookupCommandByCString(*p)));
+    }
+
+    server.loading = 0;
+    server.async_loading = 0;
+    for (p = denied_async; *p; p++) {
+        snprintf(descr,sizeof(descr),"%s allowed when not loading",*p);
+        test_cond(descr,!commandDeniedWhileLoading(lookupCommandByCString(*p)));
+    }
+    test_report();
+    return 0;
+}
+#endif
+
 int main(int argc, char **argv) {
     struct timeval tv;
 
@@ -3531,12 +3938,21 @@ int main(int argc, char **argv) {
     setlocale(LC_COLLATE,"");
     zmalloc_enable_thread_safeness();
     zmalloc_set_oom_handler(redisOutOfMemoryHandler);
+    crc64_init();
     srand(time(NULL)^getpid());
     gettimeofday(&tv,NULL);
     dictSetHashFunctionSeed(tv.tv_sec^tv.tv_usec^getpid());
     server.sentinel_mode = checkForSentinelMode(argc,argv);
     initServerConfig();
 
+#ifdef REDIS_TEST
+    if (argc == 3 && !strcasecmp(argv[1],"test")) {
+        if (!strcasecmp(argv[2],"async-loading")) return asyncLoadingTest();
+        fprintf(stderr,"Unknown test '%s'\n",argv[2]);
+        return 1;
+    }
+#endif
+
     /* We need to init sentinel right now as parsing the configuration file
      * in sentinel mode will have the effect of populating the sentinel
      * data structures with master nodes to monitor. */
@@ -3635,6 +4051,7 @@ int main(int argc, char **argv) {
     }
 
     aeSetBeforeSleepProc(server.el,beforeSleep);
+    aeSetAfterSleepProc(server.el,afterSleep);
     aeMain(server.el);
     aeDeleteEventLoop(server.el);
     return 0;
@@ -101,6 +101,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_DEFAULT_REPL_BACKLOG_SIZE (1024*1024)    /* 1mb */
 #define REDIS_DEFAULT_REPL_BACKLOG_TIME_LIMIT (60*60)  /* 1 hour */
 #define REDIS_REPL_BACKLOG_MIN_SIZE (1024*16)          /* 16k */
+#define REDIS_REPL_BUFFER_BLOCK_SIZE (1024*16)         /* 16k */
+#define REDIS_DEFAULT_REPL_BACKLOG_DISK_SIZE 0         /* Spill disabled. */
+#define REDIS_REPL_SPILL_SEGMENT_SIZE (1024*1024*64)   /* 64mb */
 #define REDIS_BGSAVE_RETRY_DELAY 5 /* Wait a few secs before trying again. */
 #define REDIS_DEFAULT_PID_FILE "/var/run/redis.pid"
 #define REDIS_DEFAULT_SYSLOG_IDENT "redis"
@@ -112,10 +115,19 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_DEFAULT_SYSLOG_ENABLED 0
 #define REDIS_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR 1
 #define REDIS_DEFAULT_RDB_COMPRESSION 1
+#define REDIS_DEFAULT_RDB_COMPRESSION_ALGO REDIS_RDB_COMPRESS_LZF
+#define REDIS_DEFAULT_RDB_ZSTD_LEVEL 3
+#define REDIS_DEFAULT_RDB_SAVE_THREADS 1
+#define REDIS_RDB_SAVE_MAX_THREADS 64
+#define REDIS_DEFAULT_RDB_THREADED_LOAD 0
+#define REDIS_DEFAULT_RDB_THREADED_SNAPSHOT 0
 #define REDIS_DEFAULT_RDB_CHECKSUM 1
 #define REDIS_DEFAULT_RDB_FILENAME "dump.rdb"
 #define REDIS_DEFAULT_REPL_DISKLESS_SYNC 0
 #define REDIS_DEFAULT_REPL_DISKLESS_SYNC_DELAY 5
+#define REDIS_DEFAULT_REPL_DISKLESS_LOAD REDIS_REPL_DISKLESS_LOAD_DISABLED
+#define REDIS_DEFAULT_REPL_COMPRESSION 0
+#define REDIS_DEFAULT_REPL_ASYNC_LOAD 0
 #define REDIS_DEFAULT_SLAVE_SERVE_STALE_DATA 1
 #define REDIS_DEFAULT_SLAVE_READ_ONLY 1
 #define REDIS_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
@@ -124,6 +136,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_DEFAULT_AOF_FILENAME "appendonly.aof"
 #define REDIS_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define REDIS_DEFAULT_AOF_LOAD_TRUNCATED 1
+#define REDIS_DEFAULT_AOF_USE_RDB_PREAMBLE 0
+#define REDIS_DEFAULT_AOF_MULTI_PART 0
+#define REDIS_DEFAULT_AOF_THREADED_WRITE 0
 #define REDIS_DEFAULT_ACTIVE_REHASHING 1
 #define REDIS_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define REDIS_DEFAULT_MIN_SLAVES_TO_WRITE 0
@@ -137,8 +152,21 @@ typedef long long mstime_t; /* millisecond time type. */
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for keys collection */
+#define LAZYFREE_CYCLE_TIME_PERC 25 /* CPU max % for lazy freeing in cron */
+#define ACTIVE_EXPIRE_CYCLE_MIN_TIME_PERC 5 /* CPU % floor when backing off. */
+#define ACTIVE_EXPIRE_CYCLE_EFFORT_STEP 5 /* CPU % added per cron when raising. */
+#define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE 10 /* % of stale keys tolerated. */
+#define ACTIVE_EXPIRE_CYCLE_HIGH_STALE 50 /* % of stale keys to use max CPU. */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
+#define REDIS_DEFAULT_ACTIVE_EXPIRE_MAX_CPU 50
+#define REDIS_DEFAULT_ACTIVE_EXPIRE_LATENCY_TARGET 0
+#define REDIS_DEFAULT_ACTIVE_DEFRAG 0
+#define REDIS_DEFAULT_ACTIVE_DEFRAG_IGNORE_BYTES (100<<20) /* 100mb */
+#define REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD_LOWER 10 /* % of fragmentation */
+#define REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD_UPPER 100 /* % of fragmentation */
+#define REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE_MIN 25 /* % of CPU when frag is low */
+#define REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE_MAX 75 /* % of CPU when frag is high */
 
 /* Protocol and I/O related defines */
 #define REDIS_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
@@ -148,6 +176,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_MBULK_BIG_ARG     (1024*32)
 #define REDIS_LONGSTR_SIZE      21          /* Bytes needed for long -> str */
 #define REDIS_AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
+#define REDIS_AOF_READ_DIFF_INTERVAL_BYTES (1024*10) /* See aofReadDiffFromParent() */
 /* When configuring the Redis eventloop, we setup it so that the total number
  * of file descriptors we can handle are server.maxclients + RESERVED_FDS + FDSET_INCR
  * that is our safety margin. */
@@ -172,6 +201,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_CMD_SKIP_MONITOR 2048         /* "M" flag */
 #define REDIS_CMD_ASKING 4096               /* "k" flag */
 #define REDIS_CMD_FAST 8192                 /* "F" flag */
+#define REDIS_CMD_NO_ASYNC_LOADING 16384    /* "L" flag */
 
 /* Object types */
 #define REDIS_STRING 0
@@ -246,12 +276,34 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_PRE_PSYNC (1<<16)   /* Instance don't understand PSYNC. */
 #define REDIS_READONLY (1<<17)    /* Cluster client is in read-only state. */
 #define REDIS_PUBSUB (1<<18)      /* Client is in Pub/Sub mode. */
+#define REDIS_AOF_WAIT (1<<19)    /* Replies held until the AOF is synced. */
+#define REDIS_REPL_LZF (1<<20)    /* Replication link uses LZF frames. */
+
+/* Slave: how to load the RDB received from the master. */
+#define REDIS_REPL_DISKLESS_LOAD_DISABLED 0 /* Save on disk, then load. */
+#define REDIS_REPL_DISKLESS_LOAD_FLUSH 1    /* Flush, load from socket. */
+#define REDIS_REPL_DISKLESS_LOAD_SWAPDB 2   /* Load from socket into new DBs,
+                                               keep the old ones on error. */
+
+/* Slave capabilities, announced with REPLCONF capa. */
+#define REDIS_SLAVE_CAPA_NONE 0
+#define REDIS_SLAVE_CAPA_PSYNC2 (1<<0)  /* Understands +CONTINUE <replid>. */
+#define REDIS_SLAVE_CAPA_LZF (1<<1)     /* Can read a LZF framed stream. */
+
+/* LZF framing of the replication link. Every frame is made of the frame
+ * type, the payload length and the uncompressed length (32 bit little
+ * endian integers), followed by the payload. */
+#define REDIS_REPL_FRAME_HDR_LEN 9
+#define REDIS_REPL_FRAME_MAX_LEN (1024*64) /* Max uncompressed frame size. */
+#define REDIS_REPL_FRAME_RAW 'R'    /* Payload stored as it is. */
+#define REDIS_REPL_FRAME_LZF 'L'    /* Payload compressed with LZF. */
 
 /* Client block type (btype field in client structure)
  * if REDIS_BLOCKED flag is set. */
 #define REDIS_BLOCKED_NONE 0    /* Not blocked, no REDIS_BLOCKED flag set. */
 #define REDIS_BLOCKED_LIST 1    /* BLPOP & co. */
 #define REDIS_BLOCKED_WAIT 2    /* WAIT for synchronous replication. */
+#define REDIS_BLOCKED_OFFSET 3  /* WAITOFFSET on a slave. */
 
 /* Client request types */
 #define REDIS_REQ_INLINE 1
@@ -314,6 +366,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_FSYNC_EVERYSEC 2
 #define REDIS_DEFAULT_AOF_FSYNC AOF_FSYNC_EVERYSEC
 
+/* RDB string compression algorithms (rdb-compression-algo) */
+#define REDIS_RDB_COMPRESS_LZF 0
+#define REDIS_RDB_COMPRESS_LZ4 1    /* Requires USE_LZ4=yes */
+#define REDIS_RDB_COMPRESS_ZSTD 2   /* Requires USE_ZSTD=yes */
+
 /* Zip structure related defaults */
 #define REDIS_HASH_MAX_ZIPLIST_ENTRIES 512
 #define REDIS_HASH_MAX_ZIPLIST_VALUE 64
@@ -369,6 +426,10 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_RDB_CHILD_TYPE_DISK 1     /* RDB is written to disk. */
 #define REDIS_RDB_CHILD_TYPE_SOCKET 2   /* RDB is written to slave socket. */
 
+/* Kind of child sending a report over the child info pipe. */
+#define REDIS_CHILD_INFO_TYPE_RDB 1
+#define REDIS_CHILD_INFO_TYPE_AOF 2
+
 /* Keyspace changes notification classes. Every class is associated with a
  * character for configuration purposes. */
 #define REDIS_NOTIFY_KEYSPACE (1<<0)    /* K */
@@ -406,6 +467,23 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_LRU_BITS 24
 #define REDIS_LRU_CLOCK_MAX ((1<<REDIS_LRU_BITS)-1) /* Max value of obj->lru */
 #define REDIS_LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
+
+/* Values of the keyspace that are shared integers are stored inline in the
+ * value slot of the db->dict entry, so that every key gets its own LRU field
+ * without allocating an object. The slot holds a tagged word: bit 0 is set
+ * (real object pointers are aligned), the next REDIS_LRU_BITS bits are the
+ * LRU clock, and the remaining bits the integer value. Use dbGetVal() to
+ * read values from db->dict. */
+#define REDIS_DBVAL_INLINE_SHIFT (REDIS_LRU_BITS+1)
+#define REDIS_DBVAL_INLINE_MAX (1UL<<(sizeof(void*)*8-REDIS_DBVAL_INLINE_SHIFT))
+#define dbValIsInline(v) (((unsigned long)(v)) & 1)
+#define dbValInlineInt(v) ((long)(((unsigned long)(v))>>REDIS_DBVAL_INLINE_SHIFT))
+#define dbValInlineLRU(v) ((unsigned)((((unsigned long)(v))>>1)&REDIS_LRU_CLOCK_MAX))
+#define dbValMakeInline(n,lru) ((void*)((((unsigned long)(n))<<REDIS_DBVAL_INLINE_SHIFT)|(((unsigned long)(lru))<<1)|1))
+/* Objects with this refcount are never freed and incrRefCount() and
+ * decrRefCount() leave them untouched, so that they can be used by threads
+ * other than the main one without races on the refcount field. */
+#define REDIS_SHARED_REFCOUNT INT_MAX
 typedef struct redisObject {
     unsigned type:4;
     unsigned encoding:4;
@@ -447,6 +525,8 @@ struct evictionPoolEntry {
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
+typedef struct rdbSnapshot rdbSnapshot;
+
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
@@ -456,6 +536,8 @@ typedef struct redisDb {
     struct evictionPoolEntry *eviction_pool;    /* Eviction pool of keys */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
+    double expired_stale_perc;  /* Estimated % of already expired keys among
+                                   the keys with an expire set. */
 } redisDb;
 
 /* Client MULTI/EXEC state */
@@ -485,7 +567,7 @@ typedef struct blockingState {
     robj *target;           /* The key that should receive the element,
                              * for BRPOPLPUSH. */
 
-    /* REDIS_BLOCK_WAIT */
+    /* REDIS_BLOCK_WAIT and REDIS_BLOCK_OFFSET */
     int numreplicas;        /* Number of replicas we are waiting for ACK. */
     long long reploffset;   /* Replication offset to reach. */
 } blockingState;
@@ -506,6 +588,44 @@ typedef struct readyList {
     robj *key;
 } readyList;
 
+/* The replication stream is serialized once into a list of blocks shared by
+ * the backlog and by all the slaves. Every consumer just holds a cursor into
+ * the list, that is a reference to a block plus an offset inside it, and
+ * 'refcount' is the number of consumers whose cursor points to the block.
+ * Blocks at the head of the list that are no longer referenced are freed. */
+typedef struct replBufBlock {
+    int refcount;           /* Consumers with a cursor inside this block. */
+    long long repl_offset;  /* Replication offset of the first byte. */
+    size_t size, used;      /* Allocated and used bytes of 'buf'. */
+    char buf[];
+} replBufBlock;
+
+/* Replication information stored in the auxiliary fields of the RDB file,
+ * see rdbSaveRio(). It is filled by the RDB loader. */
+typedef struct rdbReplInfo {
+    int repl_id_is_set;                 /* True if repl_id is valid. */
+    char repl_id[REDIS_RUN_ID_SIZE+1];  /* Replication ID of the dataset. */
+    long long repl_offset;              /* Replication offset, or -1. */
+    int repl_stream_db;                 /* DB selected by the stream, or -1. */
+} rdbReplInfo;
+
+/* The replication backlog is one of the consumers of the shared replication
+ * buffer: it references the oldest block still available for partial
+ * resynchronizations. */
+typedef struct replBacklog {
+    listNode *ref_repl_buf_node; /* First block of the backlog, or NULL. */
+} replBacklog;
+
+/* When repl-backlog-disk-size is set, the blocks the backlog drops are
+ * appended to spill files instead of being lost. The files are unlinked as
+ * soon as they are created and are only accessed via 'fd'. The list of the
+ * segments, ordered by offset, is the index used to locate old offsets. */
+typedef struct replSpillSegment {
+    int fd;
+    long long repl_offset;  /* Replication offset of the first byte. */
+    long long len;          /* Bytes stored in the segment. */
+} replSpillSegment;
+
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a linked list. */
 typedef struct redisClient {
@@ -524,6 +644,8 @@ typedef struct redisClient {
     long bulklen;           /* length of bulk argument in multi bulk request */
     list *reply;
     unsigned long reply_bytes; /* Tot bytes of objects in reply list */
+    size_t mem_usage;       /* Buffers memory accounted to mem_cat. */
+    int mem_cat;            /* ZMALLOC_CAT_* the client is accounted to. */
     int sentlen;            /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time */
@@ -537,15 +659,25 @@ typedef struct redisClient {
     off_t repldboff;        /* replication DB file offset */
     off_t repldbsize;       /* replication DB file size */
     sds replpreamble;       /* replication DB preamble. */
-    long long reploff;      /* replication offset if this is our master */
+    sds repl_lzf_buf;       /* LZF frames not yet written to the slave. */
+    long long read_reploff; /* Read replication offset if this is a master */
+    long long reploff;      /* Applied replication offset if this is a master */
+    sds pending_querybuf;   /* Master stream read but not yet proxied to our
+                               slaves, if this is our master. */
     long long repl_ack_off; /* replication ack offset, if this is a slave */
     long long repl_ack_time;/* replication ack time, if this is a slave */
-    char replrunid[REDIS_RUN_ID_SIZE+1]; /* master run id if this is a master */
+    listNode *ref_repl_buf_node; /* Slave cursor in the replication buffer: */
+    size_t ref_block_pos;        /* block and offset of the next byte. */
+    long long repl_spill_off;    /* Next offset to read from the backlog
+                                    spill files, or -1. */
+    char replid[REDIS_RUN_ID_SIZE+1]; /* Master replication ID if master. */
     int slave_listening_port; /* As configured with: SLAVECONF listening-port */
+    int slave_capa;         /* REDIS_SLAVE_CAPA_* announced by the slave. */
     multiState mstate;      /* MULTI/EXEC state */
     int btype;              /* Type of blocking op if REDIS_BLOCKED. */
     blockingState bpop;     /* blocking state */
     long long woff;         /* Last write global replication offset. */
+    long long aof_wait_seq; /* AOF writer batch to sync if REDIS_AOF_WAIT. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
@@ -648,6 +780,8 @@ struct redisServer {
     char *configfile;           /* Absolute config file path, or NULL */
     int hz;                     /* serverCron() calls frequency in hertz */
     redisDb *db;
+    list *lazyfree_dicts;       /* Dictionaries released by lazyfreeCron() */
+    unsigned long long lazyfree_pending_objects; /* Entries still to free. */
     dict *commands;             /* Command table */
     dict *orig_commands;        /* Command table before command renaming. */
     aeEventLoop *el;
@@ -683,6 +817,10 @@ struct redisServer {
     uint64_t next_client_id;    /* Next client unique ID. Incremental. */
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
+    int async_loading;          /* Loading into loading_db while clients are
+                                   still served from server.db. */
+    redisDb *loading_db;        /* DBs filled by the RDB loader: server.db
+                                   unless async_loading is true. */
     off_t loading_total_bytes;
     off_t loading_loaded_bytes;
     time_t loading_start_time;
@@ -699,12 +837,26 @@ struct redisServer {
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     size_t stat_peak_memory;        /* Max used memory record */
+    size_t initial_memory_usage;    /* Bytes used after initialization. */
     long long stat_fork_time;       /* Time needed to perform latest fork() */
+    int child_info_pipe[2];         /* Children -> parent COW reports. */
+    int in_fork_child;              /* REDIS_CHILD_INFO_TYPE_* in a child, or 0. */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
+    size_t stat_current_cow_bytes;  /* Last COW size reported by a child. */
+    size_t stat_peak_cow_bytes;     /* Peak COW size since the last fork. */
+    size_t stat_rdb_cow_bytes;      /* COW size of the last RDB child. */
+    size_t stat_aof_cow_bytes;      /* COW size of the last AOF child. */
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
+    long long stat_repl_lzf_raw;    /* Bytes sent to slaves as LZF frames, */
+    long long stat_repl_lzf_sent;   /* before and after compression. */
+    long long stat_expire_cycle_time_used; /* Microseconds used by active expire. */
+    long long stat_active_defrag_hits;      /* Number of allocations moved */
+    long long stat_active_defrag_misses;    /* Allocations scanned but not moved */
+    long long stat_active_defrag_key_hits;  /* Keys with moved allocations */
+    long long stat_active_defrag_key_misses;/* Keys scanned but not moved */
     list *slowlog;                  /* SLOWLOG list of commands */
     long long slowlog_entry_id;     /* SLOWLOG current entry ID */
     long long slowlog_log_slower_than; /* SLOWLOG time limit (to get logged) */
@@ -721,6 +873,20 @@ struct redisServer {
     int maxidletime;                /* Client timeout in seconds */
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
+    int active_expire_max_cpu;      /* Max CPU % the expire cycle can reach. */
+    long long active_expire_latency_target; /* Back off when an event loop
+                                               iteration is slower (ms). */
+    int active_expire_effort;       /* Current CPU % of the slow expire cycle. */
+    long long el_iteration_start;   /* ustime() the event loop woke up. */
+    long long el_busy_peak;         /* Slowest event loop iteration (usec)
+                                       since the last serverCron(). */
+    int active_defrag_enabled;      /* Defrag the keyspace in serverCron(). */
+    long long active_defrag_ignore_bytes; /* Min fragmented bytes to defrag. */
+    int active_defrag_threshold_lower; /* Min fragmentation % to start. */
+    int active_defrag_threshold_upper; /* Fragmentation % for max effort. */
+    int active_defrag_cycle_min;    /* Min CPU % used by the defrag cycle. */
+    int active_defrag_cycle_max;    /* Max CPU % used by the defrag cycle. */
+    int active_defrag_running;      /* CPU % of the running scan, or 0. */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
     int dbnum;                      /* Total number of configured DBs */
     int daemonize;                  /* True if running as a daemon */
@@ -750,6 +916,14 @@ struct redisServer {
     int aof_last_write_status;      /* REDIS_OK or REDIS_ERR */
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
+    int aof_use_rdb_preamble;       /* Rewrite the AOF as RDB + commands. */
+    int aof_multi_part;             /* AOF split in base + incr files? */
+    struct aofManifest *aof_manifest; /* Files of the multi part AOF. */
+    off_t aof_incr_size;            /* Size of the incr file being written. */
+    unsigned long aof_rewrite_incr_count; /* Incr files covered by the
+                                             running rewrite. */
+    int aof_threaded_write;         /* Write the AOF in a background thread. */
+    list *aof_wait_clients;         /* Clients with REDIS_AOF_WAIT set. */
     /* AOF pipes used to communicate between parent and child during rewrite. */
     int aof_pipe_write_data_to_child;
     int aof_pipe_read_data_from_parent;
@@ -768,6 +942,15 @@ struct redisServer {
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression_algo;       /* REDIS_RDB_COMPRESS_* */
+    int rdb_zstd_level;             /* Zstandard compression level. */
+    char *rdb_zstd_dict_file;       /* Zstandard dictionary or NULL. */
+    int rdb_save_threads;           /* Threads serializing the RDB. */
+    int rdb_threaded_load;          /* Parse the RDB in a loader thread. */
+    int rdb_threaded_snapshot;      /* BGSAVE with a thread, not fork(). */
+    struct rdbSnapshot *rdb_snapshot; /* Fork-free BGSAVE in progress. */
+    rdbReplInfo rdb_repl_info;      /* Replication info of the last RDB
+                                       file loaded. */
     int rdb_checksum;               /* Use RDB checksum? */
     time_t lastsave;                /* Unix time of last successful save */
     time_t lastbgsave_try;          /* Unix time of last attempted bgsave */
@@ -787,14 +970,22 @@ struct redisServer {
     int syslog_facility;            /* Syslog facility */
     /* Replication (master) */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
+    char replid[REDIS_RUN_ID_SIZE+1];  /* Our current replication ID. */
+    char replid2[REDIS_RUN_ID_SIZE+1]; /* Replication ID of our old master. */
     long long master_repl_offset;   /* Global replication offset */
+    long long second_replid_offset; /* Accept offsets up to this for replid2,
+                                       or -1 if there is no replid2. */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
-    char *repl_backlog;             /* Replication backlog for partial syncs */
-    long long repl_backlog_size;    /* Backlog circular buffer size */
+    replBacklog *repl_backlog;      /* Replication backlog for partial syncs */
+    long long repl_backlog_size;    /* Backlog size */
     long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset */
+    list *repl_buffer_blocks;       /* Shared replication buffer blocks. */
+    size_t repl_buffer_mem;         /* Memory used by the blocks above. */
     long long repl_backlog_off;     /* Replication offset of first byte in the
                                        backlog buffer. */
+    long long repl_backlog_disk_size; /* Backlog spill files max size. */
+    list *repl_spill_segments;      /* Backlog spill files (replSpillSegment). */
+    long long repl_spill_histlen;   /* Bytes stored in the spill files. */
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
                                        gets released. */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
@@ -804,6 +995,11 @@ struct redisServer {
     int repl_good_slaves_count;     /* Number of slaves with lag <= max_lag. */
     int repl_diskless_sync;         /* Send RDB to slaves sockets directly. */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    int repl_diskless_load;         /* Slave: load the RDB from the socket.
+                                       REDIS_REPL_DISKLESS_LOAD_* */
+    int repl_compression;           /* Use LZF frames on replication links. */
+    int repl_async_load;            /* Slave: serve the old dataset while the
+                                       new one is loaded. */
     /* Replication (slave) */
     char *masterauth;               /* AUTH with this password with master */
     char *masterhost;               /* Hostname of master */
@@ -820,12 +1016,16 @@ struct redisServer {
     int repl_transfer_fd;    /* Slave -> Master SYNC temp file descriptor */
     char *repl_transfer_tmpfile; /* Slave-> master SYNC temp file name */
     time_t repl_transfer_lastio; /* Unix time of the latest read, for timeout */
+    int repl_link_lzf;       /* The link with our master uses LZF frames. */
+    sds repl_frame_buf;      /* Partial frame received from our master. */
+    sds repl_transfer_decoded; /* Decoded data not yet written to the RDB,
+                                  or following it, with LZF links. */
     int repl_serve_stale_data; /* Serve stale data when link is down? */
     int repl_slave_ro;          /* Slave is read only? */
     time_t repl_down_since; /* Unix time at which link with master went down */
     int repl_disable_tcp_nodelay;   /* Disable TCP_NODELAY after SYNC? */
     int slave_priority;             /* Reported in INFO and used by Sentinel. */
-    char repl_master_runid[REDIS_RUN_ID_SIZE+1];  /* Master run id for PSYNC. */
+    char master_replid[REDIS_RUN_ID_SIZE+1];  /* Master replid for PSYNC. */
     long long repl_master_initial_offset;         /* Master PSYNC offset. */
     /* Replication script cache. */
     dict *repl_scriptcache_dict;        /* SHA1 all slaves are aware of. */
@@ -834,6 +1034,7 @@ struct redisServer {
     /* Synchronous replication. */
     list *clients_waiting_acks;         /* Clients waiting in WAIT command. */
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
+    list *clients_waiting_offset;       /* Clients waiting in WAITOFFSET. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
@@ -899,6 +1100,33 @@ struct redisServer {
     int watchdog_period;  /* Software watchdog period in ms. 0 = off */
 };
 
+/* Memory overhead breakdown, as reported by MEMORY STATS. Filled by
+ * getMemoryOverheadData() and released with freeMemoryOverheadData(). */
+struct redisMemOverhead {
+    size_t peak_allocated;
+    size_t total_allocated;
+    size_t startup_allocated;
+    size_t repl_backlog;
+    size_t clients_slaves;
+    size_t clients_normal;
+    size_t aof_buffer;
+    size_t lua_caches;
+    size_t lua_vm;
+    size_t overhead_total;
+    size_t dataset;
+    size_t total_keys;
+    size_t bytes_per_key;
+    float dataset_perc;
+    float peak_perc;
+    float fragmentation;
+    size_t num_dbs;
+    struct {
+        size_t dbid;
+        size_t overhead_ht_main;
+        size_t overhead_ht_expires;
+    } *db;
+};
+
 typedef struct pubsubPattern {
     redisClient *client;
     robj *pattern;
@@ -992,6 +1220,8 @@ extern dictType zsetDictType;
 extern dictType clusterNodesDictType;
 extern dictType clusterNodesBlackListDictType;
 extern dictType dbDictType;
+extern dictType keyptrDictType;
+extern dictType keylistDictType;
 extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
@@ -1005,6 +1235,7 @@ extern dictType replScriptCacheDictType;
 long long ustime(void);
 long long mstime(void);
 void getRandomHexChars(char *p, unsigned int len);
+void crc64_init(void);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
@@ -1020,6 +1251,7 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void *addDeferredMultiBulkLength(redisClient *c);
 void setDeferredMultiBulkLength(redisClient *c, void *node, long length);
 void processInputBuffer(redisClient *c);
+void processInputBufferAndReplicate(redisClient *c);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -1044,10 +1276,15 @@ char *getClientPeerId(redisClient *client);
 sds catClientInfoString(sds s, redisClient *client);
 sds getAllClientsInfoString(void);
 void rewriteClientCommandVector(redisClient *c, int argc, ...);
+void replaceClientCommandVector(redisClient *c, int argc, robj **argv);
 void rewriteClientCommandArgument(redisClient *c, int i, robj *newval);
 unsigned long getClientOutputBufferMemoryUsage(redisClient *c);
+unsigned long getClientReplyListMemoryUsage(redisClient *c);
+int clientHasPendingReplies(redisClient *c);
+size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientsInAsyncFreeQueue(void);
 void asyncCloseClientOnOutputBufferLimitReached(redisClient *c);
+void updateClientMemUsage(redisClient *c);
 int getClientType(redisClient *c);
 int getClientTypeByName(char *name);
 char *getClientTypeName(int class);
@@ -1101,6 +1338,7 @@ void decrRefCount(robj *o);
 void decrRefCountVoid(void *o);
 void incrRefCount(robj *o);
 robj *resetRefCount(robj *obj);
+robj *makeObjectShared(robj *o);
 void freeStringObject(robj *o);
 void freeListObject(robj *o);
 void freeSetObject(robj *o);
@@ -1136,6 +1374,10 @@ int compareStringObjects(robj *a, robj *b);
 int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
+unsigned long long estimateIdleTimeFromLRU(unsigned int lru);
+size_t objectComputeSize(robj *o, size_t sample_size);
+struct redisMemOverhead *getMemoryOverheadData(void);
+void freeMemoryOverheadData(struct redisMemOverhead *mh);
 #define sdsEncodedObject(objptr) (objptr->encoding == REDIS_ENCODING_RAW || objptr->encoding == REDIS_ENCODING_EMBSTR)
 
 /* Synchronous I/O with timeout */
@@ -1150,7 +1392,19 @@ void updateSlavesWaitingBgsave(int bgsaveerr, int type);
 void replicationCron(void);
 void replicationHandleMasterDisconnection(void);
 void replicationCacheMaster(redisClient *c);
+void replicationCacheMasterUsingMyself(void);
+void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen);
+void changeReplicationId(void);
+void clearReplicationId2(void);
 void resizeReplicationBacklog(long long newsize);
+void resizeReplicationBacklogSpill(long long newsize);
+void resetReplicationBacklogSpill(void);
+long long replicationBacklogFirstOffset(void);
+ssize_t writeReplicationBufferToSlave(redisClient *c);
+sds replicationCompressFrames(sds s, const char *buf, size_t len);
+ssize_t replicationReadFrames(int fd, sds *dst);
+long long replicationSlavePendingBytes(redisClient *c);
+void replicationReleaseSlaveCursor(redisClient *c);
 void replicationSetMaster(char *ip, int port);
 void replicationUnsetMaster(void);
 void refreshGoodSlavesCount(void);
@@ -1160,6 +1414,9 @@ void replicationScriptCacheAdd(sds sha1);
 int replicationScriptCacheExists(sds sha1);
 void processClientsWaitingReplicas(void);
 void unblockClientWaitingReplicas(redisClient *c);
+void processClientsWaitingOffset(void);
+void unblockClientWaitingOffset(redisClient *c);
+long long replicationGetServedOffset(void);
 int replicationCountAcksByOffset(long long offset);
 void replicationSendNewlineToMaster(void);
 long long replicationGetSlaveOffset(void);
@@ -1167,6 +1424,7 @@ char *replicationGetSlaveName(redisClient *c);
 
 /* Generic persistence functions */
 void startLoading(FILE *fp);
+void startLoadingSize(off_t size);
 void loadingProgress(off_t pos);
 void stopLoading(void);
 
@@ -1179,11 +1437,16 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
 int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFiles(void);
+int aofMultiPartOpen(void);
+void aofWriterInit(void);
+void aofHoldClientReply(redisClient *c);
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
 void aofRewriteBufferReset(void);
 unsigned long aofRewriteBufferSize(void);
+ssize_t aofReadDiffFromParent(void);
 
 /* Sorted sets data type */
 
@@ -1215,7 +1478,10 @@ unsigned long zslGetRank(zskiplist *zsl, double score, robj *o);
 
 /* Core functions */
 int freeMemoryIfNeeded(void);
+size_t freeMemoryGetNotCountedMemory(void);
 int processCommand(redisClient *c);
+int commandDeniedWhileLoading(struct redisCommand *cmd);
+int processMasterCommand(redisClient *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
 struct redisCommand *lookupCommandByCString(char *s);
@@ -1244,6 +1510,24 @@ void closeListeningSockets(int unlink_unix_socket);
 void updateCachedTime(void);
 void resetServerStats(void);
 unsigned int getLRUClock(void);
+long long activeExpireEstimateStaleKeys(double *perc);
+
+/* Fork-free snapshotting */
+int rdbSnapshotStart(char *filename);
+void rdbSnapshotCron(void);
+void rdbSnapshotAbort(void);
+void rdbSnapshotFinish(void);
+void rdbSnapshotTouchKey(redisDb *db, sds key);
+
+/* Child info */
+void openChildInfoPipe(void);
+void closeChildInfoPipe(void);
+void sendChildCOWInfo(int final, char *pname);
+void receiveChildInfo(void);
+
+/* Active defragmentation */
+void activeDefragCycle(void);
+float getAllocatorFragmentation(size_t *out_frag_bytes);
 
 /* Set data type */
 robj *setTypeCreate(robj *value);
@@ -1304,6 +1588,8 @@ void propagateExpire(redisDb *db, robj *key);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(redisDb *db, robj *key, long long when);
+robj *dbGetVal(dictEntry *de);
+unsigned int dbGetValLRU(dictEntry *de);
 robj *lookupKey(redisDb *db, robj *key);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
@@ -1317,6 +1603,8 @@ robj *dbRandomKey(redisDb *db);
 int dbDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 long long emptyDb(void(callback)(void*));
+void freeDictLazily(dict *d);
+void lazyfreeCron(void);
 int selectDb(redisClient *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
@@ -1333,6 +1621,7 @@ void getKeysFreeResult(int *result);
 int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys);
 int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
+int *memoryGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 
 /* Cluster */
 void clusterInit(void);
@@ -1352,6 +1641,7 @@ void sentinelIsRunning(void);
 
 /* Scripting */
 void scriptingInit(void);
+int luaLoadScriptFromRdb(robj *body);
 
 /* Blocked clients */
 void processUnblockedClients(void);
@@ -1518,12 +1808,14 @@ void bitcountCommand(redisClient *c);
 void bitposCommand(redisClient *c);
 void replconfCommand(redisClient *c);
 void waitCommand(redisClient *c);
+void waitoffsetCommand(redisClient *c);
 void pfselftestCommand(redisClient *c);
 void pfaddCommand(redisClient *c);
 void pfcountCommand(redisClient *c);
 void pfmergeCommand(redisClient *c);
 void pfdebugCommand(redisClient *c);
 void latencyCommand(redisClient *c);
+void memoryCommand(redisClient *c);
 
 #if defined(__GNUC__)
 void *calloc(size_t count, size_t size) __attribute__ ((deprecated));
@@ -30,6 +30,8 @@
 
 
 #include "redis.h"
+#include "lzf.h"
+#include "endianconv.h"
 
 #include <sys/time.h>
 #include <unistd.h>
@@ -41,6 +43,7 @@ void replicationDiscardCachedMaster(void);
 void replicationResurrectCachedMaster(int newfd);
 void replicationSendAck(void);
 void putSlaveOnline(redisClient *slave);
+static void replicationFeedSlavesEpilogue(list *slaves, long long start_off);
 
 /* --------------------------- Utility functions ---------------------------- */
 
@@ -66,18 +69,354 @@ char *replicationGetSlaveName(redisClient *c) {
     return buf;
 }
 
+/* Generate a new replication ID. This is called when the history of our
+ * dataset no longer matches the one of the previous ID, for instance after
+ * the backlog was freed or when a slave is turned into a master. */
+void changeReplicationId(void) {
+    getRandomHexChars(server.replid,REDIS_RUN_ID_SIZE);
+    server.replid[REDIS_RUN_ID_SIZE] = '\0';
+}
+
+/* Clear the secondary replication ID: the old history is no longer valid
+ * for partial resynchronizations. */
+void clearReplicationId2(void) {
+    memset(server.replid2,'0',sizeof(server.replid));
+    server.replid2[REDIS_RUN_ID_SIZE] = '\0';
+    server.second_replid_offset = -1;
+}
+
+/* Use the current replication ID / offset as secondary replication ID,
+ * and change the current one. This is used when a slave is promoted to
+ * master: slaves of our old master can still PSYNC with us using the old
+ * ID, up to the offset where our history diverges from it. */
+static void shiftReplicationId(void) {
+    memcpy(server.replid2,server.replid,sizeof(server.replid));
+    /* We accept PSYNC requests up to our current offset plus one: a slave
+     * asking for the next byte was in sync with us, anything after that
+     * belongs to a different history. */
+    server.second_replid_offset = server.master_repl_offset+1;
+    changeReplicationId();
+    redisLog(REDIS_NOTICE,"Setting secondary replication ID to %s, valid up to offset: %lld. New replication ID is %s", server.replid2, server.second_replid_offset, server.replid);
+}
+
+/* Append to 's' the LZF frames encoding 'len' bytes at 'buf', splitting
+ * the data in frames of at most REDIS_REPL_FRAME_MAX_LEN bytes. Data that
+ * does not compress is stored in raw frames. Returns the new sds string. */
+sds replicationCompressFrames(sds s, const char *buf, size_t len) {
+    while(len) {
+        uint32_t rawlen, paylen, aux;
+        size_t hdrpos = sdslen(s);
+        char *hdr;
+
+        rawlen = len > REDIS_REPL_FRAME_MAX_LEN ? REDIS_REPL_FRAME_MAX_LEN : len;
+        s = sdsMakeRoomFor(s,REDIS_REPL_FRAME_HDR_LEN+rawlen);
+        hdr = s+hdrpos;
+
+        /* The compressed payload is only used if smaller than the data. */
+        paylen = (rawlen > 4) ?
+            lzf_compress(buf,rawlen,hdr+REDIS_REPL_FRAME_HDR_LEN,rawlen-1) : 0;
+        if (paylen == 0) {
+            hdr[0] = REDIS_REPL_FRAME_RAW;
+            memcpy(hdr+REDIS_REPL_FRAME_HDR_LEN,buf,rawlen);
+            paylen = rawlen;
+        } else {
+            hdr[0] = REDIS_REPL_FRAME_LZF;
+        }
+        aux = paylen;
+        memrev32ifbe(&aux);
+        memcpy(hdr+1,&aux,4);
+        aux = rawlen;
+        memrev32ifbe(&aux);
+        memcpy(hdr+5,&aux,4);
+        sdsIncrLen(s,REDIS_REPL_FRAME_HDR_LEN+paylen);
+        buf += rawlen;
+        len -= rawlen;
+    }
+    return s;
+}
+
+/* Read from 'fd', the LZF framed link with our master, and append to '*dst'
+ * the data of every frame completed so far. The bytes of a frame not yet
+ * completely received are retained in server.repl_frame_buf.
+ *
+ * Returns the number of bytes appended, 0 on EOF, or -1 on error. When data
+ * was read but no frame was completed -1 is returned with errno set to
+ * EAGAIN, like a non blocking read(2) would do, so callers don't need to
+ * handle this case in a special way. */
+ssize_t replicationReadFrames(int fd, sds *dst) {
+    size_t buflen = sdslen(server.repl_frame_buf), pos = 0;
+    ssize_t nread, decoded = 0;
+
+    server.repl_frame_buf = sdsMakeRoomFor(server.repl_frame_buf,
+                                           REDIS_IOBUF_LEN);
+    nread = read(fd,server.repl_frame_buf+buflen,REDIS_IOBUF_LEN);
+    if (nread <= 0) return nread;
+    sdsIncrLen(server.repl_frame_buf,nread);
+    buflen += nread;
+
+    while(buflen-pos >= REDIS_REPL_FRAME_HDR_LEN) {
+        char *hdr = server.repl_frame_buf+pos;
+        uint32_t paylen, rawlen;
+
+        memcpy(&paylen,hdr+1,4);
+        memrev32ifbe(&paylen);
+        memcpy(&rawlen,hdr+5,4);
+        memrev32ifbe(&rawlen);
+        if ((hdr[0] != REDIS_REPL_FRAME_RAW &&
+             hdr[0] != REDIS_REPL_FRAME_LZF) ||
+            rawlen == 0 || rawlen > REDIS_REPL_FRAME_MAX_LEN ||
+            paylen > rawlen ||
+            (hdr[0] == REDIS_REPL_FRAME_RAW && paylen != rawlen))
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        if (buflen-pos < REDIS_REPL_FRAME_HDR_LEN+paylen) break;
+
+        *dst = sdsMakeRoomFor(*dst,rawlen);
+        if (hdr[0] == REDIS_REPL_FRAME_RAW) {
+            memcpy(*dst+sdslen(*dst),hdr+REDIS_REPL_FRAME_HDR_LEN,rawlen);
+        } else if (lzf_decompress(hdr+REDIS_REPL_FRAME_HDR_LEN,paylen,
+                                  *dst+sdslen(*dst),rawlen) != rawlen)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        sdsIncrLen(*dst,rawlen);
+        decoded += rawlen;
+        pos += REDIS_REPL_FRAME_HDR_LEN+paylen;
+    }
+    sdsrange(server.repl_frame_buf,pos,-1);
+    if (decoded == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return decoded;
+}
+
 /* ---------------------------------- MASTER -------------------------------- */
 
+/* Free the blocks at the head of the shared replication buffer that are no
+ * longer referenced by any consumer. Consumers only move forward, so every
+ * block before the oldest cursor is unreferenced. */
+void freeUnreferencedReplicationBlocks(void) {
+    while(listLength(server.repl_buffer_blocks)) {
+        listNode *ln = listFirst(server.repl_buffer_blocks);
+        replBufBlock *b = listNodeValue(ln);
+        size_t mem = sizeof(*b)+b->size;
+
+        if (b->refcount) break;
+        zmalloc_category_sub(ZMALLOC_CAT_REPLICATION,mem);
+        server.repl_buffer_mem -= mem;
+        zfree(b);
+        listDelNode(server.repl_buffer_blocks,ln);
+    }
+}
+
+/* ------------------------ BACKLOG SPILL FILES -----------------------------
+ * Surviving long disconnections needs a backlog as large as the traffic
+ * generated meanwhile, that is often too much for memory. When the
+ * repl-backlog-disk-size option is non zero the blocks dropped by the
+ * in-memory backlog are appended to a sequence of segment files on disk,
+ * so that a PSYNC for an offset older than the in-memory backlog can still
+ * be served by streaming the segments to the slave (see
+ * writeReplicationBufferToSlave()) before switching to the memory buffer.
+ *
+ * The spill always ends where the in-memory backlog starts: the disk data
+ * is the backlog history just before server.repl_backlog_off. */
+
+/* Return the first replication offset we are able to serve to a slave,
+ * either from the spill files or from the in-memory backlog. */
+long long replicationBacklogFirstOffset(void) {
+    if (listLength(server.repl_spill_segments)) {
+        replSpillSegment *seg =
+            listNodeValue(listFirst(server.repl_spill_segments));
+        return seg->repl_offset;
+    }
+    return server.repl_backlog_off;
+}
+
+/* Disconnect the slaves still streaming data older than 'offset' from the
+ * spill files, since such data is going to be discarded. */
+static void replicationDropSpillReaders(long long offset) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        redisClient *slave = ln->value;
+
+        if (slave->repl_spill_off == -1 || slave->repl_spill_off >= offset)
+            continue;
+        redisLog(REDIS_WARNING,"Slave %s is too slow reading the backlog "
+            "spill files, closing its connection.",
+            replicationGetSlaveName(slave));
+        slave->repl_spill_off = -1;
+        freeClientAsync(slave);
+    }
+}
+
+/* Close the oldest segment of the spill files. */
+static void replicationDropSpillSegment(void) {
+    listNode *ln = listFirst(server.repl_spill_segments);
+    replSpillSegment *seg = listNodeValue(ln);
+
+    replicationDropSpillReaders(seg->repl_offset+seg->len);
+    server.repl_spill_histlen -= seg->len;
+    close(seg->fd);
+    zfree(seg);
+    listDelNode(server.repl_spill_segments,ln);
+}
+
+/* Discard all the spill files. */
+void resetReplicationBacklogSpill(void) {
+    while(listLength(server.repl_spill_segments))
+        replicationDropSpillSegment();
+}
+
+/* Append a block dropped by the in-memory backlog to the spill files,
+ * starting a new segment when the last one is full, and removing the
+ * oldest segments once we hold more than repl-backlog-disk-size bytes.
+ * On errors the spill is discarded: it will restart from the next block. */
+static void replicationSpillBlock(replBufBlock *b) {
+    listNode *ln = listLast(server.repl_spill_segments);
+    replSpillSegment *seg = ln ? listNodeValue(ln) : NULL;
+    char tmpfile[256];
+    ssize_t nwritten = 0;
+
+    if (server.repl_backlog_disk_size == 0 || b->used == 0) return;
+
+    /* The stream on disk must be contiguous. */
+    if (seg && seg->repl_offset+seg->len != b->repl_offset) {
+        resetReplicationBacklogSpill();
+        seg = NULL;
+    }
+
+    if (seg == NULL || seg->len >= REDIS_REPL_SPILL_SEGMENT_SIZE) {
+        int fd;
+
+        snprintf(tmpfile,sizeof(tmpfile),"temp-backlog-%d-%lld.spill",
+            (int) getpid(), b->repl_offset);
+        fd = open(tmpfile,O_CREAT|O_RDWR|O_TRUNC,0644);
+        if (fd == -1) {
+            redisLog(REDIS_WARNING,"Opening the backlog spill file %s: %s",
+                tmpfile, strerror(errno));
+            resetReplicationBacklogSpill();
+            return;
+        }
+        /* Nobody needs the file by name, this way it does not survive
+         * us even if we crash. */
+        unlink(tmpfile);
+        seg = zmalloc(sizeof(*seg));
+        seg->fd = fd;
+        seg->repl_offset = b->repl_offset;
+        seg->len = 0;
+        listAddNodeTail(server.repl_spill_segments,seg);
+    }
+
+    while((size_t)nwritten < b->used) {
+        ssize_t n = write(seg->fd,b->buf+nwritten,b->used-nwritten);
+
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            redisLog(REDIS_WARNING,"Writing to the backlog spill file: %s",
+                n == -1 ? strerror(errno) : "short write");
+            resetReplicationBacklogSpill();
+            return;
+        }
+        nwritten += n;
+    }
+    seg->len += b->used;
+    server.repl_spill_histlen += b->used;
+
+    while(listLength(server.repl_spill_segments) > 1) {
+        seg = listNodeValue(listFirst(server.repl_spill_segments));
+        if (server.repl_spill_histlen - seg->len <
+            server.repl_backlog_disk_size) break;
+        replicationDropSpillSegment();
+    }
+}
+
+/* Read up to 'len' bytes of the spill files starting at replication offset
+ * 'offset'. Reads never cross a segment boundary. Returns the number of
+ * bytes read, or -1 on error. */
+static ssize_t replicationReadSpill(long long offset, char *buf, size_t len) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.repl_spill_segments,&li);
+    while((ln = listNext(&li))) {
+        replSpillSegment *seg = listNodeValue(ln);
+        long long pos = offset - seg->repl_offset;
+        ssize_t nread;
+
+        if (pos < 0 || pos >= seg->len) continue;
+        if ((long long)len > seg->len - pos) len = seg->len - pos;
+        nread = pread(seg->fd,buf,len,pos);
+        if (nread == 0) {
+            errno = EIO;
+            return -1;
+        }
+        return nread;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/* Called when the user modifies repl-backlog-disk-size at runtime. Setting
+ * it to zero discards the spill files, disconnecting the slaves still
+ * streaming them. When the configuration is loaded at startup the server
+ * is not initialized yet, and there is nothing but the size to set. */
+void resizeReplicationBacklogSpill(long long newsize) {
+    server.repl_backlog_disk_size = newsize;
+    if (server.repl_spill_segments == NULL) return;
+    if (newsize == 0) {
+        resetReplicationBacklogSpill();
+        return;
+    }
+    while(listLength(server.repl_spill_segments) > 1) {
+        replSpillSegment *seg =
+            listNodeValue(listFirst(server.repl_spill_segments));
+        if (server.repl_spill_histlen - seg->len < newsize) break;
+        replicationDropSpillSegment();
+    }
+}
+
+/* Move the backlog reference forward as long as the backlog can drop its
+ * first block and still hold at least server.repl_backlog_size bytes. The
+ * blocks no longer needed by the backlog are freed if no slave is still
+ * reading them, after being appended to the spill files if enabled. */
+void trimReplicationBacklog(void) {
+    listNode *ln;
+
+    while((ln = server.repl_backlog->ref_repl_buf_node) != NULL) {
+        replBufBlock *b = listNodeValue(ln);
+        listNode *next = listNextNode(ln);
+
+        if (next == NULL || server.repl_backlog_histlen - (long long)b->used <
+                            server.repl_backlog_size) break;
+        replicationSpillBlock(b);
+        b->refcount--;
+        ((replBufBlock*)listNodeValue(next))->refcount++;
+        server.repl_backlog->ref_repl_buf_node = next;
+        server.repl_backlog_histlen -= b->used;
+    }
+    if (ln) {
+        replBufBlock *b = listNodeValue(ln);
+        server.repl_backlog_off = b->repl_offset;
+    }
+    freeUnreferencedReplicationBlocks();
+}
+
 void createReplicationBacklog(void) {
     redisAssert(server.repl_backlog == NULL);
-    server.repl_backlog = zmalloc(server.repl_backlog_size);
+    redisAssert(listLength(server.repl_buffer_blocks) == 0);
+    server.repl_backlog = zmalloc(sizeof(replBacklog));
+    server.repl_backlog->ref_repl_buf_node = NULL;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
-    /* When a new backlog buffer is created, we increment the replication
-     * offset by one to make sure we'll not be able to PSYNC with any
-     * previous slave. This is needed because we avoid incrementing the
-     * master_repl_offset if no backlog exists nor slaves are attached. */
-    server.master_repl_offset++;
+    /* Note that the replication offset is not changed: slaves can't PSYNC
+     * with the stale history the offset refers to since the replication ID
+     * is changed every time the backlog is freed. */
 
     /* We don't have any data inside our buffer, but virtually the first
      * byte we have is the next byte that will be generated for the
@@ -86,70 +425,79 @@ void createReplicationBacklog(void) {
 }
 
 /* This function is called when the user modifies the replication backlog
- * size at runtime. It is up to the function to both update the
- * server.repl_backlog_size and to resize the buffer and setup it so that
- * it contains the same data as the previous one (possibly less data, but
- * the most recent bytes, or the same data and more free space in case the
- * buffer is enlarged). */
+ * size at runtime. Since the backlog is just a reference into the shared
+ * replication buffer there is nothing to copy: if the backlog shrinks the
+ * oldest blocks are released, if it grows it will retain more data from
+ * now on. */
 void resizeReplicationBacklog(long long newsize) {
     if (newsize < REDIS_REPL_BACKLOG_MIN_SIZE)
         newsize = REDIS_REPL_BACKLOG_MIN_SIZE;
     if (server.repl_backlog_size == newsize) return;
 
     server.repl_backlog_size = newsize;
-    if (server.repl_backlog != NULL) {
-        /* What we actually do is to flush the old buffer and realloc a new
-         * empty one. It will refill with new data incrementally.
-         * The reason is that copying a few gigabytes adds latency and even
-         * worse often we need to alloc additional space before freeing the
-         * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = zmalloc(server.repl_backlog_size);
-        server.repl_backlog_histlen = 0;
-        server.repl_backlog_idx = 0;
-        /* Next byte we have is... the next since the buffer is empty. */
-        server.repl_backlog_off = server.master_repl_offset+1;
-    }
+    if (server.repl_backlog != NULL) trimReplicationBacklog();
 }
 
 void freeReplicationBacklog(void) {
     redisAssert(listLength(server.slaves) == 0);
+    if (server.repl_backlog == NULL) return;
+    if (server.repl_backlog->ref_repl_buf_node) {
+        replBufBlock *b = listNodeValue(server.repl_backlog->ref_repl_buf_node);
+        b->refcount--;
+    }
     zfree(server.repl_backlog);
     server.repl_backlog = NULL;
+    server.repl_backlog_histlen = 0;
+    resetReplicationBacklogSpill();
+    /* Without slaves the backlog was the only consumer left. */
+    freeUnreferencedReplicationBlocks();
+    redisAssert(listLength(server.repl_buffer_blocks) == 0);
 }
 
-/* Add data to the replication backlog.
+/* Append data to the shared replication buffer, filling the last block
+ * and allocating new blocks as needed.
  * This function also increments the global replication offset stored at
  * server.master_repl_offset, because there is no case where we want to feed
- * the backlog without incrementing the buffer. */
-void feedReplicationBacklog(void *ptr, size_t len) {
+ * the buffer without incrementing the offset. */
+void feedReplicationBuffer(void *ptr, size_t len) {
     unsigned char *p = ptr;
+    listNode *ln = listLast(server.repl_buffer_blocks);
+    replBufBlock *tail = ln ? listNodeValue(ln) : NULL;
 
     server.master_repl_offset += len;
+    server.repl_backlog_histlen += len;
+
+    /* Fill the free space of the last block first. */
+    if (tail && tail->used < tail->size) {
+        size_t thislen = tail->size - tail->used;
 
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
-    while(len) {
-        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
         if (thislen > len) thislen = len;
-        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
-        server.repl_backlog_idx += thislen;
-        if (server.repl_backlog_idx == server.repl_backlog_size)
-            server.repl_backlog_idx = 0;
-        len -= thislen;
+        memcpy(tail->buf+tail->used,p,thislen);
+        tail->used += thislen;
         p += thislen;
-        server.repl_backlog_histlen += thislen;
+        len -= thislen;
+    }
+
+    /* Then allocate a new block for the remaining data. */
+    if (len) {
+        size_t size = len > REDIS_REPL_BUFFER_BLOCK_SIZE ?
+                      len : REDIS_REPL_BUFFER_BLOCK_SIZE;
+
+        tail = zmalloc(sizeof(*tail)+size);
+        tail->refcount = 0;
+        tail->repl_offset = server.master_repl_offset - len + 1;
+        tail->size = size;
+        tail->used = len;
+        memcpy(tail->buf,p,len);
+        listAddNodeTail(server.repl_buffer_blocks,tail);
+        zmalloc_category_add(ZMALLOC_CAT_REPLICATION,sizeof(*tail)+size);
+        server.repl_buffer_mem += sizeof(*tail)+size;
     }
-    if (server.repl_backlog_histlen > server.repl_backlog_size)
-        server.repl_backlog_histlen = server.repl_backlog_size;
-    /* Set the offset of the first byte we have in the backlog. */
-    server.repl_backlog_off = server.master_repl_offset -
-                              server.repl_backlog_histlen + 1;
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Wrapper for feedReplicationBuffer() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+void feedReplicationBufferWithObject(robj *o) {
     char llstr[REDIS_LONGSTR_SIZE];
     void *p;
     size_t len;
@@ -161,14 +509,181 @@ void feedReplicationBacklogWithObject(robj *o) {
         len = sdslen(o->ptr);
         p = o->ptr;
     }
-    feedReplicationBacklog(p,len);
+    feedReplicationBuffer(p,len);
+}
+
+/* Point the cursor of 'c' (the backlog if 'c' is NULL) to the byte at
+ * replication offset 'offset', that must be inside the shared buffer or
+ * be the next byte that will be appended to it. In the latter case and if
+ * the buffer is empty the cursor is left unset, and it will be set when
+ * new data is appended. */
+static void replicationSetCursor(redisClient *c, long long offset) {
+    listNode *ln = listLast(server.repl_buffer_blocks);
+    replBufBlock *b = NULL;
+
+    /* Usually the offset is in one of the last blocks, so scan backward. */
+    while(ln) {
+        b = listNodeValue(ln);
+        if (b->repl_offset <= offset) break;
+        ln = listPrevNode(ln);
+    }
+    if (ln == NULL) {
+        redisAssert(offset == server.master_repl_offset+1);
+        return;
+    }
+    redisAssert(offset - b->repl_offset <= (long long)b->used);
+    b->refcount++;
+    if (c) {
+        c->ref_repl_buf_node = ln;
+        c->ref_block_pos = offset - b->repl_offset;
+    } else {
+        redisAssert(offset == b->repl_offset);
+        server.repl_backlog->ref_repl_buf_node = ln;
+    }
+}
+
+/* Release the reference the slave holds to the shared replication buffer,
+ * if any, freeing the blocks that no longer have consumers. */
+void replicationReleaseSlaveCursor(redisClient *c) {
+    replBufBlock *b;
+
+    c->repl_spill_off = -1;
+    if (c->ref_repl_buf_node == NULL) return;
+    b = listNodeValue(c->ref_repl_buf_node);
+    b->refcount--;
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
+    freeUnreferencedReplicationBlocks();
 }
 
+/* Return the number of bytes of the shared replication buffer the slave
+ * still has to receive. Zero is returned for any other client. */
+long long replicationSlavePendingBytes(redisClient *c) {
+    replBufBlock *b;
+
+    if (c->ref_repl_buf_node == NULL) return 0;
+    b = listNodeValue(c->ref_repl_buf_node);
+    return (server.master_repl_offset+1) -
+           (b->repl_offset + (long long)c->ref_block_pos) +
+           (c->repl_lzf_buf ? (long long)sdslen(c->repl_lzf_buf) : 0);
+}
+
+/* Return true if the slave 'c' is still streaming the backlog from the
+ * spill files. As soon as it reaches the first byte of the in-memory
+ * backlog its cursor is set inside the shared buffer instead. */
+static int replicationSlaveReadsSpill(redisClient *c) {
+    if (c->repl_spill_off == -1) return 0;
+    if (c->repl_spill_off < server.repl_backlog_off) return 1;
+    replicationSetCursor(c,c->repl_spill_off);
+    c->repl_spill_off = -1;
+    return 0;
+}
+
+/* Return the block the slave cursor points to, moving the cursor to the
+ * next block if the current one was already fully transferred (and
+ * releasing it if the slave was its last reader). NULL is returned if there
+ * is nothing left to transfer. */
+static replBufBlock *replicationAdvanceSlaveCursor(redisClient *c) {
+    replBufBlock *b = listNodeValue(c->ref_repl_buf_node);
+
+    if (c->ref_block_pos == b->used) {
+        listNode *next = listNextNode(c->ref_repl_buf_node);
+
+        if (next == NULL) return NULL;
+        b->refcount--;
+        b = listNodeValue(next);
+        b->refcount++;
+        c->ref_repl_buf_node = next;
+        c->ref_block_pos = 0;
+        freeUnreferencedReplicationBlocks();
+    }
+    return b;
+}
+
+/* Like writeReplicationBufferToSlave() for slaves with a LZF link: up to
+ * REDIS_REPL_FRAME_MAX_LEN bytes of the replication buffer, possibly from
+ * multiple blocks, are compressed at a time into the slave LZF buffer, and
+ * written from there. */
+static ssize_t writeReplicationFramesToSlave(redisClient *c) {
+    static char raw[REDIS_REPL_FRAME_MAX_LEN];
+    ssize_t nwritten;
+
+    if (sdslen(c->repl_lzf_buf) == 0) {
+        size_t rawlen = 0, prevlen;
+        replBufBlock *b;
+
+        if (replicationSlaveReadsSpill(c)) {
+            ssize_t nread = replicationReadSpill(c->repl_spill_off,raw,
+                                                 sizeof(raw));
+            if (nread == -1) return -1;
+            c->repl_spill_off += nread;
+            rawlen = nread;
+        }
+        while(rawlen < sizeof(raw) && c->ref_repl_buf_node &&
+              (b = replicationAdvanceSlaveCursor(c)) != NULL)
+        {
+            size_t count = b->used - c->ref_block_pos;
+
+            if (count == 0) break;
+            if (count > sizeof(raw)-rawlen) count = sizeof(raw)-rawlen;
+            memcpy(raw+rawlen,b->buf+c->ref_block_pos,count);
+            c->ref_block_pos += count;
+            rawlen += count;
+        }
+        if (rawlen == 0) return 0;
+        prevlen = sdslen(c->repl_lzf_buf);
+        c->repl_lzf_buf = replicationCompressFrames(c->repl_lzf_buf,raw,rawlen);
+        server.stat_repl_lzf_raw += rawlen;
+        server.stat_repl_lzf_sent += sdslen(c->repl_lzf_buf)-prevlen;
+    }
+    nwritten = write(c->fd,c->repl_lzf_buf,sdslen(c->repl_lzf_buf));
+    if (nwritten > 0) sdsrange(c->repl_lzf_buf,nwritten,-1);
+    return nwritten;
+}
+
+/* Write to the slave socket the part of the shared replication buffer the
+ * slave did not receive yet, up to the end of the block its cursor points
+ * to. When the block was already fully transferred the cursor moves to the
+ * next one, releasing the previous block if the slave was its last reader.
+ *
+ * The return value is the one of write(2), or 0 if there is nothing to
+ * write. */
+ssize_t writeReplicationBufferToSlave(redisClient *c) {
+    replBufBlock *b;
+    ssize_t nwritten;
+
+    if (c->flags & REDIS_REPL_LZF) return writeReplicationFramesToSlave(c);
+    if (replicationSlaveReadsSpill(c)) {
+        static char buf[REDIS_IOBUF_LEN];
+        ssize_t nread = replicationReadSpill(c->repl_spill_off,buf,
+                                             sizeof(buf));
+        if (nread == -1) return -1;
+        /* What was not written is read again from the file next time. */
+        nwritten = write(c->fd,buf,nread);
+        if (nwritten > 0) c->repl_spill_off += nwritten;
+        return nwritten;
+    }
+    if (c->ref_repl_buf_node == NULL ||
+        (b = replicationAdvanceSlaveCursor(c)) == NULL) return 0;
+    nwritten = write(c->fd,b->buf+c->ref_block_pos,b->used-c->ref_block_pos);
+    if (nwritten > 0) c->ref_block_pos += nwritten;
+    return nwritten;
+}
+
+/* Propagate a command to the slaves and to the backlog. The command is
+ * serialized only once into the shared replication buffer: slaves just
+ * reference it, so the cost does not depend on the number of slaves. */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    listIter li;
     int j, len;
     char llstr[REDIS_LONGSTR_SIZE];
+    char aux[REDIS_LONGSTR_SIZE+3];
+    long long start_off;
+
+    /* If the instance is not a top level master, return ASAP: we'll just
+     * proxy the stream received by our master to our sub-slaves instead,
+     * see replicationFeedSlavesFromMasterStream(). This way the whole chain
+     * of slaves shares the same replication ID and offsets. */
+    if (server.masterhost != NULL) return;
 
     /* If there aren't slaves, and there is no backlog buffer to populate,
      * we can return ASAP. */
@@ -177,6 +692,9 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     /* We can't have slaves attached and no backlog. */
     redisAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
+    /* Replication offset of the first byte we are going to append. */
+    start_off = server.master_repl_offset+1;
+
     /* Send SELECT command to every slave if needed. */
     if (server.slaveseldb != dictid) {
         robj *selectcmd;
@@ -194,68 +712,94 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
                 dictid_len, llstr));
         }
 
-        /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listRewind(slaves,&li);
-        while((ln = listNext(&li))) {
-            redisClient *slave = ln->value;
-            addReply(slave,selectcmd);
-        }
+        feedReplicationBufferWithObject(selectcmd);
 
         if (dictid < 0 || dictid >= REDIS_SHARED_SELECT_CMDS)
             decrRefCount(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
-    if (server.repl_backlog) {
-        char aux[REDIS_LONGSTR_SIZE+3];
+    /* Add the multi bulk reply length. */
+    aux[0] = '*';
+    len = ll2string(aux+1,sizeof(aux)-1,argc);
+    aux[len+1] = '\r';
+    aux[len+2] = '\n';
+    feedReplicationBuffer(aux,len+3);
 
-        /* Add the multi bulk reply length. */
-        aux[0] = '*';
-        len = ll2string(aux+1,sizeof(aux)-1,argc);
+    for (j = 0; j < argc; j++) {
+        long objlen = stringObjectLen(argv[j]);
+
+        /* We need to feed the buffer with the object as a bulk reply
+         * not just as a plain string, so create the $..CRLF payload len
+         * and add the final CRLF */
+        aux[0] = '$';
+        len = ll2string(aux+1,sizeof(aux)-1,objlen);
         aux[len+1] = '\r';
         aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
+        feedReplicationBuffer(aux,len+3);
+        feedReplicationBufferWithObject(argv[j]);
+        feedReplicationBuffer(aux+len+1,2);
+    }
+    replicationFeedSlavesEpilogue(slaves,start_off);
+}
+
+/* This function is used in order to proxy what we receive from our master
+ * to our sub-slaves and to the backlog. The stream is appended verbatim, so
+ * the replication offsets are the same along the chain of slaves. */
+void replicationFeedSlavesFromMasterStream(list *slaves, char *buf,
+                                           size_t buflen)
+{
+    long long start_off;
+
+    /* Without a backlog there is nothing to feed: we can't have slaves
+     * attached and no backlog. */
+    if (server.repl_backlog == NULL) return;
+
+    start_off = server.master_repl_offset+1;
+    feedReplicationBuffer(buf,buflen);
+    replicationFeedSlavesEpilogue(slaves,start_off);
+}
 
-        for (j = 0; j < argc; j++) {
-            long objlen = stringObjectLen(argv[j]);
+/* Make the data appended to the replication buffer starting at 'start_off'
+ * visible to the backlog and to the slaves, then trim the backlog. */
+static void replicationFeedSlavesEpilogue(list *slaves, long long start_off) {
+    listNode *ln;
+    listIter li;
 
-            /* We need to feed the buffer with the object as a bulk reply
-             * not just as a plain string, so create the $..CRLF payload len
-             * and add the final CRLF */
-            aux[0] = '$';
-            len = ll2string(aux+1,sizeof(aux)-1,objlen);
-            aux[len+1] = '\r';
-            aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
-        }
-    }
+    /* The backlog starts referencing the buffer with its first byte. */
+    if (server.repl_backlog->ref_repl_buf_node == NULL)
+        replicationSetCursor(NULL,start_off);
 
-    /* Write the command to every slave. */
-    listRewind(server.slaves,&li);
+    /* Make the new data visible to the slaves. */
+    listRewind(slaves,&li);
     while((ln = listNext(&li))) {
         redisClient *slave = ln->value;
 
         /* Don't feed slaves that are still waiting for BGSAVE to start */
         if (slave->replstate == REDIS_REPL_WAIT_BGSAVE_START) continue;
 
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
-
-        /* Add the multi bulk length. */
-        addReplyMultiBulkLen(slave,argc);
+        /* Slaves that are waiting for the initial SYNC start accumulating
+         * the stream from the first command executed after the fork:
+         * their cursor is set the first time they are fed. */
+        if (slave->ref_repl_buf_node == NULL && slave->repl_spill_off == -1)
+            replicationSetCursor(slave,start_off);
 
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulk(slave,argv[j]);
+        /* Slaves already in sync with the master need the write handler. */
+        if (slave->replstate == REDIS_REPL_ONLINE &&
+            !slave->repl_put_online_on_ack &&
+            !(aeGetFileEvents(server.el,slave->fd) & AE_WRITABLE) &&
+            aeCreateFileEvent(server.el,slave->fd,AE_WRITABLE,
+                sendReplyToClient,slave) == AE_ERR)
+        {
+            freeClientAsync(slave);
+            continue;
+        }
+        asyncCloseClientOnOutputBufferLimitReached(slave);
     }
+
+    /* Only now that the slaves reference the new data, we can release the
+     * blocks the backlog no longer needs. */
+    trimReplicationBacklog();
 }
 
 void replicationFeedMonitors(redisClient *c, list *monitors, int dictid, robj **argv, int argc) {
@@ -298,55 +842,32 @@ void replicationFeedMonitors(redisClient *c, list *monitors, int dictid, robj **
 }
 
 /* Feed the slave 'c' with the replication backlog starting from the
- * specified 'offset' up to the end of the backlog. */
+ * specified 'offset' up to the end of the backlog. No data is copied: the
+ * slave cursor is just set at 'offset' inside the shared replication
+ * buffer, or, if the offset is older than the in-memory backlog, inside the
+ * spill files. Returns the number of bytes the slave will receive. */
 long long addReplyReplicationBacklog(redisClient *c, long long offset) {
-    long long j, skip, len;
+    long long len = (server.master_repl_offset+1) - offset;
 
     redisLog(REDIS_DEBUG, "[PSYNC] Slave request offset: %lld", offset);
-
-    if (server.repl_backlog_histlen == 0) {
-        redisLog(REDIS_DEBUG, "[PSYNC] Backlog history len is zero");
-        return 0;
-    }
-
-    redisLog(REDIS_DEBUG, "[PSYNC] Backlog size: %lld",
-             server.repl_backlog_size);
     redisLog(REDIS_DEBUG, "[PSYNC] First byte: %lld",
              server.repl_backlog_off);
     redisLog(REDIS_DEBUG, "[PSYNC] History len: %lld",
              server.repl_backlog_histlen);
-    redisLog(REDIS_DEBUG, "[PSYNC] Current index: %lld",
-             server.repl_backlog_idx);
-
-    /* Compute the amount of bytes we need to discard. */
-    skip = offset - server.repl_backlog_off;
-    redisLog(REDIS_DEBUG, "[PSYNC] Skipping: %lld", skip);
-
-    /* Point j to the oldest byte, that is actaully our
-     * server.repl_backlog_off byte. */
-    j = (server.repl_backlog_idx +
-        (server.repl_backlog_size-server.repl_backlog_histlen)) %
-        server.repl_backlog_size;
-    redisLog(REDIS_DEBUG, "[PSYNC] Index of first byte: %lld", j);
-
-    /* Discard the amount of data to seek to the specified 'offset'. */
-    j = (j + skip) % server.repl_backlog_size;
-
-    /* Feed slave with data. Since it is a circular buffer we have to
-     * split the reply in two parts if we are cross-boundary. */
-    len = server.repl_backlog_histlen - skip;
-    redisLog(REDIS_DEBUG, "[PSYNC] Reply total length: %lld", len);
-    while(len) {
-        long long thislen =
-            ((server.repl_backlog_size - j) < len) ?
-            (server.repl_backlog_size - j) : len;
 
-        redisLog(REDIS_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        addReplySds(c,sdsnewlen(server.repl_backlog + j, thislen));
-        len -= thislen;
-        j = 0;
+    if (offset < server.repl_backlog_off) {
+        redisLog(REDIS_DEBUG, "[PSYNC] Streaming %lld bytes from the spill "
+                 "files", server.repl_backlog_off - offset);
+        c->repl_spill_off = offset;
+    } else {
+        replicationSetCursor(c,offset);
     }
-    return server.repl_backlog_histlen - skip;
+    if (len && aeCreateFileEvent(server.el,c->fd,AE_WRITABLE,
+                                 sendReplyToClient,c) == AE_ERR)
+    {
+        freeClientAsync(c);
+    }
+    return len;
 }
 
 /* This function handles the PSYNC command from the point of view of a
@@ -356,19 +877,55 @@ long long addReplyReplicationBacklog(redisClient *c, long long offset) {
  * with the usual full resync. */
 int masterTryPartialResynchronization(redisClient *c) {
     long long psync_offset, psync_len;
-    char *master_runid = c->argv[1]->ptr;
+    char *master_replid = c->argv[1]->ptr;
     char buf[128];
     int buflen;
+    char *lzf = "";
+
+    /* If both sides are configured for it, whatever follows our reply is
+     * sent as LZF frames: the slave learns it by the "lzf" token at the
+     * end of the reply. Only slaves that understand PSYNC2 replies can
+     * parse the token. */
+    if (server.repl_compression &&
+        (c->slave_capa & REDIS_SLAVE_CAPA_LZF) &&
+        (c->slave_capa & REDIS_SLAVE_CAPA_PSYNC2))
+    {
+        c->flags |= REDIS_REPL_LZF;
+        if (c->repl_lzf_buf == NULL) c->repl_lzf_buf = sdsempty();
+        lzf = " lzf";
+    }
+
+    /* Parse the replication offset asked by the slave. Go to full resync
+     * on parse error: this should never happen but we try to handle
+     * it in a robust way compared to aborting. */
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&psync_offset,NULL) !=
+       REDIS_OK) goto need_full_resync;
 
-    /* Is the runid of this master the same advertised by the wannabe slave
-     * via PSYNC? If runid changed this master is a different instance and
-     * there is no way to continue. */
-    if (strcasecmp(master_runid, server.runid)) {
+    /* Is the replication ID of this master the same advertised by the
+     * wannabe slave via PSYNC? If the replication ID changed this master has
+     * a different replication history, and there is no way to continue.
+     *
+     * Note that there are two potentially valid replication IDs: the ID1
+     * and the ID2. The ID2 however is only valid up to a specific offset,
+     * the point where we were promoted to master. */
+    if (strcasecmp(master_replid, server.replid) &&
+        (strcasecmp(master_replid, server.replid2) ||
+         psync_offset > server.second_replid_offset))
+    {
         /* Run id "?" is used by slaves that want to force a full resync. */
-        if (master_runid[0] != '?') {
-            redisLog(REDIS_NOTICE,"Partial resynchronization not accepted: "
-                "Runid mismatch (Client asked for runid '%s', my runid is '%s')",
-                master_runid, server.runid);
+        if (master_replid[0] != '?') {
+            if (strcasecmp(master_replid, server.replid) &&
+                strcasecmp(master_replid, server.replid2))
+            {
+                redisLog(REDIS_NOTICE,"Partial resynchronization not accepted: "
+                    "Replication ID mismatch (Slave asked for '%s', my "
+                    "replication IDs are '%s' and '%s')",
+                    master_replid, server.replid, server.replid2);
+            } else {
+                redisLog(REDIS_NOTICE,"Partial resynchronization not accepted: "
+                    "Requested offset for second ID was %lld, but I can reply "
+                    "up to %lld", psync_offset, server.second_replid_offset);
+            }
         } else {
             redisLog(REDIS_NOTICE,"Full resync requested by slave %s",
                 replicationGetSlaveName(c));
@@ -377,10 +934,8 @@ int masterTryPartialResynchronization(redisClient *c) {
     }
 
     /* We still have the data our slave is asking for? */
-    if (getLongLongFromObjectOrReply(c,c->argv[2],&psync_offset,NULL) !=
-       REDIS_OK) goto need_full_resync;
     if (!server.repl_backlog ||
-        psync_offset < server.repl_backlog_off ||
+        psync_offset < replicationBacklogFirstOffset() ||
         psync_offset > (server.repl_backlog_off + server.repl_backlog_histlen))
     {
         redisLog(REDIS_NOTICE,
@@ -403,8 +958,15 @@ int masterTryPartialResynchronization(redisClient *c) {
     listAddNodeTail(server.slaves,c);
     /* We can't use the connection buffers since they are used to accumulate
      * new commands at this stage. But we are sure the socket send buffer is
-     * empty so this write will never fail actually. */
-    buflen = snprintf(buf,sizeof(buf),"+CONTINUE\r\n");
+     * empty so this write will never fail actually. Slaves that understand
+     * it are also told our current replication ID, that may differ from
+     * the one they asked for if we were promoted meanwhile. */
+    if (c->slave_capa & REDIS_SLAVE_CAPA_PSYNC2) {
+        buflen = snprintf(buf,sizeof(buf),"+CONTINUE %s%s\r\n",
+                          server.replid,lzf);
+    } else {
+        buflen = snprintf(buf,sizeof(buf),"+CONTINUE\r\n");
+    }
     if (write(c->fd,buf,buflen) != buflen) {
         freeClientAsync(c);
         return REDIS_OK;
@@ -424,12 +986,9 @@ int masterTryPartialResynchronization(redisClient *c) {
 need_full_resync:
     /* We need a full resync for some reason... notify the client. */
     psync_offset = server.master_repl_offset;
-    /* Add 1 to psync_offset if it the replication backlog does not exists
-     * as when it will be created later we'll increment the offset by one. */
-    if (server.repl_backlog == NULL) psync_offset++;
     /* Again, we can't use the connection buffers (see above). */
-    buflen = snprintf(buf,sizeof(buf),"+FULLRESYNC %s %lld\r\n",
-                      server.runid,psync_offset);
+    buflen = snprintf(buf,sizeof(buf),"+FULLRESYNC %s %lld%s\r\n",
+                      server.replid,psync_offset,lzf);
     if (write(c->fd,buf,buflen) != buflen) {
         freeClientAsync(c);
         return REDIS_OK;
@@ -544,12 +1103,14 @@ void syncCommand(redisClient *c) {
             c->replstate = REDIS_REPL_WAIT_BGSAVE_START;
             redisLog(REDIS_NOTICE,"Waiting for next BGSAVE for SYNC");
         }
-    } else if (server.rdb_child_pid != -1 &&
-               server.rdb_child_type == REDIS_RDB_CHILD_TYPE_SOCKET)
+    } else if ((server.rdb_child_pid != -1 &&
+                server.rdb_child_type == REDIS_RDB_CHILD_TYPE_SOCKET) ||
+               server.rdb_snapshot)
     {
         /* There is an RDB child process but it is writing directly to
-         * children sockets. We need to wait for the next BGSAVE
-         * in order to synchronize. */
+         * children sockets, or a snapshot thread that does not register
+         * differences for slaves. We need to wait for the next BGSAVE
+         * in order to synchronize: replicationCron() starts it. */
         c->replstate = REDIS_REPL_WAIT_BGSAVE_START;
         redisLog(REDIS_NOTICE,"Waiting for next BGSAVE for SYNC");
     } else {
@@ -613,6 +1174,12 @@ void replconfCommand(redisClient *c) {
                     &port,NULL) != REDIS_OK))
                 return;
             c->slave_listening_port = port;
+        } else if (!strcasecmp(c->argv[j]->ptr,"capa")) {
+            /* Ignore capabilities not understood by this master. */
+            if (!strcasecmp(c->argv[j+1]->ptr,"psync2"))
+                c->slave_capa |= REDIS_SLAVE_CAPA_PSYNC2;
+            else if (!strcasecmp(c->argv[j+1]->ptr,"lzf"))
+                c->slave_capa |= REDIS_SLAVE_CAPA_LZF;
         } else if (!strcasecmp(c->argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -677,7 +1244,8 @@ void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
     REDIS_NOTUSED(el);
     REDIS_NOTUSED(mask);
     char buf[REDIS_IOBUF_LEN];
-    ssize_t nwritten, buflen;
+    ssize_t nwritten, buflen = 0;
+    int lzf = slave->flags & REDIS_REPL_LZF;
 
     /* Before sending the RDB file, we send the preamble as configured by the
      * replication process. Currently the preamble is just the bulk count of
@@ -700,16 +1268,34 @@ void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
     }
 
-    /* If the preamble was already transfered, send the RDB bulk data. */
-    lseek(slave->repldbfd,slave->repldboff,SEEK_SET);
-    buflen = read(slave->repldbfd,buf,REDIS_IOBUF_LEN);
-    if (buflen <= 0) {
-        redisLog(REDIS_WARNING,"Read error sending DB to slave: %s",
-            (buflen == 0) ? "premature EOF" : strerror(errno));
-        freeClient(slave);
-        return;
+    /* If the preamble was already transfered, send the RDB bulk data.
+     * Slaves with a LZF link receive the file as frames, staged into their
+     * LZF buffer: the next chunk is read only once they were written. */
+    if (!lzf || sdslen(slave->repl_lzf_buf) == 0) {
+        lseek(slave->repldbfd,slave->repldboff,SEEK_SET);
+        buflen = read(slave->repldbfd,buf,REDIS_IOBUF_LEN);
+        if (buflen <= 0) {
+            redisLog(REDIS_WARNING,"Read error sending DB to slave: %s",
+                (buflen == 0) ? "premature EOF" : strerror(errno));
+            freeClient(slave);
+            return;
+        }
+        if (lzf) {
+            size_t prevlen = sdslen(slave->repl_lzf_buf);
+
+            slave->repl_lzf_buf =
+                replicationCompressFrames(slave->repl_lzf_buf,buf,buflen);
+            slave->repldboff += buflen;
+            server.stat_repl_lzf_raw += buflen;
+            server.stat_repl_lzf_sent += sdslen(slave->repl_lzf_buf)-prevlen;
+        }
     }
-    if ((nwritten = write(fd,buf,buflen)) == -1) {
+    if (lzf) {
+        nwritten = write(fd,slave->repl_lzf_buf,sdslen(slave->repl_lzf_buf));
+    } else {
+        nwritten = write(fd,buf,buflen);
+    }
+    if (nwritten == -1) {
         if (errno != EAGAIN) {
             redisLog(REDIS_WARNING,"Write error sending DB to slave: %s",
                 strerror(errno));
@@ -717,8 +1303,14 @@ void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
         return;
     }
-    slave->repldboff += nwritten;
-    if (slave->repldboff == slave->repldbsize) {
+    if (lzf) {
+        sdsrange(slave->repl_lzf_buf,nwritten,-1);
+    } else {
+        slave->repldboff += nwritten;
+    }
+    if (slave->repldboff == slave->repldbsize &&
+        (!lzf || sdslen(slave->repl_lzf_buf) == 0))
+    {
         close(slave->repldbfd);
         slave->repldbfd = -1;
         aeDeleteFileEvent(server.el,slave->fd,AE_WRITABLE);
@@ -821,9 +1413,13 @@ void replicationAbortSyncTransfer(void) {
 
     aeDeleteFileEvent(server.el,server.repl_transfer_s,AE_READABLE);
     close(server.repl_transfer_s);
-    close(server.repl_transfer_fd);
-    unlink(server.repl_transfer_tmpfile);
-    zfree(server.repl_transfer_tmpfile);
+    /* No temp file is used when the RDB is loaded from the socket. */
+    if (server.repl_transfer_fd != -1) {
+        close(server.repl_transfer_fd);
+        unlink(server.repl_transfer_tmpfile);
+        zfree(server.repl_transfer_tmpfile);
+        server.repl_transfer_fd = -1;
+    }
     server.repl_state = REDIS_REPL_CONNECT;
 }
 
@@ -854,10 +1450,270 @@ void replicationEmptyDbCallback(void *privdata) {
 
 /* Asynchronously read the SYNC payload we receive from a master */
 #define REPL_MAX_WRITTEN_BEFORE_FSYNC (1024*1024*8) /* 8 MB */
+/* Final setup of the connected slave <- master link, once the RDB received
+ * from the master was loaded. */
+static void replicationFinishSync(void) {
+    server.master = createClient(server.repl_transfer_s);
+    server.master->flags |= REDIS_MASTER;
+    server.master->authenticated = 1;
+    server.repl_state = REDIS_REPL_CONNECTED;
+    server.master->reploff = server.repl_master_initial_offset;
+    server.master->read_reploff = server.master->reploff;
+    memcpy(server.master->replid, server.master_replid,
+        sizeof(server.master_replid));
+    /* If master offset is set to -1, this master is old and is not
+     * PSYNC capable, so we flag it accordingly. */
+    if (server.master->reploff == -1)
+        server.master->flags |= REDIS_PRE_PSYNC;
+    /* The master stream continues in the DB selected when the RDB was
+     * produced, that is not necessarily followed by a SELECT. */
+    if (server.rdb_repl_info.repl_stream_db != -1)
+        selectDb(server.master,server.rdb_repl_info.repl_stream_db);
+
+    /* After a full resynchronization we use the replication ID and offset
+     * of the master. The secondary ID / offset are cleared since we are
+     * starting a new history. */
+    memcpy(server.replid,server.master->replid,sizeof(server.replid));
+    server.master_repl_offset = server.master->reploff;
+    clearReplicationId2();
+
+    /* Let's create the replication backlog if needed. Slaves need to
+     * accumulate the backlog regardless of the fact they have sub-slaves
+     * or not, in order to behave correctly if they are promoted to
+     * masters after a failover. */
+    if (server.repl_backlog == NULL) createReplicationBacklog();
+
+    /* With a LZF link, the data decoded after the end of the RDB payload
+     * is already part of the replication stream. */
+    if (server.repl_link_lzf) {
+        server.master->flags |= REDIS_REPL_LZF;
+        server.master->querybuf = sdscatsds(server.master->querybuf,
+                                            server.repl_transfer_decoded);
+        server.master->pending_querybuf =
+            sdscatsds(server.master->pending_querybuf,
+                      server.repl_transfer_decoded);
+        server.master->read_reploff += sdslen(server.repl_transfer_decoded);
+        sdsclear(server.repl_transfer_decoded);
+    }
+    redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Finished with success");
+    /* Restart the AOF subsystem now that we finished the sync. This
+     * will trigger an AOF rewrite, and when done will start appending
+     * to the new file. */
+    if (server.aof_state != REDIS_AOF_OFF) {
+        int retry = 10;
+
+        stopAppendOnly();
+        while (retry-- && startAppendOnly() == REDIS_ERR) {
+            redisLog(REDIS_WARNING,"Failed enabling the AOF after successful master synchronization! Trying it again in one second.");
+            sleep(1);
+        }
+        if (!retry) {
+            redisLog(REDIS_WARNING,"FATAL: this slave instance finished the synchronization with its master, but the AOF can't be turned on. Exiting now.");
+            exit(1);
+        }
+    }
+}
+
+/* Keyspace of the databases set aside during a swapdb diskless load. */
+typedef struct replDbBackup {
+    dict *dict;
+    dict *expires;
+} replDbBackup;
+
+/* Move the keyspace of every DB aside, leaving empty DBs in its place, so
+ * that it can be restored if the load fails. */
+static replDbBackup *replicationBackupDbs(void) {
+    replDbBackup *backup = zmalloc(sizeof(*backup)*server.dbnum);
+    int j;
+
+    if (server.rdb_snapshot) rdbSnapshotFinish();
+
+    for (j = 0; j < server.dbnum; j++) {
+        backup[j].dict = server.db[j].dict;
+        backup[j].expires = server.db[j].expires;
+        server.db[j].dict = dictCreate(&dbDictType,NULL);
+        server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+    }
+    return backup;
+}
+
+/* Put back the keyspace saved by replicationBackupDbs(), releasing what
+ * was partially loaded meanwhile. */
+static void replicationRestoreDbs(replDbBackup *backup) {
+    int j;
+
+    emptyDb(replicationEmptyDbCallback);
+    for (j = 0; j < server.dbnum; j++) {
+        dictRelease(server.db[j].dict);
+        dictRelease(server.db[j].expires);
+        server.db[j].dict = backup[j].dict;
+        server.db[j].expires = backup[j].expires;
+    }
+    zfree(backup);
+}
+
+/* Release the old keyspace once the new one was loaded with success. */
+static void replicationDiscardDbBackup(replDbBackup *backup) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        freeDictLazily(backup[j].expires);
+        freeDictLazily(backup[j].dict);
+    }
+    zfree(backup);
+}
+
+/* With repl-async-load the slave keeps serving its old dataset while the new
+ * one is loaded: the RDB loader fills a separate set of DBs, swapped with
+ * the ones of server.db only once the load succeeded. Cluster nodes track the
+ * keys of every slot, that can't be loaded aside, so the feature is not
+ * available in this case. */
+static int replicationUseAsyncLoad(void) {
+    return server.repl_async_load && !server.cluster_enabled;
+}
+
+/* Create the DBs the new dataset is loaded into, and point the RDB loader
+ * to them. Only the dictionaries touched while loading are created. */
+static redisDb *replicationStartAsyncLoad(void) {
+    redisDb *dbs = zcalloc(sizeof(redisDb)*server.dbnum);
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        dbs[j].dict = dictCreate(&dbDictType,NULL);
+        dbs[j].expires = dictCreate(&keyptrDictType,NULL);
+        dbs[j].blocking_keys = dictCreate(&keylistDictType,NULL);
+        dbs[j].id = j;
+    }
+    server.loading_db = dbs;
+    server.async_loading = 1;
+    return dbs;
+}
+
+/* Terminate a load started with replicationStartAsyncLoad(). If 'loaded' is
+ * true the keyspace of the new DBs atomically replaces the one clients were
+ * served from. Either way what is no longer used, the old dataset or the
+ * one partially loaded, is released lazily. */
+static void replicationStopAsyncLoad(redisDb *dbs, int loaded) {
+    int j;
+
+    server.loading_db = server.db;
+    server.async_loading = 0;
+    if (loaded) {
+        /* The old keyspace must be saved by a fork-free BGSAVE first. */
+        if (server.rdb_snapshot) rdbSnapshotFinish();
+        signalFlushedDb(-1);
+    }
+    for (j = 0; j < server.dbnum; j++) {
+        if (loaded) {
+            dict *keys = server.db[j].dict, *expires = server.db[j].expires;
+
+            server.db[j].dict = dbs[j].dict;
+            server.db[j].expires = dbs[j].expires;
+            server.db[j].avg_ttl = 0;
+            dbs[j].dict = keys;
+            dbs[j].expires = expires;
+        }
+        freeDictLazily(dbs[j].expires);
+        freeDictLazily(dbs[j].dict);
+        dictRelease(dbs[j].blocking_keys);
+    }
+    zfree(dbs);
+}
+
+/* Load the RDB payload straight from the master socket, without saving it
+ * on disk first. The payload is either 'size' bytes long, or terminated by
+ * 'eofmark' if 'usemark' is true. With repl-diskless-load swapdb the old
+ * dataset is restored if the transfer fails, otherwise it is flushed before
+ * loading. */
+static void readSyncBulkPayloadFromSocket(int fd, off_t size, int usemark,
+                                          char *eofmark)
+{
+    replDbBackup *backup = NULL;
+    redisDb *async_dbs = NULL;
+    char mark[REDIS_RUN_ID_SIZE];
+    int loaded;
+    rio rdb;
+    sds remaining;
+
+    /* Before loading the DB into memory we need to delete the readable
+     * handler, otherwise it will get called recursively since the loading
+     * code will call the event loop to process events from time to time. */
+    aeDeleteFileEvent(server.el,fd,AE_READABLE);
+
+    /* Cluster nodes track the keys of every slot, that can't be set aside
+     * as well: always flush in this case. */
+    if (replicationUseAsyncLoad()) {
+        redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Serving the old data until the new one is loaded");
+        async_dbs = replicationStartAsyncLoad();
+    } else if (server.repl_diskless_load == REDIS_REPL_DISKLESS_LOAD_SWAPDB &&
+               !server.cluster_enabled)
+    {
+        redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Setting aside the old data until the new one is loaded");
+        backup = replicationBackupDbs();
+    } else {
+        redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Flushing old data");
+        signalFlushedDb(-1);
+        emptyDb(replicationEmptyDbCallback);
+    }
+
+    redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Loading DB in memory from the socket");
+    rioInitWithFd(&rdb,fd,usemark ? 0 : size,server.repl_timeout*1000);
+    if (server.repl_link_lzf) rdb.io.fd.read_frames = replicationReadFrames;
+    startLoadingSize(usemark ? 0 : size);
+    loaded = rdbLoadRio(&rdb,REDIS_RDB_LOAD_NOFATAL) == REDIS_OK;
+    if (loaded && usemark) {
+        if (rioRead(&rdb,mark,REDIS_RUN_ID_SIZE) == 0 ||
+            memcmp(mark,eofmark,REDIS_RUN_ID_SIZE) != 0)
+        {
+            redisLog(REDIS_WARNING,"Bad EOF mark at the end of the RDB payload received from the MASTER");
+            loaded = 0;
+        }
+    }
+    stopLoading();
+    server.repl_transfer_read = rdb.processed_bytes;
+    remaining = rioFreeFd(&rdb);
+
+    if (!loaded) {
+        redisLog(REDIS_WARNING,"Failed trying to load the MASTER synchronization DB from socket: %s", strerror(errno));
+        if (async_dbs) {
+            replicationStopAsyncLoad(async_dbs,0);
+        } else if (backup) {
+            replicationRestoreDbs(backup);
+        } else {
+            emptyDb(replicationEmptyDbCallback);
+        }
+        sdsfree(remaining);
+        replicationAbortSyncTransfer();
+        return;
+    }
+    if (async_dbs) {
+        replicationStopAsyncLoad(async_dbs,1);
+    } else if (backup) {
+        signalFlushedDb(-1);
+        replicationDiscardDbBackup(backup);
+    }
+
+    replicationFinishSync();
+    /* Anything the master sent after the payload is replication stream. */
+    server.master->querybuf = sdscatsds(server.master->querybuf,remaining);
+    server.master->pending_querybuf =
+        sdscatsds(server.master->pending_querybuf,remaining);
+    server.master->read_reploff += sdslen(remaining);
+    sdsfree(remaining);
+
+    /* The socket may have nothing more to say for a while: don't wait for
+     * the next readable event to execute what we already have. */
+    if (sdslen(server.master->querybuf)) {
+        server.current_client = server.master;
+        processInputBufferAndReplicate(server.master);
+        server.current_client = NULL;
+    }
+}
+
 void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
-    char buf[4096];
+    char buf[4096], *data = buf;
     ssize_t nread, readlen;
-    off_t left;
+    off_t left = 0;
     REDIS_NOTUSED(el);
     REDIS_NOTUSED(privdata);
     REDIS_NOTUSED(mask);
@@ -920,6 +1776,12 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
                 "MASTER <-> SLAVE sync: receiving %lld bytes from master",
                 (long long) server.repl_transfer_size);
         }
+        /* No temp file was created if the payload is loaded while it is
+         * received. */
+        if (server.repl_transfer_fd == -1) {
+            readSyncBulkPayloadFromSocket(fd,server.repl_transfer_size,
+                                          usemark,eofmark);
+        }
         return;
     }
 
@@ -931,7 +1793,23 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
         readlen = (left < (signed)sizeof(buf)) ? left : (signed)sizeof(buf);
     }
 
-    nread = read(fd,buf,readlen);
+    if (server.repl_link_lzf) {
+        /* Decode all the frames received so far. The master only sends the
+         * replication stream after the payload, that we retain to feed the
+         * master client once the sync is completed. */
+        nread = replicationReadFrames(fd,&server.repl_transfer_decoded);
+        if (nread == -1 && errno == EAGAIN) {
+            server.repl_transfer_lastio = server.unixtime;
+            return;
+        }
+        if (nread > 0) {
+            data = server.repl_transfer_decoded;
+            nread = sdslen(server.repl_transfer_decoded);
+            if (!usemark && nread > left) nread = left;
+        }
+    } else {
+        nread = read(fd,buf,readlen);
+    }
     if (nread <= 0) {
         redisLog(REDIS_WARNING,"I/O error trying to sync with MASTER: %s",
             (nread == -1) ? strerror(errno) : "connection lost");
@@ -946,20 +1824,21 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     if (usemark) {
         /* Update the last bytes array, and check if it matches our delimiter.*/
         if (nread >= REDIS_RUN_ID_SIZE) {
-            memcpy(lastbytes,buf+nread-REDIS_RUN_ID_SIZE,REDIS_RUN_ID_SIZE);
+            memcpy(lastbytes,data+nread-REDIS_RUN_ID_SIZE,REDIS_RUN_ID_SIZE);
         } else {
             int rem = REDIS_RUN_ID_SIZE-nread;
             memmove(lastbytes,lastbytes+nread,rem);
-            memcpy(lastbytes+rem,buf,nread);
+            memcpy(lastbytes+rem,data,nread);
         }
         if (memcmp(lastbytes,eofmark,REDIS_RUN_ID_SIZE) == 0) eof_reached = 1;
     }
 
     server.repl_transfer_lastio = server.unixtime;
-    if (write(server.repl_transfer_fd,buf,nread) != nread) {
+    if (write(server.repl_transfer_fd,data,nread) != nread) {
         redisLog(REDIS_WARNING,"Write error or short write writing to the DB dump file needed for MASTER <-> SLAVE synchronization: %s", strerror(errno));
         goto error;
     }
+    if (data != buf) sdsrange(server.repl_transfer_decoded,nread,-1);
     server.repl_transfer_read += nread;
 
     /* Delete the last 40 bytes from the file if we reached EOF. */
@@ -997,51 +1876,34 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
             replicationAbortSyncTransfer();
             return;
         }
-        redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Flushing old data");
-        signalFlushedDb(-1);
-        emptyDb(replicationEmptyDbCallback);
+        redisDb *async_dbs = NULL;
+        int loaded;
+
+        if (replicationUseAsyncLoad()) {
+            redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Serving the old data until the new one is loaded");
+            async_dbs = replicationStartAsyncLoad();
+        } else {
+            redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Flushing old data");
+            signalFlushedDb(-1);
+            emptyDb(replicationEmptyDbCallback);
+        }
         /* Before loading the DB into memory we need to delete the readable
          * handler, otherwise it will get called recursively since
          * rdbLoad() will call the event loop to process events from time to
          * time for non blocking loading. */
         aeDeleteFileEvent(server.el,server.repl_transfer_s,AE_READABLE);
         redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Loading DB in memory");
-        if (rdbLoad(server.rdb_filename) != REDIS_OK) {
+        loaded = rdbLoad(server.rdb_filename) == REDIS_OK;
+        if (async_dbs) replicationStopAsyncLoad(async_dbs,loaded);
+        if (!loaded) {
             redisLog(REDIS_WARNING,"Failed trying to load the MASTER synchronization DB from disk");
             replicationAbortSyncTransfer();
             return;
         }
-        /* Final setup of the connected slave <- master link */
         zfree(server.repl_transfer_tmpfile);
         close(server.repl_transfer_fd);
-        server.master = createClient(server.repl_transfer_s);
-        server.master->flags |= REDIS_MASTER;
-        server.master->authenticated = 1;
-        server.repl_state = REDIS_REPL_CONNECTED;
-        server.master->reploff = server.repl_master_initial_offset;
-        memcpy(server.master->replrunid, server.repl_master_runid,
-            sizeof(server.repl_master_runid));
-        /* If master offset is set to -1, this master is old and is not
-         * PSYNC capable, so we flag it accordingly. */
-        if (server.master->reploff == -1)
-            server.master->flags |= REDIS_PRE_PSYNC;
-        redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Finished with success");
-        /* Restart the AOF subsystem now that we finished the sync. This
-         * will trigger an AOF rewrite, and when done will start appending
-         * to the new file. */
-        if (server.aof_state != REDIS_AOF_OFF) {
-            int retry = 10;
-
-            stopAppendOnly();
-            while (retry-- && startAppendOnly() == REDIS_ERR) {
-                redisLog(REDIS_WARNING,"Failed enabling the AOF after successful master synchronization! Trying it again in one second.");
-                sleep(1);
-            }
-            if (!retry) {
-                redisLog(REDIS_WARNING,"FATAL: this slave instance finished the synchronization with its master, but the AOF can't be turned on. Exiting now.");
-                exit(1);
-            }
-        }
+        server.repl_transfer_fd = -1;
+        replicationFinishSync();
     }
 
     return;
@@ -1119,7 +1981,7 @@ char *sendSynchronousCommand(int fd, ...) {
 #define PSYNC_FULLRESYNC 1
 #define PSYNC_NOT_SUPPORTED 2
 int slaveTryPartialResynchronization(int fd) {
-    char *psync_runid;
+    char *psync_replid;
     char psync_offset[32];
     sds reply;
 
@@ -1130,45 +1992,52 @@ int slaveTryPartialResynchronization(int fd) {
      * client structure representing the master into server.master. */
     server.repl_master_initial_offset = -1;
 
+    /* The link is in clear until the master tells us otherwise. */
+    server.repl_link_lzf = 0;
+    sdsclear(server.repl_frame_buf);
+    sdsclear(server.repl_transfer_decoded);
+
     if (server.cached_master) {
-        psync_runid = server.cached_master->replrunid;
+        psync_replid = server.cached_master->replid;
         snprintf(psync_offset,sizeof(psync_offset),"%lld", server.cached_master->reploff+1);
-        redisLog(REDIS_NOTICE,"Trying a partial resynchronization (request %s:%s).", psync_runid, psync_offset);
+        redisLog(REDIS_NOTICE,"Trying a partial resynchronization (request %s:%s).", psync_replid, psync_offset);
     } else {
         redisLog(REDIS_NOTICE,"Partial resynchronization not possible (no cached master)");
-        psync_runid = "?";
+        psync_replid = "?";
         memcpy(psync_offset,"-1",3);
     }
 
     /* Issue the PSYNC command */
-    reply = sendSynchronousCommand(fd,"PSYNC",psync_runid,psync_offset,NULL);
+    reply = sendSynchronousCommand(fd,"PSYNC",psync_replid,psync_offset,NULL);
 
     if (!strncmp(reply,"+FULLRESYNC",11)) {
-        char *runid = NULL, *offset = NULL;
-
-        /* FULL RESYNC, parse the reply in order to extract the run id
-         * and the replication offset. */
-        runid = strchr(reply,' ');
-        if (runid) {
-            runid++;
-            offset = strchr(runid,' ');
+        char *replid = NULL, *offset = NULL;
+
+        /* FULL RESYNC, parse the reply in order to extract the replication
+         * ID and the replication offset. */
+        replid = strchr(reply,' ');
+        if (replid) {
+            replid++;
+            offset = strchr(replid,' ');
             if (offset) offset++;
         }
-        if (!runid || !offset || (offset-runid-1) != REDIS_RUN_ID_SIZE) {
+        if (!replid || !offset || (offset-replid-1) != REDIS_RUN_ID_SIZE) {
             redisLog(REDIS_WARNING,
                 "Master replied with wrong +FULLRESYNC syntax.");
             /* This is an unexpected condition, actually the +FULLRESYNC
              * reply means that the master supports PSYNC, but the reply
              * format seems wrong. To stay safe we blank the master
-             * runid to make sure next PSYNCs will fail. */
-            memset(server.repl_master_runid,0,REDIS_RUN_ID_SIZE+1);
+             * replication ID to make sure next PSYNCs will fail. */
+            memset(server.master_replid,0,REDIS_RUN_ID_SIZE+1);
         } else {
-            memcpy(server.repl_master_runid, runid, offset-runid-1);
-            server.repl_master_runid[REDIS_RUN_ID_SIZE] = '\0';
+            memcpy(server.master_replid, replid, offset-replid-1);
+            server.master_replid[REDIS_RUN_ID_SIZE] = '\0';
             server.repl_master_initial_offset = strtoll(offset,NULL,10);
-            redisLog(REDIS_NOTICE,"Full resync from master: %s:%lld",
-                server.repl_master_runid,
-                server.repl_master_initial_offset);
+            server.repl_link_lzf = strstr(offset," lzf") != NULL;
+            redisLog(REDIS_NOTICE,"Full resync from master: %s:%lld%s",
+                server.master_replid,
+                server.repl_master_initial_offset,
+                server.repl_link_lzf ? " (LZF link)" : "");
         }
         /* We are going to full resync, discard the cached master structure. */
         replicationDiscardCachedMaster();
@@ -1177,11 +2046,63 @@ int slaveTryPartialResynchronization(int fd) {
     }
 
     if (!strncmp(reply,"+CONTINUE",9)) {
-        /* Partial resync was accepted, set the replication state accordingly */
+        /* Partial resync was accepted. */
         redisLog(REDIS_NOTICE,
             "Successful partial resynchronization with master.");
+
+        /* Check the new replication ID advertised by the master. If it
+         * changed, we need to set the new ID as primary ID, and set our
+         * secondary ID as the old master ID up to the current offset, so
+         * that our sub-slaves will be able to PSYNC with us after a
+         * disconnection. */
+        char *start = reply+10;
+        char *end = reply+9;
+        while(end[0] != '\r' && end[0] != '\n' && end[0] != '\0' &&
+              end[0] != ' ') end++;
+        /* What follows the reply uses LZF frames if the master says so. */
+        if (end[0] == ' ' && !strncmp(end+1,"lzf",3)) {
+            server.repl_link_lzf = 1;
+            redisLog(REDIS_NOTICE,"The replication link uses LZF frames.");
+        }
+        if (end-start == REDIS_RUN_ID_SIZE) {
+            char new_replid[REDIS_RUN_ID_SIZE+1];
+            memcpy(new_replid,start,REDIS_RUN_ID_SIZE);
+            new_replid[REDIS_RUN_ID_SIZE] = '\0';
+
+            if (strcmp(new_replid,server.cached_master->replid)) {
+                /* Master ID changed. */
+                redisLog(REDIS_WARNING,"Master replication ID changed to %s",
+                    new_replid);
+
+                /* Set the old ID as our ID2, up to the current offset+1. */
+                memcpy(server.replid2,server.cached_master->replid,
+                    sizeof(server.replid2));
+                server.second_replid_offset = server.master_repl_offset+1;
+
+                /* Update the cached master ID and our own primary ID to the
+                 * new one. */
+                memcpy(server.replid,new_replid,sizeof(server.replid));
+                memcpy(server.cached_master->replid,new_replid,
+                    sizeof(server.replid));
+
+                /* Disconnect all the sub-slaves: they need to be notified
+                 * of the new replication ID. */
+                disconnectSlaves();
+            }
+        }
+
+        /* Setup the replication to continue. */
         sdsfree(reply);
         replicationResurrectCachedMaster(fd);
+        if (server.repl_link_lzf)
+            server.master->flags |= REDIS_REPL_LZF;
+        else
+            server.master->flags &= ~REDIS_REPL_LZF;
+
+        /* If this instance was restarted and we read the metadata to
+         * PSYNC from the persistence file, our replication backlog could
+         * be still not initialized. Create it. */
+        if (server.repl_backlog == NULL) createReplicationBacklog();
         return PSYNC_CONTINUE;
     }
 
@@ -1307,6 +2228,21 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
         sdsfree(err);
     }
 
+    /* Inform the master of our capabilities. While we currently send
+     * just one capability, it is possible to chain new capabilities here
+     * in the form of REPLCONF capa X capa Y capa Z ...
+     * The master will ignore capabilities it does not understand. */
+    if (server.repl_compression) {
+        err = sendSynchronousCommand(fd,"REPLCONF","capa","psync2",
+                                     "capa","lzf",NULL);
+    } else {
+        err = sendSynchronousCommand(fd,"REPLCONF","capa","psync2",NULL);
+    }
+    if (err[0] == '-') {
+        redisLog(REDIS_NOTICE,"(Non critical) Master does not understand REPLCONF capa: %s", err);
+    }
+    sdsfree(err);
+
     /* Try a partial resynchonization. If we don't have a cached master
      * slaveTryPartialResynchronization() will at least try to use PSYNC
      * to start a full resynchronization so that we get the master run id
@@ -1318,8 +2254,15 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
         return;
     }
 
+    /* PSYNC failed or is not supported: we want our slaves to resync with
+     * us as well, if we have any sub-slaves. The master may transfer us an
+     * entirely different data set and we have no way to incrementally feed
+     * our slaves after that. */
+    disconnectSlaves(); /* Force our slaves to resync with us as well. */
+    freeReplicationBacklog(); /* Don't allow our chained slaves to PSYNC. */
+
     /* Fall back to SYNC if needed. Otherwise psync_result == PSYNC_FULLRESYNC
-     * and the server.repl_master_runid and repl_master_initial_offset are
+     * and the server.master_replid and repl_master_initial_offset are
      * already populated. */
     if (psync_result == PSYNC_NOT_SUPPORTED) {
         redisLog(REDIS_NOTICE,"Retrying with SYNC...");
@@ -1330,15 +2273,22 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
     }
 
-    /* Prepare a suitable temp file for bulk transfer */
-    while(maxtries--) {
+    /* Prepare a suitable temp file for bulk transfer, unless the payload is
+     * going to be loaded straight from the socket. */
+    dfd = -1;
+    tmpfile[0] = '\0';
+    while(server.repl_diskless_load == REDIS_REPL_DISKLESS_LOAD_DISABLED &&
+          maxtries--)
+    {
         snprintf(tmpfile,256,
             "temp-%d.%ld.rdb",(int)server.unixtime,(long int)getpid());
         dfd = open(tmpfile,O_CREAT|O_WRONLY|O_EXCL,0644);
         if (dfd != -1) break;
         sleep(1);
     }
-    if (dfd == -1) {
+    if (server.repl_diskless_load == REDIS_REPL_DISKLESS_LOAD_DISABLED &&
+        dfd == -1)
+    {
         redisLog(REDIS_WARNING,"Opening the temp file needed for MASTER <-> SLAVE synchronization: %s",strerror(errno));
         goto error;
     }
@@ -1359,7 +2309,7 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
     server.repl_transfer_last_fsync_off = 0;
     server.repl_transfer_fd = dfd;
     server.repl_transfer_lastio = server.unixtime;
-    server.repl_transfer_tmpfile = zstrdup(tmpfile);
+    server.repl_transfer_tmpfile = (dfd != -1) ? zstrdup(tmpfile) : NULL;
     return;
 
 error:
@@ -1430,16 +2380,26 @@ int cancelReplicationHandshake(void) {
 
 /* Set replication to the specified master address and port. */
 void replicationSetMaster(char *ip, int port) {
+    int was_master = server.masterhost == NULL;
+
     sdsfree(server.masterhost);
     server.masterhost = sdsnew(ip);
     server.masterport = port;
+    /* Freeing the master caches it: we'll try to PSYNC with the new master
+     * using the same replication ID and offset. */
     if (server.master) freeClient(server.master);
-    disconnectSlaves(); /* Force our slaves to resync with us as well. */
-    replicationDiscardCachedMaster(); /* Don't try a PSYNC. */
-    freeReplicationBacklog(); /* Don't allow our chained slaves to PSYNC. */
+    /* Force our slaves to reconnect: they will learn the new replication
+     * ID of our master, and may be able to PSYNC with us. */
+    disconnectSlaves();
     cancelReplicationHandshake();
+    /* Before connecting to the new master, cache ourselves as a master,
+     * so that we can try a partial resynchronization using our own
+     * replication ID and offset: the new master may be one of our old
+     * slaves that was promoted. If a cached master was already restored
+     * from the RDB file at startup, we keep it instead. */
+    if (was_master && server.cached_master == NULL)
+        replicationCacheMasterUsingMyself();
     server.repl_state = REDIS_REPL_CONNECT;
-    server.master_repl_offset = 0;
     server.repl_down_since = 0;
 }
 
@@ -1448,20 +2408,23 @@ void replicationUnsetMaster(void) {
     if (server.masterhost == NULL) return; /* Nothing to do. */
     sdsfree(server.masterhost);
     server.masterhost = NULL;
-    if (server.master) {
-        if (listLength(server.slaves) == 0) {
-            /* If this instance is turned into a master and there are no
-             * slaves, it inherits the replication offset from the master.
-             * Under certain conditions this makes replicas comparable by
-             * replication offset to understand what is the most updated. */
-            server.master_repl_offset = server.master->reploff;
-            freeReplicationBacklog();
-        }
-        freeClient(server.master);
-    }
+    /* When a slave is turned into a master, the current replication ID
+     * (that was inherited from the master at synchronization time) is
+     * used as secondary ID up to the current offset, and a new replication
+     * ID is created to continue with a new replication history. Our
+     * replication offset is the one of the master we were following, so
+     * the former slaves of our master can PSYNC with us. */
+    if (server.master) freeClient(server.master);
     replicationDiscardCachedMaster();
     cancelReplicationHandshake();
+    shiftReplicationId();
+    /* Disconnecting all the slaves is required: we need to inform them of
+     * the replication ID change. */
+    disconnectSlaves();
     server.repl_state = REDIS_REPL_NONE;
+    /* We need to make sure the new master will start the replication
+     * stream with a SELECT statement. */
+    server.slaveseldb = -1;
 }
 
 void slaveofCommand(redisClient *c) {
@@ -1599,6 +2562,20 @@ void replicationCacheMaster(redisClient *c) {
     redisAssert(ln != NULL);
     listDelNode(server.clients,ln);
 
+    /* Reset the master client so that's ready to accept new commands:
+     * we want to discard the non processed query buffers and the non
+     * processed offsets, including pending transactions, already populated
+     * arguments, pending outputs to the master. */
+    sdsclear(server.master->querybuf);
+    sdsclear(server.master->pending_querybuf);
+    server.master->read_reploff = server.master->reploff;
+    if (c->flags & REDIS_MULTI) discardTransaction(c);
+    while(listLength(c->reply))
+        listDelNode(c->reply,listFirst(c->reply));
+    c->reply_bytes = 0;
+    c->bufpos = 0;
+    resetClient(c);
+
     /* Save the master. Server.master will be set to null later by
      * replicationHandleMasterDisconnection(). */
     server.cached_master = server.master;
@@ -1624,6 +2601,30 @@ void replicationCacheMaster(redisClient *c) {
     replicationHandleMasterDisconnection();
 }
 
+/* This function is called when a master is turned into a slave, in order
+ * to create from scratch a cached master for the new client, that will
+ * allow us to PSYNC with the slave that was promoted as the new master
+ * after a failover.
+ *
+ * Assuming this instance was previously the master instance of the new
+ * master, the new master will accept its replication ID, and potentially
+ * also the current offset if no data was lost during the failover. */
+void replicationCacheMasterUsingMyself(void) {
+    /* The master client we create can be set to any DB, because the new
+     * master will start its replication stream with SELECT. */
+    server.master = createClient(-1);
+    server.master->flags |= REDIS_MASTER;
+    server.master->authenticated = 1;
+    server.master->reploff = server.master_repl_offset;
+    server.master->read_reploff = server.master->reploff;
+    memcpy(server.master->replid,server.replid,sizeof(server.replid));
+    selectDb(server.master,
+        server.slaveseldb == -1 ? 0 : server.slaveseldb);
+    server.cached_master = server.master;
+    server.master = NULL;
+    redisLog(REDIS_NOTICE,"Before turning into a slave, using my master parameters to synthesize a cached master: I may be able to synchronize with the new master with just a partial transfer.");
+}
+
 /* Free a cached master, called when there are no longer the conditions for
  * a partial resync on reconnection. */
 void replicationDiscardCachedMaster(void) {
@@ -1926,6 +2927,91 @@ long long replicationGetSlaveOffset(void) {
     return offset;
 }
 
+/* ------------------------- READ YOUR WRITES -------------------------------
+ * WAIT makes the writer pay for synchronous replication. The opposite
+ * approach is to let the writer go, and make the reader wait instead:
+ *
+ *   WAITOFFSET <offset> <milliseconds_timeout>
+ *
+ * Called against a master the command returns ASAP the current master
+ * replication offset, so a client that performed a write can use it as a
+ * token describing "a dataset containing my writes".
+ *
+ * Called against a slave with such token, the command blocks until the
+ * slave processed the master replication stream up to the specified
+ * offset, or until the timeout is reached (a zero timeout blocks forever).
+ * In both cases the reply is the offset processed by the slave, so the
+ * caller just checks if it is >= the requested one: if so, the next reads
+ * sent to this slave in the same connection will observe the writes.
+ *
+ * Offsets are only comparable in the same replication history, that is,
+ * among instances sharing the same replication ID (see PSYNC2), which is
+ * what a client routing reads to the slaves of a given master obtains. */
+
+/* Return the offset of the replication stream reflected by the dataset
+ * we are serving: our own offset when we are a master, otherwise the
+ * offset processed so far from our master. */
+long long replicationGetServedOffset(void) {
+    if (server.masterhost == NULL) return server.master_repl_offset;
+    return replicationGetSlaveOffset();
+}
+
+/* WAITOFFSET <offset> <timeout> */
+void waitoffsetCommand(redisClient *c) {
+    mstime_t timeout;
+    long long offset, served;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[1],&offset,NULL) != REDIS_OK)
+        return;
+    if (getTimeoutFromObjectOrReply(c,c->argv[2],&timeout,UNIT_MILLISECONDS)
+        != REDIS_OK) return;
+
+    /* Masters, and slaves that already reached the offset, reply ASAP.
+     * Inside MULTI we can't block, so the client gets the current offset
+     * as well and is in charge of checking it. */
+    served = replicationGetServedOffset();
+    if (server.masterhost == NULL || served >= offset ||
+        c->flags & REDIS_MULTI)
+    {
+        addReplyLongLong(c,served);
+        return;
+    }
+
+    c->bpop.timeout = timeout;
+    c->bpop.reploffset = offset;
+    listAddNodeTail(server.clients_waiting_offset,c);
+    blockClient(c,REDIS_BLOCKED_OFFSET);
+}
+
+/* This is called by unblockClient() to perform the blocking op type
+ * specific cleanup. Never call it directly, call unblockClient() instead. */
+void unblockClientWaitingOffset(redisClient *c) {
+    listNode *ln = listSearchKey(server.clients_waiting_offset,c);
+    redisAssert(ln != NULL);
+    listDelNode(server.clients_waiting_offset,ln);
+}
+
+/* Called from beforeSleep() in order to unblock the clients blocked in
+ * WAITOFFSET for an offset we reached. If in the meantime we were turned
+ * into a master, every client is released, since the dataset we serve
+ * from now on is the reference for the offsets. */
+void processClientsWaitingOffset(void) {
+    long long served = replicationGetServedOffset();
+    int master = server.masterhost == NULL;
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_waiting_offset,&li);
+    while((ln = listNext(&li))) {
+        redisClient *c = ln->value;
+
+        if (master || served >= c->bpop.reploffset) {
+            unblockClient(c);
+            addReplyLongLong(c,served);
+        }
+    }
+}
+
 /* --------------------------- REPLICATION CRON  ---------------------------- */
 
 /* Replication cron function, called 1 time per second. */
@@ -2028,11 +3114,18 @@ void replicationCron(void) {
     /* If we have no attached slaves and there is a replication backlog
      * using memory, free it after some (configured) time. */
     if (listLength(server.slaves) == 0 && server.repl_backlog_time_limit &&
-        server.repl_backlog)
+        server.repl_backlog && server.masterhost == NULL)
     {
         time_t idle = server.unixtime - server.repl_no_slaves_since;
 
         if (idle > server.repl_backlog_time_limit) {
+            /* When we free the backlog, we always use a new replication ID
+             * and clear the ID2, since without a backlog we can no longer
+             * serve partial resynchronizations of the old history. Note
+             * that slaves never free their backlog: they may be promoted
+             * to masters at any time. */
+            changeReplicationId();
+            clearReplicationId2();
             freeReplicationBacklog();
             redisLog(REDIS_NOTICE,
                 "Replication backlog freed after %d seconds "
@@ -2058,7 +3151,9 @@ void replicationCron(void) {
      * This code is also useful to trigger a BGSAVE if the diskless
      * replication was turned off with CONFIG SET, while there were already
      * slaves in WAIT_BGSAVE_START state. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        server.rdb_snapshot == NULL)
+    {
         time_t idle, max_idle = 0;
         int slaves_waiting = 0;
         listNode *ln;
@@ -157,6 +157,123 @@ void rioInitWithFile(rio *r, FILE *fp) {
     r->io.file.autosync = 0;
 }
 
+/* ------------------- File descriptor read implementation ------------------- */
+
+/* Returns 1 or 0 for success/failure.
+ * Reads are buffered, but never past 'read_limit' bytes, so that the data
+ * following the payload we are interested in is left in the socket. When
+ * the file descriptor is non blocking we wait up to 'timeout' milliseconds
+ * for more data to arrive. */
+static size_t rioFdRead(rio *r, void *buf, size_t len) {
+    char *p = buf;
+
+    while(len) {
+        size_t avail = sdslen(r->io.fd.buf) - r->io.fd.bufpos;
+        size_t toread;
+        ssize_t nread;
+
+        /* Serve the request from the buffer when possible. */
+        if (avail) {
+            size_t count = avail < len ? avail : len;
+
+            memcpy(p,r->io.fd.buf+r->io.fd.bufpos,count);
+            r->io.fd.bufpos += count;
+            r->io.fd.pos += count;
+            p += count;
+            len -= count;
+            continue;
+        }
+
+        /* Refill the buffer. */
+        toread = len > REDIS_IOBUF_LEN ? len : REDIS_IOBUF_LEN;
+        if (r->io.fd.read_limit) {
+            off_t left = r->io.fd.read_limit - r->io.fd.read_so_far;
+
+            if (left <= 0) {
+                errno = EOVERFLOW;
+                return 0;
+            }
+            if ((off_t)toread > left) toread = left;
+        }
+        sdsclear(r->io.fd.buf);
+        r->io.fd.bufpos = 0;
+        if (r->io.fd.read_frames) {
+            nread = r->io.fd.read_frames(r->io.fd.fd,&r->io.fd.buf);
+        } else {
+            r->io.fd.buf = sdsMakeRoomFor(r->io.fd.buf,toread);
+            nread = read(r->io.fd.fd,r->io.fd.buf,toread);
+            if (nread > 0) sdsIncrLen(r->io.fd.buf,nread);
+        }
+        if (nread == 0) {
+            errno = ECONNRESET;
+            return 0;
+        } else if (nread == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                if (aeWait(r->io.fd.fd,AE_READABLE,r->io.fd.timeout) > 0)
+                    continue;
+                errno = ETIMEDOUT;
+            }
+            return 0;
+        }
+        r->io.fd.read_so_far += nread;
+    }
+    return 1;
+}
+
+/* Returns 1 or 0 for success/failure. */
+static size_t rioFdWrite(rio *r, const void *buf, size_t len) {
+    REDIS_NOTUSED(r);
+    REDIS_NOTUSED(buf);
+    REDIS_NOTUSED(len);
+    return 0; /* Error, this target does not support writing. */
+}
+
+/* Returns read position in the stream. */
+static off_t rioFdTell(rio *r) {
+    return r->io.fd.pos;
+}
+
+/* Flushes any buffer to target device if applicable. Returns 1 on success
+ * and 0 on failures. */
+static int rioFdFlush(rio *r) {
+    REDIS_NOTUSED(r);
+    return 1; /* Nothing to flush for a read only target. */
+}
+
+static const rio rioFdIO = {
+    rioFdRead,
+    rioFdWrite,
+    rioFdTell,
+    rioFdFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+void rioInitWithFd(rio *r, int fd, off_t read_limit, long long timeout) {
+    *r = rioFdIO;
+    r->io.fd.fd = fd;
+    r->io.fd.pos = 0;
+    r->io.fd.buf = sdsempty();
+    r->io.fd.bufpos = 0;
+    r->io.fd.read_limit = read_limit;
+    r->io.fd.read_so_far = 0;
+    r->io.fd.timeout = timeout;
+    r->io.fd.read_frames = NULL;
+}
+
+/* Release the rio and return the data that was read from the file
+ * descriptor but not consumed, as a new sds string. */
+sds rioFreeFd(rio *r) {
+    sds remaining = sdsnewlen(r->io.fd.buf+r->io.fd.bufpos,
+                              sdslen(r->io.fd.buf)-r->io.fd.bufpos);
+    sdsfree(r->io.fd.buf);
+    return remaining;
+}
+
 /* ------------------- File descriptors set implementation ------------------- */
 
 /* Returns 1 or 0 for success/failure.
@@ -168,7 +285,7 @@ void rioInitWithFile(rio *r, FILE *fp) {
  * to implement rioFdsetFlush(). */
 static size_t rioFdsetWrite(rio *r, const void *buf, size_t len) {
     ssize_t retval;
-    int j;
+    int j, broken;
     unsigned char *p = (unsigned char*) buf;
     int doflush = (buf == NULL && len == 0);
 
@@ -183,6 +300,12 @@ static size_t rioFdsetWrite(rio *r, const void *buf, size_t len) {
     if (doflush) {
         p = (unsigned char*) r->io.fdset.buf;
         len = sdslen(r->io.fdset.buf);
+        /* File descriptors using LZF frames are served below. */
+        if (r->io.fdset.lzf && len) {
+            sdsclear(r->io.fdset.lzfbuf);
+            r->io.fdset.lzfbuf = replicationCompressFrames(r->io.fdset.lzfbuf,
+                                                           (char*)p,len);
+        }
     }
 
     /* Write in little chunchs so that when there are big writes we
@@ -190,13 +313,14 @@ static size_t rioFdsetWrite(rio *r, const void *buf, size_t len) {
      * the TCP socket. */
     while(len) {
         size_t count = len < 1024 ? len : 1024;
-        int broken = 0;
+        broken = 0;
         for (j = 0; j < r->io.fdset.numfds; j++) {
             if (r->io.fdset.state[j] != 0) {
                 /* Skip FDs alraedy in error. */
                 broken++;
                 continue;
             }
+            if (r->io.fdset.lzf && r->io.fdset.lzf[j]) continue;
 
             /* Make sure to write 'count' bytes to the socket regardless
              * of short writes. */
@@ -226,6 +350,36 @@ static size_t rioFdsetWrite(rio *r, const void *buf, size_t len) {
         r->io.fdset.pos += count;
     }
 
+    /* Write the frames to the file descriptors using LZF, one after the
+     * other. */
+    if (doflush && r->io.fdset.lzf && sdslen(r->io.fdset.lzfbuf)) {
+        broken = 0;
+        for (j = 0; j < r->io.fdset.numfds; j++) {
+            size_t nwritten = 0, count = sdslen(r->io.fdset.lzfbuf);
+
+            if (r->io.fdset.state[j] != 0) {
+                broken++;
+                continue;
+            }
+            if (!r->io.fdset.lzf[j]) continue;
+            while(nwritten != count) {
+                retval = write(r->io.fdset.fds[j],
+                               r->io.fdset.lzfbuf+nwritten,count-nwritten);
+                if (retval <= 0) {
+                    if (retval == -1 && errno == EWOULDBLOCK) errno = ETIMEDOUT;
+                    break;
+                }
+                nwritten += retval;
+            }
+            if (nwritten != count) {
+                r->io.fdset.state[j] = errno;
+                if (r->io.fdset.state[j] == 0) r->io.fdset.state[j] = EIO;
+                broken++;
+            }
+        }
+        if (broken == r->io.fdset.numfds) return 0; /* All the FDs in error. */
+    }
+
     if (doflush) sdsclear(r->io.fdset.buf);
     return 1;
 }
@@ -274,12 +428,29 @@ void rioInitWithFdset(rio *r, int *fds, int numfds) {
     r->io.fdset.numfds = numfds;
     r->io.fdset.pos = 0;
     r->io.fdset.buf = sdsempty();
+    r->io.fdset.lzf = NULL;
+    r->io.fdset.lzfbuf = NULL;
+}
+
+/* From now on, send LZF frames to the file descriptors flagged in the 'lzf'
+ * array. The data already buffered is flushed first, so that it is sent
+ * in clear to all the file descriptors.
+ *
+ * Returns 1 on success, 0 if all the file descriptors are in error. */
+int rioFdsetSetLzf(rio *r, int *lzf) {
+    if (rioFdsetWrite(r,NULL,0) == 0) return 0;
+    r->io.fdset.lzf = zmalloc(sizeof(int)*r->io.fdset.numfds);
+    memcpy(r->io.fdset.lzf,lzf,sizeof(int)*r->io.fdset.numfds);
+    r->io.fdset.lzfbuf = sdsempty();
+    return 1;
 }
 
 void rioFreeFdset(rio *r) {
     zfree(r->io.fdset.fds);
     zfree(r->io.fdset.state);
     sdsfree(r->io.fdset.buf);
+    zfree(r->io.fdset.lzf);
+    sdsfree(r->io.fdset.lzfbuf);
 }
 
 /* ---------------------------- Generic functions ---------------------------- */
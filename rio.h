@@ -73,6 +73,19 @@ struct _rio {
             off_t buffered; /* Bytes written since last fsync. */
             off_t autosync; /* fsync after 'autosync' bytes written. */
         } file;
+        /* File descriptor source (used to read from a socket). */
+        struct {
+            int fd;         /* File descriptor. */
+            off_t pos;      /* Bytes consumed by the reader. */
+            sds buf;        /* Data read but not consumed yet. */
+            size_t bufpos;  /* First byte of 'buf' not consumed. */
+            off_t read_limit;   /* Don't read more than that, if not 0. */
+            off_t read_so_far;  /* Bytes read from the file descriptor. */
+            long long timeout;  /* Milliseconds to wait for data. */
+            /* If not NULL, used instead of read(2) to append to 'buf' the
+             * data decoded from a framed stream. */
+            ssize_t (*read_frames)(int fd, sds *dst);
+        } fd;
         /* Multiple FDs target (used to write to N sockets). */
         struct {
             int *fds;       /* File descriptors. */
@@ -80,6 +93,8 @@ struct _rio {
             int numfds;
             off_t pos;
             sds buf;
+            int *lzf;       /* Send LZF frames to the fd? NULL if none. */
+            sds lzfbuf;     /* Frames of the data being flushed. */
         } fdset;
     } io;
 };
@@ -127,6 +142,9 @@ static inline int rioFlush(rio *r) {
 void rioInitWithFile(rio *r, FILE *fp);
 void rioInitWithBuffer(rio *r, sds s);
 void rioInitWithFdset(rio *r, int *fds, int numfds);
+int rioFdsetSetLzf(rio *r, int *lzf);
+void rioInitWithFd(rio *r, int fd, off_t read_limit, long long timeout);
+sds rioFreeFd(rio *r);
 
 size_t rioWriteBulkCount(rio *r, char prefix, int count);
 size_t rioWriteBulkString(rio *r, const char *buf, size_t len);
@@ -46,6 +46,9 @@ int redis_math_random (lua_State *L);
 int redis_math_randomseed (lua_State *L);
 void sha1hex(char *digest, char *script, size_t len);
 
+/* Memory accounted to the scripts cache, see luaCreateFunction(). */
+static size_t lua_scripts_mem = 0;
+
 /* Take a Redis reply in the Redis protocol format and convert it into a
  * Lua type. Thanks to this function, and the introduction of not connected
  * clients, it is trivial to implement the redis() lua function.
@@ -312,6 +315,9 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         {
             luaPushError(lua, shared.roslaveerr->ptr);
             goto cleanup;
+        } else if (server.async_loading) {
+            luaPushError(lua, shared.loadingerr->ptr);
+            goto cleanup;
         } else if (server.stop_writes_on_bgsave_err &&
                    server.saveparamslen > 0 &&
                    server.lastbgsave_status == REDIS_ERR)
@@ -731,6 +737,8 @@ void scriptingInit(void) {
  * This function is used in order to reset the scripting environment. */
 void scriptingRelease(void) {
     dictRelease(server.lua_scripts);
+    zmalloc_category_sub(ZMALLOC_CAT_SCRIPTING,lua_scripts_mem);
+    lua_scripts_mem = 0;
     lua_close(server.lua);
 }
 
@@ -847,7 +855,7 @@ void luaSetGlobalArray(lua_State *lua, char *var, robj **elev, int elec) {
  *
  * On success REDIS_OK is returned, and nothing is left on the Lua stack.
  * On error REDIS_ERR is returned and an appropriate error is set in the
- * client context. */
+ * client context, or logged if 'c' is NULL. */
 int luaCreateFunction(redisClient *c, lua_State *lua, char *funcname, robj *body) {
     sds funcdef = sdsempty();
 
@@ -858,16 +866,26 @@ int luaCreateFunction(redisClient *c, lua_State *lua, char *funcname, robj *body
     funcdef = sdscatlen(funcdef," end",4);
 
     if (luaL_loadbuffer(lua,funcdef,sdslen(funcdef),"@user_script")) {
-        addReplyErrorFormat(c,"Error compiling script (new function): %s\n",
-            lua_tostring(lua,-1));
+        if (c) {
+            addReplyErrorFormat(c,"Error compiling script (new function): %s\n",
+                lua_tostring(lua,-1));
+        } else {
+            redisLog(REDIS_WARNING,"Error compiling script (new function): %s",
+                lua_tostring(lua,-1));
+        }
         lua_pop(lua,1);
         sdsfree(funcdef);
         return REDIS_ERR;
     }
     sdsfree(funcdef);
     if (lua_pcall(lua,0,0,0)) {
-        addReplyErrorFormat(c,"Error running script (new function): %s\n",
-            lua_tostring(lua,-1));
+        if (c) {
+            addReplyErrorFormat(c,"Error running script (new function): %s\n",
+                lua_tostring(lua,-1));
+        } else {
+            redisLog(REDIS_WARNING,"Error running script (new function): %s",
+                lua_tostring(lua,-1));
+        }
         lua_pop(lua,1);
         return REDIS_ERR;
     }
@@ -876,14 +894,31 @@ int luaCreateFunction(redisClient *c, lua_State *lua, char *funcname, robj *body
      * so that we can replicate / write in the AOF all the
      * EVALSHA commands as EVAL using the original script. */
     {
-        int retval = dictAdd(server.lua_scripts,
-                             sdsnewlen(funcname+2,40),body);
+        sds sha = sdsnewlen(funcname+2,40);
+        size_t mem;
+        int retval = dictAdd(server.lua_scripts,sha,body);
         redisAssertWithInfo(c,NULL,retval == DICT_OK);
         incrRefCount(body);
+        mem = sizeof(dictEntry)+sdsAllocSize(sha)+
+              sizeof(robj)+getStringObjectSdsUsedMemory(body);
+        zmalloc_category_add(ZMALLOC_CAT_SCRIPTING,mem);
+        lua_scripts_mem += mem;
     }
     return REDIS_OK;
 }
 
+/* Add to the scripts cache a script found in the "lua" auxiliary field of
+ * an RDB file, unless it is already there. */
+int luaLoadScriptFromRdb(robj *body) {
+    char funcname[43];
+
+    funcname[0] = 'f';
+    funcname[1] = '_';
+    sha1hex(funcname+2,body->ptr,sdslen(body->ptr));
+    if (dictFind(server.lua_scripts,funcname+2) != NULL) return REDIS_OK;
+    return luaCreateFunction(NULL,server.lua,funcname,body);
+}
+
 void evalGenericCommand(redisClient *c, int evalsha) {
     lua_State *lua = server.lua;
     char funcname[43];
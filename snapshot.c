@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+#include <pthread.h>
+
+/* -----------------------------------------------------------------------------
+ * Fork-free snapshotting
+ *
+ * With rdb-threaded-snapshot enabled BGSAVE does not fork(): the RDB file is
+ * written by a thread of the server itself, so there is no page table to copy
+ * and no memory duplicated by the kernel copy-on-write.
+ *
+ * The main thread scans the buckets of every DB dictionary in order with a
+ * cursor, handing batches of key-value pairs to the snapshot thread that
+ * serializes them with rdbSaveKeyValuePair(). The scan is incremental, a bit
+ * is performed at every event loop iteration by rdbSnapshotCron(), so
+ * clients are served meanwhile. To keep the position of the keys stable the
+ * DB dictionaries are not rehashed while the snapshot is in progress.
+ *
+ * The output must be the dataset at the time the snapshot started, so every
+ * key about to be modified, deleted or created is checked against the
+ * cursor by rdbSnapshotTouchKey():
+ *
+ * 1) A key not yet scanned is serialized by the main thread as it is now,
+ *    before the change, and flagged so that the scan will skip it. New keys
+ *    are just flagged.
+ * 2) A key already scanned may still be referenced by a batch the thread
+ *    did not serialize yet: in this case we wait for the thread to write it.
+ *    Batches are small, so this is a short wait.
+ *
+ * The thread only reads the values, and never accesses the dictionaries.
+ * This includes the dictionaries inside hash, set and sorted set values:
+ * even read only commands perform incremental rehashing steps on them, so
+ * such values are serialized by the main thread while scanning, and only
+ * the values with other encodings are handed to the thread.
+ * -------------------------------------------------------------------------- */
+
+#define RDB_SNAPSHOT_BATCH_KEYS 1024       /* Max keys per batch. */
+#define RDB_SNAPSHOT_BATCH_BYTES (1024*256) /* Max raw bytes per batch. */
+#define RDB_SNAPSHOT_MAX_JOBS 8            /* Batches queued to the thread. */
+#define RDB_SNAPSHOT_CYCLE_USEC 1000       /* Scan time per event loop. */
+
+typedef struct rdbSnapshotJob {
+    sds raw;            /* Already serialized data to write before the keys:
+                           opcodes and keys saved before modifications. */
+    int numkeys;
+    sds keys[RDB_SNAPSHOT_BATCH_KEYS];
+    robj *vals[RDB_SNAPSHOT_BATCH_KEYS];
+    long long expires[RDB_SNAPSHOT_BATCH_KEYS];
+    int end_db;         /* Scan position at the time the batch was queued: */
+    unsigned long end_pos;  /* once written, every key before it is saved. */
+    struct rdbSnapshotJob *next;
+} rdbSnapshotJob;
+
+/* State of a DB dictionary at the start of the snapshot. The keys that
+ * existed at that time are either in ht[0] or, if the dictionary was
+ * rehashing, in the buckets of ht[1] already rehashed. */
+typedef struct rdbSnapshotDb {
+    unsigned long size0;    /* Size of ht[0]. */
+    unsigned long size1;    /* Size of ht[1] if rehashing, otherwise 0. */
+    long rehashidx;         /* Rehashing index, frozen meanwhile. */
+    dict *handled;          /* Keys not scanned yet the scan must skip. */
+} rdbSnapshotDb;
+
+struct rdbSnapshot {
+    char tmpfile[256];
+    sds filename;
+    FILE *fp;
+    rio rdb;                /* Only written by the thread once started. */
+    long long now;          /* Keys expired at this time are not saved. */
+    rdbSnapshotDb *dbs;
+    /* Scan state, only accessed by the main thread. */
+    int dbid;               /* DB being scanned. */
+    unsigned long cursor;   /* Next bucket of 'dbid', ht[0] then ht[1]. */
+    int stream_db;          /* DB selected by the last queued SELECTDB. */
+    rdbSnapshotJob *job;    /* Batch being filled. */
+    /* Shared with the thread, protected by 'lock'. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t newjob;  /* Signaled when a batch is queued. */
+    pthread_cond_t jobdone; /* Signaled when a batch is written. */
+    rdbSnapshotJob *head, *tail;
+    int pending;            /* Batches queued and not yet written. */
+    int written_db;         /* Scan position of the last batch written. */
+    unsigned long written_pos;
+    int scan_done;          /* No more batches: terminate the file. */
+    int abort;              /* Exit ASAP, the file is discarded. */
+    int done;               /* The thread exited. */
+    int error;              /* errno of the first write error, or 0. */
+};
+
+/* Keys of the rdbSnapshotDb.handled sets. */
+unsigned int dictSdsHash(const void *key);
+int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
+void dictSdsDestructor(void *privdata, void *val);
+
+static dictType snapshotHandledDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* ---------------------------- Snapshot thread ---------------------------- */
+
+static void rdbSnapshotFreeJob(rdbSnapshotJob *job) {
+    int j;
+
+    for (j = 0; j < job->numkeys; j++) sdsfree(job->keys[j]);
+    sdsfree(job->raw);
+    zfree(job);
+}
+
+/* Write a batch to the RDB file. Returns 0 on success, otherwise the
+ * errno of the failed write. */
+static int rdbSnapshotWriteJob(rdbSnapshot *snap, rdbSnapshotJob *job) {
+    int j;
+
+    if (sdslen(job->raw) &&
+        rioWrite(&snap->rdb,job->raw,sdslen(job->raw)) == 0)
+        return errno ? errno : EIO;
+    for (j = 0; j < job->numkeys; j++) {
+        robj key;
+
+        initStaticStringObject(key,job->keys[j]);
+        if (rdbSaveKeyValuePair(&snap->rdb,&key,job->vals[j],job->expires[j],
+                                snap->now) == -1)
+            return errno ? errno : EIO;
+    }
+    return 0;
+}
+
+static void *rdbSnapshotThreadMain(void *arg) {
+    rdbSnapshot *snap = arg;
+    rdbSnapshotJob *job;
+    int error = 0, aborted;
+
+    while(1) {
+        pthread_mutex_lock(&snap->lock);
+        while (snap->head == NULL && !snap->scan_done && !snap->abort)
+            pthread_cond_wait(&snap->newjob,&snap->lock);
+        job = snap->abort ? NULL : snap->head;
+        pthread_mutex_unlock(&snap->lock);
+        if (job == NULL) break;
+
+        /* After an error the batches are still consumed, so that the main
+         * thread never waits for them, but nothing is written. */
+        if (!error) error = rdbSnapshotWriteJob(snap,job);
+
+        pthread_mutex_lock(&snap->lock);
+        snap->head = job->next;
+        if (snap->head == NULL) snap->tail = NULL;
+        snap->pending--;
+        snap->written_db = job->end_db;
+        snap->written_pos = job->end_pos;
+        if (error && !snap->error) snap->error = error;
+        pthread_cond_broadcast(&snap->jobdone);
+        pthread_mutex_unlock(&snap->lock);
+        rdbSnapshotFreeJob(job);
+    }
+
+    pthread_mutex_lock(&snap->lock);
+    aborted = snap->abort;
+    pthread_mutex_unlock(&snap->lock);
+
+    /* Every batch was written: terminate the file and make sure it is on
+     * disk, so that the main thread just needs to rename it. */
+    if (!error && !aborted) {
+        if (rdbSaveFooter(&snap->rdb) == -1 ||
+            fflush(snap->fp) == EOF ||
+            fsync(fileno(snap->fp)) == -1) error = errno ? errno : EIO;
+    }
+
+    pthread_mutex_lock(&snap->lock);
+    if (error && !snap->error) snap->error = error;
+    snap->done = 1;
+    pthread_cond_broadcast(&snap->jobdone);
+    pthread_mutex_unlock(&snap->lock);
+    return NULL;
+}
+
+/* ------------------------------ Main thread ------------------------------ */
+
+/* Return the position of 'key' in the scan of the DB described by 'sdb',
+ * computed from the layout of its dictionary 'd' at the start.
+ *
+ * If 'd' was rehashing, the keys in the ht[0] buckets not yet rehashed stay
+ * there, since rehashing is paused, but every key created meanwhile is
+ * added to ht[1]: so a key belongs to ht[1] unless it is actually found in
+ * its ht[0] bucket. */
+static unsigned long rdbSnapshotKeyPos(rdbSnapshotDb *sdb, dict *d, sds key) {
+    unsigned int h;
+    unsigned long idx;
+    dictEntry *de;
+
+    if (sdb->size0 == 0) return 0;
+    h = dictHashKey(d,key);
+    idx = h & (sdb->size0-1);
+    if (sdb->size1 == 0) return idx;
+    if ((long)idx >= sdb->rehashidx) {
+        for (de = d->ht[0].table[idx]; de; de = de->next) {
+            if (dictCompareKeys(d,key,dictGetKey(de))) return idx;
+        }
+    }
+    return sdb->size0 + (h & (sdb->size1-1));
+}
+
+/* Return true if the value 'o' is backed by a dictionary, that is, it can't
+ * be serialized by the thread, see the top comment of this file. */
+static int rdbSnapshotValueHasDict(robj *o) {
+    return (o->type == REDIS_HASH && o->encoding == REDIS_ENCODING_HT) ||
+           (o->type == REDIS_SET && o->encoding == REDIS_ENCODING_HT) ||
+           (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_SKIPLIST);
+}
+
+/* Hand the batch being filled, if any, to the thread. */
+static void rdbSnapshotQueueJob(rdbSnapshot *snap) {
+    rdbSnapshotJob *job = snap->job;
+
+    if (job == NULL) return;
+    snap->job = NULL;
+    job->end_db = snap->dbid;
+    job->end_pos = snap->cursor;
+    pthread_mutex_lock(&snap->lock);
+    if (snap->tail)
+        snap->tail->next = job;
+    else
+        snap->head = job;
+    snap->tail = job;
+    snap->pending++;
+    pthread_cond_signal(&snap->newjob);
+    pthread_mutex_unlock(&snap->lock);
+}
+
+/* Return the batch to fill with data of the DB 'dbid', making sure the
+ * stream selects it first. If 'raw' is true the caller appends serialized
+ * data to job->raw, that is written before the keys of the batch: a new
+ * batch is started if the current one already has keys. */
+static rdbSnapshotJob *rdbSnapshotGetJob(rdbSnapshot *snap, int dbid, int raw) {
+    rdbSnapshotJob *job = snap->job;
+
+    if (job && job->numkeys && (raw || snap->stream_db != dbid)) {
+        rdbSnapshotQueueJob(snap);
+        job = NULL;
+    }
+    if (job == NULL) {
+        job = snap->job = zmalloc(sizeof(*job));
+        job->raw = sdsempty();
+        job->numkeys = 0;
+        job->next = NULL;
+    }
+    if (snap->stream_db != dbid) {
+        rio r;
+
+        /* Writing to a memory buffer can't fail. */
+        rioInitWithBuffer(&r,job->raw);
+        rdbSaveType(&r,REDIS_RDB_OPCODE_SELECTDB);
+        rdbSaveLen(&r,dbid);
+        job->raw = r.io.buffer.ptr;
+        snap->stream_db = dbid;
+    }
+    return job;
+}
+
+/* Wait until the thread wrote every batch up to the scan position 'pos' of
+ * the DB 'dbid', so that the values there are no longer referenced. */
+static void rdbSnapshotWaitWritten(rdbSnapshot *snap, int dbid,
+                                   unsigned long pos)
+{
+    /* The key may be in the batch being filled. */
+    if (snap->job && snap->job->numkeys) rdbSnapshotQueueJob(snap);
+
+    pthread_mutex_lock(&snap->lock);
+    while (!snap->done && snap->pending &&
+           (snap->written_db < dbid ||
+            (snap->written_db == dbid && snap->written_pos <= pos)))
+        pthread_cond_wait(&snap->jobdone,&snap->lock);
+    pthread_mutex_unlock(&snap->lock);
+}
+
+/* Scan buckets handing batches to the thread, until the scan is complete,
+ * RDB_SNAPSHOT_MAX_JOBS batches are queued, or 'deadline' (in microseconds)
+ * is reached. If 'sync' is true instead of stopping when too many batches
+ * are queued we wait for the thread, and there is no deadline. */
+static void rdbSnapshotScan(rdbSnapshot *snap, long long deadline, int sync) {
+    unsigned long buckets = 0;
+
+    while (snap->dbid < server.dbnum) {
+        redisDb *db = server.db+snap->dbid;
+        rdbSnapshotDb *sdb = snap->dbs+snap->dbid;
+        unsigned long total = sdb->size0+sdb->size1;
+        dictht *ht;
+        dictEntry *de;
+        unsigned long idx;
+        int pending;
+
+        pthread_mutex_lock(&snap->lock);
+        while (sync && snap->pending >= RDB_SNAPSHOT_MAX_JOBS && !snap->done)
+            pthread_cond_wait(&snap->jobdone,&snap->lock);
+        pending = snap->pending;
+        pthread_mutex_unlock(&snap->lock);
+        if (pending >= RDB_SNAPSHOT_MAX_JOBS && !sync) break;
+
+        /* Skip to the next DB once this one is scanned. If no key is left
+         * the keys that existed at the start were all already saved. */
+        if (snap->cursor >= total || dictSize(db->dict) == 0) {
+            snap->dbid++;
+            snap->cursor = 0;
+            continue;
+        }
+        if (snap->cursor == 0) {
+            rdbSnapshotJob *job = rdbSnapshotGetJob(snap,snap->dbid,1);
+            rio r;
+
+            rioInitWithBuffer(&r,job->raw);
+            rdbSaveType(&r,REDIS_RDB_OPCODE_RESIZEDB);
+            rdbSaveLen(&r,dictSize(db->dict));
+            rdbSaveLen(&r,dictSize(db->expires));
+            job->raw = r.io.buffer.ptr;
+        }
+
+        if (snap->cursor < sdb->size0) {
+            ht = &db->dict->ht[0];
+            idx = snap->cursor;
+        } else {
+            ht = &db->dict->ht[1];
+            idx = snap->cursor-sdb->size0;
+        }
+        for (de = ht->table[idx]; de; de = de->next) {
+            sds key = dictGetKey(de);
+            rdbSnapshotJob *job;
+            dictEntry *ede;
+
+            /* Already saved, or created after the start. Once the bucket
+             * is scanned the key no longer needs to be tracked. */
+            if (dictSize(sdb->handled) &&
+                dictDelete(sdb->handled,key) == DICT_OK) continue;
+
+            job = rdbSnapshotGetJob(snap,snap->dbid,0);
+            ede = dictSize(db->expires) ? dictFind(db->expires,key) : NULL;
+            if (rdbSnapshotValueHasDict(dbGetVal(de))) {
+                robj keyobj;
+                rio r;
+
+                /* Appended to the raw data of a batch of the same DB: the
+                 * order of the keys inside a DB does not matter. */
+                initStaticStringObject(keyobj,key);
+                rioInitWithBuffer(&r,job->raw);
+                rdbSaveKeyValuePair(&r,&keyobj,dbGetVal(de),
+                    ede ? dictGetSignedIntegerVal(ede) : -1,snap->now);
+                job->raw = r.io.buffer.ptr;
+                if (sdslen(job->raw) >= RDB_SNAPSHOT_BATCH_BYTES)
+                    rdbSnapshotQueueJob(snap);
+                continue;
+            }
+            job->keys[job->numkeys] = sdsdup(key);
+            job->vals[job->numkeys] = dbGetVal(de);
+            job->expires[job->numkeys] =
+                ede ? dictGetSignedIntegerVal(ede) : -1;
+            if (++job->numkeys == RDB_SNAPSHOT_BATCH_KEYS)
+                rdbSnapshotQueueJob(snap);
+        }
+        snap->cursor++;
+
+        if (!sync && (++buckets & 63) == 0 && ustime() > deadline) break;
+    }
+    rdbSnapshotQueueJob(snap);
+
+    if (snap->dbid == server.dbnum) {
+        pthread_mutex_lock(&snap->lock);
+        snap->scan_done = 1;
+        pthread_cond_signal(&snap->newjob);
+        pthread_mutex_unlock(&snap->lock);
+    }
+}
+
+/* Release the snapshot after the thread exited, renaming the temp file into
+ * the final one if the RDB was written with success. When 'aborted' is true
+ * the snapshot was stopped on purpose (FLUSHALL, SHUTDOWN, ...): like a
+ * saving child killed with SIGUSR1, this is not reported as a failure. */
+static void rdbSnapshotTerminate(rdbSnapshot *snap, int ok, int aborted) {
+    rdbSnapshotJob *job, *next;
+    int j;
+
+    pthread_join(snap->thread,NULL);
+    if (fclose(snap->fp) == EOF) ok = 0;
+    if (ok && rename(snap->tmpfile,snap->filename) == -1) {
+        redisLog(REDIS_WARNING,"Error moving temp DB file on the final destination: %s", strerror(errno));
+        ok = 0;
+    }
+    if (ok) {
+        redisLog(REDIS_NOTICE,"Background snapshot terminated with success");
+        server.dirty = server.dirty - server.dirty_before_bgsave;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = REDIS_OK;
+    } else {
+        unlink(snap->tmpfile);
+        if (!aborted) server.lastbgsave_status = REDIS_ERR;
+    }
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+
+    /* Batches not written because of an abort or an error. */
+    for (job = snap->head; job; job = next) {
+        next = job->next;
+        rdbSnapshotFreeJob(job);
+    }
+    if (snap->job) rdbSnapshotFreeJob(snap->job);
+    for (j = 0; j < server.dbnum; j++) {
+        dictRelease(snap->dbs[j].handled);
+        server.db[j].dict->iterators--;
+    }
+    pthread_mutex_destroy(&snap->lock);
+    pthread_cond_destroy(&snap->newjob);
+    pthread_cond_destroy(&snap->jobdone);
+    sdsfree(snap->filename);
+    zfree(snap->dbs);
+    zfree(snap);
+    server.rdb_snapshot = NULL;
+    updateDictResizePolicy();
+}
+
+/* Start a fork-free background save of the dataset into 'filename'.
+ * Returns REDIS_ERR if the snapshot could not be started. */
+int rdbSnapshotStart(char *filename) {
+    rdbSnapshot *snap;
+    int j;
+
+    if (server.rdb_snapshot) return REDIS_ERR;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+
+    snap = zcalloc(sizeof(*snap));
+    snprintf(snap->tmpfile,sizeof(snap->tmpfile),"temp-snapshot-%d.rdb",
+        (int) getpid());
+    snap->fp = fopen(snap->tmpfile,"w");
+    if (!snap->fp) {
+        redisLog(REDIS_WARNING,"Failed opening .rdb for saving: %s",
+            strerror(errno));
+        server.lastbgsave_status = REDIS_ERR;
+        zfree(snap);
+        return REDIS_ERR;
+    }
+    rioInitWithFile(&snap->rdb,snap->fp);
+    if (server.rdb_checksum)
+        snap->rdb.update_cksum = rioGenericUpdateChecksum;
+    if (rdbSaveHeader(&snap->rdb) == -1) {
+        redisLog(REDIS_WARNING,"Write error saving DB on disk: %s",
+            strerror(errno));
+        fclose(snap->fp);
+        unlink(snap->tmpfile);
+        server.lastbgsave_status = REDIS_ERR;
+        zfree(snap);
+        return REDIS_ERR;
+    }
+    snap->filename = sdsnew(filename);
+    snap->now = mstime();
+    snap->stream_db = -1;
+    pthread_mutex_init(&snap->lock,NULL);
+    pthread_cond_init(&snap->newjob,NULL);
+    pthread_cond_init(&snap->jobdone,NULL);
+
+    /* Freeze the layout of the DB dictionaries: holding an iterator
+     * reference, like a safe iterator would do, stops the incremental
+     * rehashing, and resizing is disabled by updateDictResizePolicy(). */
+    snap->dbs = zmalloc(sizeof(rdbSnapshotDb)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++) {
+        dict *d = server.db[j].dict;
+
+        snap->dbs[j].size0 = d->ht[0].size;
+        snap->dbs[j].size1 = dictIsRehashing(d) ? d->ht[1].size : 0;
+        snap->dbs[j].rehashidx = d->rehashidx;
+        snap->dbs[j].handled = dictCreate(&snapshotHandledDictType,NULL);
+        d->iterators++;
+    }
+
+    if (pthread_create(&snap->thread,NULL,rdbSnapshotThreadMain,snap) != 0) {
+        redisLog(REDIS_WARNING,"Can't create the snapshot thread: %s",
+            strerror(errno));
+        for (j = 0; j < server.dbnum; j++) {
+            dictRelease(snap->dbs[j].handled);
+            server.db[j].dict->iterators--;
+        }
+        fclose(snap->fp);
+        unlink(snap->tmpfile);
+        pthread_mutex_destroy(&snap->lock);
+        pthread_cond_destroy(&snap->newjob);
+        pthread_cond_destroy(&snap->jobdone);
+        sdsfree(snap->filename);
+        zfree(snap->dbs);
+        zfree(snap);
+        server.lastbgsave_status = REDIS_ERR;
+        return REDIS_ERR;
+    }
+    server.rdb_snapshot = snap;
+    server.rdb_save_time_start = time(NULL);
+    updateDictResizePolicy();
+    redisLog(REDIS_NOTICE,"Background snapshot started by the snapshot thread");
+    return REDIS_OK;
+}
+
+/* Ask the snapshot thread to exit without writing the pending batches. */
+static void rdbSnapshotStopThread(rdbSnapshot *snap) {
+    pthread_mutex_lock(&snap->lock);
+    snap->abort = 1;
+    pthread_cond_signal(&snap->newjob);
+    pthread_mutex_unlock(&snap->lock);
+}
+
+/* Called by beforeSleep() while a snapshot is in progress: scan some more
+ * keys, and handle the termination of the thread. */
+void rdbSnapshotCron(void) {
+    rdbSnapshot *snap = server.rdb_snapshot;
+    int done, error;
+
+    pthread_mutex_lock(&snap->lock);
+    done = snap->done;
+    error = snap->error;
+    pthread_mutex_unlock(&snap->lock);
+
+    if (error && !done) {
+        redisLog(REDIS_WARNING,"Write error saving DB on disk: %s",
+            strerror(error));
+        rdbSnapshotStopThread(snap);
+        rdbSnapshotTerminate(snap,0,0);
+    } else if (done) {
+        if (error) {
+            redisLog(REDIS_WARNING,"Write error saving DB on disk: %s",
+                strerror(error));
+        }
+        rdbSnapshotTerminate(snap,error == 0,0);
+    } else if (!snap->scan_done) {
+        rdbSnapshotScan(snap,ustime()+RDB_SNAPSHOT_CYCLE_USEC,0);
+    }
+}
+
+/* Stop the snapshot in progress discarding the file, like killing the
+ * saving child is for a fork()ed BGSAVE. */
+void rdbSnapshotAbort(void) {
+    rdbSnapshot *snap = server.rdb_snapshot;
+
+    rdbSnapshotStopThread(snap);
+    redisLog(REDIS_WARNING,"Background snapshot aborted");
+    rdbSnapshotTerminate(snap,0,1);
+}
+
+/* Complete the snapshot in progress synchronously. This is needed before
+ * the DB dictionaries are emptied or replaced at once, since the keys not
+ * scanned yet would be lost. */
+void rdbSnapshotFinish(void) {
+    while (server.rdb_snapshot) {
+        rdbSnapshot *snap = server.rdb_snapshot;
+
+        if (!snap->scan_done) {
+            rdbSnapshotScan(snap,0,1);
+        } else {
+            pthread_mutex_lock(&snap->lock);
+            while (!snap->done) pthread_cond_wait(&snap->jobdone,&snap->lock);
+            pthread_mutex_unlock(&snap->lock);
+        }
+        rdbSnapshotCron();
+    }
+}
+
+/* Called before 'key' is modified, deleted or created in 'db' while a
+ * snapshot is in progress, see the top comment of this file. */
+void rdbSnapshotTouchKey(redisDb *db, sds key) {
+    rdbSnapshot *snap = server.rdb_snapshot;
+    rdbSnapshotDb *sdb;
+    unsigned long pos;
+    dictEntry *de;
+
+    /* DBs that are not served, like the ones filled by an async load. */
+    if (db != server.db+db->id) return;
+
+    sdb = snap->dbs+db->id;
+    pos = rdbSnapshotKeyPos(sdb,db->dict,key);
+    if (db->id < snap->dbid || (db->id == snap->dbid && pos < snap->cursor)) {
+        rdbSnapshotWaitWritten(snap,db->id,pos);
+        return;
+    }
+    if (dictFind(sdb->handled,key)) return;
+
+    de = dictFind(db->dict,key);
+    if (de) {
+        rdbSnapshotJob *job = rdbSnapshotGetJob(snap,db->id,1);
+        dictEntry *ede;
+        robj keyobj;
+        rio r;
+
+        initStaticStringObject(keyobj,key);
+        ede = dictSize(db->expires) ? dictFind(db->expires,key) : NULL;
+        rioInitWithBuffer(&r,job->raw);
+        rdbSaveKeyValuePair(&r,&keyobj,dbGetVal(de),
+            ede ? dictGetSignedIntegerVal(ede) : -1,snap->now);
+        job->raw = r.io.buffer.ptr;
+        if (sdslen(job->raw) >= RDB_SNAPSHOT_BATCH_BYTES)
+            rdbSnapshotQueueJob(snap);
+    }
+    dictAdd(sdb->handled,sdsdup(key),NULL);
+}
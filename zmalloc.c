@@ -40,6 +40,7 @@ void zlibc_free(void *ptr) {
 }
 
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "config.h"
 #include "zmalloc.h"
@@ -109,6 +110,7 @@ void zlibc_free(void *ptr) {
 } while(0)
 
 static size_t used_memory = 0;
+static size_t category_memory[ZMALLOC_CAT_COUNT];
 static int zmalloc_thread_safe = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -210,6 +212,24 @@ void zfree(void *ptr) {
 #endif
 }
 
+/* Allocation and free functions that bypass the thread cache
+ * and go straight to the allocator arena bins.
+ * Currently implemented only for jemalloc. Used for online defragmentation. */
+#ifdef HAVE_DEFRAG
+void *zmalloc_no_tcache(size_t size) {
+    void *ptr = je_mallocx(size+PREFIX_SIZE, MALLOCX_TCACHE_NONE);
+    if (!ptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+}
+
+void zfree_no_tcache(void *ptr) {
+    if (ptr == NULL) return;
+    update_zmalloc_stat_free(zmalloc_size(ptr));
+    je_dallocx(ptr, MALLOCX_TCACHE_NONE);
+}
+#endif
+
 char *zstrdup(const char *s) {
     size_t l = strlen(s)+1;
     char *p = zmalloc(l);
@@ -237,6 +257,72 @@ size_t zmalloc_used_memory(void) {
     return um;
 }
 
+/* Account 'n' bytes to the memory category 'cat'. The allocator can't know
+ * which subsystem owns an allocation when it is released, so the categories
+ * are updated by the owners themselves with explicit deltas, with the same
+ * thread safety guarantees of the used memory counter. */
+void zmalloc_category_add(int cat, size_t n) {
+    if (zmalloc_thread_safe) {
+#if defined(__ATOMIC_RELAXED)
+        __atomic_add_fetch(&category_memory[cat],n,__ATOMIC_RELAXED);
+#elif defined(HAVE_ATOMIC)
+        __sync_add_and_fetch(&category_memory[cat],n);
+#else
+        pthread_mutex_lock(&used_memory_mutex);
+        category_memory[cat] += n;
+        pthread_mutex_unlock(&used_memory_mutex);
+#endif
+    } else {
+        category_memory[cat] += n;
+    }
+}
+
+void zmalloc_category_sub(int cat, size_t n) {
+    if (zmalloc_thread_safe) {
+#if defined(__ATOMIC_RELAXED)
+        __atomic_sub_fetch(&category_memory[cat],n,__ATOMIC_RELAXED);
+#elif defined(HAVE_ATOMIC)
+        __sync_sub_and_fetch(&category_memory[cat],n);
+#else
+        pthread_mutex_lock(&used_memory_mutex);
+        category_memory[cat] -= n;
+        pthread_mutex_unlock(&used_memory_mutex);
+#endif
+    } else {
+        category_memory[cat] -= n;
+    }
+}
+
+/* Move the accounting of an allocation of 'oldsize' bytes that is now
+ * 'newsize' bytes long, as after a realloc of a tracked buffer. */
+void zmalloc_category_update(int cat, size_t oldsize, size_t newsize) {
+    if (newsize > oldsize)
+        zmalloc_category_add(cat,newsize-oldsize);
+    else if (newsize < oldsize)
+        zmalloc_category_sub(cat,oldsize-newsize);
+}
+
+size_t zmalloc_category_used(int cat) {
+    size_t um;
+
+    if (zmalloc_thread_safe) {
+#if defined(__ATOMIC_RELAXED)
+        um = __atomic_add_fetch(&category_memory[cat],0,__ATOMIC_RELAXED);
+#elif defined(HAVE_ATOMIC)
+        um = __sync_add_and_fetch(&category_memory[cat],0);
+#else
+        pthread_mutex_lock(&used_memory_mutex);
+        um = category_memory[cat];
+        pthread_mutex_unlock(&used_memory_mutex);
+#endif
+    }
+    else {
+        um = category_memory[cat];
+    }
+
+    return um;
+}
+
 void zmalloc_enable_thread_safeness(void) {
     zmalloc_thread_safe = 1;
 }
@@ -328,6 +414,32 @@ float zmalloc_get_fragmentation_ratio(size_t rss) {
     return (float)rss/zmalloc_used_memory();
 }
 
+/* Fill 'allocated' with the bytes the allocator handed to the application,
+ * and 'active' with the bytes in the pages the allocator is actually
+ * using to serve them: the difference is the external fragmentation the
+ * allocator can't give back to the OS. Returns 1 on success, or 0 if the
+ * allocator in use does not provide this information. */
+#if defined(USE_JEMALLOC)
+int zmalloc_get_allocator_info(size_t *allocated, size_t *active) {
+    uint64_t epoch = 1;
+    size_t sz;
+
+    *allocated = *active = 0;
+    /* Update the statistics cached by mallctl. */
+    sz = sizeof(epoch);
+    je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+    sz = sizeof(size_t);
+    je_mallctl("stats.allocated", allocated, &sz, NULL, 0);
+    je_mallctl("stats.active", active, &sz, NULL, 0);
+    return 1;
+}
+#else
+int zmalloc_get_allocator_info(size_t *allocated, size_t *active) {
+    *allocated = *active = 0;
+    return 0;
+}
+#endif
+
 /* Get the sum of the specified field (converted form kb to bytes) in
  * /proc/self/smaps. The field must be specified with trailing ":" as it
  * apperas in the smaps output.
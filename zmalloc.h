@@ -66,12 +66,33 @@
 #define ZMALLOC_LIB "libc"
 #endif
 
+/* We can enable the Redis defrag capabilities only if we are using Jemalloc
+ * and the version used is our special version modified for Redis having
+ * the ability to return per-allocation fragmentation hints. */
+#if defined(USE_JEMALLOC) && defined(JEMALLOC_FRAG_HINT)
+#define HAVE_DEFRAG
+#endif
+
+/* Memory categories tracked by zmalloc_category_add() / _sub(). The
+ * keyspace is not tracked explicitly: it is what remains of the used
+ * memory once the startup memory and the other categories are removed. */
+#define ZMALLOC_CAT_CLIENTS 0       /* Normal clients query/output buffers. */
+#define ZMALLOC_CAT_REPLICATION 1   /* Slaves buffers and the backlog. */
+#define ZMALLOC_CAT_AOF 2           /* AOF and AOF rewrite buffers. */
+#define ZMALLOC_CAT_SCRIPTING 3     /* Lua scripts cache. */
+#define ZMALLOC_CAT_CLUSTER 4       /* Cluster bus links buffers. */
+#define ZMALLOC_CAT_COUNT 5
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
 size_t zmalloc_used_memory(void);
+void zmalloc_category_add(int cat, size_t n);
+void zmalloc_category_sub(int cat, size_t n);
+void zmalloc_category_update(int cat, size_t oldsize, size_t newsize);
+size_t zmalloc_category_used(int cat);
 void zmalloc_enable_thread_safeness(void);
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
 float zmalloc_get_fragmentation_ratio(size_t rss);
@@ -79,6 +100,12 @@ size_t zmalloc_get_rss(void);
 size_t zmalloc_get_private_dirty(void);
 size_t zmalloc_get_smap_bytes_by_field(char *field);
 void zlibc_free(void *ptr);
+int zmalloc_get_allocator_info(size_t *allocated, size_t *active);
+
+#ifdef HAVE_DEFRAG
+void zfree_no_tcache(void *ptr);
+void *zmalloc_no_tcache(size_t size);
+#endif
 
 #ifndef HAVE_MALLOC_SIZE
 size_t zmalloc_size(void *ptr);